@@ -0,0 +1,284 @@
+/*
+ * defrag-simplefs: lay out the files of a mounted simplefs for sequential
+ * reading.
+ *
+ * A file has a single data block, so there is nothing to fragment inside
+ * it; what costs seeks is files that end up far from each other. As
+ * mkfs-simplefs --from-dir does, each directory's regular files are placed
+ * in record order right after the directory's own block. The current
+ * blocks are found with FIEMAP and every file that is out of place is
+ * moved with SIMPLEFS_IOC_DEFRAG, which works while it is open.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "simple.h"
+
+struct defrag {
+	int dry_run;
+	int verbose;
+	dev_t dev;
+	uint64_t block_size;
+
+	/* Inodes with more than one link already seen, so that a file is
+	 * placed after the first directory that has it only */
+	ino_t *linked;
+	size_t nlinked, linked_max;
+
+	unsigned long long files, misplaced, moved, errors;
+};
+
+/* The block holding the data of fd, 0 for a hole. Files sharing their
+ * block with a clone report -1, they are not moved. */
+static int data_block(struct defrag *df, int fd, uint64_t *block)
+{
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.map.fm_length = FIEMAP_MAX_OFFSET;
+	fm.map.fm_flags = FIEMAP_FLAG_SYNC;
+	fm.map.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == -1)
+		return -errno;
+
+	*block = 0;
+	if (!fm.map.fm_mapped_extents)
+		return 0;
+	if (fm.extent.fe_flags & (FIEMAP_EXTENT_SHARED | FIEMAP_EXTENT_DATA_TAIL))
+		*block = (uint64_t)-1;
+	else
+		*block = fm.extent.fe_physical / df->block_size;
+	return 0;
+}
+
+static int seen_link(struct defrag *df, ino_t ino)
+{
+	ino_t *linked;
+	size_t i;
+
+	for (i = 0; i < df->nlinked; i++)
+		if (df->linked[i] == ino)
+			return 1;
+
+	if (df->nlinked == df->linked_max) {
+		df->linked_max = df->linked_max ? df->linked_max * 2 : 64;
+		linked = realloc(df->linked, df->linked_max * sizeof(*linked));
+		if (!linked) {
+			df->linked_max = df->nlinked;
+			return 0;
+		}
+		df->linked = linked;
+	}
+	df->linked[df->nlinked++] = ino;
+	return 0;
+}
+
+/* Place the file name of dirfd at or after *goal and advance *goal past it */
+static void defrag_file(struct defrag *df, int dirfd, const char *path,
+			const char *name, uint64_t *goal)
+{
+	struct simplefs_defrag arg;
+	struct stat st;
+	uint64_t block;
+	int fd, ret;
+
+	fd = openat(dirfd, name, (df->dry_run ? O_RDONLY : O_RDWR) |
+		    O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+		df->errors++;
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode) ||
+	    (st.st_nlink > 1 && seen_link(df, st.st_ino)))
+		goto out;
+
+	df->files++;
+	ret = data_block(df, fd, &block);
+	if (ret) {
+		fprintf(stderr, "%s/%s: %s\n", path, name, strerror(-ret));
+		df->errors++;
+		goto out;
+	}
+	if (!block)
+		goto out;
+	if (block == (uint64_t)-1 || block == *goal) {
+		if (block == *goal)
+			(*goal)++;
+		goto out;
+	}
+
+	df->misplaced++;
+	if (df->dry_run) {
+		if (df->verbose)
+			printf("%s/%s: block %llu, wants %llu\n", path, name,
+			       (unsigned long long)block,
+			       (unsigned long long)*goal);
+		goto out;
+	}
+
+	arg.goal = *goal;
+	if (ioctl(fd, SIMPLEFS_IOC_DEFRAG, &arg) == -1) {
+		fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+		df->errors++;
+		goto out;
+	}
+	if (arg.block != block) {
+		df->moved++;
+		if (df->verbose)
+			printf("%s/%s: block %llu -> %llu\n", path, name,
+			       (unsigned long long)block,
+			       (unsigned long long)arg.block);
+	}
+	/* The goal's group may be full: continue after wherever it is */
+	*goal = arg.block + 1;
+out:
+	if (fd != -1)
+		close(fd);
+}
+
+/* simplefs reports DT_UNKNOWN for every entry */
+static int is_dir(int dirfd, const struct dirent *d)
+{
+	struct stat st;
+
+	if (d->d_type != DT_UNKNOWN)
+		return d->d_type == DT_DIR;
+	return !fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+	       S_ISDIR(st.st_mode);
+}
+
+static void defrag_dir(struct defrag *df, const char *path)
+{
+	struct dirent **names;
+	struct stat st;
+	uint64_t goal;
+	char *sub;
+	char *dirs;
+	int dirfd, n, i, ret;
+
+	dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1 || fstat(dirfd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		df->errors++;
+		goto out;
+	}
+	/* Stay on this filesystem */
+	if (st.st_dev != df->dev)
+		goto out;
+
+	ret = data_block(df, dirfd, &goal);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+		df->errors++;
+		goto out;
+	}
+	/* Let the kernel pick the start of the group for a blockless one */
+	if (goal && goal != (uint64_t)-1)
+		goal++;
+	else
+		goal = 0;
+
+	/* Unsorted, so in the order of the directory's records */
+	n = scandirat(dirfd, ".", &names, NULL, NULL);
+	if (n == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		df->errors++;
+		goto out;
+	}
+
+	dirs = calloc(n ? n : 1, 1);
+	for (i = 0; i < n; i++) {
+		if (!dirs || !(dirs[i] = is_dir(dirfd, names[i])))
+			defrag_file(df, dirfd, path, names[i]->d_name, &goal);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (dirs && dirs[i] &&
+		    strcmp(names[i]->d_name, ".") &&
+		    strcmp(names[i]->d_name, "..") &&
+		    asprintf(&sub, "%s/%s", path, names[i]->d_name) != -1) {
+			defrag_dir(df, sub);
+			free(sub);
+		}
+		free(names[i]);
+	}
+	free(names);
+	free(dirs);
+out:
+	if (dirfd != -1)
+		close(dirfd);
+}
+
+static void usage(void)
+{
+	printf("Usage: defrag-simplefs [-n] [-v] <directory>\n");
+	printf("  -n  only count the files that are out of place\n");
+	printf("  -v  print every file that is (or would be) moved\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct defrag df = { 0 };
+	struct statfs sfs;
+	struct stat st;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "nv")) != -1) {
+		switch (opt) {
+		case 'n':
+			df.dry_run = 1;
+			break;
+		case 'v':
+			df.verbose = 1;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return 2;
+	}
+
+	if (statfs(argv[optind], &sfs) == -1 || stat(argv[optind], &st) == -1) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (sfs.f_type != SIMPLEFS_MAGIC) {
+		fprintf(stderr, "%s: not on a simplefs filesystem\n",
+			argv[optind]);
+		return 1;
+	}
+	df.dev = st.st_dev;
+	df.block_size = sfs.f_bsize;
+
+	defrag_dir(&df, argv[optind]);
+
+	printf("%s: %llu files, %llu out of place", argv[optind], df.files,
+	       df.misplaced);
+	if (!df.dry_run)
+		printf(", %llu moved", df.moved);
+	printf("\n");
+	free(df.linked);
+
+	return df.errors ? 1 : 0;
+}
@@ -0,0 +1,1096 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libsimplefs.h"
+
+/* Exit codes, as documented in fsck(8) */
+#define FSCK_OK			0
+#define FSCK_NONDESTRUCT	1
+#define FSCK_UNCORRECTED	4
+#define FSCK_ERROR		8
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Inode table blocks handed to a thread at a time. Big enough that every
+ * read is a long sequential one. */
+#define ITABLE_CHUNK_BYTES	(4 << 20)
+
+/* Per inode state flags */
+#define I_USED		0x01	/* slot is in use */
+#define I_BAD		0x02	/* slot is in use but nonsense, will be cleared */
+#define I_REACHED	0x04	/* directory reached from the root */
+
+struct fsck {
+	struct sfs_file_bdev bdev;
+	int repair;
+	int nthreads;
+
+	/* Super block and on-disk block bitmap, as loaded by libsimplefs */
+	struct sfs_fs sfs;
+	int mounted;
+	uint64_t bs;
+	uint64_t ipb;
+
+	/* The inode tables of all groups back to back, slot N - 1 holds
+	 * inode N. itable_dirty has a byte per table block. */
+	struct simplefs_inode *itable;
+	uint8_t *itable_dirty;
+	uint8_t *state;
+	/* Directory records pointing at each inode */
+	uint32_t *refs;
+	/* Block bitmap rebuilt from the reachable inodes, one block per
+	 * group like the one libsimplefs loads */
+	uint8_t *bmap;
+	/* Group descriptors rebuilt along with it */
+	struct simplefs_group_desc *gdt;
+	/* Blocks of directories, which are never shared, of files' data and
+	 * of extended attributes, which are only shared with their own kind */
+	uint8_t *dirmap;
+	uint8_t *datamap;
+	uint8_t *xattrmap;
+	/* A block found in use by one more file, once per extra owner.
+	 * Protected by lock. */
+	uint64_t *shared;
+	uint64_t nshared, shared_size;
+
+	/* Directories of the level being walked, and the next one */
+	uint64_t *frontier, *next;
+	uint64_t nfrontier, nnext;
+	pthread_mutex_t lock;
+
+	uint64_t ndirs, nfiles;
+	uint64_t fixed, unfixed;
+	int gdt_dirty;
+	int io_error;
+};
+
+static int quiet;
+
+#define problem(fs, fixable, fmt, ...) do {				\
+	if (fixable && (fs)->repair)					\
+		__atomic_add_fetch(&(fs)->fixed, 1, __ATOMIC_RELAXED);	\
+	else								\
+		__atomic_add_fetch(&(fs)->unfixed, 1, __ATOMIC_RELAXED);\
+	printf(fmt "%s\n", ##__VA_ARGS__,				\
+	       !(fixable) ? "" : (fs)->repair ? " Fixed." : " Not fixed."); \
+} while (0)
+
+static int read_full(struct fsck *fs, void *buf, size_t len, uint64_t off)
+{
+	int ret = fs->bdev.bdev.read(&fs->bdev.bdev, buf, len, off);
+
+	if (ret) {
+		fprintf(stderr, "Error reading the device: %s\n", strerror(-ret));
+		fs->io_error = 1;
+	}
+	return ret;
+}
+
+static int write_full(struct fsck *fs, const void *buf, size_t len, uint64_t off)
+{
+	int ret = fs->bdev.bdev.write(&fs->bdev.bdev, buf, len, off);
+
+	if (ret) {
+		fprintf(stderr, "Error writing the device: %s\n", strerror(-ret));
+		fs->io_error = 1;
+	}
+	return ret;
+}
+
+/* Run fn over [0, total) split into chunks, on fs->nthreads threads */
+struct work {
+	struct fsck *fs;
+	void (*fn)(struct fsck *fs, uint64_t start, uint64_t end);
+	uint64_t total;
+	uint64_t chunk;
+	uint64_t next;
+};
+
+static void *worker(void *arg)
+{
+	struct work *w = arg;
+	uint64_t start, end;
+
+	for (;;) {
+		start = __atomic_fetch_add(&w->next, w->chunk, __ATOMIC_RELAXED);
+		if (start >= w->total)
+			break;
+		end = start + w->chunk < w->total ? start + w->chunk : w->total;
+		w->fn(w->fs, start, end);
+	}
+	return NULL;
+}
+
+static void run_parallel(struct fsck *fs,
+			 void (*fn)(struct fsck *, uint64_t, uint64_t),
+			 uint64_t total, uint64_t chunk)
+{
+	struct work w = {
+		.fs = fs, .fn = fn, .total = total, .chunk = chunk ? chunk : 1,
+	};
+	pthread_t *threads;
+	int i, n = fs->nthreads;
+
+	if ((uint64_t)n > DIV_ROUND_UP(total, w.chunk))
+		n = DIV_ROUND_UP(total, w.chunk);
+	if (n <= 1) {
+		worker(&w);
+		return;
+	}
+
+	threads = calloc(n, sizeof(*threads));
+	for (i = 0; threads && i < n; i++)
+		if (pthread_create(&threads[i], NULL, worker, &w))
+			break;
+	/* Whatever could not be started is done by this thread */
+	worker(&w);
+	while (threads && i--)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static inline int test_and_set_bit_le(uint8_t *map, uint64_t bit)
+{
+	uint8_t mask = 1 << (bit % 8);
+
+	return __atomic_fetch_or(&map[bit / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static inline int test_bit_le(const uint8_t *map, uint64_t bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void clear_bit_le(uint8_t *map, uint64_t bit)
+{
+	__atomic_fetch_and(&map[bit / 8], ~(1 << (bit % 8)), __ATOMIC_RELAXED);
+}
+
+static inline struct simplefs_inode *slot(struct fsck *fs, uint64_t ino)
+{
+	return &fs->itable[ino - 1];
+}
+
+static inline void slot_dirty(struct fsck *fs, uint64_t ino)
+{
+	if (fs->repair)
+		__atomic_store_n(&fs->itable_dirty[(ino - 1) / fs->ipb], 1,
+				 __ATOMIC_RELAXED);
+}
+
+/* The super block is checked and the block bitmap read in one go by
+ * libsimplefs. The counts in it are not trusted, they are recomputed.
+ * Checksums are checked here rather than by libsimplefs, which would
+ * refuse to mount. */
+static int check_super(struct fsck *fs)
+{
+	int ret;
+
+	ret = sfs_mount(&fs->sfs, &fs->bdev.bdev, SFS_MOUNT_NO_CSUM |
+			(fs->repair ? 0 : SFS_MOUNT_READ_ONLY));
+	/* Made by mkfs-simplefs --from-dir, rebuild it rather than repair it */
+	if (ret == -EROFS) {
+		printf("The filesystem is a read-only image, checking only.\n");
+		fs->repair = 0;
+		ret = sfs_mount(&fs->sfs, &fs->bdev.bdev,
+				SFS_MOUNT_NO_CSUM | SFS_MOUNT_READ_ONLY);
+	}
+	if (ret == -EINVAL) {
+		fprintf(stderr, "Not a usable simplefs filesystem: %s\n",
+			simplefs_check_layout(&fs->sfs.sb));
+		return -1;
+	} else if (ret) {
+		fprintf(stderr, "Error reading the device: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	fs->mounted = 1;
+
+	if (fs->sfs.sb.checksum != sfs_sb_csum(&fs->sfs.sb))
+		problem(fs, 1, "Super block has a bad checksum.");
+	if (fs->sfs.was_dirty && !quiet)
+		printf("The filesystem was not unmounted cleanly, bitmap checksums are not checked.\n");
+
+	/* Every bitmap is compared below */
+	ret = sfs_load_bitmaps(&fs->sfs);
+	if (ret) {
+		fprintf(stderr, "Error reading the bitmaps: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	fs->bs = fs->sfs.bs;
+	fs->ipb = SIMPLEFS_INODES_PER_BLOCK(fs->bs);
+	return 0;
+}
+
+/* Only the files of a read-only image are packed, and each must fit in
+ * the part of its block it was given */
+static int bad_offset(struct fsck *fs, const struct simplefs_inode *in)
+{
+	uint64_t stored = in->flags & SIMPLEFS_INODE_LZ4 ? in->compressed_size
+							 : in->file_size;
+
+	if (!(in->flags & SIMPLEFS_INODE_PACKED))
+		return in->data_offset != 0;
+	return !(fs->sfs.sb.flags & SIMPLEFS_SB_READ_ONLY) ||
+	       S_ISDIR(in->mode) || !in->data_block_number ||
+	       in->data_offset + stored > fs->bs;
+}
+
+/* The inode table blocks of group that can hold inodes in use. A
+ * descriptor and inode bitmap with good checksums can be trusted to mark
+ * every one of them, unless the filesystem went down mounted, so the
+ * table is only read up to the block of the last one. */
+static uint64_t itable_blocks_used(struct fsck *fs, uint64_t g)
+{
+	struct simplefs_group_desc *desc = &fs->sfs.gdt[g];
+	const uint8_t *map = fs->sfs.imap + g * fs->bs;
+	uint64_t i;
+
+	if (fs->sfs.was_dirty || desc->checksum != sfs_desc_csum(desc) ||
+	    desc->imap_checksum != sfs_block_csum(map, fs->bs))
+		return fs->sfs.sb.itable_blocks;
+	for (i = fs->sfs.sb.inodes_per_group; i && !test_bit_le(map, i - 1); i--)
+		;
+	return DIV_ROUND_UP(i, fs->ipb);
+}
+
+/* Pass 1: stream in the inode tables of a run of groups and sanity check
+ * every slot in them */
+static void load_itable(struct fsck *fs, uint64_t start, uint64_t end)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t ipg = sb->inodes_per_group;
+	uint64_t ino, g, n, first = start * ipg + 1, last = end * ipg;
+	struct simplefs_inode *in;
+	uint64_t files = 0, dirs = 0;
+	const char *why;
+
+	for (g = start; g < end; g++) {
+		n = itable_blocks_used(fs, g);
+		memset(slot(fs, g * ipg + 1) + n * fs->ipb, 0,
+		       (sb->itable_blocks - n) * fs->bs);
+		if (n && read_full(fs, slot(fs, g * ipg + 1), n * fs->bs,
+				   simplefs_group_itable(sb, g) * fs->bs))
+			return;
+	}
+
+	for (ino = first; ino <= last; ino++) {
+		in = slot(fs, ino);
+		if (!in->inode_no)
+			continue;
+
+		why = NULL;
+		if (in->inode_no != ino)
+			why = "holds the wrong inode number";
+		else if (!S_ISDIR(in->mode) && !S_ISREG(in->mode))
+			why = "is neither a file nor a directory";
+		else if (in->data_block_number &&
+			 (in->data_block_number >= sb->blocks_count ||
+			  simplefs_block_is_meta(sb, in->data_block_number)))
+			why = "points outside the data area";
+		else if (!in->data_block_number && S_ISDIR(in->mode))
+			why = "has no data block";
+		else if ((in->flags & SIMPLEFS_INODE_LZ4) &&
+			 (S_ISDIR(in->mode) || !in->data_block_number ||
+			  !in->compressed_size || in->compressed_size > fs->bs ||
+			  in->file_size <= fs->bs ||
+			  in->file_size > SIMPLEFS_MAX_COMPRESSED_BLOCKS * fs->bs))
+			why = "is compressed but the sizes do not add up";
+		else if (bad_offset(fs, in))
+			why = "has its data at a bad offset";
+
+		if (why) {
+			problem(fs, 1, "Inode %llu %s.", (unsigned long long)ino, why);
+			fs->state[ino] = I_USED | I_BAD;
+			continue;
+		}
+
+		fs->state[ino] = I_USED;
+		if (in->checksum != sfs_inode_csum(in)) {
+			problem(fs, 1, "Inode %llu has a bad checksum.",
+				(unsigned long long)ino);
+			slot_dirty(fs, ino);
+		}
+		if (in->flags & ~(SIMPLEFS_INODE_LZ4 | SIMPLEFS_INODE_NOCOMPRESS |
+				  SIMPLEFS_INODE_PACKED) ||
+		    (!(in->flags & SIMPLEFS_INODE_LZ4) && in->compressed_size)) {
+			problem(fs, 1, "Inode %llu has unknown flags %#x or a stray compressed size.",
+				(unsigned long long)ino, in->flags);
+			in->flags &= SIMPLEFS_INODE_LZ4 | SIMPLEFS_INODE_NOCOMPRESS |
+				     SIMPLEFS_INODE_PACKED;
+			if (!(in->flags & SIMPLEFS_INODE_LZ4))
+				in->compressed_size = 0;
+			slot_dirty(fs, ino);
+		}
+		if (in->xattr_block &&
+		    (in->xattr_block >= sb->blocks_count ||
+		     simplefs_block_is_meta(sb, in->xattr_block))) {
+			problem(fs, 1, "Inode %llu has its extended attributes outside the data area, dropping them.",
+				(unsigned long long)ino);
+			in->xattr_block = 0;
+			slot_dirty(fs, ino);
+		}
+		if (simplefs_xattr_check(in->xattrs, sizeof(in->xattrs))) {
+			problem(fs, 1, "Inode %llu has damaged extended attributes, dropping them.",
+				(unsigned long long)ino);
+			memset(in->xattrs, 0, sizeof(in->xattrs));
+			slot_dirty(fs, ino);
+		}
+		if (S_ISDIR(in->mode)) {
+			dirs++;
+		} else {
+			files++;
+			if (in->file_size > fs->bs &&
+			    !(in->flags & SIMPLEFS_INODE_LZ4)) {
+				problem(fs, 1, "Inode %llu is %llu bytes, larger than a block and not compressed.",
+					(unsigned long long)ino,
+					(unsigned long long)in->file_size);
+				in->file_size = fs->bs;
+				slot_dirty(fs, ino);
+			}
+		}
+	}
+
+	__atomic_add_fetch(&fs->ndirs, dirs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fs->nfiles, files, __ATOMIC_RELAXED);
+}
+
+static int cmp_by_block(const void *a, const void *b, void *arg)
+{
+	struct fsck *fs = arg;
+	uint64_t ba = slot(fs, *(const uint64_t *)a)->data_block_number;
+	uint64_t bb = slot(fs, *(const uint64_t *)b)->data_block_number;
+
+	return ba < bb ? -1 : ba > bb;
+}
+
+/* Pass 2: check the records of a slice of the current directory level.
+ * Child directories are queued for the next level; a directory that is
+ * reached a second time (hard linked or part of a loop) loses the extra
+ * record. */
+static void walk_dirs(struct fsck *fs, uint64_t start, uint64_t end)
+{
+	uint64_t rpb = fs->bs / sizeof(struct simplefs_dir_record);
+	uint64_t *found = malloc(rpb * sizeof(*found));
+	char *block = malloc(fs->bs);
+	struct simplefs_dir_record *r;
+	struct simplefs_inode *dir, *child;
+	uint64_t i, k, ino, nfound, children, subdirs;
+	const char *why;
+	int dirty, bad_csum;
+
+	if (!found || !block) {
+		fprintf(stderr, "Out of memory\n");
+		fs->io_error = 1;
+		goto out;
+	}
+
+	for (i = start; i < end; i++) {
+		ino = fs->frontier[i];
+		dir = slot(fs, ino);
+		if (read_full(fs, block, fs->bs, dir->data_block_number * fs->bs))
+			break;
+
+		bad_csum = !sfs_dir_csum_ok(block, fs->bs);
+		dirty = 0;
+		nfound = children = subdirs = 0;
+		r = (struct simplefs_dir_record *)block;
+		for (k = 0; k < rpb; k++, r++) {
+			if (!r->inode_no)
+				continue;
+
+			why = NULL;
+			if (!memchr(r->filename, 0, sizeof(r->filename)) || !r->filename[0])
+				why = "has a bad name";
+			else if (r->inode_no > fs->sfs.sb.inodes_max ||
+				 r->inode_no == SIMPLEFS_ROOTDIR_INODE_NUMBER ||
+				 (fs->state[r->inode_no] & (I_USED | I_BAD)) != I_USED)
+				why = "points at an unused or damaged inode";
+			else if (S_ISDIR(slot(fs, r->inode_no)->mode) &&
+				 (__atomic_fetch_or(&fs->state[r->inode_no], I_REACHED,
+						    __ATOMIC_RELAXED) & I_REACHED))
+				why = "is a second link to a directory";
+
+			if (why) {
+				problem(fs, 1, "Directory %llu entry %llu (inode %llu) %s.",
+					(unsigned long long)ino, (unsigned long long)k,
+					(unsigned long long)r->inode_no, why);
+				memset(r, 0, sizeof(*r));
+				dirty = 1;
+				continue;
+			}
+
+			children++;
+			__atomic_add_fetch(&fs->refs[r->inode_no], 1, __ATOMIC_RELAXED);
+			child = slot(fs, r->inode_no);
+			if (S_ISDIR(child->mode)) {
+				subdirs++;
+				found[nfound++] = r->inode_no;
+			}
+		}
+
+		if (bad_csum) {
+			problem(fs, 1, "Directory %llu block has a bad checksum.",
+				(unsigned long long)ino);
+			dirty = 1;
+		}
+		if (dirty && fs->repair) {
+			sfs_dir_set_csum(block, fs->bs);
+			if (write_full(fs, block, fs->bs,
+				       dir->data_block_number * fs->bs))
+				break;
+		}
+
+		if (dir->dir_children_count != children) {
+			problem(fs, 1, "Directory %llu has %llu entries, not %llu.",
+				(unsigned long long)ino, (unsigned long long)children,
+				(unsigned long long)dir->dir_children_count);
+			dir->dir_children_count = children;
+			slot_dirty(fs, ino);
+		}
+		if (dir->nlink != 2 + subdirs) {
+			problem(fs, 1, "Directory %llu has link count %u, should be %llu.",
+				(unsigned long long)ino, dir->nlink,
+				(unsigned long long)(2 + subdirs));
+			dir->nlink = 2 + subdirs;
+			slot_dirty(fs, ino);
+		}
+
+		if (nfound) {
+			pthread_mutex_lock(&fs->lock);
+			memcpy(&fs->next[fs->nnext], found, nfound * sizeof(*found));
+			fs->nnext += nfound;
+			pthread_mutex_unlock(&fs->lock);
+		}
+	}
+out:
+	free(found);
+	free(block);
+}
+
+static int walk_tree(struct fsck *fs)
+{
+	uint64_t root = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	uint64_t *tmp;
+
+	if ((fs->state[root] & (I_USED | I_BAD)) != I_USED ||
+	    !S_ISDIR(slot(fs, root)->mode)) {
+		fprintf(stderr, "The root directory is damaged, cannot continue\n");
+		return -1;
+	}
+
+	/* Each directory is queued at most once, so ndirs bounds a level */
+	fs->frontier = malloc((fs->ndirs + 1) * sizeof(uint64_t));
+	fs->next = malloc((fs->ndirs + 1) * sizeof(uint64_t));
+	if (!fs->frontier || !fs->next) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	fs->state[root] |= I_REACHED;
+	fs->frontier[0] = root;
+	fs->nfrontier = 1;
+
+	while (fs->nfrontier && !fs->io_error) {
+		/* Read the directory blocks of a level in disk order */
+		qsort_r(fs->frontier, fs->nfrontier, sizeof(uint64_t),
+			cmp_by_block, fs);
+		fs->nnext = 0;
+		run_parallel(fs, walk_dirs, fs->nfrontier, 64);
+
+		tmp = fs->frontier;
+		fs->frontier = fs->next;
+		fs->next = tmp;
+		fs->nfrontier = fs->nnext;
+	}
+
+	return fs->io_error ? -1 : 0;
+}
+
+static void add_shared(struct fsck *fs, uint64_t block)
+{
+	uint64_t *p;
+
+	pthread_mutex_lock(&fs->lock);
+	if (fs->nshared == fs->shared_size) {
+		fs->shared_size = fs->shared_size ? 2 * fs->shared_size : 64;
+		p = realloc(fs->shared, fs->shared_size * sizeof(*p));
+		if (!p) {
+			fprintf(stderr, "Out of memory\n");
+			fs->io_error = 1;
+			pthread_mutex_unlock(&fs->lock);
+			return;
+		}
+		fs->shared = p;
+	}
+	fs->shared[fs->nshared++] = block;
+	pthread_mutex_unlock(&fs->lock);
+}
+
+/* Whether the xattr block of in can be kept: a block that is not one is
+ * dropped, one with only a bad checksum gets a new one */
+static int check_xattr_block(struct fsck *fs, struct simplefs_inode *in,
+			     void *block)
+{
+	if (read_full(fs, block, fs->bs, in->xattr_block * fs->bs))
+		return 0;
+	if (simplefs_xattr_block_check(block, fs->bs)) {
+		problem(fs, 1, "Inode %llu points at a damaged xattr block %llu, dropping its extended attributes.",
+			(unsigned long long)in->inode_no,
+			(unsigned long long)in->xattr_block);
+		return 0;
+	}
+	if (!sfs_dir_csum_ok(block, fs->bs)) {
+		/* Once for each inode sharing the block */
+		problem(fs, 1, "Xattr block %llu of inode %llu has a bad checksum.",
+			(unsigned long long)in->xattr_block,
+			(unsigned long long)in->inode_no);
+		if (fs->repair) {
+			sfs_dir_set_csum(block, fs->bs);
+			write_full(fs, block, fs->bs, in->xattr_block * fs->bs);
+		}
+	}
+	return 1;
+}
+
+/* Pass 3: drop what the walk did not reach, fix file link counts and
+ * rebuild the block bitmap from what is left */
+static void reconcile(struct fsck *fs, uint64_t start, uint64_t end)
+{
+	uint64_t ino, block;
+	struct simplefs_inode *in;
+	void *xattrs = NULL;
+
+	for (ino = start + 1; ino <= end; ino++) {
+		if (!(fs->state[ino] & I_USED))
+			continue;
+		in = slot(fs, ino);
+
+		if (!(fs->state[ino] & I_BAD)) {
+			if (S_ISDIR(in->mode) ? !(fs->state[ino] & I_REACHED)
+					      : !fs->refs[ino]) {
+				problem(fs, 1, "Inode %llu is not in any directory.",
+					(unsigned long long)ino);
+				fs->state[ino] |= I_BAD;
+				__atomic_sub_fetch(S_ISDIR(in->mode) ? &fs->ndirs : &fs->nfiles,
+						   1, __ATOMIC_RELAXED);
+			} else if (S_ISREG(in->mode) && in->nlink != fs->refs[ino]) {
+				problem(fs, 1, "Inode %llu has link count %u, should be %u.",
+					(unsigned long long)ino, in->nlink, fs->refs[ino]);
+				in->nlink = fs->refs[ino];
+				slot_dirty(fs, ino);
+			}
+		}
+
+		if (fs->state[ino] & I_BAD) {
+			memset(in, 0, sizeof(*in));
+			slot_dirty(fs, ino);
+			fs->state[ino] = 0;
+			continue;
+		}
+
+		/* A block used more than once is checked against the
+		 * reference counts later, unless small files were packed
+		 * into it */
+		block = in->data_block_number;
+		if (S_ISDIR(in->mode))
+			test_and_set_bit_le(fs->dirmap, block);
+		else if (block)
+			test_and_set_bit_le(fs->datamap, block);
+		if (block && test_and_set_bit_le(fs->bmap, block) &&
+		    !(in->flags & SIMPLEFS_INODE_PACKED))
+			add_shared(fs, block);
+
+		block = in->xattr_block;
+		if (!block)
+			continue;
+		if (!xattrs)
+			xattrs = malloc(fs->bs);
+		if (!xattrs) {
+			fprintf(stderr, "Out of memory\n");
+			fs->io_error = 1;
+			break;
+		}
+		if (!check_xattr_block(fs, in, xattrs)) {
+			in->xattr_block = 0;
+			slot_dirty(fs, ino);
+			continue;
+		}
+		test_and_set_bit_le(fs->xattrmap, block);
+		if (test_and_set_bit_le(fs->bmap, block))
+			add_shared(fs, block);
+	}
+	free(xattrs);
+}
+
+static uint64_t popcount_bytes(const uint8_t *p, uint64_t len)
+{
+	uint64_t n = 0;
+
+	while (len--)
+		n += __builtin_popcount(*p++);
+	return n;
+}
+
+/* Pass 4: compare the rebuilt bitmap with the one on disk */
+static int check_bitmap(struct fsck *fs)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t len = sb->groups_count * fs->bs;
+	uint64_t i, b, leaked = 0, missing = 0, used;
+	uint8_t *disk = fs->sfs.bmap;
+
+	for (i = 0; i < len; i++) {
+		leaked += __builtin_popcount(disk[i] & ~fs->bmap[i]);
+		missing += __builtin_popcount(fs->bmap[i] & ~disk[i]);
+	}
+
+	if (leaked)
+		problem(fs, 1, "%llu blocks are marked in use but belong to nothing.",
+			(unsigned long long)leaked);
+	if (missing)
+		problem(fs, 1, "%llu blocks in use are marked free.",
+			(unsigned long long)missing);
+
+	if ((leaked || missing) && fs->repair) {
+		for (b = 0; b < sb->groups_count; b++) {
+			if (!memcmp(disk + b * fs->bs, fs->bmap + b * fs->bs, fs->bs))
+				continue;
+			if (write_full(fs, fs->bmap + b * fs->bs, fs->bs,
+				       simplefs_group_bmap(sb, b) * fs->bs))
+				return -1;
+		}
+	}
+
+	/* Bits past the end of the device are set too, leave them out */
+	used = popcount_bytes(fs->bmap, len) - (len * 8 - sb->blocks_count);
+	if (sb->free_blocks != sb->blocks_count - used) {
+		problem(fs, 1, "Super block free block count is %llu, should be %llu.",
+			(unsigned long long)sb->free_blocks,
+			(unsigned long long)(sb->blocks_count - used));
+		sb->free_blocks = sb->blocks_count - used;
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Pass 5: a block that several files point at is a clone, or extended
+ * attributes they have in common, and must have a reference count that
+ * says so; nothing else may have one. The tables are
+ * rebuilt from the shared blocks found and compared with those on disk,
+ * whose entries are in no particular order. */
+static int check_refs(struct fsck *fs)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t n = SIMPLEFS_REFS_PER_BLOCK(fs->bs);
+	uint64_t i, j, k, g, block, *used;
+	struct simplefs_refcount *want, *have, *ref;
+	uint8_t *matched;
+	int bad, ret = -1;
+
+	want = calloc(sb->groups_count, fs->bs);
+	used = calloc(sb->groups_count, sizeof(*used));
+	matched = malloc(n);
+	if (!want || !used || !matched) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	qsort(fs->shared, fs->nshared, sizeof(*fs->shared), cmp_u64);
+	for (i = 0; i < fs->nshared; i = j) {
+		block = fs->shared[i];
+		for (j = i; j < fs->nshared && fs->shared[j] == block; j++)
+			;
+		if (test_bit_le(fs->dirmap, block)) {
+			problem(fs, 0, "Block %llu of a directory is used by another inode.",
+				(unsigned long long)block);
+			continue;
+		}
+		if (test_bit_le(fs->xattrmap, block) &&
+		    test_bit_le(fs->datamap, block)) {
+			problem(fs, 0, "Block %llu holds both extended attributes and file data.",
+				(unsigned long long)block);
+			continue;
+		}
+		g = simplefs_block_group(sb, block);
+		if (used[g] == n) {
+			problem(fs, 0, "Block %llu is shared but the reference count table of group %llu is full.",
+				(unsigned long long)block, (unsigned long long)g);
+			continue;
+		}
+		ref = &want[g * n + used[g]++];
+		simplefs_refs_locate(sb, block, &ref->index);
+		ref->count = j - i + 1;
+	}
+
+	for (g = 0; g < sb->groups_count; g++) {
+		have = fs->sfs.refs + g * n;
+		memset(matched, 0, n);
+		bad = 0;
+		for (i = 0; i < n; i++) {
+			if (!have[i].index)
+				continue;
+			block = (g << simplefs_group_bits(sb)) + have[i].index;
+			for (k = 0; k < used[g]; k++)
+				if (!matched[k] && want[g * n + k].index == have[i].index)
+					break;
+			if (k == used[g]) {
+				problem(fs, 1, "Block %llu has a reference count of %u but is not shared.",
+					(unsigned long long)block, have[i].count);
+				bad = 1;
+				continue;
+			}
+			matched[k] = 1;
+			if (have[i].count != want[g * n + k].count) {
+				problem(fs, 1, "Block %llu is shared by %u files, not %u.",
+					(unsigned long long)block,
+					want[g * n + k].count, have[i].count);
+				bad = 1;
+			}
+		}
+		for (k = 0; k < used[g]; k++) {
+			if (matched[k])
+				continue;
+			problem(fs, 1, "Block %llu is shared by %u files but has no reference count.",
+				(unsigned long long)((g << simplefs_group_bits(sb)) +
+						     want[g * n + k].index),
+				want[g * n + k].count);
+			bad = 1;
+		}
+
+		fs->gdt[g].shared_blocks = used[g];
+		fs->gdt[g].refs_checksum = sfs_block_csum(bad ? want + g * n : have,
+							  fs->bs);
+		if (bad && fs->repair &&
+		    write_full(fs, want + g * n, fs->bs,
+			       simplefs_group_refs(sb, g) * fs->bs))
+			goto out;
+	}
+	ret = 0;
+out:
+	free(want);
+	free(used);
+	free(matched);
+	return ret;
+}
+
+/* Pass 6: rebuild the inode bitmap and the group descriptors from the
+ * inodes that survived and compare them with those on disk */
+static int check_imap(struct fsck *fs)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t ipg = sb->inodes_per_group, bits = fs->bs * 8;
+	uint64_t i, g, b, ino, leaked = 0, missing = 0;
+	uint8_t *disk = fs->sfs.imap, *imap, *map;
+	struct simplefs_group_desc *want, *have;
+
+	imap = calloc(sb->groups_count, fs->bs);
+	if (!imap) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	for (g = 0; g < sb->groups_count; g++) {
+		map = imap + g * fs->bs;
+		want = &fs->gdt[g];
+		want->inode_hint = ipg;
+		for (i = 0; i < ipg; i++) {
+			ino = g * ipg + i + 1;
+			if (!(fs->state[ino] & I_USED)) {
+				want->free_inodes++;
+				if (want->inode_hint == ipg)
+					want->inode_hint = i;
+				continue;
+			}
+			test_and_set_bit_le(map, i);
+			if (S_ISDIR(slot(fs, ino)->mode))
+				want->dirs++;
+		}
+		/* Bits past the last inode of the group are always set */
+		for (i = ipg; i < bits; i++)
+			test_and_set_bit_le(map, i);
+		want->free_blocks = bits - popcount_bytes(fs->bmap + g * fs->bs, fs->bs);
+		want->bmap_checksum = sfs_block_csum(fs->bmap + g * fs->bs, fs->bs);
+		want->imap_checksum = sfs_block_csum(map, fs->bs);
+	}
+
+	for (i = 0; i < sb->groups_count * fs->bs; i++) {
+		leaked += __builtin_popcount(disk[i] & ~imap[i]);
+		missing += __builtin_popcount(imap[i] & ~disk[i]);
+	}
+
+	if (leaked)
+		problem(fs, 1, "%llu inodes are marked in use but are free.",
+			(unsigned long long)leaked);
+	if (missing)
+		problem(fs, 1, "%llu inodes in use are marked free.",
+			(unsigned long long)missing);
+
+	if ((leaked || missing) && fs->repair) {
+		for (b = 0; b < sb->groups_count; b++) {
+			if (!memcmp(disk + b * fs->bs, imap + b * fs->bs, fs->bs))
+				continue;
+			if (write_full(fs, imap + b * fs->bs, fs->bs,
+				       simplefs_group_imap(sb, b) * fs->bs)) {
+				free(imap);
+				return -1;
+			}
+		}
+	}
+	free(imap);
+
+	/* A hint below the first free inode is merely slow, one above it
+	 * hides free inodes from the allocator */
+	for (g = 0; g < sb->groups_count; g++) {
+		want = &fs->gdt[g];
+		have = &fs->sfs.gdt[g];
+		if (have->inode_hint < want->inode_hint)
+			want->inode_hint = have->inode_hint;
+		want->checksum = sfs_desc_csum(want);
+		if (!memcmp(want, have, sizeof(*want)))
+			continue;
+		fs->gdt_dirty = 1;
+
+		if (have->checksum != sfs_desc_csum(have))
+			problem(fs, 1, "Group %llu descriptor has a bad checksum.",
+				(unsigned long long)g);
+		/* Bitmaps that were found wrong above get new checksums
+		 * without another message, and after a crash the checksums
+		 * are expected to lag behind */
+		if (!fs->sfs.was_dirty &&
+		    (have->bmap_checksum != sfs_block_csum(fs->sfs.bmap + g * fs->bs, fs->bs) ||
+		     have->imap_checksum != sfs_block_csum(disk + g * fs->bs, fs->bs) ||
+		     have->refs_checksum != sfs_block_csum((uint8_t *)fs->sfs.refs +
+							   g * fs->bs, fs->bs)))
+			problem(fs, 1, "Group %llu has a bitmap or reference count table with a bad checksum.",
+				(unsigned long long)g);
+		if (!memcmp(want, have, offsetof(struct simplefs_group_desc,
+						 bmap_checksum)))
+			continue;
+		problem(fs, 1, "Group %llu has %llu/%llu/%llu/%llu free blocks/free inodes/directories/shared blocks, not %llu/%llu/%llu/%llu, and inode hint %llu, not %llu.",
+			(unsigned long long)g,
+			(unsigned long long)want->free_blocks,
+			(unsigned long long)want->free_inodes,
+			(unsigned long long)want->dirs,
+			(unsigned long long)want->shared_blocks,
+			(unsigned long long)have->free_blocks,
+			(unsigned long long)have->free_inodes,
+			(unsigned long long)have->dirs,
+			(unsigned long long)have->shared_blocks,
+			(unsigned long long)want->inode_hint,
+			(unsigned long long)have->inode_hint);
+	}
+
+	return 0;
+}
+
+static int write_back(struct fsck *fs)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t b, e, inodes = 0, ino, i;
+	struct simplefs_inode *in;
+	int ret;
+
+	for (ino = 1; ino <= sb->inodes_max; ino++)
+		if (fs->state[ino] & I_USED)
+			inodes++;
+	if (sb->inodes_count != inodes) {
+		problem(fs, 1, "Super block inode count is %llu, should be %llu.",
+			(unsigned long long)sb->inodes_count,
+			(unsigned long long)inodes);
+		sb->inodes_count = inodes;
+	}
+
+	if (!fs->repair)
+		return 0;
+
+	/* Coalesce runs of dirty inode table blocks of a group into single
+	 * writes */
+	for (b = 0; b < sb->groups_count * sb->itable_blocks; b = e) {
+		if (!fs->itable_dirty[b]) {
+			e = b + 1;
+			continue;
+		}
+		for (e = b; e < (b / sb->itable_blocks + 1) * sb->itable_blocks &&
+			    fs->itable_dirty[e]; e++) {
+			in = (struct simplefs_inode *)((char *)fs->itable + e * fs->bs);
+			for (i = 0; i < fs->ipb; i++, in++)
+				if (in->inode_no)
+					in->checksum = sfs_inode_csum(in);
+		}
+		if (write_full(fs, (char *)fs->itable + b * fs->bs, (e - b) * fs->bs,
+			       (simplefs_group_itable(sb, b / sb->itable_blocks) +
+				b % sb->itable_blocks) * fs->bs))
+			return -1;
+	}
+
+	if (fs->gdt_dirty &&
+	    write_full(fs, fs->gdt, sb->gdt_blocks * fs->bs, sb->gdt_block * fs->bs))
+		return -1;
+
+	sb->flags &= ~SIMPLEFS_SB_DIRTY;
+	sb->checksum = sfs_sb_csum(sb);
+	if (write_full(fs, sb, sizeof(*sb), 0))
+		return -1;
+
+	ret = sfs_sync(&fs->sfs);
+	if (ret) {
+		fprintf(stderr, "Error syncing the device: %s\n", strerror(-ret));
+		return -1;
+	}
+	return 0;
+}
+
+static int fsck(struct fsck *fs)
+{
+	struct simplefs_super_block *sb = &fs->sfs.sb;
+	uint64_t bit, chunk, g, start;
+
+	if (check_super(fs))
+		return -1;
+
+	fs->itable = malloc(sb->groups_count * sb->itable_blocks * fs->bs);
+	fs->itable_dirty = calloc(sb->groups_count * sb->itable_blocks, 1);
+	fs->state = calloc(sb->inodes_max + 1, 1);
+	fs->refs = calloc(sb->inodes_max + 1, sizeof(*fs->refs));
+	fs->bmap = calloc(sb->groups_count, fs->bs);
+	fs->dirmap = calloc(sb->groups_count, fs->bs);
+	fs->datamap = calloc(sb->groups_count, fs->bs);
+	fs->xattrmap = calloc(sb->groups_count, fs->bs);
+	/* The descriptor blocks are written back whole, keep their padding */
+	fs->gdt = calloc(sb->gdt_blocks, fs->bs);
+	if (!fs->itable || !fs->itable_dirty || !fs->state || !fs->refs ||
+	    !fs->bmap || !fs->dirmap || !fs->datamap || !fs->xattrmap ||
+	    !fs->gdt) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	/* Whole groups at a time, in reads of about ITABLE_CHUNK_BYTES */
+	chunk = ITABLE_CHUNK_BYTES / (sb->itable_blocks * fs->bs);
+	run_parallel(fs, load_itable, sb->groups_count, chunk);
+	if (fs->io_error)
+		return -1;
+
+	if (walk_tree(fs))
+		return -1;
+
+	/* The metadata at the front of each group and the bits past the end
+	 * of the device are always set */
+	for (g = 0; g < sb->groups_count; g++) {
+		start = g * sb->blocks_per_group;
+		for (bit = start; bit < simplefs_group_data(sb, g); bit++)
+			test_and_set_bit_le(fs->bmap, bit);
+	}
+	for (bit = sb->blocks_count; bit < sb->groups_count * sb->blocks_per_group; bit++)
+		test_and_set_bit_le(fs->bmap, bit);
+
+	run_parallel(fs, reconcile, sb->inodes_max,
+		     (chunk ? chunk : 1) * sb->inodes_per_group);
+
+	if (fs->io_error || check_bitmap(fs))
+		return -1;
+
+	if (check_refs(fs))
+		return -1;
+
+	if (check_imap(fs))
+		return -1;
+
+	return write_back(fs);
+}
+
+static void usage(void)
+{
+	printf("Usage: fsck-simplefs [-n] [-q] [-j threads] <device>\n");
+	printf("  -n  check only, do not change anything\n");
+	printf("  -q  only print problems\n");
+	printf("  -j  number of threads (default: online CPUs)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fsck fs = {
+		.repair = 1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int fd;
+	int opt;
+	int ret;
+
+	fs.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (fs.nthreads < 1)
+		fs.nthreads = 1;
+
+	while ((opt = getopt(argc, argv, "nqj:")) != -1) {
+		switch (opt) {
+		case 'n':
+			fs.repair = 0;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'j':
+			fs.nthreads = atoi(optarg);
+			if (fs.nthreads < 1) {
+				usage();
+				return FSCK_ERROR;
+			}
+			break;
+		default:
+			usage();
+			return FSCK_ERROR;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return FSCK_ERROR;
+	}
+
+	fd = open(argv[optind], fs.repair ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+	sfs_file_bdev_init(&fs.bdev, fd);
+
+	ret = fsck(&fs);
+	if (fs.mounted)
+		sfs_umount(&fs.sfs);
+	close(fd);
+	if (ret)
+		return FSCK_ERROR;
+
+	if (!quiet)
+		printf("%s: %llu files, %llu directories, %llu/%llu blocks free\n",
+		       argv[optind], (unsigned long long)fs.nfiles,
+		       (unsigned long long)fs.ndirs,
+		       (unsigned long long)fs.sfs.sb.free_blocks,
+		       (unsigned long long)fs.sfs.sb.blocks_count);
+
+	ret = FSCK_OK;
+	if (fs.fixed)
+		ret |= FSCK_NONDESTRUCT;
+	if (fs.unfixed)
+		ret |= FSCK_UNCORRECTED;
+	return ret;
+}
@@ -0,0 +1,2366 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "libsimplefs.h"
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+static int file_bdev_read(struct sfs_bdev *bdev, void *buf, size_t len,
+			  uint64_t off)
+{
+	struct sfs_file_bdev *fbdev = (struct sfs_file_bdev *)bdev;
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fbdev->fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return -EIO;
+		buf = (char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int file_bdev_write(struct sfs_bdev *bdev, const void *buf, size_t len,
+			   uint64_t off)
+{
+	struct sfs_file_bdev *fbdev = (struct sfs_file_bdev *)bdev;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fbdev->fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return -EIO;
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int file_bdev_flush(struct sfs_bdev *bdev)
+{
+	struct sfs_file_bdev *fbdev = (struct sfs_file_bdev *)bdev;
+
+	return fsync(fbdev->fd) ? -errno : 0;
+}
+
+void sfs_file_bdev_init(struct sfs_file_bdev *fbdev, int fd)
+{
+	fbdev->bdev.read = file_bdev_read;
+	fbdev->bdev.write = file_bdev_write;
+	fbdev->bdev.flush = file_bdev_flush;
+	fbdev->fd = fd;
+}
+
+/* How much larger than made a filesystem can be grown */
+#define GROW_FACTOR	1024
+
+int sfs_compute_layout(struct simplefs_super_block *sb, uint64_t block_size,
+		       uint64_t blocks_count)
+{
+	uint64_t ipb = SIMPLEFS_INODES_PER_BLOCK(block_size);
+	uint64_t bits = block_size * 8, per_group, want, reserve;
+
+	if (!simplefs_valid_block_size(block_size))
+		return -EINVAL;
+
+	sb->version = SIMPLEFS_LAYOUT_VERSION;
+	sb->magic = SIMPLEFS_MAGIC;
+	sb->block_size = block_size;
+	sb->blocks_count = blocks_count;
+
+	sb->blocks_per_group = bits;
+	sb->groups_count = DIV_ROUND_UP(blocks_count, bits);
+	sb->gdt_block = 1;
+	sb->gdt_blocks = DIV_ROUND_UP(sb->groups_count * sizeof(struct simplefs_group_desc),
+				      block_size);
+
+	/* Every group has the same inode table, sized for a full group unless
+	 * there is only one, and rounded up so that its last block is used */
+	per_group = blocks_count < bits ? blocks_count : bits;
+	sb->itable_blocks = DIV_ROUND_UP(per_group / SIMPLEFS_BLOCKS_PER_INODE, ipb);
+	if (!sb->itable_blocks)
+		sb->itable_blocks = 1;
+	sb->inodes_per_group = sb->itable_blocks * ipb;
+
+	/* A last group too short for its metadata and some data is left out */
+	if (sb->groups_count > 1 &&
+	    simplefs_group_data(sb, sb->groups_count - 1) >= blocks_count) {
+		sb->groups_count--;
+		sb->blocks_count = sb->groups_count * bits;
+	}
+
+	/* Leave room in the descriptor table for SIMPLEFS_IOC_GROW to add
+	 * groups, up to GROW_FACTOR times as many, for at most a 64th of
+	 * group 0 */
+	want = sb->groups_count * GROW_FACTOR;
+	if (want > 0xfffffffeULL / sb->inodes_per_group)
+		want = 0xfffffffeULL / sb->inodes_per_group;
+	reserve = DIV_ROUND_UP(want * sizeof(struct simplefs_group_desc), block_size);
+	if (reserve > simplefs_group_blocks(sb, 0) / 64)
+		reserve = simplefs_group_blocks(sb, 0) / 64;
+	if (reserve > sb->gdt_blocks)
+		sb->gdt_blocks = reserve;
+
+	sb->inodes_max = sb->groups_count * sb->inodes_per_group;
+	sb->data_block = simplefs_group_data(sb, 0);
+
+	/* Room for the root directory and the welcome file */
+	if (!sb->groups_count || sb->data_block + 2 > simplefs_group_blocks(sb, 0))
+		return -ENOSPC;
+
+	return 0;
+}
+
+/* crc32c, reflected polynomial 0x82f63b78: eight bits at a time from a
+ * table, or eight bytes at a time with the SSE4.2 crc32 instruction */
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc, word;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		crc32c_table[i] = crc;
+	}
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+#endif
+}
+
+uint32_t sfs_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+uint32_t sfs_inode_csum(const struct simplefs_inode *inode)
+{
+	return sfs_crc32c(SIMPLEFS_CSUM_SEED, inode,
+			  offsetof(struct simplefs_inode, checksum));
+}
+
+uint32_t sfs_desc_csum(const struct simplefs_group_desc *desc)
+{
+	return sfs_crc32c(SIMPLEFS_CSUM_SEED, desc,
+			  offsetof(struct simplefs_group_desc, checksum));
+}
+
+uint32_t sfs_sb_csum(const struct simplefs_super_block *sb)
+{
+	return sfs_crc32c(SIMPLEFS_CSUM_SEED, sb,
+			  offsetof(struct simplefs_super_block, checksum));
+}
+
+uint32_t sfs_block_csum(const void *block, uint64_t block_size)
+{
+	return sfs_crc32c(SIMPLEFS_CSUM_SEED, block, block_size);
+}
+
+static uint32_t *dir_csum_ptr(const void *block, uint64_t block_size)
+{
+	return (uint32_t *)((uint8_t *)block + SIMPLEFS_DIR_CSUM_OFFSET(block_size));
+}
+
+int sfs_dir_csum_ok(const void *block, uint64_t block_size)
+{
+	return *dir_csum_ptr(block, block_size) ==
+	       sfs_crc32c(SIMPLEFS_CSUM_SEED, block,
+			  SIMPLEFS_DIR_CSUM_OFFSET(block_size));
+}
+
+void sfs_dir_set_csum(void *block, uint64_t block_size)
+{
+	*dir_csum_ptr(block, block_size) =
+		sfs_crc32c(SIMPLEFS_CSUM_SEED, block,
+			   SIMPLEFS_DIR_CSUM_OFFSET(block_size));
+}
+
+int sfs_read_blocks(struct sfs_fs *fs, uint64_t block, uint64_t count, void *buf)
+{
+	return fs->bdev->read(fs->bdev, buf, count * fs->bs, block * fs->bs);
+}
+
+int sfs_write_blocks(struct sfs_fs *fs, uint64_t block, uint64_t count,
+		     const void *buf)
+{
+	if (fs->read_only)
+		return -EROFS;
+	return fs->bdev->write(fs->bdev, buf, count * fs->bs, block * fs->bs);
+}
+
+static int write_super(struct sfs_fs *fs)
+{
+	if (fs->read_only)
+		return -EROFS;
+	fs->sb.checksum = sfs_sb_csum(&fs->sb);
+	return fs->bdev->write(fs->bdev, &fs->sb, sizeof(fs->sb),
+			       SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER * fs->bs);
+}
+
+int sfs_mount(struct sfs_fs *fs, struct sfs_bdev *bdev, int flags)
+{
+	uint64_t groups, g;
+	int ret;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->bdev = bdev;
+	fs->read_only = flags & SFS_MOUNT_READ_ONLY;
+	fs->no_csum = flags & SFS_MOUNT_NO_CSUM;
+
+	ret = bdev->read(bdev, &fs->sb, sizeof(fs->sb), 0);
+	if (ret)
+		return ret;
+	if (simplefs_check_layout(&fs->sb))
+		return -EINVAL;
+	if (!fs->no_csum && fs->sb.checksum != sfs_sb_csum(&fs->sb))
+		return -EBADMSG;
+	if ((fs->sb.flags & SIMPLEFS_SB_READ_ONLY) && !fs->read_only)
+		return -EROFS;
+	fs->bs = fs->sb.block_size;
+	fs->was_dirty = fs->sb.flags & SIMPLEFS_SB_DIRTY;
+
+	groups = fs->sb.groups_count;
+
+	/* Only the descriptors are read, so mounting takes the same time
+	 * whatever the size of the device */
+	fs->gdt = malloc(fs->sb.gdt_blocks * fs->bs);
+	fs->bmap = malloc(3 * groups * fs->bs);
+	fs->loaded = calloc(groups, 1);
+	if (!fs->gdt || !fs->bmap || !fs->loaded) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	fs->imap = fs->bmap + groups * fs->bs;
+	fs->refs = (struct simplefs_refcount *)(fs->bmap + 2 * groups * fs->bs);
+
+	ret = sfs_read_blocks(fs, fs->sb.gdt_block, fs->sb.gdt_blocks, fs->gdt);
+	if (ret)
+		goto err;
+	for (g = 0; g < groups && !fs->no_csum; g++) {
+		if (fs->gdt[g].checksum != sfs_desc_csum(&fs->gdt[g])) {
+			ret = -EBADMSG;
+			goto err;
+		}
+	}
+
+	/* Like the module, until a clean umount */
+	if (!fs->read_only && !fs->no_csum && !fs->was_dirty) {
+		fs->sb.flags |= SIMPLEFS_SB_DIRTY;
+		ret = write_super(fs);
+		if (!ret)
+			ret = fs->bdev->flush(fs->bdev);
+		if (ret)
+			goto err;
+	}
+
+	pthread_rwlock_init(&fs->lock, NULL);
+	return 0;
+
+err:
+	free(fs->gdt);
+	free(fs->bmap);
+	free(fs->loaded);
+	return ret;
+}
+
+/* Read the block and inode bitmaps and the reference count table of group
+ * if that has not been done */
+static int load_group(struct sfs_fs *fs, uint64_t group)
+{
+	struct simplefs_group_desc *desc = &fs->gdt[group];
+	int ret;
+
+	if (fs->loaded[group])
+		return 0;
+
+	ret = sfs_read_blocks(fs, simplefs_group_bmap(&fs->sb, group), 1,
+			      fs->bmap + group * fs->bs);
+	if (!ret)
+		ret = sfs_read_blocks(fs, simplefs_group_imap(&fs->sb, group), 1,
+				      fs->imap + group * fs->bs);
+	if (!ret)
+		ret = sfs_read_blocks(fs, simplefs_group_refs(&fs->sb, group), 1,
+				      (uint8_t *)fs->refs + group * fs->bs);
+	if (ret)
+		return ret;
+
+	/* As in the module, not trusted after a crash */
+	if (!fs->no_csum && !fs->was_dirty &&
+	    (desc->bmap_checksum != sfs_block_csum(fs->bmap + group * fs->bs, fs->bs) ||
+	     desc->imap_checksum != sfs_block_csum(fs->imap + group * fs->bs, fs->bs) ||
+	     desc->refs_checksum != sfs_block_csum((uint8_t *)fs->refs +
+						   group * fs->bs, fs->bs)))
+		return -EIO;
+	fs->loaded[group] = 1;
+	return 0;
+}
+
+int sfs_load_bitmaps(struct sfs_fs *fs)
+{
+	uint64_t g;
+	int ret;
+
+	for (g = 0; g < fs->sb.groups_count; g++) {
+		ret = load_group(fs, g);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+void sfs_umount(struct sfs_fs *fs)
+{
+	if (!fs->read_only && !fs->no_csum && !fs->was_dirty) {
+		sfs_sync(fs);
+		fs->sb.flags &= ~SIMPLEFS_SB_DIRTY;
+		write_super(fs);
+	}
+	sfs_sync(fs);
+	pthread_rwlock_destroy(&fs->lock);
+	free(fs->gdt);
+	free(fs->bmap);
+	free(fs->loaded);
+}
+
+int sfs_sync(struct sfs_fs *fs)
+{
+	if (fs->read_only)
+		return 0;
+	return fs->bdev->flush(fs->bdev);
+}
+
+static inline int test_bit_le(const uint8_t *map, uint64_t bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void set_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void clear_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* Write back the group descriptor block that holds group's descriptor */
+static int gdt_sync(struct sfs_fs *fs, uint64_t group)
+{
+	unsigned int index;
+	uint64_t nr = simplefs_gdt_locate(&fs->sb, group, &index);
+
+	fs->gdt[group].checksum = sfs_desc_csum(&fs->gdt[group]);
+	return sfs_write_blocks(fs, nr, 1,
+				(uint8_t *)fs->gdt + (nr - fs->sb.gdt_block) * fs->bs);
+}
+
+/* Write back the bitmap block that holds the bit of block. Its checksum
+ * goes into the group descriptor, which the caller writes next. */
+static int bmap_sync(struct sfs_fs *fs, uint64_t block)
+{
+	unsigned int bit;
+	uint64_t nr = simplefs_bmap_locate(&fs->sb, block, &bit);
+	uint64_t g = simplefs_block_group(&fs->sb, block);
+
+	fs->gdt[g].bmap_checksum = sfs_block_csum(fs->bmap + g * fs->bs, fs->bs);
+	return sfs_write_blocks(fs, nr, 1, fs->bmap + g * fs->bs);
+}
+
+/* Blocks come from the group of the inode goal, or the next one with room */
+int sfs_alloc_block(struct sfs_fs *fs, uint64_t goal, uint64_t *out)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	uint64_t start = 0, i, g = 0, block = 0, end;
+	int ret;
+
+	if (fs->read_only)
+		return -EROFS;
+	if (!sb->free_blocks)
+		return -ENOSPC;
+	if (goal >= SIMPLEFS_START_INO && goal <= sb->inodes_max)
+		start = simplefs_ino_group(sb, goal);
+
+	/* Bytes that are all in use are skipped whole */
+	for (i = 0; i < sb->groups_count; i++) {
+		g = (start + i) % sb->groups_count;
+		if (!fs->gdt[g].free_blocks)
+			continue;
+		ret = load_group(fs, g);
+		if (ret)
+			return ret;
+		end = (g << simplefs_group_bits(sb)) + simplefs_group_blocks(sb, g);
+		for (block = simplefs_group_data(sb, g); block < end; block++) {
+			if (!(block % 8) && fs->bmap[block / 8] == 0xff) {
+				block += 7;
+				continue;
+			}
+			if (!test_bit_le(fs->bmap, block))
+				goto found;
+		}
+	}
+	return -ENOSPC;
+
+found:
+	set_bit_le(fs->bmap, block);
+	ret = bmap_sync(fs, block);
+	if (ret) {
+		clear_bit_le(fs->bmap, block);
+		return ret;
+	}
+	fs->gdt[g].free_blocks--;
+	sb->free_blocks--;
+	ret = gdt_sync(fs, g);
+	if (ret)
+		return ret;
+
+	*out = block;
+	return write_super(fs);
+}
+
+int sfs_free_block(struct sfs_fs *fs, uint64_t block)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	uint64_t g = simplefs_block_group(sb, block);
+	int ret;
+
+	if (block >= sb->blocks_count || simplefs_block_is_meta(sb, block))
+		return -EIO;
+	ret = load_group(fs, g);
+	if (ret)
+		return ret;
+	if (!test_bit_le(fs->bmap, block))
+		return -EIO;
+
+	clear_bit_le(fs->bmap, block);
+	ret = bmap_sync(fs, block);
+	if (ret) {
+		set_bit_le(fs->bmap, block);
+		return ret;
+	}
+	fs->gdt[g].free_blocks++;
+	sb->free_blocks++;
+	ret = gdt_sync(fs, g);
+	if (ret)
+		return ret;
+
+	return write_super(fs);
+}
+
+/* The entry of block in the reference count table of its group, which
+ * must be loaded, or with alloc set the first free one if it has none */
+static struct simplefs_refcount *refs_find(struct sfs_fs *fs, uint64_t block,
+					   int alloc)
+{
+	uint64_t n = SIMPLEFS_REFS_PER_BLOCK(fs->bs), i;
+	struct simplefs_refcount *table, *free = NULL;
+	unsigned int index;
+
+	simplefs_refs_locate(&fs->sb, block, &index);
+	table = fs->refs + simplefs_block_group(&fs->sb, block) * n;
+	for (i = 0; i < n; i++) {
+		if (table[i].index == index)
+			return &table[i];
+		if (!free && !table[i].index)
+			free = &table[i];
+	}
+	return alloc ? free : NULL;
+}
+
+/* Write back the reference count table of the group of block, see
+ * bmap_sync */
+static int refs_sync(struct sfs_fs *fs, uint64_t block)
+{
+	unsigned int index;
+	uint64_t nr = simplefs_refs_locate(&fs->sb, block, &index);
+	uint64_t g = simplefs_block_group(&fs->sb, block);
+	uint8_t *table = (uint8_t *)fs->refs + g * fs->bs;
+
+	fs->gdt[g].refs_checksum = sfs_block_csum(table, fs->bs);
+	return sfs_write_blocks(fs, nr, 1, table);
+}
+
+int sfs_block_refs(struct sfs_fs *fs, uint64_t block, uint32_t *count)
+{
+	uint64_t g = simplefs_block_group(&fs->sb, block);
+	struct simplefs_refcount *ref;
+	int ret;
+
+	*count = 1;
+	if (!fs->gdt[g].shared_blocks)
+		return 0;
+	ret = load_group(fs, g);
+	if (ret)
+		return ret;
+	ref = refs_find(fs, block, 0);
+	if (ref)
+		*count = ref->count;
+	return 0;
+}
+
+/* Add an owner to block, which a clone is about to point at */
+static int block_ref(struct sfs_fs *fs, uint64_t block)
+{
+	uint64_t g = simplefs_block_group(&fs->sb, block);
+	struct simplefs_refcount *ref;
+	int ret;
+
+	ret = load_group(fs, g);
+	if (ret)
+		return ret;
+	ref = refs_find(fs, block, 1);
+	if (!ref)
+		return -ENOSPC;
+	if (ref->index) {
+		if (ref->count == UINT32_MAX)
+			return -EMLINK;
+		ref->count++;
+		ret = refs_sync(fs, block);
+		return ret ? ret : gdt_sync(fs, g);
+	}
+
+	simplefs_refs_locate(&fs->sb, block, &ref->index);
+	ref->count = 2;
+	ret = refs_sync(fs, block);
+	if (ret)
+		return ret;
+	fs->gdt[g].shared_blocks++;
+	return gdt_sync(fs, g);
+}
+
+/* Drop a file's reference to block, freeing it with the last one */
+static int block_release(struct sfs_fs *fs, uint64_t block)
+{
+	uint64_t g = simplefs_block_group(&fs->sb, block);
+	struct simplefs_refcount *ref;
+	int ret;
+
+	if (!fs->gdt[g].shared_blocks)
+		return sfs_free_block(fs, block);
+	ret = load_group(fs, g);
+	if (ret)
+		return ret;
+	ref = refs_find(fs, block, 0);
+	if (!ref)
+		return sfs_free_block(fs, block);
+
+	if (--ref->count >= 2) {
+		ret = refs_sync(fs, block);
+		return ret ? ret : gdt_sync(fs, g);
+	}
+	memset(ref, 0, sizeof(*ref));
+	ret = refs_sync(fs, block);
+	if (ret)
+		return ret;
+	fs->gdt[g].shared_blocks--;
+	return gdt_sync(fs, g);
+}
+
+/* Make room for groups groups in the bitmap cache, which keeps the block
+ * bitmaps, the inode bitmaps and the reference count tables each in one
+ * run of a block per group */
+static int grow_maps(struct sfs_fs *fs, uint64_t groups)
+{
+	uint64_t old = fs->sb.groups_count, size = old * fs->bs;
+	uint8_t *maps, *loaded;
+
+	maps = calloc(3 * groups, fs->bs);
+	loaded = calloc(groups, 1);
+	if (!maps || !loaded) {
+		free(maps);
+		free(loaded);
+		return -ENOMEM;
+	}
+	memcpy(maps, fs->bmap, size);
+	memcpy(maps + groups * fs->bs, fs->imap, size);
+	memcpy(maps + 2 * groups * fs->bs, fs->refs, size);
+	memcpy(loaded, fs->loaded, old);
+
+	free(fs->bmap);
+	free(fs->loaded);
+	fs->bmap = maps;
+	fs->imap = maps + groups * fs->bs;
+	fs->refs = (struct simplefs_refcount *)(maps + 2 * groups * fs->bs);
+	fs->loaded = loaded;
+	return 0;
+}
+
+/* Write the metadata of group, which is new in geo, as mkfs would */
+static int grow_group(struct sfs_fs *fs, const struct simplefs_super_block *geo,
+		      uint64_t group, const void *zeroes)
+{
+	struct simplefs_group_desc *desc = &fs->gdt[group];
+	uint64_t start = group * geo->blocks_per_group;
+	uint64_t len = simplefs_group_blocks(geo, group);
+	uint64_t used = simplefs_group_data(geo, group) - start;
+	uint8_t *imap = fs->imap + group * fs->bs;
+	uint64_t bit;
+	int ret;
+
+	ret = sfs_write_blocks(fs, simplefs_group_itable(geo, group),
+			       geo->itable_blocks, zeroes);
+	if (ret)
+		return ret;
+
+	for (bit = 0; bit < used; bit++)
+		set_bit_le(fs->bmap, start + bit);
+	for (bit = len; bit < geo->blocks_per_group; bit++)
+		set_bit_le(fs->bmap, start + bit);
+	for (bit = geo->inodes_per_group; bit < geo->blocks_per_group; bit++)
+		set_bit_le(imap, bit);
+	fs->loaded[group] = 1;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->free_blocks = len - used;
+	desc->free_inodes = geo->inodes_per_group;
+	desc->imap_checksum = sfs_block_csum(imap, fs->bs);
+	ret = sfs_write_blocks(fs, simplefs_group_imap(geo, group), 1, imap);
+	if (!ret)
+		ret = refs_sync(fs, start);
+	if (!ret)
+		ret = bmap_sync(fs, start);
+	if (!ret)
+		ret = gdt_sync(fs, group);
+	return ret;
+}
+
+int sfs_grow(struct sfs_fs *fs, uint64_t *count)
+{
+	struct simplefs_super_block geo = fs->sb;
+	uint64_t last = fs->sb.groups_count - 1, g, old, new, bit;
+	uint64_t free_blocks = 0;
+	void *zeroes = NULL;
+	int ret;
+
+	if (fs->read_only)
+		return -EROFS;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (*count < fs->sb.blocks_count) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (simplefs_grow_layout(&geo, *count)) {
+		ret = -EFBIG;
+		goto out;
+	}
+	/* Too little to hold another group */
+	ret = 0;
+	if (geo.blocks_count <= fs->sb.blocks_count)
+		goto done;
+
+	/* The bitmap of the last group changes below */
+	ret = load_group(fs, last);
+	if (!ret)
+		ret = grow_maps(fs, geo.groups_count);
+	if (ret)
+		goto out;
+	zeroes = calloc(geo.itable_blocks, fs->bs);
+	if (!zeroes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* As in the module: the new groups first, then the end of the old
+	 * last one, and the super block only once they are all written */
+	for (g = fs->sb.groups_count; g < geo.groups_count; g++) {
+		ret = grow_group(fs, &geo, g, zeroes);
+		if (ret)
+			goto out;
+		free_blocks += fs->gdt[g].free_blocks;
+	}
+
+	old = simplefs_group_blocks(&fs->sb, last);
+	new = simplefs_group_blocks(&geo, last);
+	if (new > old) {
+		for (bit = old; bit < new; bit++)
+			clear_bit_le(fs->bmap, last * geo.blocks_per_group + bit);
+		ret = bmap_sync(fs, last * geo.blocks_per_group);
+		if (ret)
+			goto out;
+		fs->gdt[last].free_blocks += new - old;
+		free_blocks += new - old;
+		ret = gdt_sync(fs, last);
+		if (ret)
+			goto out;
+	}
+
+	fs->sb.blocks_count = geo.blocks_count;
+	fs->sb.groups_count = geo.groups_count;
+	fs->sb.inodes_max = geo.inodes_max;
+	fs->sb.free_blocks += free_blocks;
+	ret = write_super(fs);
+done:
+	*count = fs->sb.blocks_count;
+out:
+	pthread_rwlock_unlock(&fs->lock);
+	free(zeroes);
+	return ret;
+}
+
+/* A directory's block gets the checksum of an empty one */
+static int zero_block(struct sfs_fs *fs, uint64_t block, int dir)
+{
+	void *buf = calloc(1, fs->bs);
+	int ret;
+
+	if (!buf)
+		return -ENOMEM;
+	if (dir)
+		sfs_dir_set_csum(buf, fs->bs);
+	ret = sfs_write_blocks(fs, block, 1, buf);
+	free(buf);
+	return ret;
+}
+
+static uint64_t itable_offset(struct sfs_fs *fs, uint64_t inode_no)
+{
+	unsigned int slot;
+	uint64_t block = simplefs_itable_locate(&fs->sb, inode_no, &slot);
+
+	return block * fs->bs + slot * sizeof(struct simplefs_inode);
+}
+
+int sfs_read_inode(struct sfs_fs *fs, uint64_t inode_no,
+		   struct simplefs_inode *inode)
+{
+	int ret;
+
+	if (inode_no < SIMPLEFS_START_INO || inode_no > fs->sb.inodes_max)
+		return -EINVAL;
+
+	ret = fs->bdev->read(fs->bdev, inode, sizeof(*inode),
+			     itable_offset(fs, inode_no));
+	if (ret)
+		return ret;
+	if (inode->inode_no != inode_no ||
+	    inode->checksum != sfs_inode_csum(inode))
+		return -EIO;
+	return 0;
+}
+
+/* An inode is written with its checksum, a free slot (inode_no 0) as all
+ * zeroes */
+static int write_slot(struct sfs_fs *fs, uint64_t inode_no,
+		      const struct simplefs_inode *inode)
+{
+	struct simplefs_inode copy = *inode;
+
+	if (fs->read_only)
+		return -EROFS;
+	if (copy.inode_no)
+		copy.checksum = sfs_inode_csum(&copy);
+	return fs->bdev->write(fs->bdev, &copy, sizeof(copy),
+			       itable_offset(fs, inode_no));
+}
+
+int sfs_write_inode(struct sfs_fs *fs, const struct simplefs_inode *inode)
+{
+	if (inode->inode_no < SIMPLEFS_START_INO ||
+	    inode->inode_no > fs->sb.inodes_max)
+		return -EINVAL;
+	return write_slot(fs, inode->inode_no, inode);
+}
+
+/* Write back the inode bitmap block that holds the bit of inode_no, see
+ * bmap_sync */
+static int imap_sync(struct sfs_fs *fs, uint64_t inode_no)
+{
+	unsigned int bit;
+	uint64_t nr = simplefs_imap_locate(&fs->sb, inode_no, &bit);
+	uint64_t g = simplefs_ino_group(&fs->sb, inode_no);
+
+	fs->gdt[g].imap_checksum = sfs_block_csum(fs->imap + g * fs->bs, fs->bs);
+	return sfs_write_blocks(fs, nr, 1, fs->imap + g * fs->bs);
+}
+
+/* The bit of inode_no in fs->imap, which holds one block per group */
+static uint64_t imap_bit(struct sfs_fs *fs, uint64_t inode_no)
+{
+	return simplefs_ino_group(&fs->sb, inode_no) * fs->bs * 8 +
+	       simplefs_ino_index(&fs->sb, inode_no);
+}
+
+/* The first free inode in [first, end) of group, counted from the group's
+ * first inode, a byte of the bitmap at a time. end if there is none. */
+static uint64_t imap_find(struct sfs_fs *fs, uint64_t group, uint64_t first,
+			  uint64_t end)
+{
+	const uint8_t *map = fs->imap + group * fs->bs;
+	uint64_t i;
+
+	for (i = first; i < end; i++) {
+		if (!(i % 8) && map[i / 8] == 0xff) {
+			i += 7;
+			continue;
+		}
+		if (!test_bit_le(map, i))
+			return i;
+	}
+	return end;
+}
+
+/* Spread directories out: the group with the fewest directories among
+ * those with at least the average number of free inodes and blocks,
+ * searching from the one after the parent's so that ties spread too */
+static uint64_t find_group_dir(struct sfs_fs *fs, uint64_t parent)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	uint64_t avefreei = (sb->inodes_max - sb->inodes_count) / sb->groups_count;
+	uint64_t avefreeb = sb->free_blocks / sb->groups_count;
+	uint64_t best = parent, best_dirs = UINT64_MAX, i, g;
+	struct simplefs_group_desc *desc;
+
+	for (i = 1; i <= sb->groups_count; i++) {
+		g = (parent + i) % sb->groups_count;
+		desc = &fs->gdt[g];
+		if (!desc->free_inodes || desc->free_inodes < avefreei ||
+		    desc->free_blocks < avefreeb)
+			continue;
+		if (desc->dirs < best_dirs) {
+			best = g;
+			best_dirs = desc->dirs;
+		}
+	}
+	return best;
+}
+
+/* Files go into the group, and if there is room the inode table block,
+ * of their parent, so that listing a directory reads few table blocks.
+ * Directories are spread over the groups. Within a group the lowest free
+ * inode is taken, searched for from the group's hint. */
+int sfs_alloc_inode(struct sfs_fs *fs, uint64_t dir, mode_t mode,
+		    struct simplefs_inode *inode)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	uint64_t ipb = SIMPLEFS_INODES_PER_BLOCK(fs->bs);
+	uint64_t ipg = sb->inodes_per_group;
+	uint64_t parent, start, i, g = 0, idx = ipg, first, hint, ino;
+	struct simplefs_group_desc *desc = NULL;
+	int ret;
+
+	if (fs->read_only)
+		return -EROFS;
+	if (sb->inodes_count >= sb->inodes_max)
+		return -ENOSPC;
+
+	if (dir < SIMPLEFS_START_INO || dir > sb->inodes_max)
+		dir = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	parent = simplefs_ino_group(sb, dir);
+	start = S_ISDIR(mode) ? find_group_dir(fs, parent) : parent;
+
+	for (i = 0; i < sb->groups_count; i++) {
+		g = (start + i) % sb->groups_count;
+		desc = &fs->gdt[g];
+		if (!desc->free_inodes)
+			continue;
+		ret = load_group(fs, g);
+		if (ret)
+			return ret;
+		hint = desc->inode_hint < ipg ? desc->inode_hint : 0;
+
+		if (!S_ISDIR(mode) && g == parent) {
+			first = simplefs_ino_index(sb, dir) / ipb * ipb;
+			idx = imap_find(fs, g, first, first + ipb);
+			if (idx < first + ipb) {
+				if (idx == hint)
+					desc->inode_hint = idx + 1;
+				break;
+			}
+		}
+
+		idx = imap_find(fs, g, hint, ipg);
+		/* The hint was stale */
+		if (idx == ipg)
+			idx = imap_find(fs, g, 0, hint);
+		if (idx < ipg) {
+			desc->inode_hint = idx + 1;
+			break;
+		}
+	}
+	if (i == sb->groups_count)
+		return -ENOSPC;
+	ino = g * ipg + idx + 1;
+
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = mode;
+	inode->nlink = S_ISDIR(mode) ? 2 : 1;
+	inode->inode_no = ino;
+	ret = sfs_write_inode(fs, inode);
+	if (ret)
+		return ret;
+
+	set_bit_le(fs->imap, imap_bit(fs, ino));
+	ret = imap_sync(fs, ino);
+	if (ret) {
+		clear_bit_le(fs->imap, imap_bit(fs, ino));
+		return ret;
+	}
+	desc->free_inodes--;
+	if (S_ISDIR(mode))
+		desc->dirs++;
+	ret = gdt_sync(fs, g);
+	if (ret)
+		return ret;
+	sb->inodes_count++;
+	return write_super(fs);
+}
+
+/* Release the inode's slot in the inode table and its references to its
+ * data and xattr blocks */
+int sfs_free_inode(struct sfs_fs *fs, struct simplefs_inode *inode)
+{
+	struct simplefs_group_desc *desc;
+	struct simplefs_inode empty = { 0 };
+	uint64_t ino = inode->inode_no;
+	int ret;
+
+	/* Drop the slot first, a crash in between leaks the block instead of
+	 * leaving an inode that points at a free one */
+	ret = load_group(fs, simplefs_ino_group(&fs->sb, ino));
+	if (!ret)
+		ret = write_slot(fs, ino, &empty);
+	if (ret)
+		return ret;
+	clear_bit_le(fs->imap, imap_bit(fs, ino));
+	ret = imap_sync(fs, ino);
+	if (ret)
+		return ret;
+	desc = &fs->gdt[simplefs_ino_group(&fs->sb, ino)];
+	desc->free_inodes++;
+	if (S_ISDIR(inode->mode))
+		desc->dirs--;
+	if (simplefs_ino_index(&fs->sb, ino) < desc->inode_hint)
+		desc->inode_hint = simplefs_ino_index(&fs->sb, ino);
+	ret = gdt_sync(fs, simplefs_ino_group(&fs->sb, ino));
+	if (ret)
+		return ret;
+	fs->sb.inodes_count--;
+
+	if (inode->data_block_number) {
+		ret = block_release(fs, inode->data_block_number);
+		if (ret)
+			return ret;
+	}
+	if (inode->xattr_block) {
+		ret = block_release(fs, inode->xattr_block);
+		if (ret)
+			return ret;
+	}
+	return write_super(fs);
+}
+
+/* A directory's inode and its block of records */
+struct dir {
+	struct simplefs_inode inode;
+	struct simplefs_dir_record *records;
+	uint64_t nr_records;
+};
+
+static int dir_load(struct sfs_fs *fs, uint64_t dir_no, struct dir *dir)
+{
+	int ret;
+
+	dir->records = NULL;
+	ret = sfs_read_inode(fs, dir_no, &dir->inode);
+	if (ret)
+		return ret;
+	if (!S_ISDIR(dir->inode.mode))
+		return -ENOTDIR;
+
+	dir->nr_records = SIMPLEFS_DIR_RECORDS_PER_BLOCK(fs->bs);
+	dir->records = malloc(fs->bs);
+	if (!dir->records)
+		return -ENOMEM;
+	ret = sfs_read_blocks(fs, dir->inode.data_block_number, 1, dir->records);
+	if (!ret && !sfs_dir_csum_ok(dir->records, fs->bs))
+		ret = -EIO;
+	if (ret) {
+		free(dir->records);
+		dir->records = NULL;
+	}
+	return ret;
+}
+
+static void dir_release(struct dir *dir)
+{
+	free(dir->records);
+}
+
+static int check_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!len)
+		return -EINVAL;
+	if (len >= SIMPLEFS_FILENAME_MAXLEN)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+static struct simplefs_dir_record *dir_find(struct dir *dir, const char *name)
+{
+	uint64_t i;
+
+	for (i = 0; i < dir->nr_records; i++)
+		if (dir->records[i].inode_no &&
+		    !strcmp(dir->records[i].filename, name))
+			return &dir->records[i];
+	return NULL;
+}
+
+static struct simplefs_dir_record *dir_free_slot(struct dir *dir)
+{
+	uint64_t i;
+
+	for (i = 0; i < dir->nr_records; i++)
+		if (!dir->records[i].inode_no)
+			return &dir->records[i];
+	return NULL;
+}
+
+/* Write the records back after changing one, like simplefs_dir_record_write.
+ * The block goes out whole, for its checksum at the end. */
+static int dir_write(struct sfs_fs *fs, struct dir *dir)
+{
+	sfs_dir_set_csum(dir->records, fs->bs);
+	return sfs_write_blocks(fs, dir->inode.data_block_number, 1,
+				dir->records);
+}
+
+static int dir_add(struct sfs_fs *fs, struct dir *dir, const char *name,
+		   uint64_t inode_no, int is_dir)
+{
+	struct simplefs_dir_record *record = dir_free_slot(dir);
+	int ret;
+
+	if (!record)
+		return -ENOSPC;
+
+	memset(record, 0, sizeof(*record));
+	strcpy(record->filename, name);
+	record->inode_no = inode_no;
+	ret = dir_write(fs, dir);
+	if (ret) {
+		memset(record, 0, sizeof(*record));
+		return ret;
+	}
+
+	dir->inode.dir_children_count++;
+	if (is_dir)
+		dir->inode.nlink++;
+	return sfs_write_inode(fs, &dir->inode);
+}
+
+static int dir_remove(struct sfs_fs *fs, struct dir *dir,
+		      struct simplefs_dir_record *record, int is_dir)
+{
+	int ret;
+
+	memset(record, 0, sizeof(*record));
+	ret = dir_write(fs, dir);
+	if (ret)
+		return ret;
+
+	dir->inode.dir_children_count--;
+	if (is_dir)
+		dir->inode.nlink--;
+	return sfs_write_inode(fs, &dir->inode);
+}
+
+/* Drop one link to an inode, freeing it with the last one */
+static int drop_link(struct sfs_fs *fs, struct simplefs_inode *inode)
+{
+	if (S_ISDIR(inode->mode) || inode->nlink <= 1)
+		return sfs_free_inode(fs, inode);
+	inode->nlink--;
+	return sfs_write_inode(fs, inode);
+}
+
+int sfs_lookup(struct sfs_fs *fs, uint64_t dir_no, const char *name,
+	       uint64_t *inode_no)
+{
+	struct simplefs_dir_record *record;
+	struct dir dir;
+	int ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = dir_load(fs, dir_no, &dir);
+	if (!ret) {
+		record = dir_find(&dir, name);
+		if (record)
+			*inode_no = record->inode_no;
+		else
+			ret = -ENOENT;
+	}
+	dir_release(&dir);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_readdir(struct sfs_fs *fs, uint64_t dir_no, uint64_t pos,
+		sfs_filldir_t filldir, void *arg)
+{
+	struct dir dir;
+	int ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = dir_load(fs, dir_no, &dir);
+	for (; !ret && pos < dir.nr_records; pos++)
+		if (dir.records[pos].inode_no)
+			ret = filldir(arg, dir.records[pos].filename,
+				      dir.records[pos].inode_no, pos);
+	dir_release(&dir);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_getattr(struct sfs_fs *fs, uint64_t inode_no,
+		struct simplefs_inode *inode)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, inode);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_bmap(struct sfs_fs *fs, uint64_t inode_no, uint64_t *block)
+{
+	struct simplefs_inode inode;
+	int ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (!ret)
+		*block = inode.data_block_number;
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* Same ordering as simplefs_create_fs_object: the inode, then its block in
+ * the same group, then the record in the parent */
+int sfs_create(struct sfs_fs *fs, uint64_t dir_no, const char *name,
+	       mode_t mode, struct simplefs_inode *inode)
+{
+	struct dir dir;
+	uint64_t block;
+	int ret;
+
+	if (!S_ISDIR(mode) && !S_ISREG(mode))
+		return -EINVAL;
+	ret = check_name(name);
+	if (ret)
+		return ret;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = dir_load(fs, dir_no, &dir);
+	if (ret)
+		goto out;
+	if (dir_find(&dir, name)) {
+		ret = -EEXIST;
+		goto out;
+	}
+	/* Bail out before allocating anything if the parent is full */
+	if (!dir_free_slot(&dir)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = sfs_alloc_inode(fs, dir_no, mode, inode);
+	if (ret)
+		goto out;
+
+	ret = sfs_alloc_block(fs, inode->inode_no, &block);
+	if (!ret) {
+		ret = zero_block(fs, block, S_ISDIR(mode));
+		if (ret)
+			sfs_free_block(fs, block);
+	}
+	if (ret) {
+		sfs_free_inode(fs, inode);
+		goto out;
+	}
+	inode->data_block_number = block;
+	ret = sfs_write_inode(fs, inode);
+	if (!ret)
+		ret = dir_add(fs, &dir, name, inode->inode_no, S_ISDIR(mode));
+	if (ret)
+		sfs_free_inode(fs, inode);
+out:
+	dir_release(&dir);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int remove_entry(struct sfs_fs *fs, uint64_t dir_no, const char *name,
+			int want_dir)
+{
+	struct simplefs_dir_record *record;
+	struct simplefs_inode inode;
+	struct dir dir;
+	int ret;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = dir_load(fs, dir_no, &dir);
+	if (ret)
+		goto out;
+	record = dir_find(&dir, name);
+	if (!record) {
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = sfs_read_inode(fs, record->inode_no, &inode);
+	if (ret)
+		goto out;
+
+	if (want_dir && !S_ISDIR(inode.mode))
+		ret = -ENOTDIR;
+	else if (!want_dir && S_ISDIR(inode.mode))
+		ret = -EISDIR;
+	else if (want_dir && inode.dir_children_count)
+		ret = -ENOTEMPTY;
+	if (ret)
+		goto out;
+
+	ret = dir_remove(fs, &dir, record, want_dir);
+	if (!ret)
+		ret = drop_link(fs, &inode);
+out:
+	dir_release(&dir);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_unlink(struct sfs_fs *fs, uint64_t dir_no, const char *name)
+{
+	return remove_entry(fs, dir_no, name, 0);
+}
+
+int sfs_rmdir(struct sfs_fs *fs, uint64_t dir_no, const char *name)
+{
+	return remove_entry(fs, dir_no, name, 1);
+}
+
+int sfs_link(struct sfs_fs *fs, uint64_t inode_no, uint64_t dir_no,
+	     const char *name)
+{
+	struct simplefs_inode inode;
+	struct dir dir;
+	int ret;
+
+	ret = check_name(name);
+	if (ret)
+		return ret;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = dir_load(fs, dir_no, &dir);
+	if (ret)
+		goto out;
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+
+	if (S_ISDIR(inode.mode))
+		ret = -EPERM;
+	else if (inode.nlink >= SIMPLEFS_LINK_MAX)
+		ret = -EMLINK;
+	else if (dir_find(&dir, name))
+		ret = -EEXIST;
+	if (ret)
+		goto out;
+
+	ret = dir_add(fs, &dir, name, inode_no, 0);
+	if (ret)
+		goto out;
+	inode.nlink++;
+	ret = sfs_write_inode(fs, &inode);
+out:
+	dir_release(&dir);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* Like simplefs_rename. Moving a directory below itself is not caught
+ * here; the VFS checks for that before either the kernel module or a
+ * FUSE daemon gets the request. */
+int sfs_rename(struct sfs_fs *fs, uint64_t old_dir_no, const char *old_name,
+	       uint64_t new_dir_no, const char *new_name, unsigned int flags)
+{
+	struct simplefs_dir_record *old_rec, *new_rec;
+	struct simplefs_inode inode, target;
+	struct dir old_dir, new_buf, *new_dir = &old_dir;
+	int is_dir, ret;
+
+	if (flags & ~SFS_RENAME_NOREPLACE)
+		return -EINVAL;
+	ret = check_name(new_name);
+	if (ret)
+		return ret;
+
+	new_buf.records = NULL;
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = dir_load(fs, old_dir_no, &old_dir);
+	if (ret)
+		goto out;
+	if (new_dir_no != old_dir_no) {
+		new_dir = &new_buf;
+		ret = dir_load(fs, new_dir_no, new_dir);
+		if (ret)
+			goto out;
+	}
+
+	old_rec = dir_find(&old_dir, old_name);
+	if (!old_rec) {
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = sfs_read_inode(fs, old_rec->inode_no, &inode);
+	if (ret)
+		goto out;
+	is_dir = S_ISDIR(inode.mode);
+
+	new_rec = dir_find(new_dir, new_name);
+	if (new_rec == old_rec)
+		goto out;
+	if (new_rec) {
+		if (flags & SFS_RENAME_NOREPLACE) {
+			ret = -EEXIST;
+			goto out;
+		}
+		/* Two links to the same file: nothing to do */
+		if (new_rec->inode_no == inode.inode_no)
+			goto out;
+		ret = sfs_read_inode(fs, new_rec->inode_no, &target);
+		if (ret)
+			goto out;
+		if (is_dir && !S_ISDIR(target.mode))
+			ret = -ENOTDIR;
+		else if (!is_dir && S_ISDIR(target.mode))
+			ret = -EISDIR;
+		else if (S_ISDIR(target.mode) && target.dir_children_count)
+			ret = -ENOTEMPTY;
+		if (ret)
+			goto out;
+
+		/* A directory can only replace a directory: new_dir keeps
+		 * its count, old_dir loses one */
+		new_rec->inode_no = inode.inode_no;
+		ret = dir_write(fs, new_dir);
+		if (!ret)
+			ret = dir_remove(fs, &old_dir, old_rec, is_dir);
+		if (!ret)
+			ret = drop_link(fs, &target);
+	} else if (new_dir == &old_dir) {
+		memset(old_rec->filename, 0, sizeof(old_rec->filename));
+		strcpy(old_rec->filename, new_name);
+		ret = dir_write(fs, &old_dir);
+	} else {
+		/* Write the new record before dropping the old one, so that a
+		 * crash in between leaves an extra link rather than none */
+		ret = dir_add(fs, new_dir, new_name, inode.inode_no, is_dir);
+		if (!ret)
+			ret = dir_remove(fs, &old_dir, old_rec, is_dir);
+	}
+out:
+	dir_release(&old_dir);
+	dir_release(&new_buf);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* Give a file that has no data block (it was truncated to zero) a fresh,
+ * zeroed one */
+static int inode_alloc_block(struct sfs_fs *fs, struct simplefs_inode *inode)
+{
+	uint64_t block;
+	int ret;
+
+	ret = sfs_alloc_block(fs, inode->inode_no, &block);
+	if (ret)
+		return ret;
+	ret = zero_block(fs, block, 0);
+	if (ret) {
+		sfs_free_block(fs, block);
+		return ret;
+	}
+	inode->data_block_number = block;
+	return sfs_write_inode(fs, inode);
+}
+
+/* Copy on write: before a file changes a block it shares with a clone,
+ * move it to a copy of its own */
+static int inode_unshare(struct sfs_fs *fs, struct simplefs_inode *inode)
+{
+	uint64_t old = inode->data_block_number, block;
+	uint32_t count;
+	char *buf;
+	int ret;
+
+	if (!old)
+		return 0;
+	ret = sfs_block_refs(fs, old, &count);
+	if (ret || count < 2)
+		return ret;
+
+	buf = malloc(fs->bs);
+	if (!buf)
+		return -ENOMEM;
+	ret = sfs_alloc_block(fs, inode->inode_no, &block);
+	if (ret)
+		goto out;
+	ret = sfs_read_blocks(fs, old, 1, buf);
+	if (!ret)
+		ret = sfs_write_blocks(fs, block, 1, buf);
+	if (!ret) {
+		inode->data_block_number = block;
+		ret = sfs_write_inode(fs, inode);
+	}
+	if (ret) {
+		inode->data_block_number = old;
+		sfs_free_block(fs, block);
+		goto out;
+	}
+	ret = block_release(fs, old);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Write zeroes over [from, to) of a file's block, copying it first if it
+ * is shared */
+static int zero_range(struct sfs_fs *fs, struct simplefs_inode *inode,
+		      uint64_t from, uint64_t to)
+{
+	uint64_t block;
+	char *buf;
+	int ret;
+
+	if (fs->read_only)
+		return -EROFS;
+	if (from >= to)
+		return 0;
+	ret = inode_unshare(fs, inode);
+	if (ret)
+		return ret;
+	block = inode->data_block_number;
+
+	buf = calloc(1, to - from);
+	if (!buf)
+		return -ENOMEM;
+	ret = fs->bdev->write(fs->bdev, buf, to - from, block * fs->bs + from);
+	free(buf);
+	return ret;
+}
+
+/* LZ4 block format, which is what the module gets from lib/lz4: sequences
+ * of a token (literal count << 4 | match length - 4, 15 meaning more bytes
+ * follow), the literals, and a 2 byte offset back to the match. The last
+ * sequence has only literals, and covers at least the last 5 bytes. */
+#define LZ4_MIN_MATCH	4
+#define LZ4_LAST_LITERALS 5
+/* No match may start in the last 12 bytes */
+#define LZ4_MFLIMIT	12
+#define LZ4_MAX_OFFSET	65535
+#define LZ4_HASH_BITS	12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* litlen literals, then mlen bytes copied from off back, or nothing for
+ * the last sequence (mlen 0). NULL if it does not fit before oend. */
+static uint8_t *lz4_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t litlen, size_t off, size_t mlen)
+{
+	uint8_t *token = op++;
+	size_t n;
+
+	if (1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1 >
+	    (size_t)(oend - token))
+		return NULL;
+
+	*token = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15) {
+		for (n = litlen - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (!mlen)
+		return op;
+
+	*op++ = off;
+	*op++ = off >> 8;
+	mlen -= LZ4_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15) {
+		for (n = mlen - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+	return op;
+}
+
+/* Greedy, with one candidate per hash of 4 bytes. Returns the compressed
+ * size, 0 if it is larger than max. */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+			   size_t max)
+{
+	uint32_t table[1 << LZ4_HASH_BITS] = { 0 };
+	const uint8_t *ip = src, *anchor = src, *ref, *end = src + len;
+	uint8_t *op = dst, *oend = dst + max;
+	size_t mlen;
+	uint32_t h;
+
+	while (len > LZ4_MFLIMIT && ip <= end - LZ4_MFLIMIT) {
+		h = (read32(ip) * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+		    read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = LZ4_MIN_MATCH;
+		     ip + mlen < end - LZ4_LAST_LITERALS && ref[mlen] == ip[mlen];
+		     mlen++)
+			;
+		op = lz4_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+		if (!op)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz4_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op ? (size_t)(op - dst) : 0;
+}
+
+size_t sfs_lz4_compress(const void *src, size_t len, void *dst, size_t max)
+{
+	return lz4_compress(src, len, dst, max);
+}
+
+/* A length continued in the bytes after the token */
+static int lz4_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	if (*n != 15)
+		return 0;
+	do {
+		if (*ip >= iend)
+			return -EIO;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* 0 if src decompresses to exactly len bytes */
+static int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst,
+			  size_t len)
+{
+	const uint8_t *ip = src, *iend = src + src_len;
+	uint8_t *op = dst, *oend = dst + len;
+	size_t n, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+		n = token >> 4;
+		if (lz4_length(&ip, iend, &n) ||
+		    n > (size_t)(iend - ip) || n > (size_t)(oend - op))
+			return -EIO;
+		memcpy(op, ip, n);
+		ip += n;
+		op += n;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EIO;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		n = token & 15;
+		if (lz4_length(&ip, iend, &n) || !off ||
+		    off > (size_t)(op - dst) ||
+		    n + LZ4_MIN_MATCH > (size_t)(oend - op))
+			return -EIO;
+		/* The match may overlap what it produces */
+		for (n += LZ4_MIN_MATCH; n; n--, op++)
+			*op = op[-off];
+	}
+
+	return op == oend ? 0 : -EIO;
+}
+
+static uint64_t max_file_size(struct sfs_fs *fs)
+{
+	return SIMPLEFS_MAX_COMPRESSED_BLOCKS * fs->bs;
+}
+
+/* As simplefs_may_compress: a file may be larger than a block, and so
+ * compressed, if it already is or fs->compress is set and the file does
+ * not opt out */
+static int may_compress(struct sfs_fs *fs, const struct simplefs_inode *inode)
+{
+	if (inode->flags & SIMPLEFS_INODE_LZ4)
+		return 1;
+	return fs->compress && !(inode->flags & SIMPLEFS_INODE_NOCOMPRESS);
+}
+
+/* All of a file into buf, which has room for max_file_size bytes */
+static int file_load(struct sfs_fs *fs, const struct simplefs_inode *inode,
+		     uint8_t *buf)
+{
+	int lz4 = inode->flags & SIMPLEFS_INODE_LZ4;
+	uint8_t *block;
+	int ret;
+
+	if (inode->file_size > (lz4 ? max_file_size(fs) : fs->bs) ||
+	    inode->compressed_size > fs->bs ||
+	    inode->data_offset + (lz4 ? inode->compressed_size
+				      : inode->file_size) > fs->bs)
+		return -EIO;
+	if (!inode->data_block_number) {
+		memset(buf, 0, inode->file_size);
+		return 0;
+	}
+	if (!lz4)
+		return fs->bdev->read(fs->bdev, buf, inode->file_size,
+				      inode->data_block_number * fs->bs +
+				      inode->data_offset);
+
+	block = malloc(fs->bs);
+	if (!block)
+		return -ENOMEM;
+	ret = sfs_read_blocks(fs, inode->data_block_number, 1, block);
+	if (!ret)
+		ret = lz4_decompress(block + inode->data_offset,
+				     inode->compressed_size, buf,
+				     inode->file_size);
+	free(block);
+	return ret;
+}
+
+/* Like simplefs_file_rewrite: make the file its first size bytes after
+ * copying len bytes of buf (if any) to off, compressed if that is more
+ * than a block, in a new block that replaces the old one */
+static int file_rewrite(struct sfs_fs *fs, struct simplefs_inode *inode,
+			const void *buf, uint64_t off, size_t len, uint64_t size)
+{
+	struct simplefs_inode saved = *inode;
+	uint8_t *data, *packed;
+	size_t packed_len = size;
+	uint64_t block;
+	int ret;
+
+	if (fs->read_only)
+		return -EROFS;
+	if (size > max_file_size(fs) ||
+	    (size > fs->bs && !may_compress(fs, inode)))
+		return -ENOSPC;
+
+	data = calloc(2, max_file_size(fs));
+	if (!data)
+		return -ENOMEM;
+	packed = data + max_file_size(fs);
+	ret = file_load(fs, inode, data);
+	if (ret)
+		goto out;
+	if (buf)
+		memcpy(data + off, buf, len);
+
+	if (size > fs->bs) {
+		packed_len = lz4_compress(data, size, packed, fs->bs);
+		if (!packed_len) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		inode->flags |= SIMPLEFS_INODE_LZ4;
+		inode->compressed_size = packed_len;
+	} else {
+		memcpy(packed, data, size);
+		inode->flags &= ~SIMPLEFS_INODE_LZ4;
+		inode->compressed_size = 0;
+	}
+	memset(packed + packed_len, 0, fs->bs - packed_len);
+
+	ret = sfs_alloc_block(fs, inode->inode_no, &block);
+	if (ret)
+		goto restore;
+	ret = sfs_write_blocks(fs, block, 1, packed);
+	if (!ret) {
+		inode->data_block_number = block;
+		inode->file_size = size;
+		ret = sfs_write_inode(fs, inode);
+	}
+	if (ret) {
+		sfs_free_block(fs, block);
+		goto restore;
+	}
+	if (saved.data_block_number)
+		ret = block_release(fs, saved.data_block_number);
+	goto out;
+restore:
+	*inode = saved;
+out:
+	free(data);
+	return ret;
+}
+
+/* A file without a block is a hole, growing it does not allocate one */
+int sfs_truncate(struct sfs_fs *fs, uint64_t inode_no, uint64_t size)
+{
+	struct simplefs_inode inode;
+	uint64_t block, from, to;
+	int ret;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+	if (S_ISDIR(inode.mode)) {
+		ret = -EISDIR;
+		goto out;
+	}
+	if (size > max_file_size(fs) ||
+	    (size > fs->bs && !may_compress(fs, &inode))) {
+		ret = -EFBIG;
+		goto out;
+	}
+
+	block = inode.data_block_number;
+	if (!size) {
+		/* Drop the reference before freeing, a crash in between
+		 * leaks the block instead of sharing it */
+		inode.data_block_number = 0;
+		inode.file_size = 0;
+		inode.flags &= ~SIMPLEFS_INODE_LZ4;
+		inode.compressed_size = 0;
+		ret = sfs_write_inode(fs, &inode);
+		if (!ret && block)
+			ret = block_release(fs, block);
+		goto out;
+	}
+
+	if (size > fs->bs || (inode.flags & SIMPLEFS_INODE_LZ4)) {
+		ret = file_rewrite(fs, &inode, NULL, 0, 0, size);
+		goto out;
+	}
+
+	if (block) {
+		/* Zero the bytes between the old and the new end */
+		from = size < inode.file_size ? size : inode.file_size;
+		to = size < inode.file_size ? inode.file_size : size;
+		ret = zero_range(fs, &inode, from, to);
+		if (ret)
+			goto out;
+	}
+
+	inode.file_size = size;
+	ret = sfs_write_inode(fs, &inode);
+out:
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* Like simplefs_fallocate: preallocating gives a file its one block, a
+ * hole over all of its data frees it again */
+int sfs_fallocate(struct sfs_fs *fs, uint64_t inode_no, int mode,
+		  uint64_t off, uint64_t len)
+{
+	struct simplefs_inode inode;
+	uint64_t block, end;
+	int ret;
+
+	if (mode & ~(SFS_FALLOC_KEEP_SIZE | SFS_FALLOC_PUNCH_HOLE |
+		     SFS_FALLOC_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	/* As fallocate(2) demands */
+	if ((mode & SFS_FALLOC_PUNCH_HOLE) &&
+	    mode != (SFS_FALLOC_PUNCH_HOLE | SFS_FALLOC_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (!len)
+		return -EINVAL;
+	if (fs->read_only)
+		return -EROFS;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+	if (S_ISDIR(inode.mode)) {
+		ret = -EISDIR;
+		goto out;
+	}
+	if (inode.flags & SIMPLEFS_INODE_LZ4) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	block = inode.data_block_number;
+
+	if (mode & SFS_FALLOC_PUNCH_HOLE) {
+		if (!block || off >= inode.file_size)
+			goto out;
+		end = len < inode.file_size - off ? off + len : inode.file_size;
+		if (off || end < inode.file_size) {
+			ret = zero_range(fs, &inode, off, end);
+			goto out;
+		}
+		/* Drop the reference before freeing, as truncate does */
+		inode.data_block_number = 0;
+		ret = sfs_write_inode(fs, &inode);
+		if (!ret)
+			ret = block_release(fs, block);
+		goto out;
+	}
+
+	/* A file cannot grow beyond one block */
+	if (off > fs->bs || len > fs->bs - off) {
+		ret = -EFBIG;
+		goto out;
+	}
+
+	/* A new block is zeroed already */
+	if (!block)
+		ret = inode_alloc_block(fs, &inode);
+	else if (mode & SFS_FALLOC_ZERO_RANGE)
+		ret = zero_range(fs, &inode, off, off + len);
+	if (ret || (mode & SFS_FALLOC_KEEP_SIZE) || off + len <= inode.file_size)
+		goto out;
+
+	inode.file_size = off + len;
+	ret = sfs_write_inode(fs, &inode);
+out:
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_seek(struct sfs_fs *fs, uint64_t inode_no, uint64_t off, int whence,
+	     uint64_t *pos)
+{
+	struct simplefs_inode inode;
+	int ret;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	pthread_rwlock_unlock(&fs->lock);
+	if (ret)
+		return ret;
+
+	if (off >= inode.file_size ||
+	    (!inode.data_block_number && whence == SEEK_DATA))
+		return -ENXIO;
+	/* Data runs up to the hole at the end of the file */
+	*pos = inode.data_block_number && whence == SEEK_HOLE ?
+	       inode.file_size : off;
+	return 0;
+}
+
+int sfs_clone(struct sfs_fs *fs, uint64_t src, uint64_t off_in, uint64_t dst,
+	      uint64_t off_out, uint64_t len)
+{
+	struct simplefs_inode in, out;
+	uint64_t block, old;
+	int ret;
+
+	if (off_in || off_out)
+		return -EINVAL;
+	if (fs->read_only)
+		return -EROFS;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = sfs_read_inode(fs, src, &in);
+	if (!ret)
+		ret = sfs_read_inode(fs, dst, &out);
+	if (ret)
+		goto out;
+	if (S_ISDIR(in.mode) || S_ISDIR(out.mode)) {
+		ret = -EISDIR;
+		goto out;
+	}
+	if (src == dst)
+		goto out;
+
+	if (!len)
+		len = in.file_size;
+	if (len != in.file_size || out.file_size > in.file_size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!len)
+		goto out;
+
+	block = in.data_block_number;
+	if (block) {
+		ret = block_ref(fs, block);
+		if (ret)
+			goto out;
+	}
+	old = out.data_block_number;
+	out.data_block_number = block;
+	out.file_size = len;
+	out.flags = (out.flags & ~SIMPLEFS_INODE_LZ4) |
+		    (in.flags & SIMPLEFS_INODE_LZ4);
+	out.compressed_size = in.compressed_size;
+	ret = sfs_write_inode(fs, &out);
+	if (ret) {
+		if (block)
+			block_release(fs, block);
+		goto out;
+	}
+	if (old)
+		ret = block_release(fs, old);
+out:
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+ssize_t sfs_copy_file_range(struct sfs_fs *fs, uint64_t src, uint64_t off_in,
+			    uint64_t dst, uint64_t off_out, size_t len)
+{
+	struct simplefs_inode in;
+	ssize_t ret;
+	char *buf;
+
+	/* sfs_clone takes 0 to mean all of src */
+	if (!len)
+		return 0;
+	ret = sfs_getattr(fs, src, &in);
+	if (ret)
+		return ret;
+	if (!off_in && len > in.file_size)
+		len = in.file_size;
+
+	ret = sfs_clone(fs, src, off_in, dst, off_out, len);
+	if (ret != -EINVAL)
+		return ret ? ret : (ssize_t)len;
+
+	if (len > max_file_size(fs))
+		len = max_file_size(fs);
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		return -ENOMEM;
+	ret = sfs_read(fs, src, buf, len, off_in);
+	if (ret > 0)
+		ret = sfs_write(fs, dst, buf, ret, off_out);
+	free(buf);
+	return ret;
+}
+
+ssize_t sfs_read(struct sfs_fs *fs, uint64_t inode_no, void *buf, size_t len,
+		 uint64_t off)
+{
+	struct simplefs_inode inode;
+	uint8_t *data;
+	ssize_t ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+	if (S_ISDIR(inode.mode)) {
+		ret = -EISDIR;
+		goto out;
+	}
+
+	if (off >= inode.file_size)
+		goto out;
+	if (len > inode.file_size - off)
+		len = inode.file_size - off;
+
+	if (inode.flags & SIMPLEFS_INODE_LZ4) {
+		data = malloc(max_file_size(fs));
+		if (!data) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ret = file_load(fs, &inode, data);
+		if (!ret)
+			memcpy(buf, data + off, len);
+		free(data);
+	} else if (!inode.data_block_number) {
+		memset(buf, 0, len);
+	} else {
+		ret = fs->bdev->read(fs->bdev, buf, len,
+				     inode.data_block_number * fs->bs +
+				     inode.data_offset + off);
+	}
+	if (!ret)
+		ret = len;
+out:
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_write_begin(struct sfs_fs *fs, struct simplefs_inode *inode,
+		    uint64_t off, size_t len, uint64_t *pos)
+{
+	char *gap;
+	int ret;
+
+	if (S_ISDIR(inode->mode))
+		return -EISDIR;
+	if (fs->read_only)
+		return -EROFS;
+	/* A file cannot grow beyond one block unless it is compressed, and
+	 * those are rewritten whole by sfs_write */
+	if (off + len > fs->bs || (inode->flags & SIMPLEFS_INODE_LZ4)) {
+		if (off + len > max_file_size(fs) || !may_compress(fs, inode))
+			return -ENOSPC;
+		return -EOPNOTSUPP;
+	}
+
+	if (!inode->data_block_number)
+		ret = inode_alloc_block(fs, inode);
+	else
+		ret = inode_unshare(fs, inode);
+	if (ret)
+		return ret;
+	*pos = inode->data_block_number * fs->bs + off;
+
+	/* Writing past the end leaves a gap that must read back as zeroes */
+	if (off > inode->file_size) {
+		gap = calloc(1, off - inode->file_size);
+		if (!gap)
+			return -ENOMEM;
+		ret = fs->bdev->write(fs->bdev, gap, off - inode->file_size,
+				      *pos - (off - inode->file_size));
+		free(gap);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int sfs_write_end(struct sfs_fs *fs, struct simplefs_inode *inode,
+		  uint64_t off, size_t len)
+{
+	/* Shrinking is done through truncate */
+	if (off + len <= inode->file_size)
+		return 0;
+	inode->file_size = off + len;
+	return sfs_write_inode(fs, inode);
+}
+
+ssize_t sfs_write(struct sfs_fs *fs, uint64_t inode_no, const void *buf,
+		  size_t len, uint64_t off)
+{
+	struct simplefs_inode inode;
+	uint64_t pos;
+	ssize_t ret;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (!ret)
+		ret = sfs_write_begin(fs, &inode, off, len, &pos);
+	if (ret == -EOPNOTSUPP) {
+		ret = file_rewrite(fs, &inode, buf, off, len,
+				   off + len > inode.file_size ?
+				   off + len : inode.file_size);
+	} else if (!ret) {
+		ret = fs->bdev->write(fs->bdev, buf, len, pos);
+		if (!ret)
+			ret = sfs_write_end(fs, &inode, off, len);
+	}
+	if (!ret)
+		ret = len;
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* The namespace and the rest of a full attribute name */
+static int xattr_name(const char *name, int *index, const char **suffix)
+{
+	const char *prefix;
+	size_t len;
+
+	for (*index = SIMPLEFS_XATTR_INDEX_USER;
+	     *index <= SIMPLEFS_XATTR_INDEX_SECURITY; (*index)++) {
+		prefix = simplefs_xattr_prefix(*index);
+		len = strlen(prefix);
+		if (strncmp(name, prefix, len))
+			continue;
+		*suffix = name + len;
+		if (!**suffix)
+			return -EINVAL;
+		return strlen(*suffix) > UINT8_MAX ? -ERANGE : 0;
+	}
+	return -EOPNOTSUPP;
+}
+
+/* Read an xattr block, which is checksummed like a directory block */
+static int xattr_block_read(struct sfs_fs *fs, uint64_t block, void *buf)
+{
+	int ret = sfs_read_blocks(fs, block, 1, buf);
+
+	if (!ret && (!sfs_dir_csum_ok(buf, fs->bs) ||
+		     simplefs_xattr_block_check(buf, fs->bs)))
+		ret = -EIO;
+	return ret;
+}
+
+static void *xattr_area(void *block)
+{
+	return (struct simplefs_xattr_header *)block + 1;
+}
+
+ssize_t sfs_getxattr(struct sfs_fs *fs, uint64_t inode_no, const char *name,
+		     void *value, size_t size)
+{
+	struct simplefs_inode inode;
+	struct simplefs_xattr_entry *e;
+	const char *suffix;
+	void *block = NULL;
+	ssize_t ret;
+	int index;
+
+	ret = xattr_name(name, &index, &suffix);
+	if (ret)
+		return ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+	e = simplefs_xattr_find(inode.xattrs, sizeof(inode.xattrs), index,
+				suffix, strlen(suffix));
+	if (!e && inode.xattr_block) {
+		block = malloc(fs->bs);
+		ret = block ? xattr_block_read(fs, inode.xattr_block, block)
+			    : -ENOMEM;
+		if (ret)
+			goto out;
+		e = simplefs_xattr_find(xattr_area(block),
+					SIMPLEFS_XATTR_BLOCK_AREA(fs->bs),
+					index, suffix, strlen(suffix));
+	}
+	if (!e) {
+		ret = -ENODATA;
+	} else if (size && size < e->value_size) {
+		ret = -ERANGE;
+	} else {
+		if (size)
+			memcpy(value, simplefs_xattr_value(e), e->value_size);
+		ret = e->value_size;
+	}
+out:
+	free(block);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* Append the full names of the entries of area to list */
+static ssize_t xattr_list(const void *area, size_t area_size, char *list,
+			  size_t size, size_t used)
+{
+	const struct simplefs_xattr_entry *e;
+	const char *prefix;
+	size_t len;
+
+	simplefs_xattr_for_each(e, area, area_size) {
+		prefix = simplefs_xattr_prefix(e->name_index);
+		len = strlen(prefix) + e->name_len + 1;
+		if (size) {
+			if (len > size - used)
+				return -ERANGE;
+			memcpy(list + used, prefix, strlen(prefix));
+			memcpy(list + used + strlen(prefix), e->name, e->name_len);
+			list[used + len - 1] = '\0';
+		}
+		used += len;
+	}
+	return used;
+}
+
+ssize_t sfs_listxattr(struct sfs_fs *fs, uint64_t inode_no, char *list,
+		      size_t size)
+{
+	struct simplefs_inode inode;
+	void *block = NULL;
+	ssize_t ret;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	if (ret)
+		goto out;
+	ret = xattr_list(inode.xattrs, sizeof(inode.xattrs), list, size, 0);
+	if (ret >= 0 && inode.xattr_block) {
+		block = malloc(fs->bs);
+		ret = block ? xattr_block_read(fs, inode.xattr_block, block)
+			    : -ENOMEM;
+		if (!ret)
+			ret = xattr_list(xattr_area(block),
+					 SIMPLEFS_XATTR_BLOCK_AREA(fs->bs),
+					 list, size, ret);
+	}
+out:
+	free(block);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+/* The attributes that do not fit in the inode go to a new block, which
+ * the inode is switched over to before the old one is released, so that a
+ * crash leaves the old or the new attributes. Unlike the kernel module,
+ * libsimplefs does not look for a block with the same attributes to
+ * share. */
+int sfs_setxattr(struct sfs_fs *fs, uint64_t inode_no, const char *name,
+		 const void *value, size_t size, int flags)
+{
+	uint8_t xattrs[SIMPLEFS_INLINE_XATTR_SIZE];
+	struct simplefs_inode inode;
+	struct simplefs_xattr_header *header;
+	uint8_t *old = NULL, *new = NULL;
+	uint64_t old_block, block = 0;
+	const char *suffix;
+	size_t len;
+	long used;
+	int index, found, ret;
+
+	ret = xattr_name(name, &index, &suffix);
+	if (ret)
+		return ret;
+	len = strlen(suffix);
+	if (fs->read_only)
+		return -EROFS;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	old = malloc(fs->bs);
+	new = malloc(fs->bs);
+	if (!old || !new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = sfs_read_inode(fs, inode_no, &inode);
+	old_block = inode.xattr_block;
+	if (!ret && old_block)
+		ret = xattr_block_read(fs, old_block, old);
+	if (ret)
+		goto out;
+
+	found = simplefs_xattr_find(inode.xattrs, sizeof(inode.xattrs), index,
+				    suffix, len) ||
+		(old_block &&
+		 simplefs_xattr_find(xattr_area(old),
+				     SIMPLEFS_XATTR_BLOCK_AREA(fs->bs),
+				     index, suffix, len));
+	if ((flags & SFS_XATTR_CREATE) && found) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if (((flags & SFS_XATTR_REPLACE) || !value) && !found) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	used = simplefs_xattr_layout(inode.xattrs,
+				     old_block ? xattr_area(old) : NULL,
+				     SIMPLEFS_XATTR_BLOCK_AREA(fs->bs), index,
+				     suffix, len, value, size, xattrs,
+				     xattr_area(new));
+	if (used < 0) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (used) {
+		header = (struct simplefs_xattr_header *)new;
+		memset(header, 0, sizeof(*header));
+		header->magic = SIMPLEFS_XATTR_MAGIC;
+		sfs_dir_set_csum(new, fs->bs);
+		ret = sfs_alloc_block(fs, inode_no, &block);
+		if (ret)
+			goto out;
+		ret = sfs_write_blocks(fs, block, 1, new);
+		if (ret) {
+			sfs_free_block(fs, block);
+			goto out;
+		}
+	}
+
+	memcpy(inode.xattrs, xattrs, sizeof(xattrs));
+	inode.xattr_block = block;
+	ret = sfs_write_inode(fs, &inode);
+	if (ret) {
+		if (block)
+			sfs_free_block(fs, block);
+		goto out;
+	}
+	if (old_block)
+		ret = block_release(fs, old_block);
+out:
+	free(old);
+	free(new);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int sfs_removexattr(struct sfs_fs *fs, uint64_t inode_no, const char *name)
+{
+	return sfs_setxattr(fs, inode_no, name, NULL, 0, 0);
+}
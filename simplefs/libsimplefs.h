@@ -0,0 +1,205 @@
+/*
+ * libsimplefs: the simplefs on-disk format in userspace.
+ *
+ * The same allocation groups, inode tables, bitmaps and directory record
+ * handling as simple.c, on top of a small block device interface instead
+ * of buffer_heads. A pread/pwrite implementation for image files and block
+ * devices is provided, so tools can work on images at native speed
+ * without root or a kernel build.
+ *
+ * Functions return 0 (or a byte count) on success and a negative errno on
+ * failure, as in the kernel.
+ */
+#ifndef LIBSIMPLEFS_H
+#define LIBSIMPLEFS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "simple.h"
+
+struct sfs_bdev {
+	int (*read)(struct sfs_bdev *bdev, void *buf, size_t len, uint64_t off);
+	int (*write)(struct sfs_bdev *bdev, const void *buf, size_t len,
+		     uint64_t off);
+	int (*flush)(struct sfs_bdev *bdev);
+};
+
+/* A file or block device accessed with pread/pwrite. Safe to use from
+ * several threads at once. */
+struct sfs_file_bdev {
+	struct sfs_bdev bdev;
+	int fd;
+};
+
+void sfs_file_bdev_init(struct sfs_file_bdev *fbdev, int fd);
+
+/* Work out the layout mkfs writes for a device of blocks_count blocks.
+ * Only the geometry fields of sb are filled in. */
+int sfs_compute_layout(struct simplefs_super_block *sb, uint64_t block_size,
+		       uint64_t blocks_count);
+
+struct sfs_fs {
+	struct sfs_bdev *bdev;
+	struct simplefs_super_block sb;
+	uint64_t bs;
+	int read_only;
+	/* SFS_MOUNT_NO_CSUM */
+	int no_csum;
+	/* SIMPLEFS_SB_DIRTY was set at mount. The bitmap checksums are then
+	 * not checked, and the flag is left for fsck-simplefs to clear. */
+	int was_dirty;
+	/* Let files grow past their block by compressing them, as the
+	 * module's compress=lz4. Set it after sfs_mount. */
+	int compress;
+
+	/* Cached group descriptors, block and inode bitmaps and reference
+	 * count tables, written through one block at a time. Each of the
+	 * three holds one block per group, so bit N of bmap is block N. imap
+	 * and refs point into the same allocation as bmap. Mounting only reads
+	 * the descriptors, the rest of a group is read the first time it is
+	 * allocated from or freed to, and loaded has a byte per group that is
+	 * set once it is. */
+	struct simplefs_group_desc *gdt;
+	uint8_t *bmap;
+	uint8_t *imap;
+	struct simplefs_refcount *refs;
+	uint8_t *loaded;
+
+	/* Readers of file data and directories share it, everything that
+	 * changes the filesystem takes it exclusively */
+	pthread_rwlock_t lock;
+};
+
+/* -EROFS without SFS_MOUNT_READ_ONLY for an image made read-only by
+ * mkfs-simplefs --from-dir, -EBADMSG if the super block or a group
+ * descriptor fails its checksum. A read-write mount sets SIMPLEFS_SB_DIRTY
+ * until sfs_umount. */
+#define SFS_MOUNT_READ_ONLY	1
+/* Check no checksums and leave SIMPLEFS_SB_DIRTY alone, for fsck */
+#define SFS_MOUNT_NO_CSUM	2
+int sfs_mount(struct sfs_fs *fs, struct sfs_bdev *bdev, int flags);
+void sfs_umount(struct sfs_fs *fs);
+int sfs_sync(struct sfs_fs *fs);
+/* Read the bitmaps and reference counts of every group not read yet, for
+ * tools that look at fs->bmap, fs->imap and fs->refs directly */
+int sfs_load_bitmaps(struct sfs_fs *fs);
+
+/* SIMPLEFS_IOC_GROW on an unmounted filesystem: *count is the number of
+ * blocks asked for, which the device must already have, and the number
+ * reached on return. Takes fs->lock itself. */
+int sfs_grow(struct sfs_fs *fs, uint64_t *count);
+
+/* Whole blocks, no locking */
+int sfs_read_blocks(struct sfs_fs *fs, uint64_t block, uint64_t count, void *buf);
+int sfs_write_blocks(struct sfs_fs *fs, uint64_t block, uint64_t count,
+		     const void *buf);
+
+/* The low level pieces, called with fs->lock held */
+/* goal is the inode the block is for, it is taken from the same group */
+int sfs_alloc_block(struct sfs_fs *fs, uint64_t goal, uint64_t *block);
+int sfs_free_block(struct sfs_fs *fs, uint64_t block);
+/* The number of files pointing at an allocated block: 1 unless a clone
+ * shares it */
+int sfs_block_refs(struct sfs_fs *fs, uint64_t block, uint32_t *count);
+int sfs_read_inode(struct sfs_fs *fs, uint64_t inode_no,
+		   struct simplefs_inode *inode);
+int sfs_write_inode(struct sfs_fs *fs, const struct simplefs_inode *inode);
+/* dir is the parent, the new inode is placed close to it */
+int sfs_alloc_inode(struct sfs_fs *fs, uint64_t dir, mode_t mode,
+		    struct simplefs_inode *inode);
+int sfs_free_inode(struct sfs_fs *fs, struct simplefs_inode *inode);
+
+/* sfs_write in two halves, for callers that move the data themselves
+ * (splicing it in from FUSE): begin makes sure the file has a block, zeroes
+ * any gap and returns the device offset to write at; end updates the size.
+ * A compressed file has no such offset, begin returns -EOPNOTSUPP and the
+ * data must go through sfs_write instead. */
+int sfs_write_begin(struct sfs_fs *fs, struct simplefs_inode *inode,
+		    uint64_t off, size_t len, uint64_t *pos);
+int sfs_write_end(struct sfs_fs *fs, struct simplefs_inode *inode,
+		  uint64_t off, size_t len);
+
+/* Called for every record of a directory from pos on; pos is the record
+ * index. A nonzero return stops the walk and is passed back. */
+typedef int (*sfs_filldir_t)(void *arg, const char *name, uint64_t inode_no,
+			     uint64_t pos);
+
+/* Everything below takes fs->lock itself and behaves like the matching
+ * operation of the kernel module */
+int sfs_lookup(struct sfs_fs *fs, uint64_t dir, const char *name,
+	       uint64_t *inode_no);
+int sfs_readdir(struct sfs_fs *fs, uint64_t dir, uint64_t pos,
+		sfs_filldir_t filldir, void *arg);
+int sfs_getattr(struct sfs_fs *fs, uint64_t inode_no,
+		struct simplefs_inode *inode);
+int sfs_create(struct sfs_fs *fs, uint64_t dir, const char *name, mode_t mode,
+	       struct simplefs_inode *inode);
+int sfs_unlink(struct sfs_fs *fs, uint64_t dir, const char *name);
+int sfs_rmdir(struct sfs_fs *fs, uint64_t dir, const char *name);
+int sfs_link(struct sfs_fs *fs, uint64_t inode_no, uint64_t dir,
+	     const char *name);
+#define SFS_RENAME_NOREPLACE	1
+int sfs_rename(struct sfs_fs *fs, uint64_t old_dir, const char *old_name,
+	       uint64_t new_dir, const char *new_name, unsigned int flags);
+int sfs_truncate(struct sfs_fs *fs, uint64_t inode_no, uint64_t size);
+/* Same values as FALLOC_FL_*. Mode 0 or KEEP_SIZE preallocates. */
+#define SFS_FALLOC_KEEP_SIZE	0x01
+#define SFS_FALLOC_PUNCH_HOLE	0x02
+#define SFS_FALLOC_ZERO_RANGE	0x10
+int sfs_fallocate(struct sfs_fs *fs, uint64_t inode_no, int mode,
+		  uint64_t off, uint64_t len);
+/* SEEK_DATA or SEEK_HOLE from off; -ENXIO at or past the end, or when
+ * there is no data after off */
+int sfs_seek(struct sfs_fs *fs, uint64_t inode_no, uint64_t off, int whence,
+	     uint64_t *pos);
+/* Make the file dst share the block of src, like simplefs_clone_file_range:
+ * only whole files, -EINVAL for any other range. len 0 means all of src. */
+int sfs_clone(struct sfs_fs *fs, uint64_t src, uint64_t off_in, uint64_t dst,
+	      uint64_t off_out, uint64_t len);
+/* A clone when the range allows it, a copy otherwise. Returns the number
+ * of bytes copied, short at the end of src. */
+ssize_t sfs_copy_file_range(struct sfs_fs *fs, uint64_t src, uint64_t off_in,
+			    uint64_t dst, uint64_t off_out, size_t len);
+ssize_t sfs_read(struct sfs_fs *fs, uint64_t inode_no, void *buf, size_t len,
+		 uint64_t off);
+ssize_t sfs_write(struct sfs_fs *fs, uint64_t inode_no, const void *buf,
+		  size_t len, uint64_t off);
+
+/* Extended attributes, by their full name ("user.hash"), as the xattr
+ * system calls: sfs_getxattr and sfs_listxattr return the size of the
+ * value or of the NUL separated list of names, copied to the buffer unless
+ * size is 0 (-ERANGE if it is too small). A NULL value removes the
+ * attribute. */
+#define SFS_XATTR_CREATE	1
+#define SFS_XATTR_REPLACE	2
+ssize_t sfs_getxattr(struct sfs_fs *fs, uint64_t inode_no, const char *name,
+		     void *value, size_t size);
+ssize_t sfs_listxattr(struct sfs_fs *fs, uint64_t inode_no, char *list,
+		      size_t size);
+int sfs_setxattr(struct sfs_fs *fs, uint64_t inode_no, const char *name,
+		 const void *value, size_t size, int flags);
+int sfs_removexattr(struct sfs_fs *fs, uint64_t inode_no, const char *name);
+
+/* The block holding the data of a file, 0 if it has none */
+int sfs_bmap(struct sfs_fs *fs, uint64_t inode_no, uint64_t *block);
+
+/* crc32c as the kernel's crc32c() computes it, with the SSE4.2 instruction
+ * when the CPU has it */
+uint32_t sfs_crc32c(uint32_t crc, const void *buf, size_t len);
+/* The checksums of simple.h, see SIMPLEFS_CSUM_SEED. sfs_block_csum is
+ * that of a bitmap or reference count block. */
+uint32_t sfs_inode_csum(const struct simplefs_inode *inode);
+uint32_t sfs_desc_csum(const struct simplefs_group_desc *desc);
+uint32_t sfs_sb_csum(const struct simplefs_super_block *sb);
+uint32_t sfs_block_csum(const void *block, uint64_t block_size);
+int sfs_dir_csum_ok(const void *block, uint64_t block_size);
+void sfs_dir_set_csum(void *block, uint64_t block_size);
+
+/* Compress len bytes as the data block of a SIMPLEFS_INODE_LZ4 file holds
+ * them. Returns the compressed size, 0 if it would be more than max. */
+size_t sfs_lz4_compress(const void *src, size_t len, void *dst, size_t max);
+
+#endif /* LIBSIMPLEFS_H */
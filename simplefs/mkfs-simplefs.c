@@ -1,172 +1,1071 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <search.h>
+#include <getopt.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 
-#include "simple.h"
+#include "libsimplefs.h"
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
-const uint64_t WELCOMEFILE_DATABLOCK_NUMBER = 3;
 const uint64_t WELCOMEFILE_INODE_NUMBER = 2;
 
-static int write_superblock(int fd)
+static int quiet;
+
+struct layout {
+	/* Only the geometry is filled in until format() */
+	struct simplefs_super_block sb;
+	int is_blkdev;
+};
+
+/* Size of the file or block device behind fd, in bytes */
+static int device_size(int fd, struct layout *l, uint64_t *size)
 {
-	struct simplefs_super_block sb = {
-		.version = 1,
-		.magic = SIMPLEFS_MAGIC,
-		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
-		/* One inode for rootdirectory and another for a welcome file that we are going to create */
-		.inodes_count = 2,
-		/* FIXME: Free blocks management is not implemented yet */
-		.free_blocks = (~0) & ~(1 << WELCOMEFILE_DATABLOCK_NUMBER),
-	};
-	ssize_t ret;
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		perror("Error getting the size of the device");
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		l->is_blkdev = 1;
+		if (ioctl(fd, BLKGETSIZE64, size)) {
+			perror("Error getting the size of the block device");
+			return -1;
+		}
+	} else {
+		*size = st.st_size;
+	}
+
+	return 0;
+}
+
+/* The layout itself is worked out by libsimplefs, so that every tool
+ * agrees on it. Everything is sized from the device, so the metadata grows
+ * with the image. */
+static int compute_layout(struct layout *l, uint64_t size)
+{
+	uint64_t block_size = l->sb.block_size;
 
-	ret = write(fd, &sb, sizeof(sb));
-	if (ret != SIMPLEFS_DEFAULT_BLOCK_SIZE) {
-		printf
-		    ("bytes written [%d] are not equal to the default block size\n",
-		     (int)ret);
+	if (sfs_compute_layout(&l->sb, block_size, size / block_size)) {
+		fprintf(stderr,
+			"The device is too small: %llu blocks of %llu bytes, at least %llu needed\n",
+			(unsigned long long)l->sb.blocks_count,
+			(unsigned long long)block_size,
+			(unsigned long long)l->sb.data_block + 2);
 		return -1;
 	}
 
-	printf("Super block written succesfully\n");
 	return 0;
 }
 
-static int write_inode_store(int fd)
+/* Write zeroes over [off, off + len) without writing them if possible: a
+ * hole in a regular file, BLKZEROOUT on a block device. */
+static int zero_range(int fd, const struct layout *l, uint64_t off, uint64_t len)
 {
+	static char zeroes[65536];
+	uint64_t range[2] = { off, len };
 	ssize_t ret;
 
-	struct simplefs_inode root_inode;
+	if (!len)
+		return 0;
+
+	if (l->is_blkdev) {
+		if (!ioctl(fd, BLKZEROOUT, range))
+			return 0;
+	} else {
+		if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+			return 0;
+	}
+
+	/* Neither is supported, do it the slow way */
+	while (len) {
+		ret = pwrite(fd, zeroes, len < sizeof(zeroes) ? len : sizeof(zeroes), off);
+		if (ret < 0) {
+			perror("Error zeroing the metadata area");
+			return -1;
+		}
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* The data area need not be zero (the kernel clears blocks as it hands
+ * them out), so just tell the storage it is unused. Failure is harmless. */
+static void discard_range(int fd, const struct layout *l, uint64_t off, uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+
+	if (!len)
+		return;
 
-	root_inode.mode = S_IFDIR;
-	root_inode.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
-	root_inode.data_block_number = SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER;
-	root_inode.dir_children_count = 1;
+	if (l->is_blkdev)
+		ioctl(fd, BLKDISCARD, range);
+	else
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+}
+
+static int write_blocks(int fd, const struct layout *l, uint64_t block,
+			struct iovec *iov, int iovcnt, const char *what)
+{
+	ssize_t expected = 0, ret;
+	int i;
 
-	ret = write(fd, &root_inode, sizeof(root_inode));
+	for (i = 0; i < iovcnt; i++)
+		expected += iov[i].iov_len;
 
-	if (ret != sizeof(root_inode)) {
-		printf
-		    ("The inode store was not written properly. Retry your mkfs\n");
+	ret = pwritev(fd, iov, iovcnt, block * l->sb.block_size);
+	if (ret != expected) {
+		if (ret < 0)
+			perror(what);
+		else
+			fprintf(stderr, "%s: short write\n", what);
 		return -1;
 	}
 
-	printf("root directory inode written succesfully\n");
 	return 0;
 }
 
-static int write_inode(int fd, const struct simplefs_inode *i)
+static void set_bit_le(uint8_t *map, uint64_t bit)
 {
-	off_t nbytes;
-	ssize_t ret;
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static int format(int fd, const struct layout *l)
+{
+	char welcomefile_body[] = "Love is God. God is Love. Anbe Murugan.\n";
+	const struct simplefs_super_block *geo = &l->sb;
+	uint64_t bs = geo->block_size;
+	uint64_t bits_per_block = bs * 8;
+	uint64_t g, bit, start, len, used;
+	struct simplefs_super_block *sb;
+	struct simplefs_group_desc *gdt;
+	struct simplefs_inode *inodes;
+	struct simplefs_dir_record *record;
+	uint8_t *sb_block, *bmaps, *itable, *data;
+	struct iovec iov[2];
+	int ret = -1;
+
+	/* The super block and the descriptors, then the two bitmaps and the
+	 * (empty) reference count table of a group */
+	sb_block = calloc(1 + geo->gdt_blocks, bs);
+	bmaps = calloc(3, bs);
+	itable = calloc(1, bs);
+	data = calloc(2, bs);
+	if (!sb_block || !bmaps || !itable || !data) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	sb = (struct simplefs_super_block *)sb_block;
+	gdt = (struct simplefs_group_desc *)(sb_block + bs);
+	*sb = *geo;
+	/* One inode for rootdirectory and another for a welcome file that we are going to create */
+	sb->inodes_count = 2;
+	sb->free_blocks = 0;
+
+	for (g = 0; g < geo->groups_count; g++) {
+		start = g * geo->blocks_per_group;
+		len = simplefs_group_blocks(geo, g);
+		/* Metadata, and in group 0 the root directory and welcome file */
+		used = simplefs_group_data(geo, g) - start + (g ? 0 : 2);
+
+		gdt[g].free_blocks = len - used;
+		gdt[g].free_inodes = geo->inodes_per_group - (g ? 0 : 2);
+		gdt[g].dirs = g ? 0 : 1;
+		gdt[g].inode_hint = g ? 0 : 2;
+		sb->free_blocks += gdt[g].free_blocks;
+
+		/* Clear the inode table without writing it if possible, and
+		 * tell the storage the data area is unused. The kernel clears
+		 * data blocks as it hands them out. */
+		if (zero_range(fd, l, simplefs_group_itable(geo, g) * bs,
+			       geo->itable_blocks * bs))
+			goto out;
+		discard_range(fd, l, (start + used) * bs, (len - used) * bs);
+
+		/* The used blocks are at the front of the group, and the bits
+		 * past its end are set too, as are those past the last inode */
+		memset(bmaps, 0, 3 * bs);
+		for (bit = 0; bit < used; bit++)
+			set_bit_le(bmaps, bit);
+		for (bit = len; bit < bits_per_block; bit++)
+			set_bit_le(bmaps, bit);
+		for (bit = geo->inodes_per_group; bit < bits_per_block; bit++)
+			set_bit_le(bmaps + bs, bit);
+		if (!g) {
+			set_bit_le(bmaps + bs, SIMPLEFS_ROOTDIR_INODE_NUMBER - 1);
+			set_bit_le(bmaps + bs, WELCOMEFILE_INODE_NUMBER - 1);
+		}
+		gdt[g].bmap_checksum = sfs_block_csum(bmaps, bs);
+		gdt[g].imap_checksum = sfs_block_csum(bmaps + bs, bs);
+		gdt[g].refs_checksum = sfs_block_csum(bmaps + 2 * bs, bs);
+		gdt[g].checksum = sfs_desc_csum(&gdt[g]);
+
+		iov[0].iov_base = bmaps;
+		iov[0].iov_len = 3 * bs;
+		if (write_blocks(fd, l, simplefs_group_bmap(geo, g), iov, 1,
+				 "Writing the bitmaps and reference counts"))
+			goto out;
+	}
+
+	inodes = (struct simplefs_inode *)itable;
+	inodes[0].mode = S_IFDIR;
+	inodes[0].nlink = 2;
+	inodes[0].inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	inodes[0].data_block_number = geo->data_block;
+	inodes[0].dir_children_count = 1;
+
+	inodes[1].mode = S_IFREG;
+	inodes[1].nlink = 1;
+	inodes[1].inode_no = WELCOMEFILE_INODE_NUMBER;
+	inodes[1].data_block_number = geo->data_block + 1;
+	inodes[1].file_size = sizeof(welcomefile_body);
+	inodes[0].checksum = sfs_inode_csum(&inodes[0]);
+	inodes[1].checksum = sfs_inode_csum(&inodes[1]);
+
+	record = (struct simplefs_dir_record *)data;
+	strcpy(record->filename, "vanakkam");
+	record->inode_no = WELCOMEFILE_INODE_NUMBER;
+	sfs_dir_set_csum(data, bs);
+	memcpy(data + bs, welcomefile_body, sizeof(welcomefile_body));
+
+	iov[0].iov_base = itable;
+	iov[0].iov_len = bs;
+	if (write_blocks(fd, l, simplefs_group_itable(geo, 0), iov, 1,
+			 "Writing the inode table"))
+		goto out;
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = 2 * bs;
+	if (write_blocks(fd, l, geo->data_block, iov, 1,
+			 "Writing the root directory and welcome file"))
+		goto out;
+
+	/* The super block last, so that an interrupted mkfs is not mountable */
+	sb->checksum = sfs_sb_csum(sb);
+	iov[0].iov_base = sb_block;
+	iov[0].iov_len = (1 + geo->gdt_blocks) * bs;
+	if (write_blocks(fd, l, 0, iov, 1,
+			 "Writing the super block and group descriptors"))
+		goto out;
+
+	if (fsync(fd)) {
+		perror("Error syncing the device");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(sb_block);
+	free(bmaps);
+	free(itable);
+	free(data);
+	return ret;
+}
+
+/*
+ * --from-dir: a read-only image holding a copy of a directory tree, laid
+ * out for reading it back. Directory records are sorted by name, and
+ * inodes are numbered and data placed breadth first: the block of a
+ * directory is followed by the data of its files in the order of its
+ * records, so the inodes of a directory share inode table blocks and a
+ * listing reads through the image in one direction. Files smaller than a
+ * block are packed one after the other into shared blocks, files larger
+ * than one are compressed. There are no free blocks beyond the end of the
+ * last group's data.
+ */
+
+struct node;
 
-	ret = write(fd, i, sizeof(*i));
-	if (ret != sizeof(*i)) {
-		printf
-		    ("The welcomefile inode was not written properly. Retry your mkfs\n");
+struct dir_entry {
+	char *name;
+	struct node *node;
+};
+
+struct node {
+	/* The first path the node was found at, its data is read from there */
+	char *path;
+	struct stat st;
+	/* Of a directory, sorted by name */
+	struct dir_entry *entries;
+	uint64_t nentries;
+	/* Bytes the data takes in the image, compressed if the file is
+	 * larger than a block */
+	uint64_t stored;
+	/* Filled in by place_tree, which numbers the data blocks from the
+	 * start of the data area */
+	struct simplefs_inode inode;
+	uint64_t data;
+};
+
+struct tree {
+	uint64_t bs;
+	/* Every node, in the order they were found */
+	struct node **all;
+	uint64_t nall, all_size;
+	/* By inode number, nodes[0] is the root */
+	struct node **nodes;
+	/* Files with more than one link, by device and inode number */
+	void *links;
+	/* Data blocks placed so far, and the bytes used of the last block
+	 * files were packed into */
+	uint64_t data_blocks;
+	uint64_t tail, tail_used;
+	/* A whole file, and its compressed data */
+	uint8_t *buf;
+	uint8_t *packed;
+};
+
+static void nop_free(void *node)
+{
+	(void)node;
+}
+
+static int cmp_link(const void *a, const void *b)
+{
+	const struct stat *x = &((const struct node *)a)->st;
+	const struct stat *y = &((const struct node *)b)->st;
+
+	if (x->st_dev != y->st_dev)
+		return x->st_dev < y->st_dev ? -1 : 1;
+	return x->st_ino < y->st_ino ? -1 : x->st_ino > y->st_ino;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_entry *)a)->name,
+		      ((const struct dir_entry *)b)->name);
+}
+
+static struct node *new_node(struct tree *t, const char *path,
+			     const struct stat *st)
+{
+	struct node *node, **all;
+
+	if (t->nall == t->all_size) {
+		t->all_size = t->all_size ? 2 * t->all_size : 256;
+		all = realloc(t->all, t->all_size * sizeof(*all));
+		if (!all)
+			return NULL;
+		t->all = all;
+	}
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+	node->path = strdup(path);
+	if (!node->path) {
+		free(node);
+		return NULL;
+	}
+	node->st = *st;
+	t->all[t->nall++] = node;
+	return node;
+}
+
+/* All size bytes of the file at path, which must not have changed since
+ * it was looked at */
+static int read_file(const char *path, uint8_t *buf, uint64_t size)
+{
+	ssize_t ret = 0;
+	uint64_t done;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
 		return -1;
 	}
-	printf("welcomefile inode written succesfully\n");
+	for (done = 0; done < size; done += ret) {
+		ret = pread(fd, buf + done, size - done, done);
+		if (ret <= 0)
+			break;
+	}
+	close(fd);
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(*i) - sizeof(*i);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf
-		    ("The padding bytes are not written properly. Retry your mkfs\n");
+	if (ret < 0) {
+		perror(path);
 		return -1;
 	}
+	if (done != size) {
+		fprintf(stderr, "%s changed while the image was made\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* What the data block of a file holds: the file itself, or compressed
+ * into t->packed if it is larger than a block. Returns the number of
+ * bytes, or 0 with *data unset for an empty file. */
+static int64_t file_data(struct tree *t, struct node *node,
+			 const uint8_t **data)
+{
+	uint64_t size = node->st.st_size, len;
+
+	if (!size)
+		return 0;
+	if (read_file(node->path, t->buf, size))
+		return -1;
+	if (size <= t->bs) {
+		*data = t->buf;
+		return size;
+	}
+
+	len = sfs_lz4_compress(t->buf, size, t->packed, t->bs);
+	if (!len) {
+		fprintf(stderr, "%s does not compress into one block\n",
+			node->path);
+		return -1;
+	}
+	*data = t->packed;
+	return len;
+}
+
+static struct node *scan_file(struct tree *t, const char *path,
+			      const struct stat *st)
+{
+	uint64_t max = SIMPLEFS_MAX_COMPRESSED_BLOCKS * t->bs;
+	struct node key = { .st = *st }, *node;
+	const uint8_t *data;
+	void **found;
+	int64_t len;
+
+	if (st->st_nlink > 1) {
+		found = tfind(&key, &t->links, cmp_link);
+		if (found)
+			return *found;
+	}
+
+	if ((uint64_t)st->st_size > max) {
+		fprintf(stderr, "%s is %llu bytes, a file can hold at most %llu\n",
+			path, (unsigned long long)st->st_size,
+			(unsigned long long)max);
+		return NULL;
+	}
+
+	node = new_node(t, path, st);
+	if (!node) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	/* Only files larger than a block need reading to know their size
+	 * in the image */
+	if ((uint64_t)st->st_size > t->bs) {
+		len = file_data(t, node, &data);
+		if (len < 0)
+			return NULL;
+		node->stored = len;
+	} else {
+		node->stored = st->st_size;
+	}
+
+	if (st->st_nlink > 1 && !tsearch(node, &t->links, cmp_link)) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	return node;
+}
+
+static struct node *scan_dir(struct tree *t, const char *path,
+			     const struct stat *st)
+{
+	uint64_t max = SIMPLEFS_DIR_RECORDS_PER_BLOCK(t->bs), size = 0;
+	struct node *node, *child;
+	struct dir_entry *entries;
+	struct dirent *de;
+	struct stat cst;
+	char *cpath;
+	DIR *dir;
+
+	node = new_node(t, path, st);
+	if (!node) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return NULL;
+	}
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (asprintf(&cpath, "%s/%s", path, de->d_name) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			goto err;
+		}
+		if (lstat(cpath, &cst)) {
+			perror(cpath);
+			free(cpath);
+			goto err;
+		}
+		if (!S_ISDIR(cst.st_mode) && !S_ISREG(cst.st_mode)) {
+			fprintf(stderr, "Skipping %s, only files and directories are supported\n",
+				cpath);
+			free(cpath);
+			continue;
+		}
+		if (strlen(de->d_name) >= SIMPLEFS_FILENAME_MAXLEN) {
+			fprintf(stderr, "The name of %s is too long\n", cpath);
+			free(cpath);
+			goto err;
+		}
+		if (node->nentries == max) {
+			fprintf(stderr, "%s has more than the %llu entries a directory can hold\n",
+				path, (unsigned long long)max);
+			free(cpath);
+			goto err;
+		}
+
+		child = S_ISDIR(cst.st_mode) ? scan_dir(t, cpath, &cst)
+					     : scan_file(t, cpath, &cst);
+		free(cpath);
+		if (!child)
+			goto err;
+
+		if (node->nentries == size) {
+			size = size ? 2 * size : 8;
+			entries = realloc(node->entries, size * sizeof(*entries));
+			if (!entries) {
+				fprintf(stderr, "Out of memory\n");
+				goto err;
+			}
+			node->entries = entries;
+		}
+		node->entries[node->nentries].node = child;
+		node->entries[node->nentries].name = strdup(de->d_name);
+		if (!node->entries[node->nentries++].name) {
+			fprintf(stderr, "Out of memory\n");
+			goto err;
+		}
+	}
+	closedir(dir);
+
+	qsort(node->entries, node->nentries, sizeof(*node->entries), cmp_entry);
+	return node;
+
+err:
+	closedir(dir);
+	return NULL;
+}
+
+/* A file's data goes into a block of its own if it fills one, otherwise
+ * after that of the files before it if there is room */
+static void place_file(struct tree *t, struct node *node)
+{
+	node->inode.file_size = node->st.st_size;
+	if (node->inode.file_size > t->bs) {
+		node->inode.flags |= SIMPLEFS_INODE_LZ4;
+		node->inode.compressed_size = node->stored;
+	}
+
+	if (!node->stored)
+		return;
+	if (node->stored == t->bs) {
+		node->data = t->data_blocks++;
+		return;
+	}
+
+	if (!t->tail_used || t->tail_used + node->stored > t->bs) {
+		t->tail = t->data_blocks++;
+		t->tail_used = 0;
+	}
+	node->data = t->tail;
+	node->inode.flags |= SIMPLEFS_INODE_PACKED;
+	node->inode.data_offset = t->tail_used;
+	t->tail_used += node->stored;
+}
+
+/* Number the inodes and place the data, breadth first */
+static int place_tree(struct tree *t, struct node *root)
+{
+	uint64_t i, k, n = 0;
+	struct node *node, *child;
+
+	t->nodes = calloc(t->nall, sizeof(*t->nodes));
+	if (!t->nodes) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	t->nodes[n++] = root;
+	root->inode.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	for (i = 0; i < n; i++) {
+		node = t->nodes[i];
+		node->inode.mode = node->st.st_mode;
+		if (!S_ISDIR(node->st.st_mode))
+			continue;
+
+		node->data = t->data_blocks++;
+		node->inode.nlink = 2;
+		node->inode.dir_children_count = node->nentries;
+		for (k = 0; k < node->nentries; k++) {
+			child = node->entries[k].node;
+			if (S_ISDIR(child->st.st_mode))
+				node->inode.nlink++;
+			else
+				child->inode.nlink++;
+			if (child->inode.inode_no)
+				continue;
+
+			child->inode.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER + n;
+			t->nodes[n++] = child;
+			if (S_ISREG(child->st.st_mode))
+				place_file(t, child);
+		}
+	}
 
-	printf
-	    ("inode store padding bytes (after the two inodes) written sucessfully\n");
 	return 0;
 }
-int write_dirent(int fd, const struct simplefs_dir_record *record)
+
+/* The smallest layout with room for inodes inodes and data data blocks.
+ * The inode tables are sized for the inodes rather than the blocks. */
+static int packed_layout(struct layout *l, uint64_t inodes, uint64_t data)
 {
-	ssize_t nbytes = sizeof(*record), ret;
+	struct simplefs_super_block *sb = &l->sb;
+	uint64_t bs = sb->block_size, bits = bs * 8;
+	uint64_t ipb = SIMPLEFS_INODES_PER_BLOCK(bs);
+	uint64_t blocks = data + 1, avail;
+	const char *why;
+
+	for (;;) {
+		sb->version = SIMPLEFS_LAYOUT_VERSION;
+		sb->magic = SIMPLEFS_MAGIC;
+		sb->blocks_count = blocks;
+		sb->blocks_per_group = bits;
+		sb->groups_count = DIV_ROUND_UP(blocks, bits);
+		sb->gdt_block = 1;
+		sb->gdt_blocks = DIV_ROUND_UP(sb->groups_count *
+					      sizeof(struct simplefs_group_desc), bs);
+		sb->itable_blocks = DIV_ROUND_UP(DIV_ROUND_UP(inodes, sb->groups_count),
+						 ipb);
+		sb->inodes_per_group = sb->itable_blocks * ipb;
+		sb->inodes_max = sb->groups_count * sb->inodes_per_group;
+		sb->data_block = simplefs_group_data(sb, 0);
+
+		/* Too many inodes for a group, spread them over one more */
+		if (sb->inodes_per_group > bits) {
+			blocks = sb->groups_count * bits + 1;
+			continue;
+		}
+		/* The last group must have room for some data */
+		if (simplefs_group_data(sb, sb->groups_count - 1) >= blocks) {
+			blocks = simplefs_group_data(sb, sb->groups_count - 1) + 1;
+			continue;
+		}
+		avail = blocks - simplefs_overhead(sb);
+		if (avail >= data)
+			break;
+		blocks += data - avail;
+	}
+
+	sb->inodes_count = inodes;
+	sb->flags = SIMPLEFS_SB_READ_ONLY;
 
-	ret = write(fd, record, nbytes);
-	if (ret != nbytes) {
-		printf
-		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
+	why = simplefs_check_layout(sb);
+	if (why) {
+		fprintf(stderr, "Cannot lay out %llu inodes and %llu data blocks: %s\n",
+			(unsigned long long)inodes, (unsigned long long)data, why);
 		return -1;
 	}
-	printf
-	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
+	return 0;
+}
+
+/* Data blocks are numbered from the first one of group 0 on, skipping
+ * the metadata at the start of every group */
+static uint64_t data_block(const struct simplefs_super_block *sb, uint64_t n)
+{
+	uint64_t g, start, len;
+
+	for (g = 0; ; g++) {
+		start = simplefs_group_data(sb, g);
+		len = (g << simplefs_group_bits(sb)) + simplefs_group_blocks(sb, g) -
+		      start;
+		if (n < len)
+			return start + n;
+		n -= len;
+	}
+}
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf
-		    ("Writing the padding for rootdirectory children datablock has failed\n");
+static int write_at(int fd, const void *buf, size_t len, uint64_t off,
+		    const char *what)
+{
+	ssize_t ret = pwrite(fd, buf, len, off);
+
+	if (ret != (ssize_t)len) {
+		if (ret < 0)
+			perror(what);
+		else
+			fprintf(stderr, "%s: short write\n", what);
 		return -1;
 	}
-	printf
-	    ("padding after the rootdirectory children written succesfully\n");
 	return 0;
 }
-int write_block(int fd, char *block, size_t len)
+
+/* The data of every inode in inode order, which is also disk order */
+static int write_data(int fd, struct layout *l, struct tree *t)
 {
-	ssize_t ret;
+	const struct simplefs_super_block *sb = &l->sb;
+	uint64_t bs = sb->block_size, i, k;
+	struct simplefs_dir_record *records;
+	const uint8_t *data;
+	struct node *node;
+	int64_t len;
+	int ret = -1;
 
-	ret = write(fd, block, len);
-	if (ret != len) {
-		printf("Writing file body has failed\n");
+	records = malloc(bs);
+	if (!records) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < sb->inodes_count; i++) {
+		node = t->nodes[i];
+		if (S_ISDIR(node->inode.mode)) {
+			memset(records, 0, bs);
+			for (k = 0; k < node->nentries; k++) {
+				strcpy(records[k].filename, node->entries[k].name);
+				records[k].inode_no = node->entries[k].node->inode.inode_no;
+			}
+			sfs_dir_set_csum(records, bs);
+			node->inode.data_block_number = data_block(sb, node->data);
+			if (write_at(fd, records, bs,
+				     node->inode.data_block_number * bs,
+				     "Writing a directory"))
+				goto out;
+			continue;
+		}
+
+		len = file_data(t, node, &data);
+		if (len < 0)
+			goto out;
+		if ((uint64_t)len != node->stored) {
+			fprintf(stderr, "%s changed while the image was made\n",
+				node->path);
+			goto out;
+		}
+		if (!len)
+			continue;
+		node->inode.data_block_number = data_block(sb, node->data);
+		if (write_at(fd, data, len,
+			     node->inode.data_block_number * bs +
+			     node->inode.data_offset, node->path))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	free(records);
+	return ret;
+}
+
+/* Everything but the data: the inode tables and bitmaps of every group,
+ * then the group descriptors and the super block */
+static int write_meta(int fd, struct layout *l, struct tree *t)
+{
+	struct simplefs_super_block *geo = &l->sb;
+	uint64_t bs = geo->block_size, bits = bs * 8;
+	uint64_t ipg = geo->inodes_per_group, inodes = geo->inodes_count;
+	uint64_t data = t->data_blocks, g, i, bit, start, len, meta, used, first;
+	struct simplefs_super_block *sb;
+	struct simplefs_group_desc *gdt;
+	struct simplefs_inode *itable;
+	uint8_t *sb_block, *bmaps;
+	struct iovec iov[1];
+	int ret = -1;
+
+	sb_block = calloc(1 + geo->gdt_blocks, bs);
+	bmaps = calloc(3, bs);
+	itable = calloc(geo->itable_blocks, bs);
+	if (!sb_block || !bmaps || !itable) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	sb = (struct simplefs_super_block *)sb_block;
+	gdt = (struct simplefs_group_desc *)(sb_block + bs);
+	*sb = *geo;
+	sb->free_blocks = 0;
+
+	for (g = 0; g < geo->groups_count; g++) {
+		start = g * bits;
+		len = simplefs_group_blocks(geo, g);
+		meta = simplefs_group_data(geo, g) - start;
+		used = data < len - meta ? data : len - meta;
+		data -= used;
+
+		memset(bmaps, 0, 3 * bs);
+		for (bit = 0; bit < meta + used; bit++)
+			set_bit_le(bmaps, bit);
+		for (bit = len; bit < bits; bit++)
+			set_bit_le(bmaps, bit);
+
+		first = g * ipg;
+		memset(itable, 0, geo->itable_blocks * bs);
+		gdt[g].free_blocks = len - meta - used;
+		gdt[g].free_inodes = ipg;
+		gdt[g].inode_hint = ipg;
+		for (i = 0; i < ipg && first + i < inodes; i++) {
+			itable[i] = t->nodes[first + i]->inode;
+			itable[i].checksum = sfs_inode_csum(&itable[i]);
+			set_bit_le(bmaps + bs, i);
+			gdt[g].free_inodes--;
+			if (S_ISDIR(itable[i].mode))
+				gdt[g].dirs++;
+		}
+		if (i < ipg)
+			gdt[g].inode_hint = i;
+		for (bit = ipg; bit < bits; bit++)
+			set_bit_le(bmaps + bs, bit);
+		sb->free_blocks += gdt[g].free_blocks;
+		gdt[g].bmap_checksum = sfs_block_csum(bmaps, bs);
+		gdt[g].imap_checksum = sfs_block_csum(bmaps + bs, bs);
+		gdt[g].refs_checksum = sfs_block_csum(bmaps + 2 * bs, bs);
+		gdt[g].checksum = sfs_desc_csum(&gdt[g]);
+
+		iov[0].iov_base = bmaps;
+		iov[0].iov_len = 3 * bs;
+		if (write_blocks(fd, l, simplefs_group_bmap(geo, g), iov, 1,
+				 "Writing the bitmaps and reference counts"))
+			goto out;
+		iov[0].iov_base = itable;
+		iov[0].iov_len = geo->itable_blocks * bs;
+		if (write_blocks(fd, l, simplefs_group_itable(geo, g), iov, 1,
+				 "Writing the inode table"))
+			goto out;
+	}
+
+	/* The super block last, so that an interrupted mkfs is not mountable */
+	sb->checksum = sfs_sb_csum(sb);
+	iov[0].iov_base = sb_block;
+	iov[0].iov_len = (1 + geo->gdt_blocks) * bs;
+	if (write_blocks(fd, l, 0, iov, 1,
+			 "Writing the super block and group descriptors"))
+		goto out;
+
+	if (fsync(fd)) {
+		perror("Error syncing the device");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(sb_block);
+	free(bmaps);
+	free(itable);
+	return ret;
+}
+
+/* The image is sized to fit, a block device must be large enough */
+static int size_image(int fd, struct layout *l)
+{
+	uint64_t need = l->sb.blocks_count * l->sb.block_size, size;
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		perror("Error getting the size of the device");
+		return -1;
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		if (ftruncate(fd, 0) || ftruncate(fd, need)) {
+			perror("Error sizing the image");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (device_size(fd, l, &size))
+		return -1;
+	if (size < need) {
+		fprintf(stderr, "The device is too small: %llu bytes, %llu needed\n",
+			(unsigned long long)size, (unsigned long long)need);
 		return -1;
 	}
-	printf("block has been written succesfully\n");
 	return 0;
 }
 
+static void free_tree(struct tree *t)
+{
+	uint64_t i, k;
+
+	for (i = 0; i < t->nall; i++) {
+		for (k = 0; k < t->all[i]->nentries; k++)
+			free(t->all[i]->entries[k].name);
+		free(t->all[i]->entries);
+		free(t->all[i]->path);
+		free(t->all[i]);
+	}
+	tdestroy(t->links, nop_free);
+	free(t->all);
+	free(t->nodes);
+	free(t->buf);
+	free(t->packed);
+}
+
+static int build(int fd, struct layout *l, const char *path)
+{
+	struct tree t = { .bs = l->sb.block_size };
+	struct node *root;
+	struct stat st;
+	int ret = -1;
+
+	t.buf = malloc(SIMPLEFS_MAX_COMPRESSED_BLOCKS * t.bs);
+	t.packed = malloc(t.bs);
+	if (!t.buf || !t.packed) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	if (stat(path, &st)) {
+		perror(path);
+		goto out;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", path);
+		goto out;
+	}
+
+	root = scan_dir(&t, path, &st);
+	if (!root || place_tree(&t, root))
+		goto out;
+	if (packed_layout(l, t.nall, t.data_blocks) ||
+	    size_image(fd, l) ||
+	    write_data(fd, l, &t) ||
+	    write_meta(fd, l, &t))
+		goto out;
+
+	ret = 0;
+out:
+	free_tree(&t);
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: mkfs-simplefs [-q] [-b block-size] [--from-dir <dir>] <device>\n");
+	printf("  -b  block size in bytes, a power of two from %d to %d (default %d)\n",
+	       SIMPLEFS_MIN_BLOCK_SIZE, SIMPLEFS_MAX_BLOCK_SIZE,
+	       SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	printf("  -q  quiet, only print errors\n");
+	printf("  --from-dir  make a read-only image holding a copy of dir, sized to fit;\n"
+	       "              device is created if it does not exist\n");
+}
+
 int main(int argc, char *argv[])
 {
 	int fd;
-	ssize_t ret;
-
-	char welcomefile_body[] = "Love is God. God is Love. Anbe Murugan.\n";
-	struct simplefs_inode welcome = {
-		.mode = S_IFREG,
-		.inode_no = WELCOMEFILE_INODE_NUMBER,
-		.data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
-		.file_size = sizeof(welcomefile_body),
+	int opt;
+	int ret;
+	int created = 0;
+	char *end;
+	uint64_t size;
+	struct stat st;
+	const char *from_dir = NULL;
+	static const struct option long_opts[] = {
+		{ "from-dir", required_argument, NULL, 'd' },
+		{ NULL, 0, NULL, 0 }
 	};
-	struct simplefs_dir_record record = {
-		.filename = "vanakkam",
-		.inode_no = WELCOMEFILE_INODE_NUMBER,
+	struct layout layout = {
+		.sb.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
 	};
 
-	if (argc != 2) {
-		printf("Usage: mkfs-simplefs <device>\n");
+	while ((opt = getopt_long(argc, argv, "b:q", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			layout.sb.block_size = strtoull(optarg, &end, 0);
+			if (*end || !simplefs_valid_block_size(layout.sb.block_size)) {
+				printf("Invalid block size [%s]\n", optarg);
+				usage();
+				return -1;
+			}
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'd':
+			from_dir = optarg;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
 		return -1;
 	}
 
-	fd = open(argv[1], O_RDWR);
+	/* Remember whether --from-dir made the image, to remove it on failure */
+	fd = -1;
+	if (from_dir) {
+		fd = open(argv[optind], O_RDWR | O_CREAT | O_EXCL, 0644);
+		created = fd != -1;
+	}
+	if (fd == -1)
+		fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
 
-	ret = 1;
+	ret = -1;
 	do {
-		if (write_superblock(fd))
+		if (from_dir) {
+			ret = build(fd, &layout, from_dir);
+			/* Leave no half-built image that looks mountable */
+			if (ret && created)
+				unlink(argv[optind]);
+			else if (ret && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+				 ftruncate(fd, 0))
+				perror("Error truncating the image");
 			break;
-		if (write_inode_store(fd))
+		}
+		if (device_size(fd, &layout, &size))
 			break;
-
-		if (write_inode(fd, &welcome))
-			break;
-		if (write_dirent(fd, &record))
+		if (compute_layout(&layout, size))
 			break;
-		if (write_block(fd, welcomefile_body, welcome.file_size))
+		if (format(fd, &layout))
 			break;
 
 		ret = 0;
 	} while (0);
 
+	if (!ret && !quiet)
+		printf("simplefs: %llu blocks of %llu bytes, %llu inodes\n"
+		       "  %llu groups of %llu blocks and %llu inodes, %llu inode table blocks each\n"
+		       "  group descriptors at %llu (%llu blocks), data from %llu\n",
+		       (unsigned long long)layout.sb.blocks_count,
+		       (unsigned long long)layout.sb.block_size,
+		       (unsigned long long)layout.sb.inodes_max,
+		       (unsigned long long)layout.sb.groups_count,
+		       (unsigned long long)layout.sb.blocks_per_group,
+		       (unsigned long long)layout.sb.inodes_per_group,
+		       (unsigned long long)layout.sb.itable_blocks,
+		       (unsigned long long)layout.sb.gdt_block,
+		       (unsigned long long)layout.sb.gdt_blocks,
+		       (unsigned long long)layout.sb.data_block);
+
 	close(fd);
 	return ret;
 }
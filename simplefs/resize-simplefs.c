@@ -0,0 +1,149 @@
+/*
+ * resize-simplefs: grow a simplefs to the size of its device.
+ *
+ * Given a directory, the mounted filesystem holding it is grown online with
+ * SIMPLEFS_IOC_GROW. Given an image file or a block device, the unmounted
+ * filesystem on it is grown through libsimplefs. Either way the device has
+ * to be enlarged first (truncate, lvextend, then losetup -c for a loop
+ * device), and only growing is supported.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+
+#include "libsimplefs.h"
+
+/* Bytes, with an optional K, M, G or T suffix */
+static int parse_size(const char *arg, uint64_t *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(arg, &end, 0);
+	if (errno || end == arg)
+		return -1;
+	switch (*end) {
+	case 'T': case 't':
+		*size <<= 10;
+		/* fall through */
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*size <<= 10;
+		end++;
+		break;
+	}
+	return *end ? -1 : 0;
+}
+
+static int grow_mounted(int fd, uint64_t *count)
+{
+	if (ioctl(fd, SIMPLEFS_IOC_GROW, count) == -1)
+		return -errno;
+	return 0;
+}
+
+/* size 0 is the whole device */
+static int grow_image(int fd, const struct stat *st, uint64_t size,
+		      uint64_t *count, uint64_t *block_size)
+{
+	struct sfs_file_bdev bdev;
+	struct sfs_fs fs;
+	uint64_t dev_size = st->st_size;
+	int ret;
+
+	if (S_ISBLK(st->st_mode) && ioctl(fd, BLKGETSIZE64, &dev_size))
+		return -errno;
+	if (!size)
+		size = dev_size;
+	if (size > dev_size)
+		return -EINVAL;
+
+	sfs_file_bdev_init(&bdev, fd);
+	ret = sfs_mount(&fs, &bdev.bdev, 0);
+	if (ret)
+		return ret;
+	*block_size = fs.bs;
+	*count = size / fs.bs;
+	ret = sfs_grow(&fs, count);
+	sfs_umount(&fs);
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: resize-simplefs [-s size] <mount point | device>\n");
+	printf("  -s  new size in bytes, K, M, G or T (default: the whole device)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	uint64_t size = 0, count, block_size = 0;
+	int fd, opt, ret;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (parse_size(optarg, &size)) {
+				printf("Invalid size [%s]\n", optarg);
+				usage();
+				return 2;
+			}
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return 2;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd != -1 && fstat(fd, &st) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd != -1 && !S_ISDIR(st.st_mode)) {
+		close(fd);
+		fd = open(argv[optind], O_RDWR);
+	}
+	if (fd == -1) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		block_size = st.st_blksize;
+		count = size / block_size;
+		/* A count of 0 would be taken for the whole device */
+		ret = size && !count ? -EINVAL : grow_mounted(fd, &count);
+	} else {
+		ret = grow_image(fd, &st, size, &count, &block_size);
+	}
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	printf("%s: %llu blocks of %llu bytes\n", argv[optind],
+	       (unsigned long long)count, (unsigned long long)block_size);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+
+#
+# Benchmark simplefs with simplefs-bench
+#
+# - create fs on a loop image (or a brd ramdisk with -r; -x also mounts it
+#   with -o dax, which needs a kernel with CONFIG_BLK_DEV_RAM_DAX)
+# - run the metadata and I/O tests for each thread count
+# - check the image afterwards
+#
+# Results go to stdout as one JSON object per line, labelled with the
+# current commit so that runs can be compared.
+#
+# Usage: simple-bench.sh [-r] [-x] [-t threads] [-s sizes] [-f fanout] [-d depth]
+#
+
+set -e
+
+root_pwd="$PWD"
+test_dir="bench-dir-$RANDOM"
+test_mount_point="bench-mount-point-$RANDOM"
+image_mb=64
+use_brd=
+mount_opts=
+bench_args=(-t 1,2,4,8)
+
+while getopts "rxt:s:f:d:" opt; do
+    case "$opt" in
+        r) use_brd=1 ;;
+        x) use_brd=1; mount_opts="-o dax" ;;
+        t|s|f|d) bench_args+=("-$opt" "$OPTARG") ;;
+        *) exit 2 ;;
+    esac
+done
+
+function create_bench_device()
+{
+    if [ -n "$use_brd" ]; then
+        modprobe brd rd_nr=1 rd_size=$((image_mb * 1024))
+        device=/dev/ram0
+    else
+        dd bs=1M count=0 seek="$image_mb" of="$test_dir/image"
+        device="$test_dir/image"
+    fi
+    ./mkfs-simplefs "$device" >&2
+}
+function mount_bench_device()
+{
+    insmod simplefs.ko
+    if [ -n "$use_brd" ]; then
+        mount $mount_opts -t simplefs "$device" "$test_mount_point"
+    else
+        mount -o loop -t simplefs "$device" "$test_mount_point"
+    fi
+}
+function cleanup()
+{
+    cd "$root_pwd"
+    [ -d "$test_mount_point" ] && umount -t simplefs "$test_mount_point"
+    lsmod | grep -q simplefs && rmmod "$root_pwd/simplefs.ko"
+    lsmod | grep -q '^brd' && rmmod brd
+
+    rm -fR "$test_dir" "$test_mount_point"
+}
+
+
+make >&2
+
+cleanup 2>/dev/null || true
+trap cleanup SIGINT EXIT
+mkdir "$test_dir" "$test_mount_point"
+create_bench_device
+
+mount_bench_device
+sync
+./simplefs-bench -l "$(git rev-parse --short HEAD 2>/dev/null)" \
+    "${bench_args[@]}" "$test_mount_point"
+umount "$test_mount_point"
+./fsck-simplefs -n "$device" >&2
@@ -36,6 +36,10 @@ function unmount_fs()
     rmmod simplefs.ko
     dmesg | tail -n20
 }
+function check_fs_image()
+{
+    ./fsck-simplefs -n "$1"
+}
 function do_some_operations()
 {
     cd "$1"
@@ -68,6 +72,43 @@ function do_some_operations()
     cp hello hello_smaller
     echo "directory" > hello_smaller
     cat hello_smaller
+
+    echo "Renamed and linked" > tmp_file
+    mv tmp_file renamed_file
+    ln renamed_file linked_file
+    rm renamed_file
+    truncate -s 6 linked_file
+    cat linked_file
+
+    # A file without a block is a hole until it is written or fallocated
+    truncate -s 2000 sparse_file
+    cmp -n 2000 sparse_file /dev/zero
+    fallocate -l 4096 sparse_file
+    filefrag -v sparse_file
+    fallocate -p -o 0 -l 4096 sparse_file
+    cmp -n 4096 sparse_file /dev/zero
+
+    # A clone shares the block until one of them is written
+    cp --reflink=always hello_smaller cloned_file
+    filefrag -v cloned_file
+    echo "copied on write" >> cloned_file
+    cat hello_smaller cloned_file
+
+    # Small attributes stay in the inode, larger ones go to a block that
+    # files with the same attributes share
+    setfattr -n user.hash -v "$(sha256sum hello | cut -d' ' -f1)" hello
+    setfattr -n user.big -v "$(printf '%0300d' 0)" hello_smaller
+    setfattr -n user.big -v "$(printf '%0300d' 0)" cloned_file
+    setfattr -x user.big cloned_file
+    getfattr -d hello hello_smaller cloned_file
+
+    # With compress=lz4 a file may outgrow its block
+    mount -o remount,compress=lz4 "$(stat -c %m .)"
+    yes "compressed by simplefs" | head -n 500 > compressed_file
+    yes "compressed by simplefs" | head -n 500 | cmp - compressed_file
+    filefrag -v compressed_file
+
+    mkdir dir3 && rmdir dir3
 }
 function do_read_operations()
 {
@@ -85,6 +126,28 @@ function do_read_operations()
     cd dir2
     cat hello
     cat hello_smaller
+    cat linked_file
+    getfattr -n user.hash hello
+    getfattr -n user.big hello_smaller
+    yes "compressed by simplefs" | head -n 500 | cmp - compressed_file
+}
+function create_tree()
+{
+    mkdir -p "$1/dir1/dir2" "$1/empty_dir"
+    echo "Hello World" > "$1/hello"
+    echo "First level directory" > "$1/dir1/hello"
+    ln "$1/dir1/hello" "$1/dir1/dir2/linked_file"
+    touch "$1/dir1/dir2/empty_file"
+    yes "compressed by simplefs" | head -n 500 > "$1/compressed_file"
+}
+function check_read_only_image()
+{
+    diff -r "$1" "$2"
+    filefrag -v "$2/hello"
+    # Always mounted read-only
+    if touch "$2/new_file"; then
+        return 1
+    fi
 }
 function cleanup()
 {
@@ -112,11 +175,45 @@ mount_fs_image "$test_dir/image" "$test_mount_point"
 do_some_operations "$test_mount_point"
 cd "$root_pwd"
 unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
 
 # 2
 mount_fs_image "$test_dir/image" "$test_mount_point"
 do_read_operations "$test_mount_point"
 cd "$root_pwd"
+./defrag-simplefs -v "$test_mount_point"
+./defrag-simplefs -n "$test_mount_point"
+fstrim -v "$test_mount_point"
+df "$test_mount_point"
+df -i "$test_mount_point"
+unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
+
+# 3: grow the image offline, which fills up its one group
+truncate -s 4M "$test_dir/image"
+./resize-simplefs "$test_dir/image"
+check_fs_image "$test_dir/image"
+mount_fs_image "$test_dir/image" "$test_mount_point"
+df "$test_mount_point"
+do_read_operations "$test_mount_point"
+cd "$root_pwd"
+echo "grown" > "$test_mount_point/grown"
+cat "$test_mount_point/grown"
+unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
+
+# 4: a damaged super block checksum is found and repaired by fsck
+printf '\xff' | dd of="$test_dir/image" bs=1 seek=124 conv=notrunc
+! check_fs_image "$test_dir/image"
+./fsck-simplefs "$test_dir/image" || [ $? -eq 1 ]
+check_fs_image "$test_dir/image"
+
+# 5: a read-only image made from a directory tree
+create_tree "$test_dir/tree"
+./mkfs-simplefs --from-dir "$test_dir/tree" "$test_dir/ro-image"
+check_fs_image "$test_dir/ro-image"
+mount_fs_image "$test_dir/ro-image" "$test_mount_point"
+check_read_only_image "$test_dir/tree" "$test_mount_point"
 unmount_fs "$test_mount_point"
 
 dmesg | tail -n40
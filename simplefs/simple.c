@@ -15,19 +15,53 @@
 #include <linux/random.h>
 #include <linux/version.h>
 #include <linux/time64.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/blkdev.h>
+#include <linux/list_sort.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/statfs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/falloc.h>
+#include <linux/fiemap.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/lz4.h>
+#include <linux/xattr.h>
+#include <linux/compat.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#include <linux/dax.h>
+#include <linux/iomap.h>
+#endif
 
 #include "super.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 #define f_dentry f_path.dentry
+
+/* The iomap DAX helpers, which have their current names since 4.10.
+ * Without them the dax mount option is refused. */
+#define SIMPLEFS_HAVE_DAX (IS_ENABLED(CONFIG_FS_DAX) && \
+			   LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0))
+
 /* A super block lock that must be used for any critical section operation on the sb,
  * such as: updating the free_blocks, inodes_count etc. */
 static DEFINE_MUTEX(simplefs_sb_lock);
 static DEFINE_MUTEX(simplefs_inodes_mgmt_lock);
-#if 1
-#define CDBG(fmt, args...) printk(fmt, ##args)
-#else
-#define CDBG(fmt, args...)
-#endif
+/* Serialises SIMPLEFS_IOC_GROW */
+static DEFINE_MUTEX(simplefs_resize_lock);
+/* Readers of extended attributes share it, changes to them and to the
+ * xattr block cache of a mount take it exclusively */
+static DECLARE_RWSEM(simplefs_xattr_sem);
+/* Page faults on DAX files share it; truncate and hole punching take it
+ * exclusively, so that no fault maps a block they are about to free */
+static DECLARE_RWSEM(simplefs_mmap_sem);
 /* FIXME: This can be moved to an in-memory structure of the simplefs_inode.
  * Because of the global nature of this lock, we cannot create
  * new children (without locking) in two different dirs at a time.
@@ -40,20 +74,79 @@ static DEFINE_MUTEX(simplefs_directory_children_update_lock);
 static struct kmem_cache *sfs_inode_cachep;
 static struct kmem_cache *sfs_entry_cachep;
 
+static enum simplefs_stat simplefs_lock_stat(struct mutex *lock)
+{
+	if (lock == &simplefs_sb_lock)
+		return SIMPLEFS_STAT_SB_LOCK_WAITS;
+	if (lock == &simplefs_inodes_mgmt_lock)
+		return SIMPLEFS_STAT_INODES_LOCK_WAITS;
+	if (lock == &simplefs_directory_children_update_lock)
+		return SIMPLEFS_STAT_DIR_LOCK_WAITS;
+	/* Otherwise the lock of an allocation group */
+	return SIMPLEFS_STAT_GROUP_LOCK_WAITS;
+}
+
+/* Take one of the mutexes above, charging the time spent waiting for it
+ * to sb's counters. Uncontended, this is just a trylock. */
+static int __simplefs_lock(struct super_block *sb, struct mutex *lock,
+			   bool interruptible)
+{
+	enum simplefs_stat stat;
+	u64 start;
+	int ret = 0;
+
+	if (mutex_trylock(lock))
+		return 0;
+
+	start = ktime_get_ns();
+	if (interruptible)
+		ret = mutex_lock_interruptible(lock);
+	else
+		mutex_lock(lock);
+
+	stat = simplefs_lock_stat(lock);
+	simplefs_stat_inc(sb, stat);
+	simplefs_stat_add(sb, stat + 1, ktime_get_ns() - start);
+	return ret;
+}
+
+static void simplefs_lock(struct super_block *sb, struct mutex *lock)
+{
+	__simplefs_lock(sb, lock, false);
+}
+
+static int simplefs_lock_interruptible(struct super_block *sb,
+				       struct mutex *lock)
+{
+	return __simplefs_lock(sb, lock, true);
+}
+
 /*Ŀ¼ÿһϢ*/
 struct simplefs_cache_entry {
 	struct simplefs_dir_record record;
 	struct list_head list;
+	/* Linked into simplefs_dir_cache->names while the entry is in use */
+	struct hlist_node hash;
 	int entry_no;
 };
 
+#define SIMPLEFS_DIR_HASH_BITS 6
+
 /*Ŀ¼*/
 struct simplefs_dir_cache {
 	uint64_t dir_children_count;
 	struct list_head used;
 	struct list_head free;
+	/* Used entries indexed by filename, so that lookup, unlink and
+	 * rename do not have to walk the used list */
+	DECLARE_HASHTABLE(names, SIMPLEFS_DIR_HASH_BITS);
 };
 
+static inline u32 simplefs_name_hash(const char *name)
+{
+	return jhash(name, strlen(name), 0);
+}
+
 
 
 static struct simplefs_dir_cache *simplefs_cache_alloc(void)
@@ -65,10 +158,28 @@ static struct simplefs_dir_cache *simplefs_cache_alloc(void)
 
     INIT_LIST_HEAD(&dir_cache->free);
     INIT_LIST_HEAD(&dir_cache->used);
+    hash_init(dir_cache->names);
 
     return dir_cache;
 }
 
+static void simplefs_cache_free(struct simplefs_dir_cache *dir_cache)
+{
+	struct simplefs_cache_entry *tmp, *cache_entry;
+
+	list_for_each_entry_safe(cache_entry, tmp, &dir_cache->free, list) {
+		list_del(&cache_entry->list);
+		kmem_cache_free(sfs_entry_cachep, cache_entry);
+	}
+
+	list_for_each_entry_safe(cache_entry, tmp, &dir_cache->used, list) {
+		list_del(&cache_entry->list);
+		kmem_cache_free(sfs_entry_cachep, cache_entry);
+	}
+
+	kfree(dir_cache);
+}
+
 /*         ˵
     dir_cache:
     			  ǰĿ¼Ļ
@@ -88,7 +199,7 @@ static int dir_cache_build(struct simplefs_dir_cache *dir_cache, struct buffer_h
 	//SIMPLEFS_MAX_CHILDREN_CNTĿ¼ִ֧Inode
 	//ΪĿǰDATA_BLOCKдŵĶsimplefs_dir_record
 	//ݿС/Entryֵ
-	for (i = 0; i < SIMPLEFS_DEFAULT_BLOCK_SIZE/sizeof(struct simplefs_dir_record); i++, record++) {
+	for (i = 0; i < bh->b_size / sizeof(struct simplefs_dir_record); i++, record++) {
 		//ΪĿ¼еÿһݷһ
 		cache_entry = kmem_cache_alloc(sfs_entry_cachep, GFP_KERNEL);
 		if (!cache_entry)
@@ -101,6 +212,9 @@ static int dir_cache_build(struct simplefs_dir_cache *dir_cache, struct buffer_h
 			//Ϊ0뵽Ŀ¼Ļеused
 			memcpy(&cache_entry->record, record, sizeof(struct simplefs_dir_record));
 			list_add_tail(&cache_entry->list, &dir_cache->used);
+			hash_add(dir_cache->names, &cache_entry->hash,
+				 simplefs_name_hash(record->filename));
+			dir_cache->dir_children_count++;
 		} else {
 			//Ϊ0˵InodeѾͷţ뵽Ŀ¼free
 			list_add_tail(&cache_entry->list, &dir_cache->free);
@@ -119,9 +233,11 @@ static int dir_cache_build(struct simplefs_dir_cache *dir_cache, struct buffer_h
 static struct simplefs_cache_entry *used_cache_entry_get(struct simplefs_dir_cache *dir_cache,struct dentry *dentry)
 {
 	struct simplefs_cache_entry *cache_entry;
+	const char *name = dentry->d_name.name;
 
-	list_for_each_entry(cache_entry, &dir_cache->used, list) {
-		if (!strcmp(cache_entry->record.filename, dentry->d_name.name)) {
+	hash_for_each_possible(dir_cache->names, cache_entry, hash,
+			       simplefs_name_hash(name)) {
+		if (!strcmp(cache_entry->record.filename, name)) {
 			return cache_entry;
 		}
 	}
@@ -137,7 +253,7 @@ static struct simplefs_cache_entry *used_cache_entry_get(struct simplefs_dir_cac
  */
 static struct simplefs_cache_entry *free_cache_entry_get(struct simplefs_dir_cache *dir_cache)
 {
-	return list_first_entry(&dir_cache->free, struct simplefs_cache_entry, list);
+	return list_first_entry_or_null(&dir_cache->free, struct simplefs_cache_entry, list);
 }
 
 /*         ˵
@@ -148,55 +264,438 @@ static struct simplefs_cache_entry *free_cache_entry_get(struct simplefs_dir_cac
     			  
  */
 
-static void cache_entry_insert(struct list_head *head, struct simplefs_cache_entry *cache_entry)
+static void cache_entry_insert(struct simplefs_dir_cache *dir_cache, struct simplefs_cache_entry *cache_entry)
 {
-	struct simplefs_cache_entry *tmp_entry;
-	list_del(&cache_entry->list);
+	list_move_tail(&cache_entry->list, &dir_cache->used);
+	hash_add(dir_cache->names, &cache_entry->hash,
+		 simplefs_name_hash(cache_entry->record.filename));
+	dir_cache->dir_children_count++;
+}
 
-	list_for_each_entry(tmp_entry, head, list) {
-		if (cache_entry->entry_no < tmp_entry->entry_no)
-			break;
+static void cache_entry_remove(struct simplefs_dir_cache *dir_cache, struct simplefs_cache_entry *cache_entry)
+{
+	hash_del(&cache_entry->hash);
+	memset(&cache_entry->record, 0, sizeof(cache_entry->record));
+	list_move(&cache_entry->list, &dir_cache->free);
+	dir_cache->dir_children_count--;
+}
+
+/* Check the checksum of a metadata block the first time it is read. A block
+ * found good is only ever changed together with its checksum, so as long
+ * as the buffer stays cached it is not checked again. Someone else may
+ * verify the block and start changing it while we compute the checksum,
+ * which is why a mismatch is only believed if the block is still not
+ * verified afterwards. */
+static bool simplefs_verify(struct super_block *sb, struct buffer_head *bh,
+			    uint32_t csum, size_t len, const char *what)
+{
+	if (buffer_simplefs_verified(bh))
+		return true;
+	if (simplefs_csum(bh->b_data, len) != csum &&
+	    !buffer_simplefs_verified(bh)) {
+		printk_ratelimited(KERN_ERR
+		       "simplefs: %s block [%llu] has a bad checksum, run fsck-simplefs\n",
+		       what, (unsigned long long)bh->b_blocknr);
+		return false;
+	}
+	set_buffer_simplefs_verified(bh);
+	return true;
+}
+
+static bool simplefs_dir_verify(struct super_block *sb, struct buffer_head *bh)
+{
+	return simplefs_verify(sb, bh, *simplefs_dir_csum(bh),
+			       SIMPLEFS_DIR_CSUM_OFFSET(bh->b_size), "directory");
+}
+
+/* Read a bitmap or the reference count table of a group, checked against
+ * its checksum in the group descriptor unless SIMPLEFS_SB_DIRTY says those
+ * cannot be trusted. NULL if it cannot be read or is corrupt. */
+static struct buffer_head *simplefs_group_bread(struct super_block *sb,
+		uint64_t block, const uint32_t *csum)
+{
+	struct buffer_head *bh = simplefs_bread(sb, block);
+
+	if (bh && !SIMPLEFS_SB(sb)->bitmaps_unverified &&
+	    !simplefs_verify(sb, bh, READ_ONCE(*csum), bh->b_size, "group")) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/* Returns the directory cache hanging off a directory dentry, building it
+ * from the directory's data block on first use. */
+static struct simplefs_dir_cache *simplefs_dir_cache_get(struct dentry *dentry)
+{
+	struct inode *dir = d_inode(dentry);
+	struct simplefs_dir_cache *dir_cache;
+	struct buffer_head *bh;
+	int ret;
+
+	dir_cache = READ_ONCE(dentry->d_fsdata);
+	if (dir_cache)
+		return dir_cache;
+
+	dir_cache = simplefs_cache_alloc();
+	if (IS_ERR(dir_cache))
+		return dir_cache;
+
+	bh = simplefs_bread(dir->i_sb, SIMPLEFS_INODE(dir)->data_block_number);
+	if (!bh) {
+		kfree(dir_cache);
+		return ERR_PTR(-EIO);
+	}
+	if (!simplefs_dir_verify(dir->i_sb, bh)) {
+		brelse(bh);
+		kfree(dir_cache);
+		return ERR_PTR(-EIO);
+	}
+	ret = dir_cache_build(dir_cache, bh);
+	brelse(bh);
+	simplefs_stat_inc(dir->i_sb, SIMPLEFS_STAT_DIR_CACHE_BUILD);
+	if (ret) {
+		simplefs_cache_free(dir_cache);
+		return ERR_PTR(ret);
+	}
+
+	/* Lookups run in parallel, so someone may have beaten us to it */
+	if (cmpxchg(&dentry->d_fsdata, NULL, dir_cache)) {
+		simplefs_cache_free(dir_cache);
+		dir_cache = dentry->d_fsdata;
+	}
+
+	return dir_cache;
+}
+
+/* Write one cached record back to its slot in the directory's data block */
+static int simplefs_dir_record_write(struct super_block *sb,
+				     struct simplefs_inode *dir,
+				     struct simplefs_cache_entry *cache_entry)
+{
+	struct buffer_head *bh;
+	struct simplefs_dir_record *record;
+
+	bh = simplefs_bread(sb, dir->data_block_number);
+	if (!bh)
+		return -EIO;
+	/* Normally verified already when the cache was built, but the buffer
+	 * may have been dropped since */
+	if (!simplefs_dir_verify(sb, bh)) {
+		brelse(bh);
+		return -EIO;
 	}
 
-	list_add_tail(&cache_entry->list, &tmp_entry->list);
+	record = (struct simplefs_dir_record *)bh->b_data;
+	record += cache_entry->entry_no;
+	memcpy(record, &cache_entry->record, sizeof(*record));
+	*simplefs_dir_csum(bh) = simplefs_csum(bh->b_data,
+					       SIMPLEFS_DIR_CSUM_OFFSET(bh->b_size));
+
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	brelse(bh);
+
+	return 0;
 }
 
 
 //ͬ
+/* Commit the super block. The free counts are only kept in the percpu
+ * counters while mounted and are folded into it here. Called with
+ * simplefs_sb_lock held. */
 void simplefs_sb_sync(struct super_block *vsb)
 {
 	struct buffer_head *bh;
-	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb)->sb;
+	uint64_t i;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+	struct simplefs_super_block *sb = sb_info->sb;
 	
-	bh = sb_bread(vsb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
-	BUG_ON(!bh);
+	/* sb points into this buffer, which we hold for the life of the mount */
+	bh = sb_info->bh;
+
+	sb->free_blocks = percpu_counter_sum_positive(&sb_info->free_blocks);
+	sb->inodes_count = sb->inodes_max -
+			   percpu_counter_sum_positive(&sb_info->free_inodes);
+	sb->checksum = simplefs_sb_csum(sb);
 
-	bh->b_data = (char *)sb;
 	/* ǻײΪ */
-	mark_buffer_dirty(bh);
+	simplefs_mark_dirty(vsb, bh);
 	/* Ȼͬ */
-	sync_dirty_buffer(bh);
-	/*ͷbhָ*/
+	simplefs_sync_buffer(vsb, bh);
+
+	/* The group descriptors are changed under the group locks and only
+	 * marked dirty there, they go out with the super block */
+	for (i = 0; i < sb->gdt_blocks; i++)
+		simplefs_sync_buffer(vsb, sb_info->gdt_bh[i]);
+}
+
+/* Read the inode table block that holds inode_no and point *slot at the
+ * inode's record inside it. The caller must brelse the returned bh. */
+static struct buffer_head *simplefs_itable_bread(struct super_block *sb,
+		uint64_t inode_no, struct simplefs_inode **slot)
+{
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb)->sb;
+	struct buffer_head *bh;
+	unsigned int index;
+	uint64_t block;
+
+	if (unlikely(inode_no < SIMPLEFS_START_INO || inode_no > sfs_sb->inodes_max)) {
+		printk(KERN_ERR "Inode number [%llu] is out of range\n", inode_no);
+		return NULL;
+	}
+
+	block = simplefs_itable_locate(sfs_sb, inode_no, &index);
+	bh = simplefs_bread(sb, block);
+	if (bh)
+		*slot = (struct simplefs_inode *)bh->b_data + index;
+	return bh;
+}
+
+/* The descriptor of group. Its buffer is held for the whole mount, so
+ * there is nothing to release; mark *bh dirty after changing it. */
+static struct simplefs_group_desc *simplefs_group_desc(struct super_block *sb,
+		uint64_t group, struct buffer_head **bh)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	unsigned int index;
+	uint64_t block;
+
+	block = simplefs_gdt_locate(sb_info->sb, group, &index);
+	*bh = sb_info->gdt_bh[block - sb_info->sb->gdt_block];
+	return (struct simplefs_group_desc *)(*bh)->b_data + index;
+}
+
+/* Mark a changed group descriptor dirty, with its checksum brought up to
+ * date. Called with the group's lock held. */
+static void simplefs_desc_dirty(struct super_block *sb,
+				struct simplefs_group_desc *desc,
+				struct buffer_head *gdt_bh)
+{
+	desc->checksum = simplefs_desc_csum(desc);
+	simplefs_mark_dirty(sb, gdt_bh);
+}
+
+/* Mark a changed bitmap or reference count block dirty and store its new
+ * checksum at csum in the group descriptor, which the caller marks dirty
+ * with simplefs_desc_dirty. Called with the group's lock held. */
+static void simplefs_group_block_dirty(struct super_block *sb,
+				       struct buffer_head *bh, uint32_t *csum)
+{
+	*csum = simplefs_csum(bh->b_data, bh->b_size);
+	simplefs_mark_dirty(sb, bh);
+}
+
+/* Once a group is down to this many free blocks or inodes, the bitmaps of
+ * the next one are read ahead for the allocations that will spill into it */
+#define SIMPLEFS_PREFETCH_LOW	64
+
+/* Start reading the bitmaps of group in the background. Mounting reads
+ * nothing but the super block and the group descriptors, this keeps the
+ * first allocation from a group from waiting for the disk. */
+static void simplefs_group_prefetch(struct super_block *sb, uint64_t group)
+{
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb)->sb;
+	uint64_t groups = READ_ONCE(sfs_sb->groups_count);
+
+	/* Pairs with the smp_wmb() in simplefs_grow */
+	smp_rmb();
+	if (group >= groups)
+		return;
+	simplefs_breadahead(sb, simplefs_group_bmap(sfs_sb, group));
+	simplefs_breadahead(sb, simplefs_group_imap(sfs_sb, group));
+}
+
+/* Find a free inode with an index in [first, end) of group's inode bitmap,
+ * a word at a time, and mark it in use. desc is the group's descriptor.
+ * Called with the group's lock held. */
+static int simplefs_imap_take(struct super_block *sb, uint64_t group,
+			      struct simplefs_group_desc *desc,
+			      unsigned long first, unsigned long end,
+			      unsigned long *out)
+{
+	struct buffer_head *bh;
+	unsigned long bit;
+
+	bh = simplefs_group_bread(sb, simplefs_group_imap(SIMPLEFS_SB(sb)->sb, group),
+				  &desc->imap_checksum);
+	if (!bh)
+		return -EIO;
+
+	bit = find_next_zero_bit_le(bh->b_data, end, first);
+	if (bit < end) {
+		__set_bit_le(bit, bh->b_data);
+		simplefs_group_block_dirty(sb, bh, &desc->imap_checksum);
+		*out = bit;
+	}
 	brelse(bh);
+
+	return bit < end ? 0 : -ENOSPC;
+}
+
+/* The group for a new directory: of those with at least the average number
+ * of free inodes and blocks, the one with the fewest directories, so that
+ * unrelated trees end up apart. The descriptors are read without their
+ * locks, a stale count only makes for a worse choice. */
+static uint64_t simplefs_find_group_dir(struct super_block *sb, uint64_t parent)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	uint64_t groups = READ_ONCE(sb_info->sb->groups_count);
+	uint64_t best = parent, best_dirs = U64_MAX, avefreei, avefreeb, i, g;
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh;
+
+	/* Pairs with the smp_wmb() in simplefs_grow */
+	smp_rmb();
+
+	avefreei = div64_u64(percpu_counter_read_positive(&sb_info->free_inodes),
+			     groups);
+	avefreeb = div64_u64(percpu_counter_read_positive(&sb_info->free_blocks),
+			     groups);
+
+	for (i = 1; i <= groups; i++) {
+		g = parent + i;
+		if (g >= groups)
+			g -= groups;
+
+		desc = simplefs_group_desc(sb, g, &bh);
+		if (!READ_ONCE(desc->free_inodes) ||
+		    READ_ONCE(desc->free_inodes) < avefreei ||
+		    READ_ONCE(desc->free_blocks) < avefreeb)
+			continue;
+		if (READ_ONCE(desc->dirs) < best_dirs) {
+			best = g;
+			best_dirs = READ_ONCE(desc->dirs);
+		}
+	}
+
+	return best;
 }
 
-struct simplefs_inode *simplefs_inode_search(struct super_block *sb,
-		struct simplefs_inode *start,
-		struct simplefs_inode *search)
+/* Pick an inode number for a new child of dir and mark it in use. Files go
+ * into the group, and if there is room the inode table block, of their
+ * parent, so that listing a directory reads few table blocks. Directories
+ * are spread over the groups. Within a group the lowest free inode is
+ * taken, searched for from the group's hint. Only the lock of the group
+ * being searched is held, so allocations in different groups run in
+ * parallel. */
+static int simplefs_inode_no_alloc(struct super_block *sb, struct inode *dir,
+				   umode_t mode, uint64_t *out)
 {
-	uint64_t count = 0;
-	//ÿݿ4KݿȫŵInodeInode£
-	int icount = SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode);
-	while (start->inode_no != search->inode_no && count < icount) {
-		count++;
-		start++;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_super_block *sfs_sb = sb_info->sb;
+	unsigned long ipb = SIMPLEFS_INODES_PER_BLOCK(sb->s_blocksize);
+	unsigned long ipg = sfs_sb->inodes_per_group, first, hint, index;
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh;
+	uint64_t parent, start, groups, i, g;
+	bool near = false;
+	int ret = -ENOSPC;
+
+	parent = simplefs_ino_group(sfs_sb, dir->i_ino);
+	start = S_ISDIR(mode) ? simplefs_find_group_dir(sb, parent) : parent;
+
+	/* Pairs with the smp_wmb() in simplefs_grow */
+	groups = READ_ONCE(sfs_sb->groups_count);
+	smp_rmb();
+	if (start >= groups)
+		start = 0;
+	for (i = 0; i < groups && ret == -ENOSPC; i++) {
+		g = start + i;
+		if (g >= groups)
+			g -= groups;
+
+		desc = simplefs_group_desc(sb, g, &bh);
+		if (!READ_ONCE(desc->free_inodes))
+			continue;
+
+		if (simplefs_lock_interruptible(sb, &sb_info->groups[g].lock)) {
+			sfs_trace("Failed to acquire mutex lock\n");
+			return -EINTR;
+		}
+		hint = desc->inode_hint < ipg ? desc->inode_hint : 0;
+
+		if (!S_ISDIR(mode) && g == parent) {
+			first = simplefs_ino_index(sfs_sb, dir->i_ino) / ipb * ipb;
+			ret = simplefs_imap_take(sb, g, desc, first, first + ipb,
+						 &index);
+			near = !ret;
+		}
+
+		if (ret == -ENOSPC) {
+			ret = simplefs_imap_take(sb, g, desc, hint, ipg, &index);
+			/* Only a stale hint, left by a crash, hides free inodes */
+			if (ret == -ENOSPC)
+				ret = simplefs_imap_take(sb, g, desc, 0, hint,
+							 &index);
+		}
+
+		if (!ret) {
+			if (!near || index == hint)
+				desc->inode_hint = index + 1;
+			desc->free_inodes--;
+			if (desc->free_inodes == SIMPLEFS_PREFETCH_LOW)
+				simplefs_group_prefetch(sb, g + 1);
+			if (S_ISDIR(mode))
+				desc->dirs++;
+			simplefs_desc_dirty(sb, desc, bh);
+			*out = g * ipg + index + 1;
+		}
+		mutex_unlock(&sb_info->groups[g].lock);
 	}
 
-	if (start->inode_no == search->inode_no) {
-		return start;
+	if (!ret) {
+		percpu_counter_dec(&sb_info->free_inodes);
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_INODE_ALLOC);
+		trace_simplefs_alloc_inode(dir, mode, *out, near);
 	}
 
-	return NULL;
+	return ret;
+}
+
+/* Mark inode_no free in the inode bitmap and give it back to its group.
+ * mode is that of the inode, directories are counted per group. */
+static void simplefs_imap_clear(struct super_block *sb, uint64_t inode_no,
+				umode_t mode)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	uint64_t group = simplefs_ino_group(sb_info->sb, inode_no);
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned int bit;
+
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	bh = simplefs_group_bread(sb, simplefs_imap_locate(sb_info->sb, inode_no, &bit),
+				  &desc->imap_checksum);
+	if (!bh) {
+		printk(KERN_ERR "Reading the inode bitmap of [%llu] failed\n", inode_no);
+		return;
+	}
+
+	simplefs_lock(sb, &sb_info->groups[group].lock);
+	if (__test_and_clear_bit_le(bit, bh->b_data)) {
+		desc->free_inodes++;
+		if (S_ISDIR(mode) && desc->dirs)
+			desc->dirs--;
+		if (bit < desc->inode_hint)
+			desc->inode_hint = bit;
+		simplefs_group_block_dirty(sb, bh, &desc->imap_checksum);
+		simplefs_desc_dirty(sb, desc, gdt_bh);
+		percpu_counter_inc(&sb_info->free_inodes);
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_INODE_FREE);
+	} else {
+		printk(KERN_ERR "Inode [%llu] was already free\n", inode_no);
+	}
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
+}
+
+/* Give back a number from simplefs_inode_no_alloc that never made it into
+ * the inode table */
+static void simplefs_inode_no_free(struct super_block *sb, uint64_t inode_no,
+				   umode_t mode)
+{
+	simplefs_imap_clear(sb, inode_no, mode);
 }
 		
 /*         ˵
@@ -209,44 +708,28 @@ struct simplefs_inode *simplefs_inode_search(struct super_block *sb,
 
 void simplefs_inode_add(struct super_block *vsb, struct simplefs_inode *inode)
 {
-	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
 	struct buffer_head *bh;
 	struct simplefs_inode *inode_iterator;
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
+	if (simplefs_lock_interruptible(vsb, &simplefs_inodes_mgmt_lock)) {
 		sfs_trace("Failed to acquire mutex lock\n");
 		return;
 	}
 
-	//InodeϢ
-	bh = sb_bread(vsb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
+	//ŸInodeϢInode
+	bh = simplefs_itable_bread(vsb, inode->inode_no, &inode_iterator);
 	BUG_ON(!bh);
-	//ΪδŵĶsimplefs_inodeĽṹǿת
-	inode_iterator = (struct simplefs_inode *)bh->b_data;
-
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return;
-	}
 
 	/* Append the new inode in the end in the inode store */
-	/*Ƚinode_iteratorָinode_noӦĴ洢*/
-	inode_iterator += inode->inode_no-1;
-	//InodeϢӦλ
+	//InodeϢӦλãInodeλͼڷInodeʱѾλ
 	memcpy(inode_iterator, inode, sizeof(struct simplefs_inode));
-	//еInode
-	sb_info->sb->inodes_count++;
-	//еInode bitmapĶӦλλ
-	set_bit(inode->inode_no, &sb_info->imap);
+	inode_iterator->checksum = simplefs_inode_csum(inode_iterator);
 
 	//ȽǰݿΪ࣬ȴд
-	mark_buffer_dirty(bh);
-	//ͬҲҪ
-	simplefs_sb_sync(vsb);
+	simplefs_mark_dirty(vsb, bh);
 	/*ͷInodeݿ*/
 	brelse(bh);
 
-	mutex_unlock(&simplefs_sb_lock);
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
 }
 
@@ -260,47 +743,35 @@ void simplefs_inode_add(struct super_block *vsb, struct simplefs_inode *inode)
 
 void simplefs_inode_del(struct super_block *vsb, struct simplefs_inode *inode)
 {
-	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
 	struct buffer_head *bh;
 	struct simplefs_inode *inode_iterator;
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
+	if (simplefs_lock_interruptible(vsb, &simplefs_inodes_mgmt_lock)) {
 		sfs_trace("Failed to acquire mutex lock\n");
 		return;
 	}
 
-	//InodeϢ
-	bh = sb_bread(vsb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
+	//ŸInodeϢInode
+	bh = simplefs_itable_bread(vsb, inode->inode_no, &inode_iterator);
 	BUG_ON(!bh);
-	//ΪδŵĶsimplefs_inodeĽṹǿת
-	inode_iterator = (struct simplefs_inode *)bh->b_data;
-
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return;
-	}
 
 	/* Append the new inode in the end in the inode store */
-	/*Ƚinode_iteratorָinode_noӦĴ洢*/
-	inode_iterator += inode->inode_no-1;
 	//InodeϢӦλ
 	memset(inode_iterator, 0x0, sizeof(struct simplefs_inode));
-	//еInodeԼ
-	sb_info->sb->inodes_count--;
-	//еInode bitmapĶӦλλ
-	clear_bit(inode->inode_no, &sb_info->imap);
 
 	//ȽǰݿΪ࣬ȴд
-	mark_buffer_dirty(bh);
-	//ͬҲҪ
-	simplefs_sb_sync(vsb);
+	simplefs_mark_dirty(vsb, bh);
 	/*ͷInodeݿ*/
 	brelse(bh);
 
-	mutex_unlock(&simplefs_sb_lock);
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	//InodeλͼĶӦλ
+	simplefs_imap_clear(vsb, inode->inode_no, inode->mode);
 }
 
+int simplefs_sb_flush_deferred(struct super_block *vsb);
+
 /* This function returns a blocknumber which is free.
  * The block will be removed from the freeblock list.
  *
@@ -309,146 +780,630 @@ void simplefs_inode_del(struct super_block *vsb, struct simplefs_inode *inode)
  *
  * If for some reason, the file creation/deletion failed, the block number
  * will still be marked as non-free. You need fsck to fix this.*/
-// sb->free_blocksӦBitλΪ1ô˵ӦݿУݿBusy
+// λͼÿһBitһݿ飬BitΪ1˵ӦݿѱռãΪ0
 
 /*         ˵
     vsb:
     			  
+    goal:
+    			  ݿInodeţڵз
     out:
     			  صĿݿ
     			  
  */
-int simplefs_sb_get_a_freeblock(struct super_block *vsb, uint64_t * out)
+/* Take the first free block of group at or after block from, wrapping
+ * around to the start of the group's data area. Returns -ENOSPC if the
+ * group is full. */
+static int simplefs_group_take_block(struct super_block *vsb, uint64_t group,
+				     uint64_t from, uint64_t *out)
 {
-	//ͨں˱׼SuperBlockṹȡضļϵͳSBṹ
-	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb)->sb;
-	int i;
-	int ret = 0;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+	struct simplefs_super_block *sb = sb_info->sb;
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned long bit, start, end;
+
+	/* Full groups are skipped without reading their bitmap */
+	desc = simplefs_group_desc(vsb, group, &gdt_bh);
+	if (!READ_ONCE(desc->free_blocks))
+		return -ENOSPC;
 
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
+	bh = simplefs_group_bread(vsb, simplefs_group_bmap(sb, group),
+				  &desc->bmap_checksum);
+	if (!bh)
+		return -EIO;
+	if (simplefs_lock_interruptible(vsb, &sb_info->groups[group].lock)) {
+		brelse(bh);
 		sfs_trace("Failed to acquire mutex lock\n");
-		ret = -EINTR;
-		goto end;
+		return -EINTR;
 	}
 
-	//ҪעǣݿǴӵ3ʼģԭǳ飬inodeϢڵѾļϵͳ
-	// sb->free_blocksеÿһBitһݿ
-	/* Loop until we find a free block. We start the loop from 3,
-	 * as all prior blocks will always be in use */
-	for (i = 3; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) {
-		//sb->free_blocksĶӦBitΪ0ζŵǰݿǿеĿʹ
-		if (sb->free_blocks & (1 << i)) {
-			break;
-		}
+	start = simplefs_group_data(sb, group) -
+		(group << simplefs_group_bits(sb));
+	end = simplefs_group_blocks(sb, group);
+	from -= group << simplefs_group_bits(sb);
+	if (from < start || from >= end)
+		from = start;
+	bit = find_next_zero_bit_le(bh->b_data, end, from);
+	if (bit >= end && from > start) {
+		bit = find_next_zero_bit_le(bh->b_data, from, start);
+		if (bit >= from)
+			bit = end;
 	}
-
-	//ѭ3~SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED,һȦûҵеݿ
-	//˵ļϵͳûʣĿռˣسϢ
-	if (unlikely(i == SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)) {
-		printk(KERN_ERR "No more free blocks available");
-		ret = -ENOSPC;
-		goto end;
+	if (bit >= end) {
+		mutex_unlock(&sb_info->groups[group].lock);
+		brelse(bh);
+		return -ENOSPC;
 	}
 
 	//ҵеݿ飬򷵻ظݿ
-	*out = i;
+	*out = (group << simplefs_group_bits(sb)) + bit;
 
-	//Ȼҵ˿еݿ飬ôҪsb->free_blocksĶӦBitλ
+	//Ȼҵ˿еݿ飬ôҪλͼжӦBitλд
 	/* Remove the identified block from the free list */
-	sb->free_blocks &= ~(1 << i);
-
-	//ǻҪӦݿΪdirtyд
-	simplefs_sb_sync(vsb);
+	__set_bit_le(bit, bh->b_data);
+	simplefs_group_block_dirty(vsb, bh, &desc->bmap_checksum);
+	simplefs_sync_buffer(vsb, bh);
+	desc->free_blocks--;
+	simplefs_desc_dirty(vsb, desc, gdt_bh);
+	if (desc->free_blocks == SIMPLEFS_PREFETCH_LOW)
+		simplefs_group_prefetch(vsb, group + 1);
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
 
-end:
-	mutex_unlock(&simplefs_sb_lock);
-	return ret;
+	percpu_counter_dec(&sb_info->free_blocks);
+	simplefs_stat_inc(vsb, SIMPLEFS_STAT_BLOCK_ALLOC);
+	return 0;
 }
 
-/*صǰļϵͳеInode*/
-static int simplefs_sb_get_objects_count(struct super_block *vsb,
-					 uint64_t * out)
+int simplefs_sb_get_a_freeblock(struct super_block *vsb, uint64_t goal,
+				uint64_t * out)
 {
-	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb)->sb;
+	//ͨں˱׼SuperBlockṹȡضļϵͳSBṹ
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+	struct simplefs_super_block *sb = sb_info->sb;
+	uint64_t i, first = 0, group, groups;
+	bool retried = false;
+	int ret;
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
+	/* Start in the group of the inode the block is for, so that a file's
+	 * data sits next to its inode */
+	if (goal >= SIMPLEFS_START_INO && goal <= sb->inodes_max)
+		first = simplefs_ino_group(sb, goal);
+
+retry:
+	/* Pairs with the smp_wmb() in simplefs_grow */
+	groups = READ_ONCE(sb->groups_count);
+	smp_rmb();
+	if (first >= groups)
+		first = 0;
+	for (i = 0; i < groups; i++) {
+		group = first + i;
+		if (group >= groups)
+			group -= groups;
+
+		ret = simplefs_group_take_block(vsb, group, 0, out);
+		if (ret != -ENOSPC)
+			return ret;
 	}
-	*out = sb->inodes_count;
-	mutex_unlock(&simplefs_inodes_mgmt_lock);
 
-	return 0;
+	//һȦûҵеݿ飬˵ļϵͳûʣĿռˣسϢ
+	/* Blocks may still be sitting on the deferred free list */
+	if (!retried && simplefs_sb_flush_deferred(vsb) > 0) {
+		retried = true;
+		goto retry;
+	}
+	printk(KERN_ERR "No more free blocks available");
+	return -ENOSPC;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-/*"ls"ָʱᱻȵ*/
-/*         ˵
-    filp:
-    			  ǰĿ¼ļָ
-    ctx:
-    			  ʾϢ
+/* Write back a bitmap block of group that freed of its bits were cleared
+ * in, credit them to the group and drop the group lock taken by
+ * simplefs_bmap_clear */
+static void simplefs_bmap_release(struct super_block *vsb, uint64_t group,
+				  struct buffer_head *bh, uint64_t freed)
+{
+	struct simplefs_group_desc *desc;
+	struct buffer_head *gdt_bh;
+
+	desc = simplefs_group_desc(vsb, group, &gdt_bh);
+	desc->free_blocks += freed;
+	simplefs_group_block_dirty(vsb, bh, &desc->bmap_checksum);
+	simplefs_desc_dirty(vsb, desc, gdt_bh);
+	simplefs_sync_buffer(vsb, bh);
+	mutex_unlock(&SIMPLEFS_SB(vsb)->groups[group].lock);
+	brelse(bh);
+}
 
-    ˵ӵǰĿ¼Ļȡʹõentryϱvfs
- */
-static int simplefs_iterate(struct file *filp, struct dir_context *ctx)
-#else
-static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
-#endif
+/* Clear the bitmap bits of [start, start + count) and credit them to their
+ * groups and free_blocks. Takes the group locks itself. Returns the number
+ * of blocks that were actually in use and are now free. */
+static uint64_t simplefs_bmap_clear(struct super_block *vsb, uint64_t start,
+				    uint64_t count)
 {
-	loff_t pos;
-	//ͨĿ¼ļָ룬ȡĿ¼ṹ
-	struct dentry *dentry = filp->f_path.dentry;
-	//ȡǰĿ¼Inode
-	struct inode * parent_inode = dentry->d_inode;
-	//Ŀ¼ָ
-	struct simplefs_dir_cache *dir_cache = NULL;
-	//ʱ¼еÿһļ
-	struct simplefs_cache_entry *cache_entry;
-	//ͨں˵inodeָȡضļϵͳinodeָ
-	struct simplefs_inode *parent = SIMPLEFS_INODE(parent_inode);
-	struct buffer_head *bh;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+	struct simplefs_super_block *sb = sb_info->sb;
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh = NULL, *gdt_bh;
+	uint64_t block, group = 0, freed = 0, group_freed = 0;
+	unsigned int bit;
+
+	for (block = start; block < start + count; block++) {
+		if (unlikely(block >= sb->blocks_count ||
+			     simplefs_block_is_meta(sb, block))) {
+			printk(KERN_ERR "Trying to free an invalid block [%llu]\n", block);
+			continue;
+		}
 
-	CDBG("dentry inode no: %d\n",parent_inode->i_ino);
-	
-	dir_cache = (struct simplefs_dir_cache *)dentry->d_fsdata;
-
-	//Ŀ¼Ļ治ڣΪĿ¼һµĻ
-	if (!dir_cache) {
-		CDBG("new simplefs_dir_cache\n");
-		//ΪǰĿ¼һ
-		dir_cache = simplefs_cache_alloc();
-		if (IS_ERR(dentry->d_fsdata))
-		    return -EINVAL;
-		//ӵǰĿ¼лȡϢ
-		bh = sb_bread(parent_inode->i_sb, parent->data_block_number);
-		BUG_ON(!bh);
-		//ΪǰĿ¼úͿ
-		dir_cache_build(dir_cache, bh);
-		brelse(bh);
+		if (!bh || simplefs_block_group(sb, block) != group) {
+			if (bh) {
+				simplefs_bmap_release(vsb, group, bh, group_freed);
+				freed += group_freed;
+			}
+			group = simplefs_block_group(sb, block);
+			group_freed = 0;
+			desc = simplefs_group_desc(vsb, group, &gdt_bh);
+			bh = simplefs_group_bread(vsb, simplefs_group_bmap(sb, group),
+						  &desc->bmap_checksum);
+			if (!bh) {
+				printk(KERN_ERR "Reading the block bitmap of group [%llu] failed\n",
+				       group);
+				break;
+			}
+			simplefs_lock(vsb, &sb_info->groups[group].lock);
+		}
+
+		simplefs_bmap_locate(sb, block, &bit);
+		if (__test_and_clear_bit_le(bit, bh->b_data))
+			group_freed++;
+		else
+			printk(KERN_ERR "Block [%llu] was already free\n", block);
 	}
-	dentry->d_fsdata = dir_cache;
 
-	pos = ctx->pos;
-	
-	if (pos) {
-		/* FIXME: We use a hack of reading pos to figure if we have filled in all data.
-		 * We should probably fix this to work in a cursor based model and
-		 * use the tokens correctly to not fill too many data in each cursor based call */
-		return 0;
+	if (bh) {
+		simplefs_bmap_release(vsb, group, bh, group_freed);
+		freed += group_freed;
 	}
 
-	list_for_each_entry(cache_entry, &dir_cache->used, list) {
-		dir_emit(ctx, cache_entry->record.filename, SIMPLEFS_FILENAME_MAXLEN,
+	percpu_counter_add(&sb_info->free_blocks, freed);
+	simplefs_stat_add(vsb, SIMPLEFS_STAT_BLOCK_FREE, freed);
+	return freed;
+}
+
+/* Hand a data block back to the free list, the reverse of
+ * simplefs_sb_get_a_freeblock */
+void simplefs_sb_put_a_freeblock(struct super_block *vsb, uint64_t block)
+{
+	simplefs_bmap_clear(vsb, block, 1);
+	simplefs_lock(vsb, &simplefs_sb_lock);
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+}
+
+/* A run of data blocks waiting on the deferred free list */
+struct simplefs_free_extent {
+	struct list_head list;
+	uint64_t start;
+	uint64_t count;
+};
+
+/* Freed blocks are merged into the bitmap at most this long after the
+ * unlink, or straight away once this many have piled up */
+#define SIMPLEFS_FREE_DELAY	(HZ)
+#define SIMPLEFS_FREE_BATCH	32
+
+/* Queue [start, start + count) to be returned to the free list later.
+ * Unlike simplefs_sb_put_a_freeblock this does no I/O, so removing a
+ * large tree costs one superblock write per batch instead of per file. */
+void simplefs_sb_defer_free(struct super_block *vsb, uint64_t start,
+			    uint64_t count)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB(vsb);
+	struct simplefs_free_extent *ext, *last;
+	unsigned int pending;
+	bool merged = false;
+
+	ext = kmalloc(sizeof(*ext), GFP_NOFS);
+	if (unlikely(!ext)) {
+		/* Nowhere to queue it, free it the slow way */
+		while (count--)
+			simplefs_sb_put_a_freeblock(vsb, start++);
+		return;
+	}
+	ext->start = start;
+	ext->count = count;
+
+	spin_lock(&sbi->free_lock);
+	/* Files are mostly deleted in the order they were created, so the
+	 * new run often extends the previous one */
+	if (!list_empty(&sbi->free_extents)) {
+		last = list_last_entry(&sbi->free_extents,
+				       struct simplefs_free_extent, list);
+		if (last->start + last->count == start) {
+			last->count += count;
+			merged = true;
+		} else if (start + count == last->start) {
+			last->start = start;
+			last->count += count;
+			merged = true;
+		}
+	}
+	if (!merged)
+		list_add_tail(&ext->list, &sbi->free_extents);
+	sbi->free_pending += count;
+	pending = sbi->free_pending;
+	spin_unlock(&sbi->free_lock);
+
+	if (merged)
+		kfree(ext);
+
+	if (pending >= SIMPLEFS_FREE_BATCH)
+		mod_delayed_work(system_wq, &sbi->free_work, 0);
+	else
+		schedule_delayed_work(&sbi->free_work, SIMPLEFS_FREE_DELAY);
+}
+
+static int simplefs_free_extent_cmp(void *priv, struct list_head *a,
+				    struct list_head *b)
+{
+	struct simplefs_free_extent *ea, *eb;
+
+	ea = list_entry(a, struct simplefs_free_extent, list);
+	eb = list_entry(b, struct simplefs_free_extent, list);
+
+	if (ea->start < eb->start)
+		return -1;
+	return ea->start > eb->start;
+}
+
+/* Merge everything on the deferred free list back into free_blocks with a
+ * single superblock write. Adjacent runs are coalesced first so that, with
+ * -o discard, the device sees as few and as large discards as possible.
+ * Returns the number of blocks that were freed. */
+int simplefs_sb_flush_deferred(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB(vsb);
+	struct simplefs_free_extent *ext, *next;
+	LIST_HEAD(batch);
+	int freed = 0;
+
+	spin_lock(&sbi->free_lock);
+	list_splice_init(&sbi->free_extents, &batch);
+	sbi->free_pending = 0;
+	spin_unlock(&sbi->free_lock);
+
+	if (list_empty(&batch))
+		return 0;
+
+	list_sort(NULL, &batch, simplefs_free_extent_cmp);
+	list_for_each_entry_safe(ext, next, &batch, list) {
+		if (&next->list != &batch &&
+		    ext->start + ext->count == next->start) {
+			next->start = ext->start;
+			next->count += ext->count;
+			list_del(&ext->list);
+			kfree(ext);
+		}
+	}
+
+	/* Discard before the blocks become allocatable again, otherwise we
+	 * could throw away data that was just written to them */
+	if (test_opt(sbi, DISCARD)) {
+		list_for_each_entry(ext, &batch, list)
+			sb_issue_discard(vsb, ext->start, ext->count, GFP_NOFS, 0);
+	}
+
+	list_for_each_entry_safe(ext, next, &batch, list) {
+		freed += simplefs_bmap_clear(vsb, ext->start, ext->count);
+		list_del(&ext->list);
+		kfree(ext);
+	}
+	simplefs_lock(vsb, &simplefs_sb_lock);
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return freed;
+}
+
+static void simplefs_free_worker(struct work_struct *work)
+{
+	struct simplefs_sb_info *sbi;
+
+	sbi = container_of(to_delayed_work(work), struct simplefs_sb_info,
+			   free_work);
+	simplefs_sb_flush_deferred(sbi->vfs_sb);
+}
+
+/* The entry of the block with index in its group's reference count table,
+ * or with alloc set the first free one if it has none. NULL if neither is
+ * there. Called with the group's lock held. */
+static struct simplefs_refcount *simplefs_refs_find(struct buffer_head *bh,
+						    unsigned int index,
+						    bool alloc)
+{
+	struct simplefs_refcount *ref = (struct simplefs_refcount *)bh->b_data;
+	struct simplefs_refcount *end = ref + bh->b_size / sizeof(*ref);
+	struct simplefs_refcount *free = NULL;
+
+	for (; ref < end; ref++) {
+		if (ref->index == index)
+			return ref;
+		if (!free && !ref->index)
+			free = ref;
+	}
+	return alloc ? free : NULL;
+}
+
+/* Whether a clone shares block with some other file. Only an owner of the
+ * block may ask: nobody else can make a block that it alone owns shared,
+ * so the group's count can be read without its lock. A read-only image
+ * has no clones, and no group descriptors loaded. */
+static bool simplefs_block_shared(struct super_block *sb, uint64_t block)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	uint64_t group = simplefs_block_group(sb_info->sb, block);
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned int index;
+	bool shared;
+
+	if (simplefs_read_only_image(sb))
+		return false;
+
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	if (!READ_ONCE(desc->shared_blocks))
+		return false;
+
+	bh = simplefs_group_bread(sb, simplefs_refs_locate(sb_info->sb, block, &index),
+				  &desc->refs_checksum);
+	/* Copying a block that is not shared is only a waste */
+	if (!bh)
+		return true;
+	simplefs_lock(sb, &sb_info->groups[group].lock);
+	shared = simplefs_refs_find(bh, index, false);
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
+
+	return shared;
+}
+
+/* Add an owner to block, which a clone is about to point at */
+static int simplefs_block_ref(struct super_block *sb, uint64_t block)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	uint64_t group = simplefs_block_group(sb_info->sb, block);
+	struct simplefs_group_desc *desc;
+	struct simplefs_refcount *ref;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned int index;
+	int ret = 0;
+
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	bh = simplefs_group_bread(sb, simplefs_refs_locate(sb_info->sb, block, &index),
+				  &desc->refs_checksum);
+	if (!bh)
+		return -EIO;
+
+	simplefs_lock(sb, &sb_info->groups[group].lock);
+	ref = simplefs_refs_find(bh, index, true);
+	if (!ref) {
+		/* The group has as many shared blocks as it can track */
+		ret = -ENOSPC;
+	} else if (ref->index) {
+		if (ref->count == U32_MAX)
+			ret = -EMLINK;
+		else
+			ref->count++;
+	} else {
+		ref->index = index;
+		ref->count = 2;
+		desc->shared_blocks++;
+	}
+	if (!ret) {
+		simplefs_group_block_dirty(sb, bh, &desc->refs_checksum);
+		simplefs_desc_dirty(sb, desc, gdt_bh);
+		simplefs_sync_buffer(sb, bh);
+	}
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
+
+	if (!ret)
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_BLOCK_CLONE);
+	return ret;
+}
+
+/* Drop an owner of block. Returns true if it was the last one and the
+ * block is to be freed. */
+static bool simplefs_block_unref(struct super_block *sb, uint64_t block)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	uint64_t group = simplefs_block_group(sb_info->sb, block);
+	struct simplefs_group_desc *desc;
+	struct simplefs_refcount *ref;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned int index;
+
+	/* As in simplefs_block_shared, the caller owns the block */
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	if (!READ_ONCE(desc->shared_blocks))
+		return true;
+
+	bh = simplefs_group_bread(sb, simplefs_refs_locate(sb_info->sb, block, &index),
+				  &desc->refs_checksum);
+	if (!bh) {
+		/* Leak it rather than free a block another file may use */
+		printk(KERN_ERR "Reading the reference counts of block [%llu] failed\n",
+		       block);
+		return false;
+	}
+
+	simplefs_lock(sb, &sb_info->groups[group].lock);
+	ref = simplefs_refs_find(bh, index, false);
+	if (ref) {
+		if (--ref->count < 2) {
+			memset(ref, 0, sizeof(*ref));
+			desc->shared_blocks--;
+		}
+		simplefs_group_block_dirty(sb, bh, &desc->refs_checksum);
+		simplefs_desc_dirty(sb, desc, gdt_bh);
+		simplefs_sync_buffer(sb, bh);
+	}
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
+
+	return !ref;
+}
+
+/* Drop a file's reference to its data block, which is freed once no clone
+ * shares it any more */
+static void simplefs_block_release(struct super_block *sb, uint64_t block)
+{
+	if (simplefs_block_unref(sb, block))
+		simplefs_sb_defer_free(sb, block, 1);
+}
+
+/*صǰļϵͳеInode*/
+/* Exact, unlike what statfs reports, so that a create never picks an
+ * inode number past the end of the table */
+static int simplefs_sb_get_objects_count(struct super_block *vsb,
+					 uint64_t * out)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+
+	*out = sb_info->sb->inodes_max -
+	       percpu_counter_sum_positive(&sb_info->free_inodes);
+
+	return 0;
+}
+
+static struct inode *simplefs_iget(struct super_block *sb, uint64_t inode_no);
+
+static bool simplefs_ino_valid(struct super_block *sb, uint64_t inode_no)
+{
+	return inode_no >= SIMPLEFS_START_INO &&
+	       inode_no <= SIMPLEFS_SB(sb)->sb->inodes_max;
+}
+
+/* A listing is usually followed by a lookup and a stat of every entry
+ * (ls -l), each of which would read its inode table block on its own.
+ * Read the blocks of the children not in the inode cache ahead in one
+ * plugged batch, then instantiate their inodes from the buffer cache. */
+static void simplefs_iterate_prefetch(struct super_block *sb,
+				      struct simplefs_dir_cache *dir_cache)
+{
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb)->sb;
+	struct simplefs_cache_entry *cache_entry;
+	struct blk_plug plug;
+	struct inode *inode;
+	uint64_t inode_no, block, last = 0;
+	unsigned int index;
+	bool missing = false;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(cache_entry, &dir_cache->used, list) {
+		inode_no = cache_entry->record.inode_no;
+		if (!simplefs_ino_valid(sb, inode_no))
+			continue;
+		inode = ilookup(sb, inode_no);
+		if (inode) {
+			iput(inode);
+			continue;
+		}
+		missing = true;
+		/* Children allocated together share table blocks */
+		block = simplefs_itable_locate(sfs_sb, inode_no, &index);
+		if (block != last)
+			simplefs_breadahead(sb, block);
+		last = block;
+	}
+	blk_finish_plug(&plug);
+
+	if (!missing)
+		return;
+
+	/* Errors are left for the lookup to report */
+	list_for_each_entry(cache_entry, &dir_cache->used, list) {
+		inode_no = cache_entry->record.inode_no;
+		if (!simplefs_ino_valid(sb, inode_no))
+			continue;
+		inode = simplefs_iget(sb, inode_no);
+		if (!IS_ERR(inode))
+			iput(inode);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+/*"ls"ָʱᱻȵ*/
+/*         ˵
+    filp:
+    			  ǰĿ¼ļָ
+    ctx:
+    			  ʾϢ
+
+    ˵ӵǰĿ¼Ļȡʹõentryϱvfs
+ */
+static int simplefs_iterate(struct file *filp, struct dir_context *ctx)
+#else
+static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+#endif
+{
+	loff_t pos;
+	//ͨĿ¼ļָ룬ȡĿ¼ṹ
+	struct dentry *dentry = filp->f_path.dentry;
+	//ȡǰĿ¼Inode
+	struct inode * parent_inode = dentry->d_inode;
+	//Ŀ¼ָ
+	struct simplefs_dir_cache *dir_cache = NULL;
+	//ʱ¼еÿһļ
+	struct simplefs_cache_entry *cache_entry;
+	u64 start = ktime_get_ns();
+	unsigned int emitted = 0;
+
+	dir_cache = simplefs_dir_cache_get(dentry);
+	if (IS_ERR(dir_cache))
+		return PTR_ERR(dir_cache);
+
+	pos = ctx->pos;
+	
+	if (pos) {
+		/* FIXME: We use a hack of reading pos to figure if we have filled in all data.
+		 * We should probably fix this to work in a cursor based model and
+		 * use the tokens correctly to not fill too many data in each cursor based call */
+		goto out;
+	}
+
+	list_for_each_entry(cache_entry, &dir_cache->used, list) {
+		dir_emit(ctx, cache_entry->record.filename, SIMPLEFS_FILENAME_MAXLEN,
 			cache_entry->record.inode_no, DT_UNKNOWN);		
 		ctx->pos += sizeof(struct simplefs_dir_record);
 		pos += sizeof(struct simplefs_dir_record);
+		emitted++;
 	}
 
+	simplefs_iterate_prefetch(parent_inode->i_sb, dir_cache);
 
+out:
+	trace_simplefs_iterate(parent_inode, ctx->pos, emitted);
+	simplefs_latency_add(parent_inode->i_sb, SIMPLEFS_OP_ITERATE, start);
 	return 0;
 }
 
+/* Check an inode just copied out of the inode table. A free slot is all
+ * zeroes and has no checksum, simplefs_iget tells those apart. Frees the
+ * copy and returns NULL if it is corrupt. */
+static struct simplefs_inode *simplefs_inode_verify(struct simplefs_inode *inode)
+{
+	if (inode && inode->inode_no &&
+	    inode->checksum != simplefs_inode_csum(inode)) {
+		printk_ratelimited(KERN_ERR
+		       "simplefs: inode [%llu] has a bad checksum, run fsck-simplefs\n",
+		       inode->inode_no);
+		kmem_cache_free(sfs_inode_cachep, inode);
+		return NULL;
+	}
+	return inode;
+}
+
 /* This functions returns a simplefs_inode with the given inode_no
  * from the inode store, if it exists. */
 //InodeʼʼInodeŲѯӦInodeϢء
@@ -463,39 +1418,249 @@ struct simplefs_inode *simplefs_get_inode(struct super_block *sb,
 	/* The inode store can be read once and kept in memory permanently while mounting.
 	 * But such a model will not be scalable in a filesystem with
 	 * millions or billions of files (inodes) */
-	//ָInodeʼ
-	bh = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	BUG_ON(!bh);
-	//ǿתΪsimplefs_inode͵ָ
-	sfs_inode = (struct simplefs_inode *)bh->b_data;
-	
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
+	//ҵŸInodeInode
+	/*  
+	 *  ڵ ռ1InodeInodeŷ
+	 */
+	bh = simplefs_itable_bread(sb, inode_no, &sfs_inode);
+	if (!bh)
+		return NULL;
+
+	/* Nobody saves inodes of a read-only image behind our back */
+	if (simplefs_read_only_image(sb)) {
+		inode_buffer = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+		if (inode_buffer)
+			memcpy(inode_buffer, sfs_inode, sizeof(*inode_buffer));
+		brelse(bh);
+		return simplefs_inode_verify(inode_buffer);
+	}
+
+	if (simplefs_lock_interruptible(sb, &simplefs_inodes_mgmt_lock)) {
 		printk(KERN_ERR "Failed to acquire mutex lock %s +%d\n",
 		       __FILE__, __LINE__);
+		brelse(bh);
 		return NULL;
 	}
 
-	if(inode_no == 0)
-	{
-		printk("%s invalid inode_no\n",__func__);
-	}
-	
 	//һеInode棬еInodeϢ
 	inode_buffer = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
-	//InodeϢǰ˳ŵ
-	/*  
-	 *  ڵ ռ1InodeInodeŷ
-	 */
-	sfs_inode += inode_no-1;
+	if (!inode_buffer) {
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		brelse(bh);
+		return NULL;
+	}
 	memcpy(inode_buffer, sfs_inode, sizeof(struct simplefs_inode));
 	
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
 	brelse(bh);
-	return inode_buffer;
+	return simplefs_inode_verify(inode_buffer);
+}
+
+/* LZ4 from lib/lz4, whose interface changed in 4.11. Without it compressed
+ * files cannot be read and compress=lz4 is refused. */
+#define SIMPLEFS_HAVE_LZ4 (IS_ENABLED(CONFIG_LZ4_COMPRESS) && \
+			   IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+
+#if SIMPLEFS_HAVE_LZ4
+/* Room the output of compressing len bytes may need */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define SIMPLEFS_LZ4_BOUND(len) LZ4_COMPRESSBOUND(len)
+#else
+#define SIMPLEFS_LZ4_BOUND(len) lz4_compressbound(len)
+#endif
+
+/* The compressed size, 0 if it is larger than max */
+static size_t simplefs_lz4_compress(const void *src, size_t len, void *dst,
+				    size_t max, void *wrkmem)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return LZ4_compress_default(src, dst, len, max, wrkmem);
+#else
+	size_t out;
+
+	if (lz4_compress(src, len, dst, &out, wrkmem) || out > max)
+		return 0;
+	return out;
+#endif
+}
+
+static int simplefs_lz4_decompress(const void *src, size_t src_len,
+				   void *dst, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	if (LZ4_decompress_safe(src, dst, src_len, len) != len)
+		return -EIO;
+#else
+	size_t out = len;
+
+	if (lz4_decompress_unknownoutputsize(src, src_len, dst, &out) ||
+	    out != len)
+		return -EIO;
+#endif
+	return 0;
+}
+#else
+#define SIMPLEFS_LZ4_BOUND(len) (len)
+
+static size_t simplefs_lz4_compress(const void *src, size_t len, void *dst,
+				    size_t max, void *wrkmem)
+{
+	return 0;
+}
+
+static int simplefs_lz4_decompress(const void *src, size_t src_len,
+				   void *dst, size_t len)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* A file may be larger than a block, and so compressed, if it already is or
+ * compression is on for the mount and not turned off for the file */
+static bool simplefs_may_compress(struct inode *inode)
+{
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+
+	if (sfs_inode->flags & SIMPLEFS_INODE_LZ4)
+		return true;
+	return test_opt(SIMPLEFS_SB(inode->i_sb), COMPRESS) &&
+	       !(sfs_inode->flags & SIMPLEFS_INODE_NOCOMPRESS);
+}
+
+/* Read all of a file into buf, which has room for the largest one:
+ * decompressed, copied from its block, or zeroes for a hole */
+static int simplefs_file_load(struct super_block *sb,
+			      struct simplefs_inode *sfs_inode, char *buf)
+{
+	bool lz4 = sfs_inode->flags & SIMPLEFS_INODE_LZ4;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (sfs_inode->file_size > (lz4 ? sb->s_maxbytes : sb->s_blocksize) ||
+	    sfs_inode->compressed_size > sb->s_blocksize ||
+	    sfs_inode->data_offset + (lz4 ? sfs_inode->compressed_size
+					  : sfs_inode->file_size) > sb->s_blocksize) {
+		printk(KERN_ERR "simplefs: inode %llu has a bad size\n",
+		       sfs_inode->inode_no);
+		return -EIO;
+	}
+
+	if (!sfs_inode->data_block_number) {
+		memset(buf, 0, sfs_inode->file_size);
+		return 0;
+	}
+
+	bh = simplefs_bread(sb, sfs_inode->data_block_number);
+	if (!bh)
+		return -EIO;
+	if (lz4)
+		ret = simplefs_lz4_decompress(bh->b_data + sfs_inode->data_offset,
+					      sfs_inode->compressed_size, buf,
+					      sfs_inode->file_size);
+	else
+		memcpy(buf, bh->b_data + sfs_inode->data_offset,
+		       sfs_inode->file_size);
+	brelse(bh);
+
+	if (ret)
+		printk(KERN_ERR "simplefs: inode %llu cannot be decompressed\n",
+		       sfs_inode->inode_no);
+	return ret;
+}
+
+/* Decompress a file into its page cache, where reads find it until the
+ * file changes. Called with the inode locked, unless the image is
+ * read-only. */
+static int simplefs_fill_cache(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct address_space *mapping = inode->i_mapping;
+	loff_t size = sfs_inode->file_size, pos;
+	struct page *page;
+	char *buf, *kaddr;
+	size_t n;
+	int ret;
+
+	buf = vmalloc(sb->s_maxbytes);
+	if (!buf)
+		return -ENOMEM;
+	ret = simplefs_file_load(sb, sfs_inode, buf);
+
+	for (pos = 0; !ret && pos < size; pos += PAGE_SIZE) {
+		page = find_or_create_page(mapping, pos >> PAGE_SHIFT,
+					   mapping_gfp_mask(mapping));
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (!PageUptodate(page)) {
+			n = min_t(loff_t, PAGE_SIZE, size - pos);
+			kaddr = kmap(page);
+			memcpy(kaddr, buf + pos, n);
+			memset(kaddr + n, 0, PAGE_SIZE - n);
+			kunmap(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		put_page(page);
+	}
+	vfree(buf);
+
+	if (!ret)
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_DECOMPRESS);
+	return ret;
+}
+
+/* Reads of a compressed file are served from the page cache, and a miss
+ * fills it with the whole file */
+static ssize_t simplefs_cached_read(struct inode *inode, char __user *buf,
+				    size_t len, loff_t *ppos)
+{
+	struct address_space *mapping = inode->i_mapping;
+	size_t copied = 0, offset, n;
+	struct page *page;
+	char *kaddr;
+	int ret;
+
+	while (copied < len && *ppos < i_size_read(inode)) {
+		page = find_get_page(mapping, *ppos >> PAGE_SHIFT);
+		if (!page || !PageUptodate(page)) {
+			if (page)
+				put_page(page);
+			/* Filling twice is harmless, only changes need
+			 * keeping out */
+			if (simplefs_read_only_image(inode->i_sb)) {
+				ret = simplefs_fill_cache(inode);
+			} else {
+				inode_lock(inode);
+				ret = simplefs_fill_cache(inode);
+				inode_unlock(inode);
+			}
+			if (ret)
+				return copied ? copied : ret;
+			/* The size may have changed meanwhile */
+			continue;
+		}
+
+		offset = *ppos & ~PAGE_MASK;
+		n = min_t(loff_t, min_t(size_t, PAGE_SIZE - offset, len - copied),
+			  i_size_read(inode) - *ppos);
+		kaddr = kmap(page);
+		ret = copy_to_user(buf + copied, kaddr + offset, n);
+		kunmap(page);
+		put_page(page);
+		if (ret)
+			return copied ? copied : -EFAULT;
+		copied += n;
+		*ppos += n;
+	}
+
+	return copied;
 }
 
-ssize_t simplefs_read(struct file * filp, char __user * buf, size_t len,
-		      loff_t * ppos)
+static ssize_t __simplefs_read(struct file * filp, char __user * buf, size_t len,
+			       loff_t * ppos)
 {
 	/* After the commit dd37978c5 in the upstream linux kernel,
 	 * we can use just filp->f_inode instead of the
@@ -507,14 +1672,29 @@ ssize_t simplefs_read(struct file * filp, char __user * buf, size_t len,
 	char *buffer;
 	int nbytes;
 
+	/* Compressed files are read through the page cache */
+	if (inode->flags & SIMPLEFS_INODE_LZ4)
+		return simplefs_cached_read(filp->f_path.dentry->d_inode, buf,
+					    len, ppos);
+
 	//ҪݵƫƳ˸InodeĴСôֱӷضȡΪ0
 	if (*ppos >= inode->file_size) {
 		/* Read request with offset beyond the filesize */
 		return 0;
 	}
+	//ȻǶҪǵпȡĳȻᳬInodeĴСҪȡеֵ
+	nbytes = min((size_t) (inode->file_size - *ppos), len);
+
+	/* A file without a block is a hole, it reads as zeroes without I/O */
+	if (!inode->data_block_number) {
+		if (clear_user(buf, nbytes))
+			return -EFAULT;
+		*ppos += nbytes;
+		return nbytes;
+	}
 
 	//õInodeȡ
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb,
+	bh = simplefs_bread(filp->f_path.dentry->d_inode->i_sb,
 					    inode->data_block_number);
 
 	if (!bh) {
@@ -523,9 +1703,7 @@ ssize_t simplefs_read(struct file * filp, char __user * buf, size_t len,
 		return 0;
 	}
 	//ǿתΪChar*
-	buffer = (char *)bh->b_data;
-	//ȻǶҪǵпȡĳȻᳬInodeĴСҪȡеֵ
-	nbytes = min((size_t) inode->file_size, len);
+	buffer = (char *)bh->b_data + inode->data_offset + *ppos;
 	//Inodeȡݴݸû
 	if (copy_to_user(buf, buffer, nbytes)) {
 		brelse(bh);
@@ -546,28 +1724,28 @@ int simplefs_inode_save(struct super_block *sb, struct simplefs_inode *sfs_inode
 {
 	struct simplefs_inode *inode_iterator;
 	struct buffer_head *bh;
-	//ȶȡInode
-	bh = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	BUG_ON(!bh);
+	//ȶȡŸInodeInode
+	bh = simplefs_itable_bread(sb, sfs_inode->inode_no, &inode_iterator);
+	if (!bh)
+		return -EIO;
 
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
+	if (simplefs_lock_interruptible(sb, &simplefs_sb_lock)) {
 		sfs_trace("Failed to acquire mutex lock\n");
+		brelse(bh);
 		return -EINTR;
 	}
-	//InodeƥҪµInode
-	inode_iterator = simplefs_inode_search(sb,
-		(struct simplefs_inode *)bh->b_data,
-		sfs_inode);
 
-	if (likely(inode_iterator)) {
+	//ȷInodeжӦλȷʵҪµInode
+	if (likely(inode_iterator->inode_no == sfs_inode->inode_no)) {
 		/*Inode*/
 		memcpy(inode_iterator, sfs_inode, sizeof(*inode_iterator));
-		CDBG(KERN_INFO "The inode updated\n");
+		inode_iterator->checksum = simplefs_inode_csum(inode_iterator);
 		//InodeΪDirtyͬ
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
+		simplefs_mark_dirty(sb, bh);
+		simplefs_sync_buffer(sb, bh);
 	} else {
 		mutex_unlock(&simplefs_sb_lock);
+		brelse(bh);
 		printk(KERN_ERR
 		       "The new filesize could not be stored to the inode.");
 		return -EIO;
@@ -580,10 +1758,283 @@ int simplefs_inode_save(struct super_block *sb, struct simplefs_inode *sfs_inode
 	return 0;
 }
 
+/* Newly allocated blocks may hold whatever a deleted file left behind
+ * (mkfs does not zero the data area either), so clear them on disk
+ * before anyone can read them. The block of a new directory gets the
+ * checksum of an empty one. */
+static int simplefs_zero_block(struct super_block *sb, uint64_t block,
+			       bool dir)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, block);
+	if (!bh)
+		return -EIO;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	if (dir) {
+		*simplefs_dir_csum(bh) = simplefs_csum(bh->b_data,
+				SIMPLEFS_DIR_CSUM_OFFSET(bh->b_size));
+		set_buffer_simplefs_verified(bh);
+	} else {
+		clear_buffer_simplefs_verified(bh);
+	}
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/* Point a file at block, a fresh copy of its data block, and release the
+ * old one. On failure block is left to the caller to free. */
+static int simplefs_inode_move(struct super_block *sb,
+			       struct simplefs_inode *sfs_inode, uint64_t block)
+{
+	uint64_t old = sfs_inode->data_block_number;
+	struct buffer_head *from, *to;
+	int ret;
+
+	from = simplefs_bread(sb, old);
+	to = from ? sb_getblk(sb, block) : NULL;
+	if (!to) {
+		brelse(from);
+		return -EIO;
+	}
+	lock_buffer(to);
+	memcpy(to->b_data, from->b_data, to->b_size);
+	set_buffer_uptodate(to);
+	unlock_buffer(to);
+	simplefs_mark_dirty(sb, to);
+	simplefs_sync_buffer(sb, to);
+	brelse(to);
+	brelse(from);
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->data_block_number = block;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret)
+		sfs_inode->data_block_number = old;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		return ret;
+
+	simplefs_block_release(sb, old);
+	return 0;
+}
+
+/* Copy on write: before a file changes a block it shares with a clone, move
+ * it to a copy of its own */
+static int simplefs_inode_unshare(struct super_block *sb,
+				  struct simplefs_inode *sfs_inode)
+{
+	uint64_t old = sfs_inode->data_block_number, block;
+	int ret;
+
+	if (!old || !simplefs_block_shared(sb, old))
+		return 0;
+
+	ret = simplefs_sb_get_a_freeblock(sb, sfs_inode->inode_no, &block);
+	if (ret < 0)
+		return ret;
+
+	ret = simplefs_inode_move(sb, sfs_inode, block);
+	if (ret) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		return ret;
+	}
+
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_BLOCK_COW);
+	return 0;
+}
+
+/* See simplefs_mmap_sem. Only DAX files can be mapped. */
+static void simplefs_mmap_lock(struct inode *inode)
+{
+	if (IS_DAX(inode))
+		down_write(&simplefs_mmap_sem);
+}
+
+static void simplefs_mmap_unlock(struct inode *inode)
+{
+	if (IS_DAX(inode))
+		up_write(&simplefs_mmap_sem);
+}
+
+#if SIMPLEFS_HAVE_DAX
+static const struct iomap_ops simplefs_iomap_ops;
+#endif
+
+/* Clear [from, to) of a file's block, e.g. the tail a truncate cuts off.
+ * A block shared with a clone is copied first. */
+static int simplefs_zero_range(struct inode *inode, loff_t from, loff_t to)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct buffer_head *bh;
+	int ret;
+
+#if SIMPLEFS_HAVE_DAX
+	/* DAX writes bypass the buffer cache, whose copy may be stale */
+	if (IS_DAX(inode))
+		return iomap_zero_range(inode, from, to - from, NULL,
+					&simplefs_iomap_ops);
+#endif
+
+	ret = simplefs_inode_unshare(sb, sfs_inode);
+	if (ret)
+		return ret;
+
+	bh = simplefs_bread(sb, sfs_inode->data_block_number);
+	if (!bh)
+		return -EIO;
+	memset(bh->b_data + from, 0, to - from);
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/* st_blocks, in 512 byte units: a file has its one block or is a hole */
+static void simplefs_update_blocks(struct inode *inode)
+{
+	inode->i_blocks = SIMPLEFS_INODE(inode)->data_block_number ?
+			  inode->i_sb->s_blocksize >> 9 : 0;
+}
+
+/* Give a file that has no data block (a hole) a fresh, zeroed one */
+static int simplefs_inode_alloc_block(struct super_block *sb,
+				      struct simplefs_inode *sfs_inode)
+{
+	uint64_t block;
+	int ret;
+
+	ret = simplefs_sb_get_a_freeblock(sb, sfs_inode->inode_no, &block);
+	if (ret < 0)
+		return ret;
+
+	ret = simplefs_zero_block(sb, block, false);
+	if (ret) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		return ret;
+	}
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->data_block_number = block;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	return ret;
+}
+
+/* Replace the data of a file with its first size bytes, after copying len
+ * bytes from ubuf (if any) to pos. Compressed files are always rewritten
+ * whole through here, as are files that outgrow their block; the data is
+ * compressed when it is larger than a block. It goes to a new block and the
+ * inode is only switched over once that is written, so that a crash leaves
+ * the old or the new file and a block shared with a clone is left alone.
+ * Called with the inode locked. */
+static int simplefs_file_rewrite(struct inode *inode, const char __user *ubuf,
+				 loff_t pos, size_t len, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_inode saved = *sfs_inode;
+	uint64_t block;
+	struct buffer_head *bh;
+	char *data, *packed;
+	void *wrkmem = NULL;
+	size_t packed_len = size;
+	int ret;
+
+	if (size > sb->s_blocksize && !simplefs_may_compress(inode))
+		return -ENOSPC;
+
+	packed = data = vzalloc(sb->s_maxbytes);
+	if (!data)
+		return -ENOMEM;
+	ret = simplefs_file_load(sb, sfs_inode, data);
+	if (ret)
+		goto out;
+	if (ubuf && copy_from_user(data + pos, ubuf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (size > sb->s_blocksize) {
+		packed = vmalloc(SIMPLEFS_LZ4_BOUND(size));
+		wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+		if (!packed || !wrkmem) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		packed_len = simplefs_lz4_compress(data, size, packed,
+						   sb->s_blocksize, wrkmem);
+		if (!packed_len) {
+			ret = -ENOSPC;
+			goto out;
+		}
+	}
+
+	ret = simplefs_sb_get_a_freeblock(sb, sfs_inode->inode_no, &block);
+	if (ret < 0)
+		goto out;
+	bh = sb_getblk(sb, block);
+	if (!bh) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		ret = -EIO;
+		goto out;
+	}
+	lock_buffer(bh);
+	memcpy(bh->b_data, packed, packed_len);
+	memset(bh->b_data + packed_len, 0, bh->b_size - packed_len);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	brelse(bh);
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->data_block_number = block;
+	sfs_inode->file_size = size;
+	if (packed != data) {
+		sfs_inode->flags |= SIMPLEFS_INODE_LZ4;
+		sfs_inode->compressed_size = packed_len;
+	} else {
+		sfs_inode->flags &= ~SIMPLEFS_INODE_LZ4;
+		sfs_inode->compressed_size = 0;
+	}
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret)
+		*sfs_inode = saved;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		goto out;
+	}
+
+	if (saved.data_block_number)
+		simplefs_block_release(sb, saved.data_block_number);
+	i_size_write(inode, size);
+	simplefs_update_blocks(inode);
+	truncate_inode_pages(inode->i_mapping, 0);
+	if (packed != data)
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_COMPRESS);
+out:
+	if (packed != data)
+		vfree(packed);
+	vfree(wrkmem);
+	vfree(data);
+	return ret;
+}
+
 /* FIXME: The write support is rudimentary. I have not figured out a way to do writes
  * from particular offsets (even though I have written some untested code for this below) efficiently. */
-ssize_t simplefs_write(struct file * filp, const char __user * buf, size_t len,
-		       loff_t * ppos)
+static ssize_t __simplefs_write(struct file * filp, const char __user * buf,
+				size_t len, loff_t * ppos)
 {
 	/* After the commit dd37978c5 in the upstream linux kernel,
 	 * we can use just filp->f_inode instead of the
@@ -609,13 +2060,50 @@ ssize_t simplefs_write(struct file * filp, const char __user * buf, size_t len,
 	sfs_inode = SIMPLEFS_INODE(inode);
 	//ͨInodeõSuperBlock
 	sb = inode->i_sb;
+
+	/* A file cannot grow beyond one block, unless it is compressed and
+	 * then only as far as what compresses into one */
+	if (*ppos + len > sb->s_blocksize &&
+	    (!simplefs_may_compress(inode) || *ppos + len > sb->s_maxbytes))
+		return -ENOSPC;
+
+	inode_lock(inode);
+	if (*ppos + len > sb->s_blocksize ||
+	    (sfs_inode->flags & SIMPLEFS_INODE_LZ4)) {
+		retval = simplefs_file_rewrite(inode, buf, *ppos, len,
+					       max_t(loff_t, *ppos + len,
+						     sfs_inode->file_size));
+		if (!retval) {
+			*ppos += len;
+			retval = len;
+		}
+		inode_unlock(inode);
+		return retval;
+	}
+
+	if (!sfs_inode->data_block_number) {
+		/* The file is a hole */
+		retval = simplefs_inode_alloc_block(sb, sfs_inode);
+		if (retval) {
+			inode_unlock(inode);
+			return retval;
+		}
+		simplefs_update_blocks(inode);
+	} else {
+		retval = simplefs_inode_unshare(sb, sfs_inode);
+		if (retval) {
+			inode_unlock(inode);
+			return retval;
+		}
+	}
 	//ȡInodeָݿ
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb,
+	bh = simplefs_bread(filp->f_path.dentry->d_inode->i_sb,
 					    sfs_inode->data_block_number);
 
 	if (!bh) {
 		printk(KERN_ERR "Reading the block number [%llu] failed.",
 		       sfs_inode->data_block_number);
+		inode_unlock(inode);
 		return 0;
 	}
 	
@@ -626,74 +2114,1638 @@ ssize_t simplefs_write(struct file * filp, const char __user * buf, size_t len,
 	//ƶvfsָƫλ
 	buffer += *ppos;
 
-	//ûռݵӦݿ
-	if (copy_from_user(buffer, buf, len)) {
-		brelse(bh);
-		printk(KERN_ERR
-		       "Error copying file contents from the userspace buffer to the kernel space\n");
-		return -EFAULT;
+	/* Writing past the end leaves a gap that must read back as zeroes */
+	if (*ppos > sfs_inode->file_size)
+		memset(buffer - (*ppos - sfs_inode->file_size), 0,
+		       *ppos - sfs_inode->file_size);
+
+	//ûռݵӦݿ
+	if (copy_from_user(buffer, buf, len)) {
+		brelse(bh);
+		inode_unlock(inode);
+		printk(KERN_ERR
+		       "Error copying file contents from the userspace buffer to the kernel space\n");
+		return -EFAULT;
+	}
+	//֪ͨVFSָƫ˶
+	*ppos += len;
+	//ΪDirtyд
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	//ͷݿָ
+	brelse(bh);
+
+	/* Set new size. Shrinking is done through truncate (setattr), so an
+	 * overwrite of some bytes in between must not cut the file short. */
+	if (simplefs_lock_interruptible(sb, &simplefs_inodes_mgmt_lock)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		inode_unlock(inode);
+		return -EINTR;
+	}
+	sfs_inode->file_size = max(sfs_inode->file_size, (uint64_t)*ppos);
+	i_size_write(inode, sfs_inode->file_size);
+	retval = simplefs_inode_save(sb, sfs_inode);
+	if (retval) {
+		len = retval;
+	}
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	inode_unlock(inode);
+
+	return len;
+}
+
+ssize_t simplefs_read(struct file *filp, char __user *buf, size_t len,
+		      loff_t *ppos)
+{
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	ret = __simplefs_read(filp, buf, len, ppos);
+	simplefs_latency_add(file_inode(filp)->i_sb, SIMPLEFS_OP_READ, start);
+	return ret;
+}
+
+ssize_t simplefs_write(struct file *filp, const char __user *buf, size_t len,
+		       loff_t *ppos)
+{
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	ret = __simplefs_write(filp, buf, len, ppos);
+	simplefs_latency_add(file_inode(filp)->i_sb, SIMPLEFS_OP_WRITE, start);
+	return ret;
+}
+
+/* Discard every run of free blocks inside the byte range asked for by
+ * FITRIM. On a sparse loop image this punches holes in the backing file.
+ * Every group starts with metadata, so no run crosses a group and they are
+ * walked one at a time, each with its lock held so that none of the blocks
+ * being discarded can be allocated and written underneath us. */
+static int simplefs_trim_fs(struct super_block *vsb, struct fstrim_range *range)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(vsb);
+	struct simplefs_super_block *sb = sb_info->sb;
+	struct request_queue *q = bdev_get_queue(vsb->s_bdev);
+	unsigned int bits = vsb->s_blocksize_bits;
+	uint64_t first, last, group, groups, base, block, end, minblocks;
+	uint64_t start, stop, trimmed = 0;
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	int ret = 0;
+
+	first = range->start >> bits;
+	if (first >= sb->blocks_count)
+		return -EINVAL;
+	last = sb->blocks_count;
+	if ((range->len >> bits) < last - first)
+		last = first + (range->len >> bits);
+
+	minblocks = max_t(uint64_t, range->minlen,
+			  q->limits.discard_granularity) >> bits;
+	if (!minblocks)
+		minblocks = 1;
+
+	/* Recently freed blocks should be trimmed too */
+	simplefs_sb_flush_deferred(vsb);
+
+	/* Pairs with the smp_wmb() in simplefs_grow */
+	groups = READ_ONCE(sb->groups_count);
+	smp_rmb();
+	for (group = simplefs_block_group(sb, first);
+	     group < groups && !ret; group++) {
+		base = group << simplefs_group_bits(sb);
+		if (base >= last)
+			break;
+		block = max_t(uint64_t, first, simplefs_group_data(sb, group));
+		end = min_t(uint64_t, last, base + simplefs_group_blocks(sb, group));
+
+		desc = simplefs_group_desc(vsb, group, &gdt_bh);
+		bh = simplefs_group_bread(vsb, simplefs_group_bmap(sb, group),
+					  &desc->bmap_checksum);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+
+		simplefs_lock(vsb, &sb_info->groups[group].lock);
+		while (block < end) {
+			start = base + find_next_zero_bit_le(bh->b_data,
+					end - base, block - base);
+			if (start >= end)
+				break;
+			stop = base + find_next_bit_le(bh->b_data,
+					end - base, start - base);
+
+			if (stop - start >= minblocks) {
+				ret = sb_issue_discard(vsb, start, stop - start,
+						       GFP_NOFS, 0);
+				if (ret)
+					break;
+				trimmed += stop - start;
+			}
+			block = stop;
+		}
+		mutex_unlock(&sb_info->groups[group].lock);
+		brelse(bh);
+
+		if (!ret && fatal_signal_pending(current))
+			ret = -ERESTARTSYS;
+	}
+
+	range->len = trimmed << bits;
+	return ret;
+}
+
+/* FS_IOC_SETFLAGS: FS_NOCOMP_FL (chattr +m) is the only flag there is */
+static int simplefs_set_flags(struct file *filp, int __user *uflags)
+{
+	struct inode *inode = file_inode(filp);
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint32_t old;
+	int flags, ret;
+
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (get_user(flags, uflags))
+		return -EFAULT;
+	if (flags & ~FS_NOCOMP_FL)
+		return -EOPNOTSUPP;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+	inode_lock(inode);
+	simplefs_lock(inode->i_sb, &simplefs_inodes_mgmt_lock);
+	old = sfs_inode->flags;
+	if (flags & FS_NOCOMP_FL)
+		sfs_inode->flags |= SIMPLEFS_INODE_NOCOMPRESS;
+	else
+		sfs_inode->flags &= ~SIMPLEFS_INODE_NOCOMPRESS;
+	ret = simplefs_inode_save(inode->i_sb, sfs_inode);
+	if (ret)
+		sfs_inode->flags = old;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (!ret)
+		inode->i_ctime = CURRENT_TIME;
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+
+	return ret;
+}
+
+static uint64_t simplefs_block_distance(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/* SIMPLEFS_IOC_DEFRAG, see simple.h. The data is copied through the buffer
+ * cache to the new block and the inode switched over under the inode lock,
+ * as a copy on write does, so the file can stay open meanwhile. */
+static int simplefs_defrag(struct file *filp,
+			   struct simplefs_defrag __user *uarg)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb)->sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_defrag arg;
+	uint64_t old, block;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.goal >= sfs_sb->blocks_count)
+		return -EINVAL;
+	if (!arg.goal)
+		arg.goal = simplefs_group_data(sfs_sb,
+				simplefs_ino_group(sfs_sb, sfs_inode->inode_no));
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+	inode_lock(inode);
+	old = sfs_inode->data_block_number;
+	/* The block of a DAX file may be mapped, so it stays put */
+	if (!old || old == arg.goal || IS_DAX(inode) ||
+	    simplefs_block_shared(sb, old))
+		goto out;
+
+	ret = simplefs_group_take_block(sb, simplefs_block_group(sfs_sb, arg.goal),
+					arg.goal, &block);
+	if (ret) {
+		/* A full group is not an error, the file stays put */
+		if (ret == -ENOSPC)
+			ret = 0;
+		goto out;
+	}
+	if (simplefs_block_distance(block, arg.goal) >=
+	    simplefs_block_distance(old, arg.goal)) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		goto out;
+	}
+
+	ret = simplefs_inode_move(sb, sfs_inode, block);
+	if (ret) {
+		simplefs_sb_put_a_freeblock(sb, block);
+		goto out;
+	}
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_BLOCK_DEFRAG);
+out:
+	arg.block = sfs_inode->data_block_number;
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+	if (!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/* Write the metadata of group, which is new in geo: the bitmaps with the
+ * group's metadata and everything past its end marked in use, an empty
+ * reference count table, a zeroed inode table and the descriptor. *free
+ * is set to the group's free blocks. */
+static int simplefs_grow_group(struct super_block *sb,
+			       const struct simplefs_super_block *geo,
+			       uint64_t group, uint64_t *free)
+{
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	uint64_t start = group << simplefs_group_bits(geo);
+	uint64_t len = simplefs_group_blocks(geo, group);
+	uint64_t used = simplefs_group_data(geo, group) - start;
+	unsigned long bit, bits = geo->blocks_per_group;
+	uint32_t *csum[3];
+	unsigned int i;
+	int ret;
+
+	/* Like mkfs, without writing the zeroes where the device can */
+	ret = sb_issue_zeroout(sb, simplefs_group_itable(geo, group),
+			       geo->itable_blocks, GFP_NOFS);
+	if (ret)
+		return ret;
+
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	memset(desc, 0, sizeof(*desc));
+	csum[0] = &desc->bmap_checksum;
+	csum[1] = &desc->imap_checksum;
+	csum[2] = &desc->refs_checksum;
+	for (i = 0; i < 3; i++) {
+		bh = sb_getblk(sb, simplefs_group_bmap(geo, group) + i);
+		if (!bh)
+			return -EIO;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		if (i == 0) {
+			for (bit = 0; bit < used; bit++)
+				__set_bit_le(bit, bh->b_data);
+			for (bit = len; bit < bits; bit++)
+				__set_bit_le(bit, bh->b_data);
+		} else if (i == 1) {
+			for (bit = geo->inodes_per_group; bit < bits; bit++)
+				__set_bit_le(bit, bh->b_data);
+		}
+		*csum[i] = simplefs_csum(bh->b_data, bh->b_size);
+		set_buffer_simplefs_verified(bh);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		simplefs_mark_dirty(sb, bh);
+		ret = simplefs_sync_buffer(sb, bh);
+		brelse(bh);
+		if (ret)
+			return ret;
+	}
+
+	desc->free_blocks = len - used;
+	desc->free_inodes = geo->inodes_per_group;
+	mutex_init(&SIMPLEFS_SB(sb)->groups[group].lock);
+	simplefs_desc_dirty(sb, desc, gdt_bh);
+	*free = desc->free_blocks;
+	return 0;
+}
+
+/* Give the blocks the last group gains in geo back to its bitmap, where
+ * mkfs marked everything past the end in use. They are not allocated
+ * before the super block's blocks_count covers them. */
+static int simplefs_grow_last(struct super_block *sb,
+			      const struct simplefs_super_block *geo,
+			      uint64_t group, uint64_t *free)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_group_desc *desc;
+	struct buffer_head *bh, *gdt_bh;
+	unsigned long bit, old, new;
+
+	old = simplefs_group_blocks(sb_info->sb, group);
+	new = simplefs_group_blocks(geo, group);
+	*free = new - old;
+	if (new == old)
+		return 0;
+
+	desc = simplefs_group_desc(sb, group, &gdt_bh);
+	bh = simplefs_group_bread(sb, simplefs_group_bmap(geo, group),
+				  &desc->bmap_checksum);
+	if (!bh)
+		return -EIO;
+	simplefs_lock(sb, &sb_info->groups[group].lock);
+	for (bit = old; bit < new; bit++)
+		__clear_bit_le(bit, bh->b_data);
+	simplefs_group_block_dirty(sb, bh, &desc->bmap_checksum);
+	simplefs_sync_buffer(sb, bh);
+	desc->free_blocks += new - old;
+	simplefs_desc_dirty(sb, desc, gdt_bh);
+	mutex_unlock(&sb_info->groups[group].lock);
+	brelse(bh);
+
+	return 0;
+}
+
+/* SIMPLEFS_IOC_GROW, see simple.h. *count is the size asked for on entry
+ * and the size reached on return. The new groups are written out in full
+ * before the super block takes them in, so the allocators, which read the
+ * geometry without locks, never see one half made. */
+static int simplefs_grow(struct super_block *sb, uint64_t *count)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_super_block *sfs_sb = sb_info->sb;
+	struct simplefs_super_block geo;
+	uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	uint64_t g, free, free_blocks = 0, free_inodes;
+	int ret = 0;
+
+	if (!*count)
+		*count = dev_blocks;
+	if (*count > dev_blocks) {
+		printk(KERN_ERR "simplefs: cannot grow to [%llu] blocks, the device only has [%llu]\n",
+		       *count, dev_blocks);
+		return -EINVAL;
+	}
+
+	mutex_lock(&simplefs_resize_lock);
+	geo = *sfs_sb;
+	if (*count < sfs_sb->blocks_count) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (simplefs_grow_layout(&geo, *count)) {
+		printk(KERN_ERR "simplefs: the group descriptor table has no room for [%llu] blocks\n",
+		       *count);
+		ret = -EFBIG;
+		goto out;
+	}
+	/* Too little to hold another group */
+	if (geo.blocks_count <= sfs_sb->blocks_count)
+		goto done;
+
+	for (g = sfs_sb->groups_count; g < geo.groups_count; g++) {
+		ret = simplefs_grow_group(sb, &geo, g, &free);
+		if (ret)
+			goto out;
+		free_blocks += free;
+	}
+	ret = simplefs_grow_last(sb, &geo, sfs_sb->groups_count - 1, &free);
+	if (ret)
+		goto out;
+	free_blocks += free;
+
+	simplefs_lock(sb, &simplefs_sb_lock);
+	free_inodes = geo.inodes_max - sfs_sb->inodes_max;
+	sfs_sb->inodes_max = geo.inodes_max;
+	sfs_sb->blocks_count = geo.blocks_count;
+	/* The groups past the old end are only looked at once groups_count
+	 * takes them in, which must come last */
+	smp_wmb();
+	WRITE_ONCE(sfs_sb->groups_count, geo.groups_count);
+	percpu_counter_add(&sb_info->free_blocks, free_blocks);
+	percpu_counter_add(&sb_info->free_inodes, free_inodes);
+	simplefs_sb_sync(sb);
+	mutex_unlock(&simplefs_sb_lock);
+	printk(KERN_INFO "simplefs: grown to [%llu] blocks in [%llu] groups\n",
+	       geo.blocks_count, geo.groups_count);
+done:
+	*count = sfs_sb->blocks_count;
+out:
+	mutex_unlock(&simplefs_resize_lock);
+	return ret;
+}
+
+static long simplefs_ioctl(struct file *filp, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	struct fstrim_range __user *urange = (struct fstrim_range __user *)arg;
+	struct fstrim_range range;
+	uint64_t count;
+	int ret;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		ret = SIMPLEFS_INODE(file_inode(filp))->flags &
+		      SIMPLEFS_INODE_NOCOMPRESS ? FS_NOCOMP_FL : 0;
+		return put_user(ret, (int __user *)arg);
+	case FS_IOC_SETFLAGS:
+		return simplefs_set_flags(filp, (int __user *)arg);
+	case SIMPLEFS_IOC_DEFRAG:
+		return simplefs_defrag(filp, (struct simplefs_defrag __user *)arg);
+	case SIMPLEFS_IOC_GROW:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (simplefs_read_only_image(sb))
+			return -EROFS;
+		if (get_user(count, (uint64_t __user *)arg))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = simplefs_grow(sb, &count);
+		mnt_drop_write_file(filp);
+		if (ret)
+			return ret;
+		return put_user(count, (uint64_t __user *)arg);
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		/* Nothing is free, and the bitmaps are never read */
+		if (simplefs_read_only_image(sb))
+			return -EROFS;
+
+		if (!blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+			return -EOPNOTSUPP;
+
+		if (copy_from_user(&range, urange, sizeof(range)))
+			return -EFAULT;
+
+		ret = simplefs_trim_fs(sb, &range);
+		if (ret < 0)
+			return ret;
+
+		if (copy_to_user(urange, &range, sizeof(range)))
+			return -EFAULT;
+
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+/* The other commands have the same numbers and layouts for 32-bit callers */
+static long simplefs_compat_ioctl(struct file *filp, unsigned int cmd,
+				  unsigned long arg)
+{
+	switch (cmd) {
+	case FS_IOC32_GETFLAGS:
+		cmd = FS_IOC_GETFLAGS;
+		break;
+	case FS_IOC32_SETFLAGS:
+		cmd = FS_IOC_SETFLAGS;
+		break;
+	}
+	return simplefs_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+/* Preallocate (mode 0 or FALLOC_FL_KEEP_SIZE), punch a hole or zero a
+ * range. A file has at most one block: preallocating gives it that block
+ * and a hole over all of its data frees it again. */
+static long simplefs_fallocate(struct file *filp, int mode, loff_t offset,
+			       loff_t len)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block;
+	loff_t end;
+	bool changed = false;
+	int ret = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
+
+	inode_lock(inode);
+	simplefs_mmap_lock(inode);
+	block = sfs_inode->data_block_number;
+
+	/* The offsets of a compressed file are not those of its block */
+	if (sfs_inode->flags & SIMPLEFS_INODE_LZ4) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	/* vfs_fallocate makes sure KEEP_SIZE comes with it */
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		end = min_t(loff_t, offset + len, sfs_inode->file_size);
+		if (!block || offset >= end)
+			goto out;
+
+		changed = true;
+		if (offset || end < sfs_inode->file_size) {
+			ret = simplefs_zero_range(inode, offset, end);
+			goto out;
+		}
+
+		/* Drop the reference before freeing, as truncate does */
+		if (IS_DAX(inode))
+			truncate_pagecache(inode, 0);
+		simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+		sfs_inode->data_block_number = 0;
+		ret = simplefs_inode_save(sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		if (!ret) {
+			simplefs_block_release(sb, block);
+			simplefs_update_blocks(inode);
+		}
+		goto out;
+	}
+
+	/* A file cannot grow beyond one block */
+	if (offset + len > sb->s_blocksize) {
+		ret = -EFBIG;
+		goto out;
+	}
+
+	/* A new block is zeroed already */
+	if (!block) {
+		changed = true;
+		ret = simplefs_inode_alloc_block(sb, sfs_inode);
+		if (!ret)
+			simplefs_update_blocks(inode);
+	} else if (mode & FALLOC_FL_ZERO_RANGE) {
+		changed = true;
+		ret = simplefs_zero_range(inode, offset, offset + len);
+	}
+	if (ret || (mode & FALLOC_FL_KEEP_SIZE) ||
+	    offset + len <= sfs_inode->file_size)
+		goto out;
+
+	/* Stores through a DAX mapping may have left data past the end */
+	if (IS_DAX(inode) && block) {
+		ret = simplefs_zero_range(inode, sfs_inode->file_size,
+					  offset + len);
+		if (ret)
+			goto out;
+	}
+
+	changed = true;
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->file_size = offset + len;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (!ret)
+		i_size_write(inode, sfs_inode->file_size);
+
+out:
+	if (!ret && changed) {
+		inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(inode);
+	}
+	simplefs_mmap_unlock(inode);
+	inode_unlock(inode);
+	return ret;
+}
+
+/* SEEK_DATA and SEEK_HOLE: a file is either all data up to its size, with
+ * the implicit hole at the end, or all hole. Everything else is generic. */
+static loff_t simplefs_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(filp);
+	bool hole;
+	loff_t size;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(filp, offset, whence);
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	hole = !SIMPLEFS_INODE(inode)->data_block_number;
+	inode_unlock(inode);
+
+	if (offset < 0 || offset >= size || (hole && whence == SEEK_DATA))
+		return -ENXIO;
+	if (!hole && whence == SEEK_HOLE)
+		offset = size;
+
+	return vfs_setpos(filp, offset, inode->i_sb->s_maxbytes);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+/* Reflink: point file_out at the block of file_in instead of copying it,
+ * both then share it until one of them writes to it. A file is a single
+ * block, so only whole files can be cloned: both offsets must be 0 and the
+ * range must be all of file_in, and cover all the data of file_out. A
+ * compressed block is shared as it is. FICLONE, FICLONERANGE and
+ * cp --reflink end up here. */
+static int simplefs_clone_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     u64 len)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = src->i_sb;
+	struct simplefs_inode *sfs_src = SIMPLEFS_INODE(src);
+	struct simplefs_inode *sfs_dst = SIMPLEFS_INODE(dst);
+	struct simplefs_inode saved;
+	uint64_t block;
+	loff_t size;
+	int ret = 0;
+
+	if (pos_in || pos_out)
+		return -EINVAL;
+	if (src == dst)
+		return 0;
+	/* A store through a DAX mapping would change both files */
+	if (IS_DAX(src) || IS_DAX(dst))
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+	size = i_size_read(src);
+	/* 0 means up to the end of file_in */
+	if (!len)
+		len = size;
+	if (len != size || i_size_read(dst) > size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!size)
+		goto out;
+
+	block = sfs_src->data_block_number;
+	if (block) {
+		ret = simplefs_block_ref(sb, block);
+		if (ret)
+			goto out;
+	}
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	saved = *sfs_dst;
+	sfs_dst->data_block_number = block;
+	sfs_dst->file_size = size;
+	sfs_dst->flags = (sfs_dst->flags & ~SIMPLEFS_INODE_LZ4) |
+			 (sfs_src->flags & SIMPLEFS_INODE_LZ4);
+	sfs_dst->compressed_size = sfs_src->compressed_size;
+	ret = simplefs_inode_save(sb, sfs_dst);
+	if (ret)
+		*sfs_dst = saved;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret) {
+		if (block)
+			simplefs_block_release(sb, block);
+		goto out;
+	}
+
+	if (saved.data_block_number)
+		simplefs_block_release(sb, saved.data_block_number);
+	i_size_write(dst, size);
+	simplefs_update_blocks(dst);
+	truncate_inode_pages(dst->i_mapping, 0);
+	dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+
+out:
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+/* Copying a whole file is a clone. Anything else is left to the VFS,
+ * which falls back to reading and writing in the kernel. */
+static ssize_t simplefs_copy_file_range(struct file *file_in, loff_t pos_in,
+					struct file *file_out, loff_t pos_out,
+					size_t len, unsigned int flags)
+{
+	loff_t size = i_size_read(file_inode(file_in));
+	int ret;
+
+	/* Callers ask for more than there is and expect a short copy */
+	if (!pos_in && len > size)
+		len = size;
+	ret = simplefs_clone_file_range(file_in, pos_in, file_out, pos_out,
+					len);
+	if (ret == -EINVAL)
+		return -EOPNOTSUPP;
+	return ret ? ret : len;
+}
+#endif
+
+#if SIMPLEFS_HAVE_DAX
+/* DAX, with the dax mount option on pmem or a brd ramdisk: the block of a
+ * file is memory that reads, writes and mmap reach directly, without a
+ * copy in the page cache or the buffer cache. A file has one block, so
+ * its map is that block from offset 0, or a hole. DAX files never share
+ * their block (see simplefs_set_dax), so there is nothing to copy on
+ * write. */
+
+/* Give a hole a zeroed block. It is zeroed on the device, not through the
+ * buffer cache, and any buffer a deleted file left for it is dropped so
+ * that it cannot be written back over DAX stores. A write and a fault,
+ * which does not take the inode lock, may both find the hole: the loser
+ * frees its block again. */
+static int simplefs_dax_alloc_block(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block;
+	int ret;
+
+	ret = simplefs_sb_get_a_freeblock(sb, sfs_inode->inode_no, &block);
+	if (ret < 0)
+		return ret;
+
+	clean_bdev_aliases(sb->s_bdev, block, 1);
+	ret = sb_issue_zeroout(sb, block, 1, GFP_NOFS);
+	if (!ret) {
+		simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+		if (!sfs_inode->data_block_number) {
+			sfs_inode->data_block_number = block;
+			ret = simplefs_inode_save(sb, sfs_inode);
+			if (ret)
+				sfs_inode->data_block_number = 0;
+			else
+				block = 0;
+		}
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+	}
+	if (block)
+		simplefs_sb_put_a_freeblock(sb, block);
+	simplefs_update_blocks(inode);
+
+	return ret;
+}
+
+static int simplefs_iomap_begin(struct inode *inode, loff_t offset,
+				loff_t length, unsigned flags,
+				struct iomap *iomap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block;
+	int ret;
+
+	/* A file cannot grow beyond one block */
+	if (offset >= sb->s_blocksize)
+		return -ENOSPC;
+
+	iomap->flags = 0;
+	block = READ_ONCE(sfs_inode->data_block_number);
+	if (!block && (flags & IOMAP_WRITE)) {
+		ret = simplefs_dax_alloc_block(inode);
+		if (ret)
+			return ret;
+		block = sfs_inode->data_block_number;
+		iomap->flags |= IOMAP_F_NEW;
+	}
+
+	iomap->offset = 0;
+	iomap->length = sb->s_blocksize;
+	iomap->bdev = sb->s_bdev;
+	if (block) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->blkno = block << (sb->s_blocksize_bits - 9);
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->blkno = IOMAP_NULL_BLOCK;
+	}
+
+	return 0;
+}
+
+static const struct iomap_ops simplefs_iomap_ops = {
+	.iomap_begin = simplefs_iomap_begin,
+};
+
+static ssize_t simplefs_dax_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	ret = dax_iomap_rw(iocb, to, &simplefs_iomap_ops);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+
+	simplefs_latency_add(inode->i_sb, SIMPLEFS_OP_READ, start);
+	return ret;
+}
+
+static ssize_t simplefs_dax_write_iter(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+	int err;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	/* As simplefs_write, all or nothing */
+	if (iocb->ki_pos + iov_iter_count(from) > sb->s_blocksize) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret)
+		goto out;
+
+	/* Writing past the end leaves a gap that must read back as zeroes,
+	 * and stores through a mapping may have left data there */
+	if (iocb->ki_pos > sfs_inode->file_size &&
+	    sfs_inode->data_block_number) {
+		ret = simplefs_zero_range(inode, sfs_inode->file_size,
+					  iocb->ki_pos);
+		if (ret)
+			goto out;
+	}
+
+	ret = dax_iomap_rw(iocb, from, &simplefs_iomap_ops);
+	if (ret > 0 && iocb->ki_pos > sfs_inode->file_size) {
+		simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+		sfs_inode->file_size = iocb->ki_pos;
+		err = simplefs_inode_save(sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		if (err)
+			ret = err;
+		else
+			i_size_write(inode, iocb->ki_pos);
+	}
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+
+	simplefs_latency_add(sb, SIMPLEFS_OP_WRITE, start);
+	return ret;
+}
+
+/* Both read and write faults: a write fault on a hole allocates the block
+ * through simplefs_iomap_begin */
+static int __simplefs_dax_fault(struct vm_area_struct *vma,
+				struct vm_fault *vmf)
+{
+	struct super_block *sb = file_inode(vma->vm_file)->i_sb;
+	bool write = vmf->flags & FAULT_FLAG_WRITE;
+	int ret;
+
+	if (write)
+		sb_start_pagefault(sb);
+	down_read(&simplefs_mmap_sem);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	ret = dax_iomap_fault(vmf, PE_SIZE_PTE, &simplefs_iomap_ops);
+#else
+	ret = dax_iomap_fault(vma, vmf, &simplefs_iomap_ops);
+#endif
+	up_read(&simplefs_mmap_sem);
+	if (write)
+		sb_end_pagefault(sb);
+
+	return ret;
+}
+
+/* The first store to a page mapped by a read fault */
+static int __simplefs_dax_pfn_mkwrite(struct vm_area_struct *vma,
+				      struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	int ret;
+
+	sb_start_pagefault(inode->i_sb);
+	down_read(&simplefs_mmap_sem);
+	if (vmf->pgoff >= DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE))
+		ret = VM_FAULT_SIGBUS;
+	else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+		ret = dax_pfn_mkwrite(vmf);
+#else
+		ret = dax_pfn_mkwrite(vma, vmf);
+#endif
+	up_read(&simplefs_mmap_sem);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+/* The vm_operations take the vma from the vm_fault since 4.11 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static int simplefs_dax_fault(struct vm_fault *vmf)
+{
+	return __simplefs_dax_fault(vmf->vma, vmf);
+}
+
+static int simplefs_dax_pfn_mkwrite(struct vm_fault *vmf)
+{
+	return __simplefs_dax_pfn_mkwrite(vmf->vma, vmf);
+}
+#else
+static int simplefs_dax_fault(struct vm_area_struct *vma,
+			      struct vm_fault *vmf)
+{
+	return __simplefs_dax_fault(vma, vmf);
+}
+
+static int simplefs_dax_pfn_mkwrite(struct vm_area_struct *vma,
+				    struct vm_fault *vmf)
+{
+	return __simplefs_dax_pfn_mkwrite(vma, vmf);
+}
+#endif
+
+/* A file is one page, so there are no huge page faults */
+static const struct vm_operations_struct simplefs_dax_vm_ops = {
+	.fault = simplefs_dax_fault,
+	.page_mkwrite = simplefs_dax_fault,
+	.pfn_mkwrite = simplefs_dax_pfn_mkwrite,
+};
+
+static int simplefs_dax_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	file_accessed(filp);
+	vma->vm_ops = &simplefs_dax_vm_ops;
+	vma->vm_flags |= VM_MIXEDMAP;
+	return 0;
+}
+
+/* Stores through a mapping may still be in the CPU caches. fsync, sync and
+ * writeback flush the pages that were written to. */
+static int simplefs_dax_writepages(struct address_space *mapping,
+				   struct writeback_control *wbc)
+{
+	return dax_writeback_mapping_range(mapping, mapping->host->i_sb->s_bdev,
+					   wbc);
+}
+
+static const struct address_space_operations simplefs_dax_aops = {
+	.writepages = simplefs_dax_writepages,
+};
+
+/* No clone_file_range or copy_file_range: DAX files are not cloned, and
+ * copy_file_range falls back to copying */
+static const struct file_operations simplefs_dax_file_operations = {
+	.llseek = simplefs_llseek,
+	.read_iter = simplefs_dax_read_iter,
+	.write_iter = simplefs_dax_write_iter,
+	.mmap = simplefs_dax_mmap,
+	.fsync = generic_file_fsync,
+	.fallocate = simplefs_fallocate,
+	.unlocked_ioctl = simplefs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = simplefs_compat_ioctl,
+#endif
+};
+#endif
+
+/* On a dax mount, a regular file is read and written through DAX unless it
+ * is compressed or packed, whose bytes are not at their offset in the
+ * block, or shares its block with a clone, which a store through a mapping
+ * would change for both. Those go through the buffer cache as usual. */
+static void simplefs_set_dax(struct inode *inode)
+{
+#if SIMPLEFS_HAVE_DAX
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+
+	if (!test_opt(SIMPLEFS_SB(inode->i_sb), DAX) ||
+	    (sfs_inode->flags & (SIMPLEFS_INODE_LZ4 | SIMPLEFS_INODE_PACKED)) ||
+	    (sfs_inode->data_block_number &&
+	     simplefs_block_shared(inode->i_sb, sfs_inode->data_block_number)))
+		return;
+
+	inode->i_flags |= S_DAX;
+	inode->i_fop = &simplefs_dax_file_operations;
+	inode->i_mapping->a_ops = &simplefs_dax_aops;
+#endif
+}
+
+const struct file_operations simplefs_file_operations = {
+	.llseek = simplefs_llseek,
+	.read = simplefs_read,
+	.write = simplefs_write,
+	.fallocate = simplefs_fallocate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	.clone_file_range = simplefs_clone_file_range,
+	.copy_file_range = simplefs_copy_file_range,
+#endif
+	.unlocked_ioctl = simplefs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = simplefs_compat_ioctl,
+#endif
+};
+
+const struct file_operations simplefs_dir_operations = {
+	.owner = THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+	.iterate = simplefs_iterate,
+#else
+	.readdir = simplefs_readdir,
+#endif
+	.unlocked_ioctl = simplefs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = simplefs_compat_ioctl,
+#endif
+};
+
+struct dentry *simplefs_lookup(struct inode *parent_inode,
+			       struct dentry *child_dentry, unsigned int flags);
+
+static int simplefs_create(struct inode *dir, struct dentry *dentry,
+			   umode_t mode, bool excl);
+
+static int simplefs_mkdir(struct inode *dir, struct dentry *dentry,
+			  umode_t mode);
+static int simplefs_unlink(struct inode *dir,struct dentry *dentry);
+static int simplefs_rmdir(struct inode *dir, struct dentry *dentry);
+static int simplefs_link(struct dentry *old_dentry, struct inode *dir,
+			 struct dentry *dentry);
+static int simplefs_rename(struct inode *old_dir, struct dentry *old_dentry,
+			   struct inode *new_dir, struct dentry *new_dentry,
+			   unsigned int flags);
+static int simplefs_setattr(struct dentry *dentry, struct iattr *attr);
+
+/* The one block of a file or directory is its only extent, flagged shared
+ * while a clone points at it too. That of a compressed file covers all of
+ * its data and is flagged encoded, and the data of a file packed with
+ * others starts part way into the block. */
+static int simplefs_fiemap(struct inode *inode,
+			   struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block = sfs_inode->data_block_number;
+	u64 length = sb->s_blocksize;
+	u32 flags;
+	int ret;
+
+	ret = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (ret)
+		return ret;
+
+	flags = FIEMAP_EXTENT_LAST;
+	if (sfs_inode->flags & SIMPLEFS_INODE_LZ4) {
+		flags |= FIEMAP_EXTENT_ENCODED;
+		length = round_up(i_size_read(inode), sb->s_blocksize);
+	}
+	if (sfs_inode->flags & SIMPLEFS_INODE_PACKED)
+		flags |= FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED;
+	if (!block || start >= length)
+		return 0;
+	if (simplefs_block_shared(sb, block))
+		flags |= FIEMAP_EXTENT_SHARED;
+	ret = fiemap_fill_next_extent(fieinfo, 0,
+				      (block << sb->s_blocksize_bits) +
+				      sfs_inode->data_offset, length, flags);
+	return ret < 0 ? ret : 0;
+}
+
+/* Extended attributes. Those that fit are kept in the inode itself, so
+ * reading them is served from the in-memory inode without any I/O; the
+ * rest go to an xattr block. A block is never changed in place: setting an
+ * attribute writes the new ones to another block, or takes a reference to
+ * an identical block that another inode already has, switches the inode
+ * over and only then releases the old block, as simplefs_file_rewrite does
+ * for data. */
+
+/* Blocks remembered for sharing per mount, past that new ones are not */
+#define SIMPLEFS_XATTR_CACHE_MAX	1024
+
+/* An xattr block in simplefs_sb_info.xattr_blocks, keyed by its checksum */
+struct simplefs_xattr_cache_entry {
+	struct hlist_node node;
+	uint64_t block;
+	uint32_t csum;
+};
+
+static void *simplefs_xattr_area(struct buffer_head *bh)
+{
+	return (struct simplefs_xattr_header *)bh->b_data + 1;
+}
+
+/* Read an xattr block, checksummed like a directory block. NULL if it
+ * cannot be read or is corrupt. */
+static struct buffer_head *simplefs_xattr_bread(struct super_block *sb,
+						uint64_t block)
+{
+	struct buffer_head *bh = simplefs_bread(sb, block);
+
+	if (!bh)
+		return NULL;
+	/* The entries are walked without bounds checks from now on */
+	if (!buffer_simplefs_verified(bh) &&
+	    simplefs_xattr_block_check(bh->b_data, bh->b_size)) {
+		printk_ratelimited(KERN_ERR
+		       "simplefs: xattr block [%llu] is corrupt, run fsck-simplefs\n",
+		       block);
+		brelse(bh);
+		return NULL;
+	}
+	if (!simplefs_verify(sb, bh, *simplefs_dir_csum(bh),
+			     SIMPLEFS_DIR_CSUM_OFFSET(bh->b_size), "xattr")) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/* The length of the name of an attribute, without its prefix */
+static int simplefs_xattr_name_len(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!len)
+		return -EINVAL;
+	return len > U8_MAX ? -ERANGE : len;
+}
+
+/* Nothing changes on a read-only image, so its readers take no lock */
+static void simplefs_xattr_read_lock(struct super_block *sb)
+{
+	if (!simplefs_read_only_image(sb))
+		down_read(&simplefs_xattr_sem);
+}
+
+static void simplefs_xattr_read_unlock(struct super_block *sb)
+{
+	if (!simplefs_read_only_image(sb))
+		up_read(&simplefs_xattr_sem);
+}
+
+static int simplefs_xattr_get(struct inode *inode, int index,
+			      const char *name, void *buffer, size_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_xattr_entry *e;
+	struct buffer_head *bh = NULL;
+	int len = simplefs_xattr_name_len(name);
+	int ret;
+
+	if (len < 0)
+		return len;
+
+	simplefs_xattr_read_lock(sb);
+	e = simplefs_xattr_find(sfs_inode->xattrs, SIMPLEFS_INLINE_XATTR_SIZE,
+				index, name, len);
+	if (e) {
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_XATTR_INLINE);
+	} else if (sfs_inode->xattr_block) {
+		bh = simplefs_xattr_bread(sb, sfs_inode->xattr_block);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_XATTR_BLOCK);
+		e = simplefs_xattr_find(simplefs_xattr_area(bh),
+					SIMPLEFS_XATTR_BLOCK_AREA(bh->b_size),
+					index, name, len);
+	}
+
+	if (!e) {
+		ret = -ENODATA;
+	} else if (size && size < e->value_size) {
+		ret = -ERANGE;
+	} else {
+		if (size)
+			memcpy(buffer, simplefs_xattr_value(e), e->value_size);
+		ret = e->value_size;
+	}
+out:
+	brelse(bh);
+	simplefs_xattr_read_unlock(sb);
+	return ret;
+}
+
+/* Append the full names of the entries of area to buffer, past used.
+ * trusted.* is only listed for CAP_SYS_ADMIN, as getxattr checks. */
+static ssize_t simplefs_xattr_list_area(const void *area, size_t area_size,
+					char *buffer, size_t size,
+					size_t used)
+{
+	const struct simplefs_xattr_entry *e;
+	const char *prefix;
+	size_t prefix_len, len;
+
+	simplefs_xattr_for_each(e, area, area_size) {
+		if (e->name_index == SIMPLEFS_XATTR_INDEX_TRUSTED &&
+		    !capable(CAP_SYS_ADMIN))
+			continue;
+		prefix = simplefs_xattr_prefix(e->name_index);
+		prefix_len = strlen(prefix);
+		len = prefix_len + e->name_len + 1;
+		if (size) {
+			if (len > size - used)
+				return -ERANGE;
+			memcpy(buffer + used, prefix, prefix_len);
+			memcpy(buffer + used + prefix_len, e->name, e->name_len);
+			buffer[used + len - 1] = '\0';
+		}
+		used += len;
+	}
+	return used;
+}
+
+static ssize_t simplefs_listxattr(struct dentry *dentry, char *buffer,
+				  size_t size)
+{
+	struct inode *inode = dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct buffer_head *bh;
+	ssize_t ret;
+
+	simplefs_xattr_read_lock(sb);
+	ret = simplefs_xattr_list_area(sfs_inode->xattrs,
+				       SIMPLEFS_INLINE_XATTR_SIZE, buffer,
+				       size, 0);
+	if (ret >= 0 && sfs_inode->xattr_block) {
+		bh = simplefs_xattr_bread(sb, sfs_inode->xattr_block);
+		if (bh) {
+			ret = simplefs_xattr_list_area(simplefs_xattr_area(bh),
+					SIMPLEFS_XATTR_BLOCK_AREA(bh->b_size),
+					buffer, size, ret);
+			brelse(bh);
+		} else {
+			ret = -EIO;
+		}
+	}
+	simplefs_xattr_read_unlock(sb);
+	return ret;
+}
+
+/* Point an inode at an xattr block holding data, a whole block with its
+ * header: one that another inode has already if the cache knows of one
+ * with the same contents, a new one near goal otherwise. Called with
+ * simplefs_xattr_sem held for writing. */
+static int simplefs_xattr_block_get(struct super_block *sb, uint64_t goal,
+				    void *data, uint64_t *block)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	size_t csum_offset = SIMPLEFS_DIR_CSUM_OFFSET(sb->s_blocksize);
+	struct simplefs_xattr_cache_entry *entry;
+	struct buffer_head *bh;
+	uint32_t csum;
+	bool same;
+	int ret;
+
+	csum = simplefs_csum(data, csum_offset);
+	*(uint32_t *)((char *)data + csum_offset) = csum;
+
+	hash_for_each_possible(sb_info->xattr_blocks, entry, node, csum) {
+		if (entry->csum != csum)
+			continue;
+		bh = simplefs_xattr_bread(sb, entry->block);
+		if (!bh)
+			continue;
+		same = !memcmp(bh->b_data, data, bh->b_size);
+		brelse(bh);
+		/* With no room left for its count, write a copy instead */
+		if (same && !simplefs_block_ref(sb, entry->block)) {
+			*block = entry->block;
+			return 0;
+		}
+	}
+
+	ret = simplefs_sb_get_a_freeblock(sb, goal, block);
+	if (ret < 0)
+		return ret;
+	bh = sb_getblk(sb, *block);
+	if (!bh) {
+		simplefs_sb_put_a_freeblock(sb, *block);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	memcpy(bh->b_data, data, bh->b_size);
+	set_buffer_simplefs_verified(bh);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	simplefs_mark_dirty(sb, bh);
+	simplefs_sync_buffer(sb, bh);
+	brelse(bh);
+
+	if (sb_info->xattr_cached < SIMPLEFS_XATTR_CACHE_MAX) {
+		entry = kmalloc(sizeof(*entry), GFP_NOFS);
+		if (entry) {
+			entry->block = *block;
+			entry->csum = csum;
+			hash_add(sb_info->xattr_blocks, &entry->node, csum);
+			sb_info->xattr_cached++;
+		}
+	}
+	return 0;
+}
+
+/* Drop an inode's reference to its xattr block. The last one frees it,
+ * and only then is the cache searched (whole) to forget it. Called with
+ * simplefs_xattr_sem held for writing. */
+static void simplefs_xattr_block_put(struct super_block *sb, uint64_t block)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_xattr_cache_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	if (!simplefs_block_unref(sb, block))
+		return;
+	hash_for_each_safe(sb_info->xattr_blocks, bkt, tmp, entry, node) {
+		if (entry->block == block) {
+			hash_del(&entry->node);
+			kfree(entry);
+			sb_info->xattr_cached--;
+		}
+	}
+	simplefs_sb_defer_free(sb, block, 1);
+}
+
+static void simplefs_xattr_cache_destroy(struct simplefs_sb_info *sb_info)
+{
+	struct simplefs_xattr_cache_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(sb_info->xattr_blocks, bkt, tmp, entry, node) {
+		hash_del(&entry->node);
+		kfree(entry);
+	}
+	sb_info->xattr_cached = 0;
+}
+
+/* Set the attribute index and name to value, or remove it if value is
+ * NULL. The attributes are laid out again from scratch, so that they move
+ * into the inode as room is made there. */
+static int simplefs_xattr_set(struct inode *inode, int index,
+			      const char *name, const void *value,
+			      size_t size, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint8_t xattrs[SIMPLEFS_INLINE_XATTR_SIZE];
+	uint8_t saved[SIMPLEFS_INLINE_XATTR_SIZE];
+	struct simplefs_xattr_header *header;
+	struct buffer_head *old_bh = NULL;
+	void *old_area = NULL;
+	uint64_t old, block = 0;
+	int len = simplefs_xattr_name_len(name);
+	bool found;
+	long used;
+	int ret;
+
+	if (len < 0)
+		return len;
+	header = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!header)
+		return -ENOMEM;
+
+	down_write(&simplefs_xattr_sem);
+	old = sfs_inode->xattr_block;
+	if (old) {
+		old_bh = simplefs_xattr_bread(sb, old);
+		if (!old_bh) {
+			ret = -EIO;
+			goto out;
+		}
+		old_area = simplefs_xattr_area(old_bh);
+	}
+
+	found = simplefs_xattr_find(sfs_inode->xattrs,
+				    SIMPLEFS_INLINE_XATTR_SIZE, index, name,
+				    len) ||
+		(old_area &&
+		 simplefs_xattr_find(old_area,
+				     SIMPLEFS_XATTR_BLOCK_AREA(sb->s_blocksize),
+				     index, name, len));
+	if ((flags & XATTR_CREATE) && found) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if (((flags & XATTR_REPLACE) || !value) && !found) {
+		ret = -ENODATA;
+		goto out;
 	}
-	//֪ͨVFSָƫ˶
-	*ppos += len;
-	//ΪDirtyд
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	//ͷݿָ
-	brelse(bh);
 
-	/* Set new size
-	 * sfs_inode->file_size = max(sfs_inode->file_size, *ppos);
-	 *
-	 * FIXME: What to do if someone writes only some parts in between ?
-	 * The above code will also fail in case a file is overwritten with
-	 * a shorter buffer */
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
+	used = simplefs_xattr_layout(sfs_inode->xattrs, old_area,
+				     SIMPLEFS_XATTR_BLOCK_AREA(sb->s_blocksize),
+				     index, name, len, value, size, xattrs,
+				     header + 1);
+	if (used < 0) {
+		ret = -ENOSPC;
+		goto out;
 	}
-	//InodeļС
-	sfs_inode->file_size = *ppos;
-	//ȻInodeϢôInodeϢҲҪͬ
-	retval = simplefs_inode_save(sb, sfs_inode);
-	if (retval) {
-		len = retval;
+	if (used) {
+		memset(header, 0, sizeof(*header));
+		header->magic = SIMPLEFS_XATTR_MAGIC;
+		ret = simplefs_xattr_block_get(sb, sfs_inode->inode_no, header,
+					       &block);
+		if (ret)
+			goto out;
+	}
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	memcpy(saved, sfs_inode->xattrs, sizeof(saved));
+	memcpy(sfs_inode->xattrs, xattrs, sizeof(xattrs));
+	sfs_inode->xattr_block = block;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret) {
+		memcpy(sfs_inode->xattrs, saved, sizeof(saved));
+		sfs_inode->xattr_block = old;
 	}
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret) {
+		if (block)
+			simplefs_xattr_block_put(sb, block);
+		goto out;
+	}
 
-	return len;
+	if (old)
+		simplefs_xattr_block_put(sb, old);
+	inode->i_ctime = CURRENT_TIME;
+out:
+	up_write(&simplefs_xattr_sem);
+	brelse(old_bh);
+	kfree(header);
+	return ret;
 }
 
-const struct file_operations simplefs_file_operations = {
-	.read = simplefs_read,
-	.write = simplefs_write,
-};
+/* The handler's flags are the SIMPLEFS_XATTR_INDEX_* of its prefix */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static int simplefs_xattr_handler_get(const struct xattr_handler *handler,
+				      struct dentry *dentry,
+				      struct inode *inode, const char *name,
+				      void *buffer, size_t size)
+{
+	return simplefs_xattr_get(inode, handler->flags, name, buffer, size);
+}
 
-const struct file_operations simplefs_dir_operations = {
-	.owner = THIS_MODULE,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-	.iterate = simplefs_iterate,
+static int simplefs_xattr_handler_set(const struct xattr_handler *handler,
+				      struct dentry *dentry,
+				      struct inode *inode, const char *name,
+				      const void *value, size_t size,
+				      int flags)
+{
+	return simplefs_xattr_set(inode, handler->flags, name, value, size,
+				  flags);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+static int simplefs_xattr_handler_get(const struct xattr_handler *handler,
+				      struct dentry *dentry, const char *name,
+				      void *buffer, size_t size)
+{
+	return simplefs_xattr_get(dentry->d_inode, handler->flags, name,
+				  buffer, size);
+}
+
+static int simplefs_xattr_handler_set(const struct xattr_handler *handler,
+				      struct dentry *dentry, const char *name,
+				      const void *value, size_t size,
+				      int flags)
+{
+	return simplefs_xattr_set(dentry->d_inode, handler->flags, name,
+				  value, size, flags);
+}
 #else
-	.readdir = simplefs_readdir,
+static int simplefs_xattr_handler_get(struct dentry *dentry,
+				      const char *name, void *buffer,
+				      size_t size, int index)
+{
+	return simplefs_xattr_get(dentry->d_inode, index, name, buffer, size);
+}
+
+static int simplefs_xattr_handler_set(struct dentry *dentry,
+				      const char *name, const void *value,
+				      size_t size, int flags, int index)
+{
+	return simplefs_xattr_set(dentry->d_inode, index, name, value, size,
+				  flags);
+}
 #endif
+
+static const struct xattr_handler simplefs_xattr_user_handler = {
+	.prefix = XATTR_USER_PREFIX,
+	.flags = SIMPLEFS_XATTR_INDEX_USER,
+	.get = simplefs_xattr_handler_get,
+	.set = simplefs_xattr_handler_set,
 };
 
-struct dentry *simplefs_lookup(struct inode *parent_inode,
-			       struct dentry *child_dentry, unsigned int flags);
+static const struct xattr_handler simplefs_xattr_trusted_handler = {
+	.prefix = XATTR_TRUSTED_PREFIX,
+	.flags = SIMPLEFS_XATTR_INDEX_TRUSTED,
+	.get = simplefs_xattr_handler_get,
+	.set = simplefs_xattr_handler_set,
+};
 
-static int simplefs_create(struct inode *dir, struct dentry *dentry,
-			   umode_t mode, bool excl);
+static const struct xattr_handler simplefs_xattr_security_handler = {
+	.prefix = XATTR_SECURITY_PREFIX,
+	.flags = SIMPLEFS_XATTR_INDEX_SECURITY,
+	.get = simplefs_xattr_handler_get,
+	.set = simplefs_xattr_handler_set,
+};
 
-static int simplefs_mkdir(struct inode *dir, struct dentry *dentry,
-			  umode_t mode);
-static int simplefs_unlink(struct inode *dir,struct dentry *dentry);
+static const struct xattr_handler *simplefs_xattr_handlers[] = {
+	&simplefs_xattr_user_handler,
+	&simplefs_xattr_trusted_handler,
+	&simplefs_xattr_security_handler,
+	NULL
+};
 
 static struct inode_operations simplefs_inode_ops = {
 	.create = simplefs_create,
 	.lookup = simplefs_lookup,
 	.mkdir = simplefs_mkdir,
 	.unlink = simplefs_unlink,
-	
+	.rmdir = simplefs_rmdir,
+	.link = simplefs_link,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	.rename = simplefs_rename,
+#else
+	.rename2 = simplefs_rename,
+#endif
+	.setattr = simplefs_setattr,
+	.fiemap = simplefs_fiemap,
+	.listxattr = simplefs_listxattr,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+	.getxattr = generic_getxattr,
+	.setxattr = generic_setxattr,
+	.removexattr = generic_removexattr,
+#endif
 };
+
+/* Add a name+inode_no record to dir, in the first free slot of its cache.
+ * Called with simplefs_directory_children_update_lock held. The caller
+ * adjusts dir->i_nlink beforehand if a subdirectory is being added. */
+static int simplefs_dir_add_entry(struct inode *dir, struct dentry *dentry,
+				  uint64_t inode_no)
+{
+	struct super_block *sb = dir->i_sb;
+	struct simplefs_inode *parent_dir_inode = SIMPLEFS_INODE(dir);
+	struct simplefs_dir_cache *dir_cache;
+	struct simplefs_cache_entry *cache_entry;
+	int ret;
+
+	dir_cache = simplefs_dir_cache_get(dentry->d_parent);
+	if (IS_ERR(dir_cache))
+		return PTR_ERR(dir_cache);
+
+	cache_entry = free_cache_entry_get(dir_cache);
+	if (!cache_entry) {
+		printk(KERN_ERR "No free record left in the directory block\n");
+		return -ENOSPC;
+	}
+
+	cache_entry->record.inode_no = inode_no;
+	strcpy(cache_entry->record.filename, dentry->d_name.name);
+	ret = simplefs_dir_record_write(sb, parent_dir_inode, cache_entry);
+	if (ret) {
+		memset(&cache_entry->record, 0, sizeof(cache_entry->record));
+		return ret;
+	}
+	cache_entry_insert(dir_cache, cache_entry);
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	parent_dir_inode->dir_children_count++;
+	parent_dir_inode->nlink = dir->i_nlink;
+	ret = simplefs_inode_save(sb, parent_dir_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+	return ret;
+}
+
+/* The reverse of simplefs_dir_add_entry, with the same locking rules */
+static int simplefs_dir_remove_entry(struct inode *dir, struct dentry *dentry)
+{
+	struct super_block *sb = dir->i_sb;
+	struct simplefs_inode *parent_dir_inode = SIMPLEFS_INODE(dir);
+	struct simplefs_dir_cache *dir_cache;
+	struct simplefs_cache_entry *cache_entry;
+	int ret;
+
+	dir_cache = simplefs_dir_cache_get(dentry->d_parent);
+	if (IS_ERR(dir_cache))
+		return PTR_ERR(dir_cache);
+
+	cache_entry = used_cache_entry_get(dir_cache, dentry);
+	if (!cache_entry)
+		return -ENOENT;
+
+	cache_entry_remove(dir_cache, cache_entry);
+	ret = simplefs_dir_record_write(sb, parent_dir_inode, cache_entry);
+	if (ret)
+		return ret;
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	parent_dir_inode->dir_children_count--;
+	parent_dir_inode->nlink = dir->i_nlink;
+	ret = simplefs_inode_save(sb, parent_dir_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+	return ret;
+}
 /*
  *        		˵
  *    dir    			ǰĿ¼Inode
@@ -704,25 +3756,20 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 {
 	struct inode *inode;
 	struct simplefs_inode *sfs_inode;
-	struct simplefs_inode *parent_dir_inode;
-	struct buffer_head *bh;
-	struct simplefs_dir_record *dir_contents_datablock;
-	uint64_t count;
+	uint64_t count, inode_no;
 	int ret;
 	struct super_block *sb = dir->i_sb;
 	struct dentry *parent_dentry = dentry->d_parent;
-	struct simplefs_cache_entry *cache_entry;
 	struct simplefs_dir_cache * dir_cache;
-	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
 
 
 	BUG_ON(parent_dentry->d_inode != dir);
 
-	dir_cache = (struct simplefs_dir_cache *)parent_dentry->d_fsdata;
-
-	BUG_ON(!dir_cache);
+	dir_cache = simplefs_dir_cache_get(parent_dentry);
+	if (IS_ERR(dir_cache))
+		return PTR_ERR(dir_cache);
 	
-	if (mutex_lock_interruptible(&simplefs_directory_children_update_lock)) {
+	if (simplefs_lock_interruptible(sb, &simplefs_directory_children_update_lock)) {
 		sfs_trace("Failed to acquire mutex lock\n");
 		return -EINTR;
 	}
@@ -738,7 +3785,7 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 	}
 
 	//жInodeǷˣǣ򷵻ûûпռ䴴
-	if (unlikely(count >= SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)) {
+	if (unlikely(count >= simplefs_max_objects(sb))) {
 		/* The above condition can be just == insted of the >= */
 		printk(KERN_ERR
 		       "Maximum number of objects supported by simplefs is already reached");
@@ -753,42 +3800,60 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 		mutex_unlock(&simplefs_directory_children_update_lock);
 		return -EINVAL;
 	}
+
+	/* Bail out before allocating anything if the parent is full */
+	if (list_empty(&dir_cache->free)) {
+		printk(KERN_ERR "No free record left in the directory block\n");
+		mutex_unlock(&simplefs_directory_children_update_lock);
+		return -ENOSPC;
+	}
+
+	//InodeλͼзһInodeţĿ¼
+	ret = simplefs_inode_no_alloc(sb, dir, mode, &inode_no);
+	if (ret) {
+		mutex_unlock(&simplefs_directory_children_update_lock);
+		return ret;
+	}
 	
 	//ͨSuperBlockһյInode  
 	inode = new_inode(sb);
 	if (!inode) {
+		simplefs_inode_no_free(sb, inode_no, mode);
 		mutex_unlock(&simplefs_directory_children_update_lock);
 		return -ENOMEM;
 	}
-	CDBG("sb imap inode no = %d\n",ffz(sb_info->imap));
 	//InodeָSuperBlock   
 	inode->i_sb = sb;
 	//InodeĲָ
 	inode->i_op = &simplefs_inode_ops;
 	//InodeĴʱ
 	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
-	//ӳinode mapȡһΪ0(Bitλ)
-	inode->i_ino = ffz(sb_info->imap);
+	inode->i_ino = inode_no;
 	//ضļϵͳInodeṹ
-	sfs_inode = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+	sfs_inode = kmem_cache_zalloc(sfs_inode_cachep, GFP_KERNEL);
+	if (!sfs_inode) {
+		ret = -ENOMEM;
+		goto out_inode;
+	}
 	//ԸýڵInodeŸֵ
 	sfs_inode->inode_no = inode->i_ino;
 	//ں˱׼ڵ˽ָָǰضļϵͳInodeṹ
 	inode->i_private = sfs_inode;
 	//ļϵͳ
 	sfs_inode->mode = mode;
+	sfs_inode->nlink = S_ISDIR(mode) ? 2 : 1;
+	set_nlink(inode, sfs_inode->nlink);
 
 	//ļĿ¼ԼͨļֱãҪעǣһĿ¼ôʣǰĿ¼
 	//Inode϶Ϊ0
 	if (S_ISDIR(mode)) {
-		CDBG(KERN_INFO "New directory creation request\n");
 		sfs_inode->dir_children_count = 0;
 		inode->i_fop = &simplefs_dir_operations;
 	} else if (S_ISREG(mode)) {
-		CDBG(KERN_INFO "New file creation request\n");
 		sfs_inode->file_size = 0;
 		//ͨļöд
 		inode->i_fop = &simplefs_file_operations;
+		simplefs_set_dax(inode);
 	}
 
 	/* First get a free block and update the free map,
@@ -799,73 +3864,58 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 	 * even in most crashes
 	 */
 	//ӳлȡеݿ
-	ret = simplefs_sb_get_a_freeblock(sb, &sfs_inode->data_block_number);
+	ret = simplefs_sb_get_a_freeblock(sb, inode_no,
+					  &sfs_inode->data_block_number);
 	if (ret < 0) {
 		printk(KERN_ERR "simplefs could not get a freeblock");
-		mutex_unlock(&simplefs_directory_children_update_lock);
-		return ret;
+		goto out_inode;
 	}
+	ret = simplefs_zero_block(sb, sfs_inode->data_block_number,
+				  S_ISDIR(mode));
+	if (ret) {
+		simplefs_sb_put_a_freeblock(sb, sfs_inode->data_block_number);
+		goto out_inode;
+	}
+	simplefs_update_blocks(inode);
 	//½һInodeҪInodeͬ
 	simplefs_inode_add(sb, sfs_inode);
 
-	/*ӵǰĿ¼еfreeȡһеentry*/
-	cache_entry = free_cache_entry_get(dir_cache);
-
 	/*˸InodeǻҪһ:ڸĿ¼(Inode)棬ӸInodeϢ*/
-	//ȻҪϢȡõǰĿ¼ĽṹϢͨں˵ı׼InodeȡضļϵͳInode
-	//Ϣ
-	parent_dir_inode = SIMPLEFS_INODE(dir);
-	//ͨsimplefs_inodeеĳԱӶȡϢ
-	bh = sb_bread(sb, parent_dir_inode->data_block_number);
-	BUG_ON(!bh);
-	//Ҫ֪Ŀ¼Inodeдŵݽṹǹ̶ģǿת
-	dir_contents_datablock = (struct simplefs_dir_record *)bh->b_data;
-
-	/* Navigate to the last record in the directory contents */
-	/*ҪעǸĿ¼еentryҲǰ˳ŵģcache_entry->entry_noָ
-      ǴŵţǴfreeȡentryǽused
-	*/
-	dir_contents_datablock += cache_entry->entry_no;
-	/*еĿ¼entryϢ*/
-	dir_contents_datablock->inode_no = sfs_inode->inode_no;
-	strcpy(dir_contents_datablock->filename, dentry->d_name.name);
-	/*Ŀ¼ŵݵentryĻ*/
-	memcpy(&cache_entry->record, dir_contents_datablock,sizeof(struct simplefs_dir_record));
-	/*ǰcache_entry뵽used*/
-	cache_entry_insert(&dir_cache->used, cache_entry);
-
-	/*Ŀ¼ָݿΪdirtyд̣֮ͷ*/
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		mutex_unlock(&simplefs_directory_children_update_lock);
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
-	}
-	//Ŀ¼еdir_children_countҲ
-	parent_dir_inode->dir_children_count++;
-	//ͬǸInodeȻҲҪͬ
-	ret = simplefs_inode_save(sb, parent_dir_inode);
+	if (S_ISDIR(mode))
+		inc_nlink(dir);
+	ret = simplefs_dir_add_entry(dir, dentry, sfs_inode->inode_no);
 	if (ret) {
-		mutex_unlock(&simplefs_inodes_mgmt_lock);
-		mutex_unlock(&simplefs_directory_children_update_lock);
-
-		/* TODO: Remove the newly created inode from the disk and in-memory inode store
-		 * and also update the superblock, freemaps etc. to reflect the same.
-		 * Basically, Undo all actions done during this create call */
-		return ret;
+		if (S_ISDIR(mode))
+			drop_nlink(dir);
+		/* Also clears the inode's bit in the bitmap */
+		simplefs_inode_del(sb, sfs_inode);
+		simplefs_sb_put_a_freeblock(sb, sfs_inode->data_block_number);
+		goto out_iput;
 	}
 
-	mutex_unlock(&simplefs_inodes_mgmt_lock);
 	mutex_unlock(&simplefs_directory_children_update_lock);
 	//ǰInode丸Ŀ¼
 	inode_init_owner(inode, dir, mode);
+	/* Hash it so that lookups and links find this inode instead of
+	 * instantiating a second copy from the inode store */
+	insert_inode_hash(inode);
 	//ǰinode󶨵dentry
 	d_add(dentry, inode);
 
 	return 0;
+
+out_inode:
+	simplefs_inode_no_free(sb, inode_no, mode);
+out_iput:
+	/* Not in the inode store (any more), so evict must not delete it */
+	inode->i_private = NULL;
+	if (sfs_inode)
+		kmem_cache_free(sfs_inode_cachep, sfs_inode);
+	make_bad_inode(inode);
+	clear_nlink(inode);
+	iput(inode);
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	return ret;
 }
 
 /*
@@ -873,77 +3923,392 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
  *    dir    			ǰĿ¼Inode
  *    dentry:  			dentry->d_name.name:ɾļ
  */
-static int simplefs_unlink(struct inode *dir,struct dentry *dentry)
+static int __simplefs_unlink(struct inode *dir,struct dentry *dentry)
 {
-	struct inode *inode;
-	struct simplefs_inode *sfs_inode;
-	struct simplefs_inode *parent_dir_inode;
-	struct buffer_head *bh;
-	struct simplefs_dir_record *dir_contents_datablock;
-	uint64_t count;
+	struct inode *inode = d_inode(dentry);
+	/*ȡɾļӦļϵͳinode*/
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
 	int ret;
-	struct super_block *sb = dir->i_sb;
-	struct dentry *parent_dentry = dentry->d_parent;
-	struct simplefs_cache_entry *cache_entry;
-	struct simplefs_dir_cache * dir_cache;
-	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
 
-	/*ȡɾļӦļϵͳinode*/
-	sfs_inode = SIMPLEFS_INODE(dentry->d_inode);
+	if (simplefs_lock_interruptible(dir->i_sb, &simplefs_directory_children_update_lock)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
+	}
+	/*Ŀ¼жӦ*/
+	ret = simplefs_dir_remove_entry(dir, dentry);
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	if (ret)
+		return ret;
+
+	inode->i_ctime = dir->i_ctime;
+	drop_nlink(inode);
+
+	/* When the last link goes away simplefs_evict_inode frees the inode
+	 * and its data block, once nobody holds the file open any more */
+	if (inode->i_nlink) {
+		simplefs_lock(dir->i_sb, &simplefs_inodes_mgmt_lock);
+		sfs_inode->nlink = inode->i_nlink;
+		ret = simplefs_inode_save(inode->i_sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+	}
+
+	return ret;
+}
+
+static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = __simplefs_unlink(dir, dentry);
+	simplefs_latency_add(dir->i_sb, SIMPLEFS_OP_UNLINK, start);
+	return ret;
+}
+
+static int simplefs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	if (SIMPLEFS_INODE(inode)->dir_children_count)
+		return -ENOTEMPTY;
+
+	/* The child no longer has a record pointing back at the parent */
+	drop_nlink(dir);
+	ret = __simplefs_unlink(dir, dentry);
+	if (ret) {
+		inc_nlink(dir);
+		return ret;
+	}
+	clear_nlink(inode);
+
+	return 0;
+}
+
+static int simplefs_link(struct dentry *old_dentry, struct inode *dir,
+			 struct dentry *dentry)
+{
+	struct inode *inode = d_inode(old_dentry);
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	int ret;
+
+	if (simplefs_lock_interruptible(dir->i_sb, &simplefs_directory_children_update_lock)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
+	}
+	ret = simplefs_dir_add_entry(dir, dentry, inode->i_ino);
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	if (ret)
+		return ret;
+
+	inode->i_ctime = CURRENT_TIME;
+	inc_nlink(inode);
+	simplefs_lock(dir->i_sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->nlink = inode->i_nlink;
+	ret = simplefs_inode_save(inode->i_sb, sfs_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	ihold(inode);
+	d_instantiate(dentry, inode);
+
+	return ret;
+}
+
+/* Renames never move data, only directory records:
+ *  - within one directory the record's slot is rewritten in place,
+ *  - over an existing name the target's slot is repointed at our inode,
+ *  - otherwise a slot is taken in the new directory and the old one cleared.
+ * All slots are found through the directory caches, never by a scan. */
+static int simplefs_rename(struct inode *old_dir, struct dentry *old_dentry,
+			   struct inode *new_dir, struct dentry *new_dentry,
+			   unsigned int flags)
+{
+	struct super_block *sb = old_dir->i_sb;
+	struct inode *inode = d_inode(old_dentry);
+	struct inode *target = d_inode(new_dentry);
+	struct simplefs_dir_cache *old_cache, *new_cache;
+	struct simplefs_cache_entry *old_entry, *new_entry;
+	bool is_dir = S_ISDIR(inode->i_mode);
+	int ret;
+
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+
+	if (target && S_ISDIR(target->i_mode) &&
+	    SIMPLEFS_INODE(target)->dir_children_count)
+		return -ENOTEMPTY;
+
+	if (simplefs_lock_interruptible(sb, &simplefs_directory_children_update_lock)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
+	}
+
+	old_cache = simplefs_dir_cache_get(old_dentry->d_parent);
+	new_cache = simplefs_dir_cache_get(new_dentry->d_parent);
+	if (IS_ERR(old_cache) || IS_ERR(new_cache)) {
+		ret = IS_ERR(old_cache) ? PTR_ERR(old_cache) : PTR_ERR(new_cache);
+		goto out;
+	}
+
+	old_entry = used_cache_entry_get(old_cache, old_dentry);
+	if (!old_entry) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	if (target) {
+		new_entry = used_cache_entry_get(new_cache, new_dentry);
+		if (!new_entry) {
+			ret = -ENOENT;
+			goto out;
+		}
+		new_entry->record.inode_no = inode->i_ino;
+		ret = simplefs_dir_record_write(sb, SIMPLEFS_INODE(new_dir),
+						new_entry);
+		if (ret)
+			goto out;
+		/* A directory can only replace a directory: new_dir keeps its
+		 * count, old_dir loses one (the same one when they are equal) */
+		if (is_dir)
+			drop_nlink(old_dir);
+		ret = simplefs_dir_remove_entry(old_dir, old_dentry);
+	} else if (old_dir == new_dir) {
+		hash_del(&old_entry->hash);
+		strcpy(old_entry->record.filename, new_dentry->d_name.name);
+		hash_add(old_cache->names, &old_entry->hash,
+			 simplefs_name_hash(old_entry->record.filename));
+		ret = simplefs_dir_record_write(sb, SIMPLEFS_INODE(old_dir),
+						old_entry);
+	} else {
+		/* Write the new record before dropping the old one, so that a
+		 * crash in between leaves an extra link rather than none */
+		if (is_dir)
+			inc_nlink(new_dir);
+		ret = simplefs_dir_add_entry(new_dir, new_dentry, inode->i_ino);
+		if (ret) {
+			if (is_dir)
+				drop_nlink(new_dir);
+			goto out;
+		}
+		if (is_dir)
+			drop_nlink(old_dir);
+		ret = simplefs_dir_remove_entry(old_dir, old_dentry);
+	}
+	if (ret)
+		goto out;
+
+	old_dir->i_mtime = old_dir->i_ctime = CURRENT_TIME;
+	new_dir->i_mtime = new_dir->i_ctime = old_dir->i_ctime;
+	inode->i_ctime = old_dir->i_ctime;
+
+	if (target) {
+		target->i_ctime = old_dir->i_ctime;
+		if (S_ISDIR(target->i_mode))
+			clear_nlink(target);
+		else
+			drop_nlink(target);
+		if (target->i_nlink) {
+			simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+			SIMPLEFS_INODE(target)->nlink = target->i_nlink;
+			ret = simplefs_inode_save(sb, SIMPLEFS_INODE(target));
+			mutex_unlock(&simplefs_inodes_mgmt_lock);
+		}
+	}
+
+out:
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	return ret;
+}
+
+/* Change the size of a regular file. Shrinking to zero drops the data
+ * block, freeing it unless a clone shares it, and growing a file without one leaves it a
+ * hole; any other size change zeroes the bytes between the old and the
+ * new end so they cannot leak old contents. */
+static int simplefs_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block = sfs_inode->data_block_number;
+	loff_t from, to;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	if (size == 0) {
+		/* Drop the reference before freeing, a crash in between
+		 * leaks the block instead of sharing it */
+		if (IS_DAX(inode))
+			truncate_pagecache(inode, 0);
+		simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+		sfs_inode->data_block_number = 0;
+		sfs_inode->file_size = 0;
+		sfs_inode->flags &= ~SIMPLEFS_INODE_LZ4;
+		sfs_inode->compressed_size = 0;
+		ret = simplefs_inode_save(sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		if (ret)
+			return ret;
+
+		if (block)
+			simplefs_block_release(sb, block);
+		i_size_write(inode, 0);
+		simplefs_update_blocks(inode);
+		truncate_inode_pages(inode->i_mapping, 0);
+		return 0;
+	}
 
-	dir_cache = (struct simplefs_dir_cache *)parent_dentry->d_fsdata;
+	/* A compressed file, or one growing past its block, is rewritten
+	 * whole */
+	if (size > sb->s_blocksize || (sfs_inode->flags & SIMPLEFS_INODE_LZ4)) {
+		if (size > sb->s_blocksize && !simplefs_may_compress(inode))
+			return -EFBIG;
+		return simplefs_file_rewrite(inode, NULL, 0, 0, size);
+	}
+
+	if (block) {
+		from = min_t(loff_t, size, sfs_inode->file_size);
+		to = max_t(loff_t, size, sfs_inode->file_size);
+		ret = simplefs_zero_range(inode, from, to);
+		if (ret)
+			return ret;
+	}
+
+	simplefs_lock(sb, &simplefs_inodes_mgmt_lock);
+	sfs_inode->file_size = size;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		return ret;
+
+	i_size_write(inode, size);
+	return 0;
+}
 
-	/*Ŀ¼жӦ*/
-	parent_dir_inode = SIMPLEFS_INODE(dir);
-	//ͨsimplefs_inodeеĳԱӶȡϢ
-	bh = sb_bread(sb, parent_dir_inode->data_block_number);
-	dir_contents_datablock = (struct simplefs_dir_record *)bh->b_data;
-	cache_entry = used_cache_entry_get(dir_cache,dentry);
-	dir_contents_datablock += cache_entry->entry_no;
-	memset(dir_contents_datablock,0x0,sizeof(struct simplefs_dir_record));
-	/*Ŀ¼ָݿΪdirtyд̣֮ͷ*/
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+static int simplefs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	int ret;
 
-	/*ӵǰĿ¼usedУɾǰcache_entry*/
-	list_del(&cache_entry->list);
-	//ͷŵcache_entry뵽ǰĿ¼free
-	list_add(&cache_entry->list,&dir_cache->free);
-	//Ŀ¼µinodeһ
-	dir_cache->dir_children_count--;
-	//Ŀ¼еdir_children_countҲԼ
-	parent_dir_inode->dir_children_count--;
-	//ͬǸInodeȻҲҪͬ
-	ret = simplefs_inode_save(sb, parent_dir_inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	ret = setattr_prepare(dentry, attr);
+#else
+	ret = inode_change_ok(inode, attr);
+#endif
+	if (ret)
+		return ret;
 
-	//InodeĴ洢УӦInode
-	simplefs_inode_del(sb,sfs_inode);
+	if ((attr->ia_valid & ATTR_SIZE) &&
+	    attr->ia_size != i_size_read(inode)) {
+		simplefs_mmap_lock(inode);
+		ret = simplefs_truncate(inode, attr->ia_size);
+		simplefs_mmap_unlock(inode);
+		if (ret)
+			return ret;
+	}
 
-	//ͷں˵inodeṹ
-	__destroy_inode(dentry->d_inode);
+	setattr_copy(inode, attr);
 
-	dput(dentry);
+	if (attr->ia_valid & ATTR_MODE) {
+		simplefs_lock(inode->i_sb, &simplefs_inodes_mgmt_lock);
+		sfs_inode->mode = inode->i_mode;
+		ret = simplefs_inode_save(inode->i_sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+	}
 
-	return 0;
+	return ret;
 }
 
 static int simplefs_mkdir(struct inode *dir, struct dentry *dentry,
 			  umode_t mode)
 {
+	u64 start = ktime_get_ns();
+	int ret;
+
 	/* I believe this is a bug in the kernel, for some reason, the mkdir callback
 	 * does not get the S_IFDIR flag set. Even ext2 sets is explicitly */
-	 
-	CDBG("%s LINE = %d\n",__func__,__LINE__);
-	return simplefs_create_fs_object(dir, dentry, S_IFDIR | mode);
+	ret = simplefs_create_fs_object(dir, dentry, S_IFDIR | mode);
+	trace_simplefs_create(dir, dentry, S_IFDIR | mode, ret);
+	simplefs_latency_add(dir->i_sb, SIMPLEFS_OP_CREATE, start);
+	return ret;
 }
 
 static int simplefs_create(struct inode *dir, struct dentry *dentry,
 			   umode_t mode, bool excl)
 {
-	CDBG("%s LINE = %d\n",__func__,__LINE__);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = simplefs_create_fs_object(dir, dentry, mode);
+	trace_simplefs_create(dir, dentry, mode, ret);
+	simplefs_latency_add(dir->i_sb, SIMPLEFS_OP_CREATE, start);
+	return ret;
+}
+
+/* Returns the in-memory inode for inode_no, reading it from the inode
+ * store only if it is not cached already. Every path that instantiates an
+ * inode goes through here, so hard links share a single struct inode. */
+static struct inode *simplefs_iget(struct super_block *sb, uint64_t inode_no)
+{
+	struct inode *inode;
+	struct simplefs_inode *sfs_inode;
+
+	inode = iget_locked(sb, inode_no);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	sfs_inode = simplefs_get_inode(sb, inode_no);
+	if (!sfs_inode) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	if (unlikely(sfs_inode->inode_no != inode_no)) {
+		/* A directory record points at an unused inode table slot */
+		printk(KERN_ERR "simplefs inode [%llu] is not in use\n", inode_no);
+		kmem_cache_free(sfs_inode_cachep, sfs_inode);
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
 
-	return simplefs_create_fs_object(dir, dentry, mode);
+	/* The entries are walked without bounds checks from now on */
+	if (unlikely(simplefs_xattr_check(sfs_inode->xattrs,
+					  SIMPLEFS_INLINE_XATTR_SIZE))) {
+		printk(KERN_ERR "simplefs inode [%llu] has corrupt extended attributes, run fsck-simplefs\n",
+		       inode_no);
+		kmem_cache_free(sfs_inode_cachep, sfs_inode);
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+
+	inode_init_owner(inode, NULL, sfs_inode->mode);
+	inode->i_op = &simplefs_inode_ops;
+	/* Images made before link counts were stored have zero here */
+	if (sfs_inode->nlink)
+		set_nlink(inode, sfs_inode->nlink);
+	else
+		set_nlink(inode, S_ISDIR(sfs_inode->mode) ? 2 : 1);
+
+	if (S_ISDIR(inode->i_mode)) {
+		inode->i_fop = &simplefs_dir_operations;
+	} else if (S_ISREG(inode->i_mode)) {
+		inode->i_fop = &simplefs_file_operations;
+		inode->i_size = sfs_inode->file_size;
+		simplefs_set_dax(inode);
+	} else
+		printk(KERN_ERR
+		       "Unknown inode type. Neither a directory nor a file");
+
+	/* FIXME: We should store these times to disk and retrieve them */
+	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+
+	inode->i_private = sfs_inode;
+	simplefs_update_blocks(inode);
+	unlock_new_inode(inode);
+
+	return inode;
 }
 /*         ˵
     parent_inode:
@@ -953,75 +4318,64 @@ static int simplefs_create(struct inode *dir, struct dentry *dentry,
     flags:
     
  */
-struct dentry *simplefs_lookup(struct inode *parent_inode,
-			       struct dentry *child_dentry, unsigned int flags)
+static struct dentry *__simplefs_lookup(struct inode *parent_inode,
+					struct dentry *child_dentry)
 {
 	struct super_block *sb = parent_inode->i_sb;
 	struct dentry *parent_dentry;
 	struct simplefs_dir_cache *dir_cache;
 	struct simplefs_cache_entry *cache_entry;
 	struct inode *inode;
-	struct simplefs_inode *sfs_inode;
 
-	CDBG("%s LINE = %d,%s\n",__func__,__LINE__,
-		child_dentry->d_name.name);
-	
 	//õĿ¼
 	parent_dentry = child_dentry->d_parent;
 	
 	if (parent_dentry->d_inode != parent_inode)
 		return ERR_PTR(-ENOENT);
+
+	if (child_dentry->d_name.len >= SIMPLEFS_FILENAME_MAXLEN)
+		return ERR_PTR(-ENAMETOOLONG);
 	
 	//õĿ¼˽: Ŀ¼Cache
-	dir_cache = (struct simplefs_dir_cache *)parent_dentry->d_fsdata;
-	
-	CDBG("%s LINE = %d\n",__func__,__LINE__);
+	dir_cache = simplefs_dir_cache_get(parent_dentry);
+	if (IS_ERR(dir_cache))
+		return ERR_CAST(dir_cache);
 
 	//Ŀ¼cacheеusedҵǰѯļcache_entry
 	cache_entry = used_cache_entry_get(dir_cache, child_dentry);
 
 	//cache_entryΪգ˵ļĿ¼УҪcreat
-	if (!cache_entry)
+	if (!cache_entry) {
+		simplefs_stat_inc(sb, SIMPLEFS_STAT_LOOKUP_MISS);
+		trace_simplefs_lookup(parent_inode, child_dentry, 0);
 		goto out;
-	
-	CDBG("%s check inode_no = %d\n",__func__,cache_entry->record.inode_no);
-
-	
-	sfs_inode = simplefs_get_inode(sb, cache_entry->record.inode_no);
-	if (!sfs_inode)
-		return ERR_PTR(-ENOENT);
-
-	
-	inode = new_inode(sb);
-	inode->i_ino = cache_entry->record.inode_no;
-	inode_init_owner(inode, parent_inode, sfs_inode->mode);
-	inode->i_sb = sb;
-	inode->i_op = &simplefs_inode_ops;
-
-	if (S_ISDIR(inode->i_mode))
-		inode->i_fop = &simplefs_dir_operations;
-	else if (S_ISREG(inode->i_mode))
-		inode->i_fop = &simplefs_file_operations;
-	else
-		printk(KERN_ERR
-		       "Unknown inode type. Neither a directory nor a file");
-
-	/* FIXME: We should store these times to disk and retrieve them */
-	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	}
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_LOOKUP_HIT);
+	trace_simplefs_lookup(parent_inode, child_dentry,
+			      cache_entry->record.inode_no);
 
-	inode->i_private = sfs_inode;
+	inode = simplefs_iget(sb, cache_entry->record.inode_no);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
 
 	d_add(child_dentry, inode);
-	
-	CDBG(KERN_ERR
-	       "No inode found for the filename [%s]\n",
-	       child_dentry->d_name.name);
 
 out:
 	return NULL;
 
 }
 
+struct dentry *simplefs_lookup(struct inode *parent_inode,
+			       struct dentry *child_dentry, unsigned int flags)
+{
+	u64 start = ktime_get_ns();
+	struct dentry *ret;
+
+	ret = __simplefs_lookup(parent_inode, child_dentry);
+	simplefs_latency_add(parent_inode->i_sb, SIMPLEFS_OP_LOOKUP, start);
+	return ret;
+}
+
 
 /**
  * Simplest
@@ -1030,73 +4384,337 @@ void simplefs_destory_inode(struct inode *inode)
 {
 	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
 
-	printk(KERN_INFO "Freeing private data of inode %p (%lu)\n",
-	       sfs_inode, inode->i_ino);
-	kmem_cache_free(sfs_inode_cachep, sfs_inode);
+	if (sfs_inode)
+		kmem_cache_free(sfs_inode_cachep, sfs_inode);
 }
 
-static const struct super_operations simplefs_sops = {
-	.destroy_inode = simplefs_destory_inode,
+/* Called when the last reference to an inode is dropped. Unlinked inodes
+ * are removed from the inode store here rather than in unlink, so that a
+ * file stays usable for as long as someone holds it open. */
+static void simplefs_evict_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t block, xattr_block;
+
+	truncate_inode_pages_final(&inode->i_data);
+
+	if (!inode->i_nlink && sfs_inode) {
+		block = sfs_inode->data_block_number;
+		xattr_block = sfs_inode->xattr_block;
+		simplefs_inode_del(sb, sfs_inode);
+		if (block)
+			simplefs_block_release(sb, block);
+		if (xattr_block) {
+			down_write(&simplefs_xattr_sem);
+			simplefs_xattr_block_put(sb, xattr_block);
+			up_write(&simplefs_xattr_sem);
+		}
+	}
+
+	clear_inode(inode);
+}
+
+/* Sanity check the layout recorded by mkfs before trusting any of it */
+static int simplefs_check_geometry(struct super_block *sb,
+				   struct simplefs_super_block *sfs_sb)
+{
+	uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	const char *why = simplefs_check_layout(sfs_sb);
+
+	if (sfs_sb->blocks_count > dev_blocks) {
+		printk(KERN_ERR "simplefs has [%llu] blocks but the device only [%llu]\n",
+		       sfs_sb->blocks_count, dev_blocks);
+		return -EINVAL;
+	}
+
+	if (!why && (sfs_sb->free_blocks > sfs_sb->blocks_count - simplefs_overhead(sfs_sb) ||
+		     sfs_sb->inodes_count > sfs_sb->inodes_max))
+		why = "impossible free counts";
+	if (why) {
+		printk(KERN_ERR "simplefs super block is not usable: %s\n", why);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+enum {
+	Opt_discard, Opt_nodiscard, Opt_compress, Opt_nocompress, Opt_dax,
+	Opt_err
 };
 
-static void simplefs_dentry_release(struct dentry *dentry)
+static const match_table_t simplefs_tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_compress, "compress=%s"},
+	{Opt_nocompress, "nocompress"},
+	{Opt_dax, "dax"},
+	{Opt_err, NULL}
+};
+
+static int simplefs_parse_options(struct super_block *sb, char *options,
+				  struct simplefs_sb_info *sb_info)
 {
-	struct simplefs_dir_cache *dir_cache = dentry->d_fsdata;
-	struct simplefs_cache_entry *tmp, *cache_entry;
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
 
-	if (dir_cache) {
-		list_for_each_entry_safe(cache_entry, tmp, &dir_cache->free, list) {
-		list_del(&cache_entry->list);
-		kmem_cache_free(sfs_entry_cachep, cache_entry);
-		}
+	if (!options)
+		return 0;
 
-		list_for_each_entry_safe(cache_entry, tmp, &dir_cache->used, list) {
-		list_del(&cache_entry->list);
-		kmem_cache_free(sfs_entry_cachep, cache_entry);
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, simplefs_tokens, args)) {
+		case Opt_discard:
+			set_opt(sb_info, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(sb_info, DISCARD);
+			break;
+		case Opt_compress:
+			/* zstd only came to the kernel in 4.14 */
+			if (strcmp(args[0].from, "lz4") || !SIMPLEFS_HAVE_LZ4) {
+				printk(KERN_ERR "simplefs: compression \"%s\" is not supported\n",
+				       args[0].from);
+				return -EINVAL;
+			}
+			set_opt(sb_info, COMPRESS);
+			break;
+		case Opt_nocompress:
+			clear_opt(sb_info, COMPRESS);
+			break;
+		case Opt_dax:
+			if (!SIMPLEFS_HAVE_DAX) {
+				printk(KERN_ERR "simplefs: dax is not supported by this kernel\n");
+				return -EINVAL;
+			}
+			set_opt(sb_info, DAX);
+			break;
+		default:
+			printk(KERN_ERR "simplefs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
 		}
 	}
 
-	kfree(dir_cache);
-	dentry->d_fsdata = NULL;
+	/* A DAX file is written in place, a compressed one never is */
+	if (test_opt(sb_info, DAX) && test_opt(sb_info, COMPRESS)) {
+		printk(KERN_ERR "simplefs: dax and compress=lz4 cannot be used together\n");
+		return -EINVAL;
+	}
+
+	if (test_opt(sb_info, DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		printk(KERN_WARNING
+		       "simplefs: device does not support discard, ignoring -o discard\n");
+		clear_opt(sb_info, DISCARD);
+	}
+
+	return 0;
 }
 
-static const struct dentry_operations simplefs_dentry_operations = {
-	.d_release = simplefs_dentry_release,
-};
+/* Set SIMPLEFS_SB_DIRTY while mounted read-write. It is only cleared if it
+ * was not already set at mount, the bitmap checksums of a filesystem that
+ * went down with it set stay suspect until fsck-simplefs has run. */
+static void simplefs_set_dirty(struct super_block *sb, bool dirty)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+
+	simplefs_lock(sb, &simplefs_sb_lock);
+	if (dirty)
+		sb_info->sb->flags |= SIMPLEFS_SB_DIRTY;
+	else if (!sb_info->bitmaps_unverified)
+		sb_info->sb->flags &= ~SIMPLEFS_SB_DIRTY;
+	simplefs_sb_sync(sb);
+	mutex_unlock(&simplefs_sb_lock);
+}
 
-static void fill_imap(struct super_block *sb)
+static int simplefs_remount(struct super_block *sb, int *flags, char *data)
 {
-	int i;
-	struct simplefs_sb_info *sb_info = sb->s_fs_info;
-	struct simplefs_inode *simple_inode;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	unsigned long old_opt = sb_info->mount_opt;
+	int ret;
+
+	if (simplefs_read_only_image(sb) && !(*flags & MS_RDONLY))
+		return -EROFS;
+
+	sync_filesystem(sb);
+
+	ret = simplefs_parse_options(sb, data, sb_info);
+	/* Open files keep the operations they were given */
+	if (!ret && test_opt(sb_info, DAX) != (old_opt & SIMPLEFS_MOUNT_DAX)) {
+		printk(KERN_ERR "simplefs: dax cannot be changed on remount\n");
+		ret = -EINVAL;
+	}
+	if (ret) {
+		sb_info->mount_opt = old_opt;
+		return ret;
+	}
+
+	if ((*flags & MS_RDONLY) != (sb->s_flags & MS_RDONLY) &&
+	    !simplefs_read_only_image(sb)) {
+		if (*flags & MS_RDONLY)
+			simplefs_sb_flush_deferred(sb);
+		simplefs_set_dirty(sb, !(*flags & MS_RDONLY));
+	}
+
+	return 0;
+}
+
+/* Pin the group descriptor blocks, check them and set up the group locks */
+static int simplefs_load_groups(struct super_block *sb)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_super_block *sfs_sb = sb_info->sb;
+	struct simplefs_group_desc *desc;
 	struct buffer_head *bh;
-	int icount = SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode);
+	uint64_t i;
+
+	sb_info->gdt_bh = kcalloc(sfs_sb->gdt_blocks, sizeof(*sb_info->gdt_bh),
+				  GFP_KERNEL);
+	/* Room for the groups SIMPLEFS_IOC_GROW can add */
+	sb_info->groups = vzalloc(simplefs_gdt_capacity(sfs_sb) *
+				  sizeof(*sb_info->groups));
+	if (!sb_info->gdt_bh || !sb_info->groups)
+		return -ENOMEM;
 
-	bh = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	simple_inode = (struct simplefs_inode *)bh->b_data;
-	
-	CDBG("%s start,root inode = %d\n",__func__,simple_inode->inode_no);
-	CDBG("sb imap inode no = %d\n",ffz(sb_info->imap));
-
-	/*1bitԤãΪrootڵǴ1ʼ*/
-	for (i = 0; i < SIMPLEFS_START_INO; i++)
-		set_bit(i, &sb_info->imap);
-
-	/*inodeԪУȶԣѾʹõinodebitmapб*/
-	for (i = SIMPLEFS_START_INO; i < icount; i++) {
-		if (simple_inode->inode_no != 0) {
-			printk("func %s, line %d, ino %lld\n", __func__, __LINE__, simple_inode->inode_no);
-			set_bit(simple_inode->inode_no, &sb_info->imap);
+	/* Queue all of them before waiting for the first */
+	for (i = 1; i < sfs_sb->gdt_blocks; i++)
+		simplefs_breadahead(sb, sfs_sb->gdt_block + i);
+	for (i = 0; i < sfs_sb->gdt_blocks; i++) {
+		sb_info->gdt_bh[i] = simplefs_bread(sb, sfs_sb->gdt_block + i);
+		if (!sb_info->gdt_bh[i])
+			return -EIO;
+	}
+	for (i = 0; i < sfs_sb->groups_count; i++) {
+		desc = simplefs_group_desc(sb, i, &bh);
+		if (desc->checksum != simplefs_desc_csum(desc)) {
+			printk(KERN_ERR
+			       "simplefs: group [%llu] descriptor has a bad checksum, run fsck-simplefs\n",
+			       i);
+			return -EBADMSG;
 		}
-		simple_inode++;
+		mutex_init(&sb_info->groups[i].lock);
 	}
-	
-	CDBG("sb imap inode no = %d\n",ffz(sb_info->imap));
-	CDBG("%s end\n",__func__);
 
-	brelse(bh);
+	return 0;
+}
+
+/* Undo simplefs_load_groups, also after it failed half way */
+static void simplefs_put_groups(struct simplefs_sb_info *sb_info)
+{
+	uint64_t i;
+
+	if (sb_info->gdt_bh) {
+		for (i = 0; i < sb_info->sb->gdt_blocks; i++)
+			brelse(sb_info->gdt_bh[i]);
+	}
+	kfree(sb_info->gdt_bh);
+	vfree(sb_info->groups);
+	sb_info->gdt_bh = NULL;
+	sb_info->groups = NULL;
+}
+
+static void simplefs_put_super(struct super_block *sb)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+
+	/* evict_inode has run for every inode by now, so nothing new can be
+	 * queued behind the final flush */
+	cancel_delayed_work_sync(&sb_info->free_work);
+	if (!simplefs_read_only_image(sb)) {
+		simplefs_sb_flush_deferred(sb);
+		/* A read-only mount never set it and must not write */
+		if (!(sb->s_flags & MS_RDONLY))
+			simplefs_set_dirty(sb, false);
+	}
+	percpu_counter_destroy(&sb_info->free_blocks);
+	percpu_counter_destroy(&sb_info->free_inodes);
+	simplefs_stats_unregister(sb);
+	simplefs_put_groups(sb_info);
+	simplefs_xattr_cache_destroy(sb_info);
+	brelse(sb_info->bh);
+}
+
+/* The super block is only written here, on umount and when deferred frees
+ * are merged, so a crash can leave stale free counts behind. fsck-simplefs
+ * recomputes them. */
+static int simplefs_sync_fs(struct super_block *sb, int wait)
+{
+	if (!wait || simplefs_read_only_image(sb))
+		return 0;
+
+	simplefs_sb_flush_deferred(sb);
+	simplefs_lock(sb, &simplefs_sb_lock);
+	simplefs_sb_sync(sb);
+	mutex_unlock(&simplefs_sb_lock);
+	return 0;
+}
+
+/* O(1): everything comes from the super block and the percpu counters.
+ * Blocks waiting on the deferred free list are reported as free already. */
+static int simplefs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(sb);
+	struct simplefs_super_block *sfs_sb = sb_info->sb;
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = SIMPLEFS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sfs_sb->blocks_count - simplefs_overhead(sfs_sb);
+	buf->f_bfree = percpu_counter_read_positive(&sb_info->free_blocks) +
+		       READ_ONCE(sb_info->free_pending);
+	buf->f_bfree = min_t(u64, buf->f_bfree, buf->f_blocks);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sfs_sb->inodes_max;
+	buf->f_ffree = percpu_counter_read_positive(&sb_info->free_inodes);
+	/* The record has room for the terminating NUL */
+	buf->f_namelen = SIMPLEFS_FILENAME_MAXLEN - 1;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+
+	return 0;
+}
+
+static int simplefs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct simplefs_sb_info *sb_info = SIMPLEFS_SB(root->d_sb);
+
+	if (test_opt(sb_info, DISCARD))
+		seq_puts(seq, ",discard");
+	if (test_opt(sb_info, COMPRESS))
+		seq_puts(seq, ",compress=lz4");
+	if (test_opt(sb_info, DAX))
+		seq_puts(seq, ",dax");
+	return 0;
+}
+
+static const struct super_operations simplefs_sops = {
+	.destroy_inode = simplefs_destory_inode,
+	.evict_inode = simplefs_evict_inode,
+	.put_super = simplefs_put_super,
+	.sync_fs = simplefs_sync_fs,
+	.statfs = simplefs_statfs,
+	.show_options = simplefs_show_options,
+	.remount_fs = simplefs_remount,
+};
+
+static void simplefs_dentry_release(struct dentry *dentry)
+{
+	struct simplefs_dir_cache *dir_cache = dentry->d_fsdata;
+
+	if (dir_cache)
+		simplefs_cache_free(dir_cache);
+
+	dentry->d_fsdata = NULL;
 }
 
+static const struct dentry_operations simplefs_dentry_operations = {
+	.d_release = simplefs_dentry_release,
+};
+
 
 /* This function, as the name implies, Makes the super_block valid and
  * fills filesystem specific information in the super block */
@@ -1109,7 +4727,18 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 	int ret = -EPERM;
 
 	sb_info = kzalloc(sizeof(struct simplefs_sb_info),GFP_KERNEL);
-	bh = sb_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
+	if (!sb_info)
+		return -ENOMEM;
+	/* For all practical purposes, we will be using this s_fs_info as the super block */
+	//ʹں˵sb˽ָָ򳬼Ļ
+	sb->s_fs_info = sb_info;
+	/* The counters must exist before the first read below */
+	if (simplefs_stats_init(sb)) {
+		sb->s_fs_info = NULL;
+		kfree(sb_info);
+		return -ENOMEM;
+	}
+	bh = simplefs_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
 	BUG_ON(!bh);
 	//ȡдŵsuper blockʵ
 	sb_disk = (struct simplefs_super_block *)bh->b_data;
@@ -1118,6 +4747,11 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 	sb_info->sb = sb_disk;
 	//ó黺ָbuffer_head
 	sb_info->bh = bh;
+	sb_info->vfs_sb = sb;
+	spin_lock_init(&sb_info->free_lock);
+	INIT_LIST_HEAD(&sb_info->free_extents);
+	INIT_DELAYED_WORK(&sb_info->free_work, simplefs_free_worker);
+	hash_init(sb_info->xattr_blocks);
 
 	printk(KERN_INFO "The magic number obtained in disk is: [%llu]\n",
 	       sb_disk->magic);
@@ -1128,9 +4762,27 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
-	if (unlikely(sb_disk->block_size != SIMPLEFS_DEFAULT_BLOCK_SIZE)) {
+	if (unlikely(sb_disk->version != SIMPLEFS_LAYOUT_VERSION)) {
+		printk(KERN_ERR
+		       "simplefs layout version [%llu] is not supported, only [%d]. Reformat with a matching mkfs-simplefs.",
+		       sb_disk->version, SIMPLEFS_LAYOUT_VERSION);
+		goto release;
+	}
+
+	if (unlikely(sb_disk->block_size < SIMPLEFS_MIN_BLOCK_SIZE ||
+		     sb_disk->block_size > SIMPLEFS_MAX_BLOCK_SIZE ||
+		     !is_power_of_2(sb_disk->block_size))) {
+		printk(KERN_ERR
+		       "simplefs seem to be formatted using an invalid block size [%llu].",
+		       sb_disk->block_size);
+		goto release;
+	}
+
+	/* The buffer cache cannot map blocks larger than a page */
+	if (unlikely(sb_disk->block_size > PAGE_SIZE)) {
 		printk(KERN_ERR
-		       "simplefs seem to be formatted using a non-standard block size.");
+		       "simplefs block size [%llu] is larger than the page size [%lu], cannot mount.",
+		       sb_disk->block_size, PAGE_SIZE);
 		goto release;
 	}
 
@@ -1138,53 +4790,106 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 	       "simplefs filesystem of version [%llu] formatted with a block size of [%llu] detected in the device.\n",
 	       sb_disk->version, sb_disk->block_size);
 
+	/* Block 0 was read with the device's default block size. Switch to
+	 * the one the filesystem was made with and read it again. */
+	if (sb->s_blocksize != sb_disk->block_size) {
+		if (!sb_set_blocksize(sb, sb_disk->block_size)) {
+			printk(KERN_ERR
+			       "simplefs block size [%llu] is smaller than the device sector size.",
+			       sb_disk->block_size);
+			goto release;
+		}
+		brelse(bh);
+		bh = simplefs_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
+		if (!bh) {
+			ret = -EIO;
+			goto free;
+		}
+		sb_disk = (struct simplefs_super_block *)bh->b_data;
+		sb_info->sb = sb_disk;
+		sb_info->bh = bh;
+	}
+
+	if (unlikely(simplefs_check_geometry(sb, sb_disk))) {
+		ret = -EINVAL;
+		goto release;
+	}
+
+	if (unlikely(sb_disk->checksum != simplefs_sb_csum(sb_disk))) {
+		printk(KERN_ERR
+		       "simplefs super block has a bad checksum, run fsck-simplefs\n");
+		ret = -EBADMSG;
+		goto release;
+	}
+
+	ret = simplefs_parse_options(sb, data, sb_info);
+	if (ret)
+		goto release;
+
+#if SIMPLEFS_HAVE_DAX
+	/* Also refuses blocks smaller than a page, which DAX maps one to one */
+	if (test_opt(sb_info, DAX)) {
+		ret = bdev_dax_supported(sb, sb->s_blocksize);
+		if (ret)
+			goto release;
+	}
+#endif
+
+	ret = percpu_counter_init(&sb_info->free_blocks, sb_disk->free_blocks,
+				  GFP_KERNEL);
+	if (!ret)
+		ret = percpu_counter_init(&sb_info->free_inodes,
+					  sb_disk->inodes_max - sb_disk->inodes_count,
+					  GFP_KERNEL);
+	if (ret)
+		goto release;
+
+	/* Only the group descriptors are read here. The bitmaps are read a
+	 * block at a time as allocations need them, so there is nothing to
+	 * scan. A read-only image needs neither. */
+	if (simplefs_read_only_image(sb)) {
+		if (!(sb->s_flags & MS_RDONLY))
+			printk(KERN_INFO "simplefs: read-only image, mounting read-only\n");
+		sb->s_flags |= MS_RDONLY;
+	} else {
+		ret = simplefs_load_groups(sb);
+		if (ret)
+			goto release;
+		sb_info->bitmaps_unverified = sb_disk->flags & SIMPLEFS_SB_DIRTY;
+		if (sb_info->bitmaps_unverified)
+			printk(KERN_WARNING
+			       "simplefs was not unmounted cleanly, bitmap checksums are not checked until fsck-simplefs has run\n");
+	}
+	/* New files of the root go to its group. A read-only mount never
+	 * looks at the bitmaps. */
+	if (!(sb->s_flags & MS_RDONLY))
+		simplefs_group_prefetch(sb, 0);
+
 	/* A magic number that uniquely identifies our filesystem type */
 	//sbеħʹеһ
 	sb->s_magic = SIMPLEFS_MAGIC;
 
-	/* For all practical purposes, we will be using this s_fs_info as the super block */
-	//ʹں˵sb˽ָָ򳬼Ļ
-	sb->s_fs_info = sb_info;
-	//ǰļϵͳݿΪ4K
-	sb->s_maxbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	//ǰļϵͳļСΪһݿ
+	/* or a few when compressed */
+	sb->s_maxbytes = sb->s_blocksize * SIMPLEFS_MAX_COMPRESSED_BLOCKS;
+	sb->s_max_links = SIMPLEFS_LINK_MAX;
 	//ʵInodedestroyָ룬ļϵͳļɾӦInodeᱻ
 	//ָĺͷ
 	sb->s_op = &simplefs_sops;
 	
 	sb->s_d_op = &simplefs_dentry_operations;
-	/*³黺дŵinode bitmap*/
-	fill_imap(sb);
+	sb->s_xattr = simplefs_xattr_handlers;
+
+	ret = simplefs_stats_register(sb);
+	if (ret)
+		goto release;
 
 	//ΪǵĸڵһInode
-	root_inode = new_inode(sb);
-	//øڵInode
-	root_inode->i_ino = SIMPLEFS_ROOTDIR_INODE_NUMBER;
-	//InodeһĿ¼ΪǸdentryĿ¼ΪNULL
-	inode_init_owner(root_inode, NULL, S_IFDIR);
-	//ָļϵͳĳ
-	root_inode->i_sb = sb;
-	//ΪҪڸڵ½вҪʵֽڵĲָ
-	/*
-	 * 	1.һͨļcreateָ;
-	 * 	2.һͨļ֮ǰҪȵlookupָ;
-	 * 	3.һĿ¼mkdir;
-	 */
-	root_inode->i_op = &simplefs_inode_ops;
-	//Provide Io Operation For UserSpace,eg:readdir
-	//ǷҪ֧ļĲд,mmap
-	root_inode->i_fop = &simplefs_dir_operations;
-	//InodeĴʱ
-	root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime =
-	    CURRENT_TIME;
-	//ȻǸڵ㣬ȻҪȡڵݣi_privateָڵϢ
-	/*
-		Ϣ:
-		1.ڵ
-		2.ڵݴŵλ-> DATA_BLOCK_BUMBER
-		3.ڵӽڵ
-	*/
-	root_inode->i_private =
-	    simplefs_get_inode(sb, SIMPLEFS_ROOTDIR_INODE_NUMBER);
+	root_inode = simplefs_iget(sb, SIMPLEFS_ROOTDIR_INODE_NUMBER);
+	if (IS_ERR(root_inode)) {
+		ret = PTR_ERR(root_inode);
+		goto unregister;
+	}
 
 	
 	/* TODO: move such stuff into separate header. */
@@ -1199,13 +4904,27 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto release;
+		goto unregister;
 	}
 
+	if (!(sb->s_flags & MS_RDONLY))
+		simplefs_set_dirty(sb, true);
+
+	/* The superblock buffer stays pinned until put_super */
+	return 0;
 
-	ret = 0;
+unregister:
+	simplefs_stats_unregister(sb);
 release:
+	simplefs_put_groups(sb_info);
 	brelse(bh);
+free:
+	sb->s_fs_info = NULL;
+	/* No-ops on counters that were never set up */
+	percpu_counter_destroy(&sb_info->free_blocks);
+	percpu_counter_destroy(&sb_info->free_inodes);
+	simplefs_stats_destroy(sb_info);
+	kfree(sb_info);
 
 	return ret;
 }
@@ -1238,6 +4957,8 @@ static void simplefs_kill_superblock(struct super_block *sb)
 
 	kill_block_super(sb);
 	//brelse(sb_info->bh);
+	if (sb_info)
+		simplefs_stats_destroy(sb_info);
 	kfree(sb_info);
 	return;
 }
@@ -1275,11 +4996,17 @@ static int simplefs_init(void)
 		return -ENOMEM;
 	}
 
+	ret = simplefs_stats_module_init();
+	if (ret)
+		return ret;
+
 	ret = register_filesystem(&simplefs_fs_type);
 	if (likely(ret == 0))
 		printk(KERN_INFO "Sucessfully registered simplefs\n");
-	else
+	else {
 		printk(KERN_ERR "Failed to register simplefs. Error:[%d]", ret);
+		simplefs_stats_module_exit();
+	}
 
 	return ret;
 }
@@ -1289,6 +5016,7 @@ static void simplefs_exit(void)
 	int ret;
 
 	ret = unregister_filesystem(&simplefs_fs_type);
+	simplefs_stats_module_exit();
 	kmem_cache_destroy(sfs_inode_cachep);
 
 	if (likely(ret == 0))
@@ -9,7 +9,21 @@
 */
 
 #define SIMPLEFS_MAGIC 0x10032013
+/* Bumped whenever the on-disk layout changes incompatibly.
+ * 2: block bitmap and multi-block inode table sized to the device
+ * 3: inode bitmap and next free inode hint
+ * 4: allocation groups
+ * 5: reference counts of blocks shared by cloned files
+ * 6: 64 byte inodes with flags, for compressed files
+ * 7: read-only images with files packed together, see SIMPLEFS_SB_READ_ONLY
+ * 8: crc32c checksums of the metadata, see SIMPLEFS_CSUM_SEED
+ * 9: 256 byte inodes with extended attributes, see simplefs_xattr_entry */
+#define SIMPLEFS_LAYOUT_VERSION 9
 #define SIMPLEFS_DEFAULT_BLOCK_SIZE 4096
+/* Block sizes mkfs-simplefs accepts. The kernel can only mount those that
+ * are no larger than PAGE_SIZE. */
+#define SIMPLEFS_MIN_BLOCK_SIZE 1024
+#define SIMPLEFS_MAX_BLOCK_SIZE 65536
 #define SIMPLEFS_FILENAME_MAXLEN 255
 #define SIMPLEFS_START_INO 1
 #define SIMPLEFS_ICOUNT 256
@@ -19,6 +33,9 @@
  */
 #define SIMPLEFS_RESERVED_INODES 3
 
+/* Upper bound on hard links to a single inode, enforced by the VFS */
+#define SIMPLEFS_LINK_MAX 65000
+
 #define SIMPLEFS_MAX_CHILDREN_CNT 64//(SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_dir_record))
 #ifdef SIMPLEFS_DEBUG
 #define sfs_trace(fmt, ...) {                       \
@@ -34,17 +51,44 @@
 #endif
 
 /* Hard-coded inode number for the root directory */
-const int SIMPLEFS_ROOTDIR_INODE_NUMBER = 1;
+static const int SIMPLEFS_ROOTDIR_INODE_NUMBER = 1;
+
+/* The disk block where super block is stored. The rest of the device is
+ * split into allocation groups of blocks_per_group blocks, group g
+ * covering [g * blocks_per_group, (g + 1) * blocks_per_group):
+ *
+ *   0                        super block
+ *   gdt_block ...            group descriptors, in group 0
+ *
+ * and at the start of every group (after the descriptors in group 0)
+ *
+ *   block bitmap             one block, bit i for the group's i-th block, 1 = in use
+ *   inode bitmap             one block, bit i for the group's i-th inode
+ *   reference counts         one block, the group's shared data blocks
+ *   inode table              itable_blocks blocks, inodes_per_group slots
+ *   data blocks              in group 0 the first one is the root directory
+ *
+ * Inode N is the ((N - 1) % inodes_per_group)-th inode of group
+ * (N - 1) / inodes_per_group.
+ */
+static const int SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 
-/* The disk block where super block is stored */
-const int SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER = 0;
+/* mkfs creates one inode table slot for every this many blocks */
+#define SIMPLEFS_BLOCKS_PER_INODE 4
 
-/* The disk block where the inodes are stored */
-const int SIMPLEFS_INODESTORE_BLOCK_NUMBER = 1;
+/* The super block, group descriptors, inodes, bitmaps, reference count
+ * tables and directory blocks are checksummed with crc32c (Castagnoli, as
+ * computed by the SSE4.2 and arm64 CRC instructions), starting from this
+ * value and without a final inversion. A structure's checksum is its last
+ * field and covers everything before it. The bitmaps and the reference
+ * count table of a group fill their blocks, so their checksums are kept in
+ * the group descriptor. Free inode table slots are all zeroes and have
+ * none. */
+#define SIMPLEFS_CSUM_SEED 0xffffffffU
 
-/* The disk block where the name+inode_number pairs of the
- * contents of the root directory are stored */
-const int SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER = 2;
+/* A directory block's checksum is in its last four bytes, which the
+ * records never reach at any block size */
+#define SIMPLEFS_DIR_CSUM_OFFSET(block_size) ((block_size) - sizeof(uint32_t))
 
 /* The name+inode_number pair for each file in a directory.
  * This gets stored as the data for a directory */
@@ -53,8 +97,14 @@ struct simplefs_dir_record {
 	uint64_t inode_no;
 };
 
+/* Bytes of an inode given to extended attributes, what is left of 256 */
+#define SIMPLEFS_INLINE_XATTR_SIZE 196
+
 struct simplefs_inode {
 	mode_t mode;
+	/* Number of directory records pointing at this inode. Directories
+	 * count 2 + the number of child directories, as in ext2. */
+	uint32_t nlink;
 	uint64_t inode_no;
 	uint64_t data_block_number;
 
@@ -62,13 +112,136 @@ struct simplefs_inode {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+
+	/* SIMPLEFS_INODE_* */
+	uint32_t flags;
+	/* Bytes of the data block that hold the compressed data of an
+	 * SIMPLEFS_INODE_LZ4 file, 0 otherwise */
+	uint32_t compressed_size;
+	/* Where the data starts in the data block, 0 unless
+	 * SIMPLEFS_INODE_PACKED */
+	uint32_t data_offset;
+	uint32_t reserved;
+	/* The block holding the extended attributes that do not fit in
+	 * xattrs, 0 if there is none */
+	uint64_t xattr_block;
+	/* Extended attributes kept in the inode itself, so that reading them
+	 * takes no I/O once the inode is in memory */
+	uint8_t xattrs[SIMPLEFS_INLINE_XATTR_SIZE];
+	/* The size must stay a power of two, so that no inode straddles two
+	 * blocks of the inode table */
+	uint32_t checksum;
+};
+
+/* The data block holds the file_size bytes of the file compressed with
+ * LZ4 (the block format, without a frame). Set exactly when the file is
+ * larger than a block. */
+#define SIMPLEFS_INODE_LZ4		0x0001
+/* Never compress the file, FS_NOCOMP_FL (chattr +m) */
+#define SIMPLEFS_INODE_NOCOMPRESS	0x0002
+/* The data block is shared with other small files of a read-only image,
+ * this one's data is at data_offset. Packed blocks have no reference
+ * count, they are never freed. */
+#define SIMPLEFS_INODE_PACKED		0x0004
+
+/* An extended attribute. The xattrs of an inode and its xattr block hold
+ * these back to back, each padded to 4 bytes, up to the end of the area or
+ * an entry with a name_len of 0, and all zeroes after that. The name
+ * (without its prefix or a NUL) follows the entry and the value follows
+ * the name. */
+struct simplefs_xattr_entry {
+	/* SIMPLEFS_XATTR_INDEX_*, the prefix of the name */
+	uint8_t name_index;
+	uint8_t name_len;
+	uint16_t value_size;
+	char name[];
+};
+
+#define SIMPLEFS_XATTR_INDEX_USER	1	/* user. */
+#define SIMPLEFS_XATTR_INDEX_TRUSTED	2	/* trusted. */
+#define SIMPLEFS_XATTR_INDEX_SECURITY	3	/* security. */
+
+/* An xattr block starts with this header and has its checksum in its last
+ * four bytes, like a directory block, with the entries in between. It is
+ * never changed in place: new attributes go to a new block. Inodes whose
+ * attributes come out the same share one, which then has a reference
+ * count like the data block of a clone. */
+struct simplefs_xattr_header {
+	uint32_t magic;
+	uint32_t reserved;
+};
+
+#define SIMPLEFS_XATTR_MAGIC 0x53465841
+
+/* Bytes for entries in an xattr block */
+#define SIMPLEFS_XATTR_BLOCK_AREA(block_size) \
+	((block_size) - sizeof(struct simplefs_xattr_header) - sizeof(uint32_t))
+
+/* SIMPLEFS_IOC_DEFRAG moves the data block of a regular file, which must be
+ * open for writing, to the first free block at or after goal in goal's
+ * group (wrapping around to the start of its data area), if that is closer
+ * to goal than where it is. goal 0 means the start of the data area of the
+ * file's inode group. Holes and blocks shared with a clone are left alone.
+ * block returns where the data is afterwards, 0 for a hole. */
+struct simplefs_defrag {
+	uint64_t goal;
+	uint64_t block;
 };
 
-const int SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
-/* min (
-		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode),
-		sizeof(uint64_t) //The free_blocks tracker in the sb
- 	); */
+#define SIMPLEFS_IOC_DEFRAG _IOWR('S', 1, struct simplefs_defrag)
+
+/* SIMPLEFS_IOC_GROW takes the number of blocks the filesystem should have,
+ * 0 for all of the device, and returns the number it has afterwards. The
+ * last group is filled up and new groups are added behind it, as many as
+ * the group descriptor table has room for (mkfs-simplefs leaves room to
+ * grow), see simplefs_grow_layout. Shrinking is not supported. */
+#define SIMPLEFS_IOC_GROW _IOWR('S', 2, uint64_t)
+
+/* A file has one data block; compressed, it can hold up to this many
+ * blocks worth of data */
+#define SIMPLEFS_MAX_COMPRESSED_BLOCKS 4
+
+#define SIMPLEFS_INODES_PER_BLOCK(block_size) \
+	((block_size) / sizeof(struct simplefs_inode))
+
+/* A data block that more than one file points at, after a clone. Blocks
+ * with a single owner are not in the table; the first one to be cloned is
+ * entered with a count of 2 and the entry is cleared when the count drops
+ * back to 1. */
+struct simplefs_refcount {
+	/* Of the block in its group. The first block of a group is always
+	 * metadata, so 0 marks a free entry. */
+	uint32_t index;
+	/* Files pointing at the block */
+	uint32_t count;
+};
+
+#define SIMPLEFS_REFS_PER_BLOCK(block_size) \
+	((block_size) / sizeof(struct simplefs_refcount))
+
+/* What the allocators need to know about a group without reading its
+ * bitmaps */
+struct simplefs_group_desc {
+	uint64_t free_blocks;
+	uint64_t free_inodes;
+	/* New directories go to groups with few of them */
+	uint64_t dirs;
+	/* No inode of the group below this index is free. Only a hint, a
+	 * stale value costs a longer search and fsck-simplefs recomputes it. */
+	uint64_t inode_hint;
+	/* Entries in the group's reference count table. While it is 0 no
+	 * block of the group is shared and the table is never read. */
+	uint64_t shared_blocks;
+	/* Of the group's block bitmap, inode bitmap and reference count
+	 * table. They are written separately from the descriptor, so after a
+	 * crash they may not match, see SIMPLEFS_SB_DIRTY. */
+	uint32_t bmap_checksum;
+	uint32_t imap_checksum;
+	uint32_t refs_checksum;
+	/* The size must stay a power of two, see simplefs_gdt_locate */
+	uint32_t reserved[2];
+	uint32_t checksum;
+};
 
 /* FIXME: Move the struct to its own file and not expose the members
  * Always access using the simplefs_sb_* functions and
@@ -81,13 +254,457 @@ struct simplefs_super_block {
 	/* FIXME: This should be moved to the inode store and not part of the sb */
 	uint64_t inodes_count;
 
+	/* Number of unused blocks, the sum of those of the groups */
 	uint64_t free_blocks;
 
-	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (5 * sizeof(uint64_t))];
-};
+	/* Geometry, fixed by mkfs */
+	uint64_t blocks_count;
+	uint64_t inodes_max;
+	uint64_t groups_count;
+	uint64_t blocks_per_group;
+	uint64_t inodes_per_group;
+	uint64_t gdt_block;
+	uint64_t gdt_blocks;
+	/* Inode table blocks of each group */
+	uint64_t itable_blocks;
+	/* The first data block of group 0 */
+	uint64_t data_block;
+
+	/* SIMPLEFS_SB_* */
+	uint64_t flags;
+
+	uint32_t reserved;
+	uint32_t checksum;
 
-struct simplefs_sb_info {
-	struct simplefs_super_block *sb;
-	unsigned long imap;
-	struct buffer_head *bh;
+	/* The rest of block 0 is unused; pad to the smallest block size */
+	char padding[SIMPLEFS_MIN_BLOCK_SIZE - (16 * sizeof(uint64_t))];
 };
+
+/* Made by mkfs-simplefs --from-dir and never written again: the image is
+ * only mounted read-only, which takes none of the allocator locks */
+#define SIMPLEFS_SB_READ_ONLY	0x0001
+/* Mounted read-write, or it was when the system went down. The bitmap
+ * checksums in the group descriptors may then lag behind the bitmaps and
+ * are not verified. Cleared on umount unless it was already set at mount,
+ * in which case only fsck-simplefs clears it. */
+#define SIMPLEFS_SB_DIRTY	0x0002
+
+/* Layout helpers shared by the kernel module and libsimplefs. They only
+ * look at the on-disk structures above, and use shifts rather than 64 bit
+ * divisions so that they build for 32 bit kernels as well. */
+
+#define SIMPLEFS_DIR_RECORDS_PER_BLOCK(block_size) \
+	((block_size) / sizeof(struct simplefs_dir_record))
+
+static inline int simplefs_valid_block_size(uint64_t block_size)
+{
+	return block_size >= SIMPLEFS_MIN_BLOCK_SIZE &&
+	       block_size <= SIMPLEFS_MAX_BLOCK_SIZE &&
+	       !(block_size & (block_size - 1));
+}
+
+static inline unsigned int simplefs_block_bits(const struct simplefs_super_block *sb)
+{
+	return __builtin_ctzll(sb->block_size);
+}
+
+static inline unsigned int simplefs_group_bits(const struct simplefs_super_block *sb)
+{
+	return simplefs_block_bits(sb) + 3;
+}
+
+/* The group's block bitmap, the first of its metadata blocks */
+static inline uint64_t simplefs_group_bmap(const struct simplefs_super_block *sb,
+					   uint64_t group)
+{
+	if (!group)
+		return sb->gdt_block + sb->gdt_blocks;
+	return group << simplefs_group_bits(sb);
+}
+
+static inline uint64_t simplefs_group_imap(const struct simplefs_super_block *sb,
+					   uint64_t group)
+{
+	return simplefs_group_bmap(sb, group) + 1;
+}
+
+static inline uint64_t simplefs_group_refs(const struct simplefs_super_block *sb,
+					   uint64_t group)
+{
+	return simplefs_group_bmap(sb, group) + 2;
+}
+
+static inline uint64_t simplefs_group_itable(const struct simplefs_super_block *sb,
+					     uint64_t group)
+{
+	return simplefs_group_bmap(sb, group) + 3;
+}
+
+/* The first block of the group that is not metadata */
+static inline uint64_t simplefs_group_data(const struct simplefs_super_block *sb,
+					   uint64_t group)
+{
+	return simplefs_group_itable(sb, group) + sb->itable_blocks;
+}
+
+/* Blocks in the group, the last one may be short */
+static inline uint64_t simplefs_group_blocks(const struct simplefs_super_block *sb,
+					     uint64_t group)
+{
+	uint64_t start = group << simplefs_group_bits(sb);
+
+	if (sb->blocks_count - start < sb->blocks_per_group)
+		return sb->blocks_count - start;
+	return sb->blocks_per_group;
+}
+
+static inline uint64_t simplefs_block_group(const struct simplefs_super_block *sb,
+					    uint64_t block)
+{
+	return block >> simplefs_group_bits(sb);
+}
+
+/* Inode numbers fit in 32 bits, see simplefs_check_layout */
+static inline uint64_t simplefs_ino_group(const struct simplefs_super_block *sb,
+					  uint64_t inode_no)
+{
+	return (uint32_t)(inode_no - 1) / (uint32_t)sb->inodes_per_group;
+}
+
+static inline unsigned int simplefs_ino_index(const struct simplefs_super_block *sb,
+					      uint64_t inode_no)
+{
+	return (uint32_t)(inode_no - 1) % (uint32_t)sb->inodes_per_group;
+}
+
+/* Whether block is metadata: the super block, the group descriptors or
+ * one of the bitmaps, the reference count table or the inode table blocks
+ * of its group */
+static inline int simplefs_block_is_meta(const struct simplefs_super_block *sb,
+					 uint64_t block)
+{
+	return block < simplefs_group_data(sb, simplefs_block_group(sb, block));
+}
+
+/* Blocks that can never hold data */
+static inline uint64_t simplefs_overhead(const struct simplefs_super_block *sb)
+{
+	return sb->gdt_block + sb->gdt_blocks +
+	       sb->groups_count * (3 + sb->itable_blocks);
+}
+
+/* The group descriptor block holding group's descriptor, and the
+ * descriptor's index in that block */
+static inline uint64_t simplefs_gdt_locate(const struct simplefs_super_block *sb,
+					   uint64_t group, unsigned int *index)
+{
+	unsigned int shift = simplefs_block_bits(sb) -
+			     __builtin_ctzll(sizeof(struct simplefs_group_desc));
+
+	*index = group & ((1ULL << shift) - 1);
+	return sb->gdt_block + (group >> shift);
+}
+
+/* The groups the descriptor table has room for */
+static inline uint64_t simplefs_gdt_capacity(const struct simplefs_super_block *sb)
+{
+	return sb->gdt_blocks << (simplefs_block_bits(sb) -
+				  __builtin_ctzll(sizeof(struct simplefs_group_desc)));
+}
+
+/* Change the geometry of sb to cover blocks_count blocks, with the same
+ * inode table in each group. As mkfs does, a last group too short for its
+ * metadata and some data is left out. Returns nonzero, leaving sb alone,
+ * if the groups do not fit in the descriptor table or their inode numbers
+ * in 32 bits. */
+static inline int simplefs_grow_layout(struct simplefs_super_block *sb,
+				       uint64_t blocks_count)
+{
+	struct simplefs_super_block geo = *sb;
+
+	geo.blocks_count = blocks_count;
+	geo.groups_count = (blocks_count + sb->blocks_per_group - 1) >>
+			   simplefs_group_bits(sb);
+	if (geo.groups_count > 1 &&
+	    simplefs_group_data(&geo, geo.groups_count - 1) >= blocks_count) {
+		geo.groups_count--;
+		geo.blocks_count = geo.groups_count << simplefs_group_bits(sb);
+	}
+	geo.inodes_max = geo.groups_count * geo.inodes_per_group;
+	if (geo.groups_count > simplefs_gdt_capacity(sb) ||
+	    geo.inodes_max >= 0xffffffffULL)
+		return -1;
+
+	sb->blocks_count = geo.blocks_count;
+	sb->groups_count = geo.groups_count;
+	sb->inodes_max = geo.inodes_max;
+	return 0;
+}
+
+/* NULL if the super block describes a layout that can be used, otherwise
+ * what is wrong with it. The device size and the free counts are left to
+ * the caller. */
+static inline const char *simplefs_check_layout(const struct simplefs_super_block *sb)
+{
+	uint64_t bits, ipb;
+
+	if (sb->magic != SIMPLEFS_MAGIC)
+		return "bad magic number";
+	if (sb->version != SIMPLEFS_LAYOUT_VERSION)
+		return "unsupported layout version";
+	if (!simplefs_valid_block_size(sb->block_size))
+		return "invalid block size";
+	if (sb->flags & ~(SIMPLEFS_SB_READ_ONLY | SIMPLEFS_SB_DIRTY))
+		return "unknown flags";
+
+	bits = sb->block_size * 8;
+	ipb = SIMPLEFS_INODES_PER_BLOCK(sb->block_size);
+	if (sb->blocks_per_group != bits ||
+	    !sb->blocks_count ||
+	    sb->groups_count != (sb->blocks_count + bits - 1) >> simplefs_group_bits(sb) ||
+	    !sb->inodes_per_group || sb->inodes_per_group > bits ||
+	    sb->inodes_per_group != sb->itable_blocks * ipb ||
+	    sb->inodes_max != sb->groups_count * sb->inodes_per_group ||
+	    sb->inodes_max >= 0xffffffffULL ||
+	    sb->gdt_block != 1 ||
+	    sb->gdt_blocks * sb->block_size <
+		sb->groups_count * sizeof(struct simplefs_group_desc) ||
+	    sb->data_block != simplefs_group_data(sb, 0) ||
+	    sb->data_block >= bits ||
+	    simplefs_group_data(sb, sb->groups_count - 1) >= sb->blocks_count)
+		return "impossible layout";
+
+	return NULL;
+}
+
+/* The inode table block holding inode_no, and its slot in that block */
+static inline uint64_t simplefs_itable_locate(const struct simplefs_super_block *sb,
+					      uint64_t inode_no, unsigned int *slot)
+{
+	unsigned int shift = simplefs_block_bits(sb) -
+			     __builtin_ctzll(sizeof(struct simplefs_inode));
+	unsigned int index = simplefs_ino_index(sb, inode_no);
+
+	*slot = index & ((1U << shift) - 1);
+	return simplefs_group_itable(sb, simplefs_ino_group(sb, inode_no)) +
+	       (index >> shift);
+}
+
+/* The bitmap block holding the bit of block, and the bit in that block */
+static inline uint64_t simplefs_bmap_locate(const struct simplefs_super_block *sb,
+					    uint64_t block, unsigned int *bit)
+{
+	unsigned int shift = simplefs_group_bits(sb);
+
+	*bit = block & ((1ULL << shift) - 1);
+	return simplefs_group_bmap(sb, block >> shift);
+}
+
+/* The reference count table of the group of block, and the block's index
+ * in the group as it is recorded there */
+static inline uint64_t simplefs_refs_locate(const struct simplefs_super_block *sb,
+					    uint64_t block, unsigned int *index)
+{
+	unsigned int shift = simplefs_group_bits(sb);
+
+	*index = block & ((1ULL << shift) - 1);
+	return simplefs_group_refs(sb, block >> shift);
+}
+
+/* The inode bitmap block holding the bit of inode_no, and the bit in that
+ * block */
+static inline uint64_t simplefs_imap_locate(const struct simplefs_super_block *sb,
+					    uint64_t inode_no, unsigned int *bit)
+{
+	*bit = simplefs_ino_index(sb, inode_no);
+	return simplefs_group_imap(sb, simplefs_ino_group(sb, inode_no));
+}
+
+/* Extended attribute helpers, shared like the layout ones above. An area
+ * is the xattrs of an inode or the part of an xattr block between its
+ * header and its checksum. */
+
+/* The prefix of the names of a SIMPLEFS_XATTR_INDEX_*, NULL if unknown */
+static inline const char *simplefs_xattr_prefix(int index)
+{
+	switch (index) {
+	case SIMPLEFS_XATTR_INDEX_USER:
+		return "user.";
+	case SIMPLEFS_XATTR_INDEX_TRUSTED:
+		return "trusted.";
+	case SIMPLEFS_XATTR_INDEX_SECURITY:
+		return "security.";
+	}
+	return NULL;
+}
+
+static inline size_t simplefs_xattr_entry_size(size_t name_len,
+					       size_t value_size)
+{
+	return (sizeof(struct simplefs_xattr_entry) + name_len + value_size +
+		3) & ~(size_t)3;
+}
+
+static inline const char *simplefs_xattr_value(const struct simplefs_xattr_entry *e)
+{
+	return e->name + e->name_len;
+}
+
+/* The entry at off in area, NULL past the last one */
+static inline struct simplefs_xattr_entry *
+simplefs_xattr_at(const void *area, size_t size, size_t off)
+{
+	struct simplefs_xattr_entry *e =
+		(struct simplefs_xattr_entry *)((const char *)area + off);
+
+	if (off + sizeof(*e) > size || !e->name_len)
+		return NULL;
+	return e;
+}
+
+static inline struct simplefs_xattr_entry *
+simplefs_xattr_next(const void *area, size_t size,
+		    const struct simplefs_xattr_entry *e)
+{
+	return simplefs_xattr_at(area, size, (const char *)e -
+				 (const char *)area +
+				 simplefs_xattr_entry_size(e->name_len,
+							   e->value_size));
+}
+
+/* Only for areas that passed simplefs_xattr_check */
+#define simplefs_xattr_for_each(e, area, size)				\
+	for ((e) = simplefs_xattr_at(area, size, 0); (e);		\
+	     (e) = simplefs_xattr_next(area, size, e))
+
+/* Nonzero if an entry of area has an unknown prefix or runs past its end */
+static inline int simplefs_xattr_check(const void *area, size_t size)
+{
+	const struct simplefs_xattr_entry *e;
+	size_t off = 0, len;
+
+	while ((e = simplefs_xattr_at(area, size, off))) {
+		len = simplefs_xattr_entry_size(e->name_len, e->value_size);
+		if (!simplefs_xattr_prefix(e->name_index) || len > size - off)
+			return -1;
+		off += len;
+	}
+	return 0;
+}
+
+/* Nonzero unless block is an xattr block with well formed entries. The
+ * checksum is left to the caller. */
+static inline int simplefs_xattr_block_check(const void *block,
+					     size_t block_size)
+{
+	const struct simplefs_xattr_header *header = block;
+
+	return header->magic != SIMPLEFS_XATTR_MAGIC ||
+	       simplefs_xattr_check(header + 1,
+				    SIMPLEFS_XATTR_BLOCK_AREA(block_size));
+}
+
+static inline struct simplefs_xattr_entry *
+simplefs_xattr_find(const void *area, size_t size, int index,
+		    const char *name, size_t name_len)
+{
+	struct simplefs_xattr_entry *e;
+
+	simplefs_xattr_for_each(e, area, size)
+		if (e->name_index == index && e->name_len == name_len &&
+		    !memcmp(e->name, name, name_len))
+			return e;
+	return NULL;
+}
+
+/* Append an entry to the *used bytes of area. Nonzero if it does not fit. */
+static inline int simplefs_xattr_put(void *area, size_t size, size_t *used,
+				     int index, const char *name,
+				     size_t name_len, const void *value,
+				     size_t value_size)
+{
+	struct simplefs_xattr_entry *e =
+		(struct simplefs_xattr_entry *)((char *)area + *used);
+	size_t len = simplefs_xattr_entry_size(name_len, value_size);
+
+	if (len > size - *used)
+		return -1;
+	e->name_index = index;
+	e->name_len = name_len;
+	e->value_size = value_size;
+	memcpy(e->name, name, name_len);
+	memcpy(e->name + name_len, value, value_size);
+	*used += len;
+	return 0;
+}
+
+/* Put an entry into the inode if there is still room for it there, into
+ * the block otherwise. Nonzero if it fits in neither. */
+static inline int simplefs_xattr_place(void *xattrs, size_t *xattrs_used,
+				       void *block, size_t block_size,
+				       size_t *block_used, int index,
+				       const char *name, size_t name_len,
+				       const void *value, size_t value_size)
+{
+	return simplefs_xattr_put(xattrs, SIMPLEFS_INLINE_XATTR_SIZE,
+				  xattrs_used, index, name, name_len, value,
+				  value_size) &&
+	       simplefs_xattr_put(block, block_size, block_used, index, name,
+				  name_len, value, value_size);
+}
+
+/* Place the entries of area but the one named index and name */
+static inline int simplefs_xattr_keep(const void *area, size_t size,
+				      int index, const char *name,
+				      size_t name_len, void *xattrs,
+				      size_t *xattrs_used, void *block,
+				      size_t block_size, size_t *block_used)
+{
+	const struct simplefs_xattr_entry *e;
+
+	simplefs_xattr_for_each(e, area, size) {
+		if (e->name_index == index && e->name_len == name_len &&
+		    !memcmp(e->name, name, name_len))
+			continue;
+		if (simplefs_xattr_place(xattrs, xattrs_used, block,
+					 block_size, block_used,
+					 e->name_index, e->name, e->name_len,
+					 simplefs_xattr_value(e),
+					 e->value_size))
+			return -1;
+	}
+	return 0;
+}
+
+/* Lay out the extended attributes of an inode again with the one named
+ * index and name set to value, or removed if value is NULL. The inode's
+ * own (xattrs) are placed first, then those of its xattr block (block,
+ * NULL if it has none), then the new one, so attributes move into the
+ * inode as room is made there. new_xattrs and new_block are cleared first
+ * and sized as xattrs and block. Returns the bytes used in new_block, or
+ * -1 if the attributes do not fit. */
+static inline long simplefs_xattr_layout(const void *xattrs,
+					 const void *block, size_t block_size,
+					 int index, const char *name,
+					 size_t name_len, const void *value,
+					 size_t value_size, void *new_xattrs,
+					 void *new_block)
+{
+	size_t xattrs_used = 0, block_used = 0;
+
+	memset(new_xattrs, 0, SIMPLEFS_INLINE_XATTR_SIZE);
+	memset(new_block, 0, block_size);
+
+	if (simplefs_xattr_keep(xattrs, SIMPLEFS_INLINE_XATTR_SIZE, index,
+				name, name_len, new_xattrs, &xattrs_used,
+				new_block, block_size, &block_used) ||
+	    (block && simplefs_xattr_keep(block, block_size, index, name,
+					  name_len, new_xattrs, &xattrs_used,
+					  new_block, block_size, &block_used)))
+		return -1;
+	if (value && simplefs_xattr_place(new_xattrs, &xattrs_used, new_block,
+					  block_size, &block_used, index,
+					  name, name_len, value, value_size))
+		return -1;
+	return block_used;
+}
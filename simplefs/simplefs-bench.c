@@ -0,0 +1,578 @@
+/*
+ * simplefs-bench: metadata and I/O microbenchmarks for a mounted simplefs
+ * (or anything else) directory.
+ *
+ * Every thread builds its own tree under <dir>/t<N>: fanout directories
+ * per level, depth levels, fanout files in each leaf directory. The tests
+ * then run in order over those trees, all threads starting together:
+ *
+ *   create    mkdir/creat of the whole tree
+ *   stat      stat of every file
+ *   readdir   opendir + readdir of every directory
+ *   seqwrite  pwrite of <size> bytes at 0 of every file, in tree order
+ *   seqread   pread of the same
+ *   randwrite pwrite of <size> bytes at a random aligned offset of a random file
+ *   randread  pread of the same
+ *   fsync     pwrite + fsync of a random file
+ *   unlink    unlink/rmdir of the whole tree
+ *
+ * The stat and I/O tests go over the files -r times, so that there are
+ * enough samples for the tail latencies.
+ *
+ * Each test prints one JSON object per line with its throughput and
+ * p50/p99/p999 latencies, so that runs can be compared between commits.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MAX_THREAD_COUNTS	16
+#define MAX_SIZES		16
+
+enum test {
+	T_CREATE, T_STAT, T_READDIR, T_SEQWRITE, T_SEQREAD,
+	T_RANDWRITE, T_RANDREAD, T_FSYNC, T_UNLINK, T_COUNT
+};
+
+static const char *test_names[T_COUNT] = {
+	"create", "stat", "readdir", "seqwrite", "seqread",
+	"randwrite", "randread", "fsync", "unlink",
+};
+
+/* Tests whose ops move <size> bytes, run once per size */
+static int sized(enum test t)
+{
+	return t == T_SEQWRITE || t == T_SEQREAD ||
+	       t == T_RANDWRITE || t == T_RANDREAD;
+}
+
+struct config {
+	const char *dir;
+	const char *label;
+	int fanout;
+	int depth;
+	int passes;
+	int threads[MAX_THREAD_COUNTS];
+	int nthreads;
+	size_t sizes[MAX_SIZES];
+	int nsizes;
+	size_t file_max;
+	unsigned int seed;
+	int tests[T_COUNT];
+};
+
+struct thread {
+	pthread_t tid;
+	int id;
+	const struct config *cfg;
+	pthread_barrier_t *barrier;
+
+	/* Paths of the tree, directories in creation order (parents first) */
+	char **dirs;
+	int ndirs;
+	char **files;
+	int nfiles;
+
+	enum test test;
+	size_t size;
+	char *buf;
+	unsigned int rand;
+
+	uint64_t *lat;
+	uint64_t nlat;
+	uint64_t bytes;
+	/* When this thread started and finished its ops */
+	uint64_t start, end;
+	int error;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *path_join(const char *a, const char *b)
+{
+	char *p;
+
+	if (asprintf(&p, "%s/%s", a, b) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return p;
+}
+
+static void add_path(char ***v, int *n, char *p)
+{
+	*v = realloc(*v, (*n + 1) * sizeof(**v));
+	if (!*v) {
+		perror("realloc");
+		exit(1);
+	}
+	(*v)[(*n)++] = p;
+}
+
+static void build_tree(struct thread *t, const char *parent, int level)
+{
+	char name[32];
+	char *p;
+	int i;
+
+	for (i = 0; i < t->cfg->fanout; i++) {
+		if (level == t->cfg->depth) {
+			snprintf(name, sizeof(name), "f%d", i);
+			add_path(&t->files, &t->nfiles, path_join(parent, name));
+		} else {
+			snprintf(name, sizeof(name), "d%d", i);
+			p = path_join(parent, name);
+			add_path(&t->dirs, &t->ndirs, p);
+			build_tree(t, p, level + 1);
+		}
+	}
+}
+
+static int fail(struct thread *t, const char *what, const char *path)
+{
+	fprintf(stderr, "thread %d: %s %s: %s\n", t->id, what, path,
+		strerror(errno));
+	t->error = 1;
+	return -1;
+}
+
+static int do_create(struct thread *t, int i)
+{
+	int fd;
+
+	if (i < t->ndirs)
+		return mkdir(t->dirs[i], 0755) ? fail(t, "mkdir", t->dirs[i]) : 0;
+
+	i -= t->ndirs;
+	fd = open(t->files[i], O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (fd < 0)
+		return fail(t, "create", t->files[i]);
+	close(fd);
+	return 0;
+}
+
+static int do_unlink(struct thread *t, int i)
+{
+	/* Files first, then directories children before parents */
+	if (i < t->nfiles)
+		return unlink(t->files[i]) ? fail(t, "unlink", t->files[i]) : 0;
+
+	i = t->ndirs - 1 - (i - t->nfiles);
+	return rmdir(t->dirs[i]) ? fail(t, "rmdir", t->dirs[i]) : 0;
+}
+
+static int do_readdir(struct thread *t, int i)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(t->dirs[i]);
+	if (!d)
+		return fail(t, "opendir", t->dirs[i]);
+	while ((de = readdir(d)))
+		;
+	closedir(d);
+	return 0;
+}
+
+static int do_io(struct thread *t, int i, int random, int write, int sync)
+{
+	size_t slots = t->cfg->file_max / t->size;
+	off_t off = 0;
+	const char *path;
+	ssize_t ret;
+	int fd;
+
+	if (random) {
+		i = rand_r(&t->rand) % t->nfiles;
+		off = (off_t)(rand_r(&t->rand) % slots) * t->size;
+	}
+	path = t->files[i];
+
+	fd = open(path, write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return fail(t, "open", path);
+	if (write)
+		ret = pwrite(fd, t->buf, t->size, off);
+	else
+		ret = pread(fd, t->buf, t->size, off);
+	if (ret < 0) {
+		close(fd);
+		return fail(t, write ? "write" : "read", path);
+	}
+	if (sync && fsync(fd)) {
+		close(fd);
+		return fail(t, "fsync", path);
+	}
+	close(fd);
+	t->bytes += ret;
+	return 0;
+}
+
+static int test_ops(struct thread *t)
+{
+	switch (t->test) {
+	case T_CREATE:
+	case T_UNLINK:
+		return t->ndirs + t->nfiles;
+	case T_READDIR:
+		return t->ndirs;
+	default:
+		return t->nfiles * t->cfg->passes;
+	}
+}
+
+static int run_op(struct thread *t, int i)
+{
+	struct stat st;
+
+	/* Tests over the files go round them cfg->passes times */
+	if (t->test != T_CREATE && t->test != T_UNLINK && t->test != T_READDIR)
+		i %= t->nfiles;
+
+	switch (t->test) {
+	case T_CREATE:
+		return do_create(t, i);
+	case T_STAT:
+		return stat(t->files[i], &st) ? fail(t, "stat", t->files[i]) : 0;
+	case T_READDIR:
+		return do_readdir(t, i);
+	case T_SEQWRITE:
+		return do_io(t, i, 0, 1, 0);
+	case T_SEQREAD:
+		return do_io(t, i, 0, 0, 0);
+	case T_RANDWRITE:
+		return do_io(t, i, 1, 1, 0);
+	case T_RANDREAD:
+		return do_io(t, i, 1, 0, 0);
+	case T_FSYNC:
+		return do_io(t, i, 1, 1, 1);
+	case T_UNLINK:
+		return do_unlink(t, i);
+	default:
+		return -1;
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	struct thread *t = arg;
+	int i, n = test_ops(t);
+	uint64_t start;
+
+	pthread_barrier_wait(t->barrier);
+	t->start = now_ns();
+	for (i = 0; i < n && !t->error; i++) {
+		start = now_ns();
+		if (run_op(t, i))
+			break;
+		t->lat[t->nlat++] = now_ns() - start;
+	}
+	t->end = now_ns();
+	pthread_barrier_wait(t->barrier);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *v, uint64_t n, double p)
+{
+	uint64_t i;
+
+	if (!n)
+		return 0;
+	i = (uint64_t)(p * n);
+	if (i >= n)
+		i = n - 1;
+	return v[i] / 1000.0;
+}
+
+/* Run one test on nthreads threads and print its results */
+static int run_test(const struct config *cfg, struct thread *threads,
+		    int nthreads, enum test test, size_t size)
+{
+	pthread_barrier_t barrier;
+	uint64_t start = UINT64_MAX, end = 0, total = 0, bytes = 0, *all;
+	double secs;
+	int i, error = 0;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].barrier = &barrier;
+		threads[i].test = test;
+		threads[i].size = size;
+		threads[i].nlat = 0;
+		threads[i].bytes = 0;
+		pthread_create(&threads[i].tid, NULL, thread_main, &threads[i]);
+	}
+
+	/* The threads take their own times: this one may wake from the first
+	 * barrier only after they are done */
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].start < start)
+			start = threads[i].start;
+		if (threads[i].end > end)
+			end = threads[i].end;
+		total += threads[i].nlat;
+		bytes += threads[i].bytes;
+		error |= threads[i].error;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	all = malloc((total ? total : 1) * sizeof(*all));
+	if (!all) {
+		perror("malloc");
+		exit(1);
+	}
+	for (total = 0, i = 0; i < nthreads; i++) {
+		memcpy(all + total, threads[i].lat, threads[i].nlat * sizeof(*all));
+		total += threads[i].nlat;
+	}
+	qsort(all, total, sizeof(*all), cmp_u64);
+
+	secs = (end - start) / 1e9;
+	printf("{\"label\":\"%s\",\"test\":\"%s\",\"threads\":%d,\"size\":%zu,"
+	       "\"fanout\":%d,\"depth\":%d,\"ops\":%llu,\"seconds\":%.6f,"
+	       "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+	       "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"errors\":%d}\n",
+	       cfg->label, test_names[test], nthreads, size, cfg->fanout,
+	       cfg->depth, (unsigned long long)total, secs,
+	       secs > 0 ? total / secs : 0,
+	       secs > 0 ? bytes / secs / (1 << 20) : 0,
+	       percentile_us(all, total, 0.50), percentile_us(all, total, 0.99),
+	       percentile_us(all, total, 0.999), error);
+	fflush(stdout);
+
+	free(all);
+	return error ? -1 : 0;
+}
+
+static int run_threads(const struct config *cfg, int nthreads)
+{
+	struct thread *threads = calloc(nthreads, sizeof(*threads));
+	int i, j, k, ret = 0;
+	char name[32];
+	char *root;
+
+	if (!threads) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct thread *t = &threads[i];
+
+		t->id = i;
+		t->cfg = cfg;
+		t->rand = cfg->seed + i;
+		snprintf(name, sizeof(name), "t%d", i);
+		root = path_join(cfg->dir, name);
+		add_path(&t->dirs, &t->ndirs, root);
+		build_tree(t, root, 1);
+		t->lat = malloc((t->ndirs + (uint64_t)t->nfiles * cfg->passes) *
+				sizeof(*t->lat));
+		t->buf = malloc(cfg->file_max);
+		if (!t->lat || !t->buf) {
+			perror("malloc");
+			exit(1);
+		}
+		memset(t->buf, 'a' + i % 26, cfg->file_max);
+	}
+
+	for (j = 0; j < T_COUNT && !ret; j++) {
+		if (!cfg->tests[j])
+			continue;
+		if (!sized(j)) {
+			ret = run_test(cfg, threads, nthreads, j, j == T_FSYNC ? 512 : 0);
+			continue;
+		}
+		for (k = 0; k < cfg->nsizes && !ret; k++)
+			ret = run_test(cfg, threads, nthreads, j, cfg->sizes[k]);
+	}
+
+	/* Leave the directory empty for the next thread count, even when
+	 * the unlink test was not asked for */
+	if (!cfg->tests[T_UNLINK])
+		for (i = 0; i < nthreads; i++) {
+			for (j = 0; j < threads[i].nfiles; j++)
+				unlink(threads[i].files[j]);
+			for (j = threads[i].ndirs - 1; j >= 0; j--)
+				rmdir(threads[i].dirs[j]);
+		}
+
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; j < threads[i].ndirs; j++)
+			free(threads[i].dirs[j]);
+		for (j = 0; j < threads[i].nfiles; j++)
+			free(threads[i].files[j]);
+		free(threads[i].dirs);
+		free(threads[i].files);
+		free(threads[i].lat);
+		free(threads[i].buf);
+	}
+	free(threads);
+	return ret;
+}
+
+static int parse_list(const char *arg, long *out, int max)
+{
+	char *copy = strdup(arg), *tok, *save, *end;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (n == max)
+			break;
+		out[n] = strtol(tok, &end, 0);
+		if (*end || out[n] <= 0) {
+			n = -1;
+			break;
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static void usage(void)
+{
+	printf("Usage: simplefs-bench [options] <dir>\n");
+	printf("  -t list   thread counts, e.g. 1,2,4 (default 1)\n");
+	printf("  -f n      entries per directory (default 8)\n");
+	printf("  -d n      directory levels per thread (default 2)\n");
+	printf("  -r n      passes over the files for the stat and I/O tests (default 10)\n");
+	printf("  -s list   I/O sizes in bytes (default 512,4096)\n");
+	printf("  -m bytes  largest file size, the block size on simplefs (default 4096)\n");
+	printf("  -T list   tests to run (default all): create,stat,readdir,seqwrite,\n");
+	printf("            seqread,randwrite,randread,fsync,unlink\n");
+	printf("  -S seed   random seed (default 1)\n");
+	printf("  -l label  added to every result, e.g. the commit being measured\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct config cfg = {
+		.label = "",
+		.fanout = 8,
+		.depth = 2,
+		.passes = 10,
+		.threads = { 1 },
+		.nthreads = 1,
+		.sizes = { 512, 4096 },
+		.nsizes = 2,
+		.file_max = 4096,
+		.seed = 1,
+	};
+	long list[MAX_SIZES];
+	char *tok, *save;
+	int opt, i, j, n, ret = 0;
+
+	for (i = 0; i < T_COUNT; i++)
+		cfg.tests[i] = 1;
+
+	while ((opt = getopt(argc, argv, "t:f:d:r:s:m:T:S:l:")) != -1) {
+		switch (opt) {
+		case 't':
+			n = parse_list(optarg, list, MAX_THREAD_COUNTS);
+			if (n <= 0)
+				goto bad;
+			for (i = 0; i < n; i++)
+				cfg.threads[i] = list[i];
+			cfg.nthreads = n;
+			break;
+		case 'f':
+			cfg.fanout = atoi(optarg);
+			if (cfg.fanout <= 0)
+				goto bad;
+			break;
+		case 'd':
+			cfg.depth = atoi(optarg);
+			if (cfg.depth <= 0)
+				goto bad;
+			break;
+		case 'r':
+			cfg.passes = atoi(optarg);
+			if (cfg.passes <= 0)
+				goto bad;
+			break;
+		case 's':
+			n = parse_list(optarg, list, MAX_SIZES);
+			if (n <= 0)
+				goto bad;
+			for (i = 0; i < n; i++)
+				cfg.sizes[i] = list[i];
+			cfg.nsizes = n;
+			break;
+		case 'm':
+			cfg.file_max = strtoul(optarg, NULL, 0);
+			if (!cfg.file_max)
+				goto bad;
+			break;
+		case 'T':
+			memset(cfg.tests, 0, sizeof(cfg.tests));
+			for (tok = strtok_r(optarg, ",", &save); tok;
+			     tok = strtok_r(NULL, ",", &save)) {
+				for (j = 0; j < T_COUNT; j++)
+					if (!strcmp(tok, test_names[j]))
+						break;
+				if (j == T_COUNT)
+					goto bad;
+				cfg.tests[j] = 1;
+			}
+			break;
+		case 'S':
+			cfg.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.label = optarg;
+			break;
+		default:
+			goto bad;
+		}
+	}
+
+	if (optind != argc - 1)
+		goto bad;
+	cfg.dir = argv[optind];
+
+	for (i = 0; i < cfg.nsizes; i++)
+		if (cfg.sizes[i] > cfg.file_max)
+			goto bad;
+	/* Everything but the tree must exist already for the later tests */
+	if (!cfg.tests[T_CREATE]) {
+		fprintf(stderr, "The create test builds the trees the others use\n");
+		return 1;
+	}
+
+	for (i = 0; i < cfg.nthreads && !ret; i++)
+		ret = run_threads(&cfg, cfg.threads[i]);
+
+	return ret ? 1 : 0;
+bad:
+	usage();
+	return 1;
+}
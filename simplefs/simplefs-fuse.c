@@ -0,0 +1,718 @@
+/*
+ * simplefs-fuse: mount a simplefs image without the kernel module.
+ *
+ * Built on libsimplefs and the FUSE low level API, whose inode numbers map
+ * one to one onto simplefs inode numbers (both have the root at 1).
+ * Requests are handled by FUSE's multithreaded loop; libsimplefs lets
+ * readers run in parallel and serialises changes. File data is spliced
+ * between /dev/fuse and the image when the kernel allows it, and the page
+ * cache is kept across opens since nothing else changes the image while
+ * it is mounted.
+ *
+ *   simplefs-fuse [options] <image> <mountpoint>
+ */
+#define FUSE_USE_VERSION 34
+#define _GNU_SOURCE
+#include <fuse_lowlevel.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "libsimplefs.h"
+
+/* Nothing but this daemon changes the image, so the kernel may cache
+ * names and attributes for a while */
+#define SFS_FUSE_TIMEOUT	1.0
+
+struct sfs_fuse {
+	struct sfs_fs fs;
+	struct sfs_file_bdev bdev;
+	uid_t uid;
+	gid_t gid;
+	time_t mount_time;
+
+	/* Command line */
+	const char *image;
+	int nowriteback;
+	int nosplice;
+	int read_only;
+	int compress;
+};
+
+static const char zero_block[SIMPLEFS_MAX_BLOCK_SIZE];
+
+static inline struct sfs_fuse *sfs_fuse(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+/* The on-disk inode has no owner or times; like the kernel module, the
+ * files belong to whoever mounted them */
+static void fill_stat(struct sfs_fuse *sf, const struct simplefs_inode *inode,
+		      struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = inode->inode_no;
+	st->st_mode = inode->mode;
+	if (!(st->st_mode & 07777))
+		st->st_mode |= S_ISDIR(inode->mode) ? 0755 : 0644;
+	st->st_nlink = inode->nlink;
+	st->st_uid = sf->uid;
+	st->st_gid = sf->gid;
+	st->st_size = S_ISDIR(inode->mode) ? sf->fs.bs : inode->file_size;
+	st->st_blksize = sf->fs.bs;
+	st->st_blocks = inode->data_block_number ? sf->fs.bs / 512 : 0;
+	st->st_atime = st->st_mtime = st->st_ctime = sf->mount_time;
+}
+
+static void reply_entry(fuse_req_t req, const struct simplefs_inode *inode)
+{
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode->inode_no;
+	e.attr_timeout = SFS_FUSE_TIMEOUT;
+	e.entry_timeout = SFS_FUSE_TIMEOUT;
+	fill_stat(sfs_fuse(req), inode, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct sfs_fuse *sf = userdata;
+
+	if (!sf->nosplice) {
+		if (conn->capable & FUSE_CAP_SPLICE_READ)
+			conn->want |= FUSE_CAP_SPLICE_READ;
+		if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+			conn->want |= FUSE_CAP_SPLICE_WRITE;
+		if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+			conn->want |= FUSE_CAP_SPLICE_MOVE;
+	}
+
+	if (!sf->nowriteback && !sf->read_only &&
+	    (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	else
+		conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+}
+
+static void sfs_ll_destroy(void *userdata)
+{
+	struct sfs_fuse *sf = userdata;
+
+	sfs_sync(&sf->fs);
+}
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	struct simplefs_inode inode;
+	uint64_t ino;
+	int ret;
+
+	ret = sfs_lookup(&sf->fs, parent, name, &ino);
+	if (!ret)
+		ret = sfs_getattr(&sf->fs, ino, &inode);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		reply_entry(req, &inode);
+}
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	/* Inodes are not cached, there is nothing to drop */
+	fuse_reply_none(req);
+}
+
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	struct simplefs_inode inode;
+	struct stat st;
+	int ret;
+
+	ret = sfs_getattr(&sf->fs, ino, &inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fill_stat(sf, &inode, &st);
+	fuse_reply_attr(req, &st, SFS_FUSE_TIMEOUT);
+}
+
+/* Only the size is stored, as with simplefs_setattr */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			   int to_set, struct fuse_file_info *fi)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	int ret;
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		ret = sfs_truncate(&sf->fs, ino, attr->st_size);
+		if (ret) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	sfs_ll_getattr(req, ino, fi);
+}
+
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	struct simplefs_inode inode;
+	struct fuse_entry_param e;
+	int ret;
+
+	ret = sfs_create(&sf->fs, parent, name, mode, &inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	if (!fi) {
+		reply_entry(req, &inode);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode.inode_no;
+	e.attr_timeout = SFS_FUSE_TIMEOUT;
+	e.entry_timeout = SFS_FUSE_TIMEOUT;
+	fill_stat(sf, &inode, &e.attr);
+	fi->keep_cache = 1;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void sfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, dev_t rdev)
+{
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	do_create(req, parent, name, mode, NULL);
+}
+
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode)
+{
+	do_create(req, parent, name, S_IFDIR | (mode & 07777), NULL);
+}
+
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  mode_t mode, struct fuse_file_info *fi)
+{
+	do_create(req, parent, name, S_IFREG | (mode & 07777), fi);
+}
+
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -sfs_unlink(&sfs_fuse(req)->fs, parent, name));
+}
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -sfs_rmdir(&sfs_fuse(req)->fs, parent, name));
+}
+
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  fuse_ino_t newparent, const char *newname,
+			  unsigned int flags)
+{
+	unsigned int sfs_flags = 0;
+
+	/* RENAME_EXCHANGE and RENAME_WHITEOUT are not supported */
+	if (flags & ~RENAME_NOREPLACE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (flags & RENAME_NOREPLACE)
+		sfs_flags |= SFS_RENAME_NOREPLACE;
+
+	fuse_reply_err(req, -sfs_rename(&sfs_fuse(req)->fs, parent, name,
+					newparent, newname, sfs_flags));
+}
+
+static void sfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+			const char *newname)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	struct simplefs_inode inode;
+	int ret;
+
+	ret = sfs_link(&sf->fs, ino, newparent, newname);
+	if (!ret)
+		ret = sfs_getattr(&sf->fs, ino, &inode);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		reply_entry(req, &inode);
+}
+
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+/* Compressed files are decompressed into a buffer by sfs_read */
+static void sfs_ll_read_copy(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	ssize_t ret;
+	char *data;
+
+	data = malloc(size);
+	if (!data) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	ret = sfs_read(&sf->fs, ino, data, size, off);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, data, ret);
+	free(data);
+}
+
+/* Splice straight from the image when the data is there, under the read
+ * lock so that the block cannot be freed and reused in the meantime */
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(0);
+	struct simplefs_inode inode;
+	int ret;
+
+	pthread_rwlock_rdlock(&sf->fs.lock);
+	ret = sfs_read_inode(&sf->fs, ino, &inode);
+	if (!ret && S_ISDIR(inode.mode))
+		ret = -EISDIR;
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto out;
+	}
+	if (inode.flags & SIMPLEFS_INODE_LZ4) {
+		pthread_rwlock_unlock(&sf->fs.lock);
+		sfs_ll_read_copy(req, ino, size, off);
+		return;
+	}
+
+	if ((uint64_t)off >= inode.file_size)
+		size = 0;
+	else if (size > inode.file_size - off)
+		size = inode.file_size - off;
+
+	if (!size || !inode.data_block_number) {
+		fuse_reply_buf(req, zero_block, size);
+		goto out;
+	}
+
+	buf.buf[0].size = size;
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = sf->bdev.fd;
+	buf.buf[0].pos = inode.data_block_number * sf->fs.bs +
+			 inode.data_offset + off;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+out:
+	pthread_rwlock_unlock(&sf->fs.lock);
+}
+
+static void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_bufvec *in_buf, off_t off,
+			     struct fuse_file_info *fi)
+{
+	struct sfs_fuse *sf = sfs_fuse(req);
+	size_t size = fuse_buf_size(in_buf);
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(size);
+	struct simplefs_inode inode;
+	uint64_t pos;
+	ssize_t copied = 0;
+	int ret;
+
+	pthread_rwlock_wrlock(&sf->fs.lock);
+	ret = sfs_read_inode(&sf->fs, ino, &inode);
+	if (!ret)
+		ret = sfs_write_begin(&sf->fs, &inode, off, size, &pos);
+	if (!ret) {
+		out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		out_buf.buf[0].fd = sf->bdev.fd;
+		out_buf.buf[0].pos = pos;
+		copied = fuse_buf_copy(&out_buf, in_buf, 0);
+		if (copied < 0)
+			ret = copied;
+		else
+			ret = sfs_write_end(&sf->fs, &inode, off, copied);
+	}
+	pthread_rwlock_unlock(&sf->fs.lock);
+
+	/* A compressed file, or one about to become one: its data goes
+	 * through memory */
+	if (ret == -EOPNOTSUPP) {
+		out_buf.buf[0].flags = 0;
+		out_buf.buf[0].mem = malloc(size);
+		if (!out_buf.buf[0].mem) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		copied = fuse_buf_copy(&out_buf, in_buf, 0);
+		if (copied >= 0)
+			copied = sfs_write(&sf->fs, ino, out_buf.buf[0].mem,
+					   copied, off);
+		free(out_buf.buf[0].mem);
+		ret = copied < 0 ? copied : 0;
+	}
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, copied);
+}
+
+/* Everything is written through, flush has nothing left to do */
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			 struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -sfs_sync(&sfs_fuse(req)->fs));
+}
+
+static void sfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			     off_t off, off_t len, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -sfs_fallocate(&sfs_fuse(req)->fs, ino, mode, off, len));
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+/* Without it the kernel treats the whole file as data */
+static void sfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			 struct fuse_file_info *fi)
+{
+	uint64_t pos;
+	int ret;
+
+	ret = sfs_seek(&sfs_fuse(req)->fs, ino, off, whence, &pos);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_lseek(req, pos);
+}
+#endif
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+/* A clone for whole files, so cp --reflink and friends share the block */
+static void sfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+				   off_t off_in, struct fuse_file_info *fi_in,
+				   fuse_ino_t ino_out, off_t off_out,
+				   struct fuse_file_info *fi_out, size_t len,
+				   int flags)
+{
+	ssize_t ret;
+
+	ret = sfs_copy_file_range(&sfs_fuse(req)->fs, ino_in, off_in, ino_out,
+				  off_out, len);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+#endif
+
+/* SFS_XATTR_CREATE and SFS_XATTR_REPLACE are XATTR_CREATE and XATTR_REPLACE */
+static void sfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			    const char *value, size_t size, int flags)
+{
+	fuse_reply_err(req, -sfs_setxattr(&sfs_fuse(req)->fs, ino, name, value,
+					  size, flags));
+}
+
+static void sfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino,
+			       const char *name)
+{
+	fuse_reply_err(req, -sfs_removexattr(&sfs_fuse(req)->fs, ino, name));
+}
+
+/* Either the size only, or the value in a buffer of size bytes */
+static void reply_xattr(fuse_req_t req, ssize_t ret, const char *buf,
+			size_t size)
+{
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+}
+
+static void sfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			    size_t size)
+{
+	char *buf = NULL;
+
+	if (size && !(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	reply_xattr(req, sfs_getxattr(&sfs_fuse(req)->fs, ino, name, buf, size),
+		    buf, size);
+	free(buf);
+}
+
+static void sfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char *buf = NULL;
+
+	if (size && !(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	reply_xattr(req, sfs_listxattr(&sfs_fuse(req)->fs, ino, buf, size),
+		    buf, size);
+	free(buf);
+}
+
+struct readdir_buf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+static int fill_dirent(void *arg, const char *name, uint64_t inode_no,
+		       uint64_t pos)
+{
+	struct readdir_buf *rb = arg;
+	struct stat st = { .st_ino = inode_no };
+	size_t len;
+
+	/* The offset is that of the next record */
+	len = fuse_add_direntry(rb->req, rb->buf + rb->used, rb->size - rb->used,
+				name, &st, pos + 1);
+	if (len > rb->size - rb->used)
+		return 1;
+	rb->used += len;
+	return 0;
+}
+
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *fi)
+{
+	struct readdir_buf rb = { .req = req, .size = size };
+	int ret;
+
+	rb.buf = malloc(size);
+	if (!rb.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = sfs_readdir(&sfs_fuse(req)->fs, ino, off, fill_dirent, &rb);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, rb.buf, rb.used);
+	free(rb.buf);
+}
+
+static void sfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct sfs_fs *fs = &sfs_fuse(req)->fs;
+	struct statvfs st;
+
+	memset(&st, 0, sizeof(st));
+	pthread_rwlock_rdlock(&fs->lock);
+	st.f_bsize = fs->bs;
+	st.f_frsize = fs->bs;
+	st.f_blocks = fs->sb.blocks_count;
+	st.f_bfree = fs->sb.free_blocks;
+	st.f_bavail = fs->sb.free_blocks;
+	st.f_files = fs->sb.inodes_max;
+	st.f_ffree = fs->sb.inodes_max - fs->sb.inodes_count;
+	st.f_favail = st.f_ffree;
+	st.f_namemax = SIMPLEFS_FILENAME_MAXLEN - 1;
+	pthread_rwlock_unlock(&fs->lock);
+
+	fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops sfs_ll_ops = {
+	.init		= sfs_ll_init,
+	.destroy	= sfs_ll_destroy,
+	.lookup		= sfs_ll_lookup,
+	.forget		= sfs_ll_forget,
+	.getattr	= sfs_ll_getattr,
+	.setattr	= sfs_ll_setattr,
+	.mknod		= sfs_ll_mknod,
+	.mkdir		= sfs_ll_mkdir,
+	.unlink		= sfs_ll_unlink,
+	.rmdir		= sfs_ll_rmdir,
+	.rename		= sfs_ll_rename,
+	.link		= sfs_ll_link,
+	.open		= sfs_ll_open,
+	.read		= sfs_ll_read,
+	.write_buf	= sfs_ll_write_buf,
+	.flush		= sfs_ll_flush,
+	.fsync		= sfs_ll_fsync,
+	.readdir	= sfs_ll_readdir,
+	.statfs		= sfs_ll_statfs,
+	.create		= sfs_ll_create,
+	.fallocate	= sfs_ll_fallocate,
+	.setxattr	= sfs_ll_setxattr,
+	.getxattr	= sfs_ll_getxattr,
+	.listxattr	= sfs_ll_listxattr,
+	.removexattr	= sfs_ll_removexattr,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	.lseek		= sfs_ll_lseek,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+	.copy_file_range = sfs_ll_copy_file_range,
+#endif
+};
+
+#define SFS_OPT(t, p) { t, offsetof(struct sfs_fuse, p), 1 }
+
+static const struct fuse_opt sfs_fuse_opts[] = {
+	SFS_OPT("nowriteback", nowriteback),
+	SFS_OPT("nosplice", nosplice),
+	SFS_OPT("ro", read_only),
+	SFS_OPT("compress=lz4", compress),
+	/* and passed on, so that the kernel enforces it too */
+	FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP),
+	FUSE_OPT_END
+};
+
+static int sfs_fuse_opt_proc(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	struct sfs_fuse *sf = data;
+
+	/* The first bare argument is the image, the second the mountpoint */
+	if (key == FUSE_OPT_KEY_NONOPT && !sf->image) {
+		sf->image = arg;
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s [options] <image> <mountpoint>\n\n", progname);
+	printf("simplefs options:\n"
+	       "    -o nowriteback         do not use the kernel writeback cache\n"
+	       "    -o nosplice            copy data instead of splicing it\n"
+	       "    -o ro                  mount read-only\n"
+	       "    -o compress=lz4        compress files that outgrow their block\n\n");
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	struct sfs_fuse sf;
+	int fd, ret = 1;
+
+	memset(&sf, 0, sizeof(sf));
+	if (fuse_opt_parse(&args, &sf, sfs_fuse_opts, sfs_fuse_opt_proc))
+		return 1;
+	if (fuse_parse_cmdline(&args, &opts))
+		return 1;
+
+	if (opts.show_help) {
+		usage(argv[0]);
+		ret = 0;
+		goto out_args;
+	}
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out_args;
+	}
+	if (!sf.image || !opts.mountpoint) {
+		usage(argv[0]);
+		goto out_args;
+	}
+
+	fd = open(sf.image, sf.read_only ? O_RDONLY : O_RDWR);
+	if (fd == -1) {
+		perror("Error opening the image");
+		goto out_args;
+	}
+	sfs_file_bdev_init(&sf.bdev, fd);
+	ret = sfs_mount(&sf.fs, &sf.bdev.bdev, sf.read_only);
+	/* Images made by mkfs-simplefs --from-dir are always mounted
+	 * read-only, as the kernel module does */
+	if (ret == -EROFS) {
+		sf.read_only = 1;
+		ret = fuse_opt_add_arg(&args, "-oro") ? -ENOMEM :
+			sfs_mount(&sf.fs, &sf.bdev.bdev, 1);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: not a usable simplefs image: %s\n", sf.image,
+			ret == -EINVAL ? simplefs_check_layout(&sf.fs.sb)
+				       : strerror(-ret));
+		ret = 1;
+		goto out_close;
+	}
+	sf.fs.compress = sf.compress;
+	sf.uid = getuid();
+	sf.gid = getgid();
+	sf.mount_time = time(NULL);
+
+	ret = 1;
+	se = fuse_session_new(&args, &sfs_ll_ops, sizeof(sfs_ll_ops), &sf);
+	if (!se)
+		goto out_umount;
+	if (fuse_set_signal_handlers(se))
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out_umount:
+	sfs_umount(&sf.fs);
+out_close:
+	close(fd);
+out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
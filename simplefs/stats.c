@@ -0,0 +1,276 @@
+/*
+ * Per-mount counters for simplefs.
+ *
+ * The counters live in percpu memory and are only summed when somebody
+ * reads them. Each mount gets
+ *
+ *   /proc/fs/simplefs/<dev>/stats    every counter, one "name value" per line
+ *   /sys/fs/simplefs/<dev>/<name>    one file per counter
+ *   <debugfs>/simplefs/<dev>/latency log2 latency histograms
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+
+#include "super.h"
+
+#define SIMPLEFS_STAT_ATTR(_stat, _name) \
+	[SIMPLEFS_STAT_##_stat] = { .name = _name, .mode = 0444 }
+
+static struct attribute simplefs_stat_attrs[SIMPLEFS_STAT_NR] = {
+	SIMPLEFS_STAT_ATTR(BREAD, "bread"),
+	SIMPLEFS_STAT_ATTR(PREFETCH, "prefetch"),
+	SIMPLEFS_STAT_ATTR(BWRITE, "bwrite"),
+	SIMPLEFS_STAT_ATTR(SYNC_WRITE, "sync_write"),
+	SIMPLEFS_STAT_ATTR(BLOCK_ALLOC, "block_alloc"),
+	SIMPLEFS_STAT_ATTR(BLOCK_FREE, "block_free"),
+	SIMPLEFS_STAT_ATTR(BLOCK_CLONE, "block_clone"),
+	SIMPLEFS_STAT_ATTR(BLOCK_COW, "block_cow"),
+	SIMPLEFS_STAT_ATTR(BLOCK_DEFRAG, "block_defrag"),
+	SIMPLEFS_STAT_ATTR(COMPRESS, "compress"),
+	SIMPLEFS_STAT_ATTR(DECOMPRESS, "decompress"),
+	SIMPLEFS_STAT_ATTR(INODE_ALLOC, "inode_alloc"),
+	SIMPLEFS_STAT_ATTR(INODE_FREE, "inode_free"),
+	SIMPLEFS_STAT_ATTR(LOOKUP_HIT, "lookup_hit"),
+	SIMPLEFS_STAT_ATTR(LOOKUP_MISS, "lookup_miss"),
+	SIMPLEFS_STAT_ATTR(DIR_CACHE_BUILD, "dir_cache_build"),
+	SIMPLEFS_STAT_ATTR(XATTR_INLINE, "xattr_inline"),
+	SIMPLEFS_STAT_ATTR(XATTR_BLOCK, "xattr_block"),
+	SIMPLEFS_STAT_ATTR(SB_LOCK_WAITS, "sb_lock_waits"),
+	SIMPLEFS_STAT_ATTR(SB_LOCK_WAIT_NS, "sb_lock_wait_ns"),
+	SIMPLEFS_STAT_ATTR(INODES_LOCK_WAITS, "inodes_lock_waits"),
+	SIMPLEFS_STAT_ATTR(INODES_LOCK_WAIT_NS, "inodes_lock_wait_ns"),
+	SIMPLEFS_STAT_ATTR(DIR_LOCK_WAITS, "dir_lock_waits"),
+	SIMPLEFS_STAT_ATTR(DIR_LOCK_WAIT_NS, "dir_lock_wait_ns"),
+	SIMPLEFS_STAT_ATTR(GROUP_LOCK_WAITS, "group_lock_waits"),
+	SIMPLEFS_STAT_ATTR(GROUP_LOCK_WAIT_NS, "group_lock_wait_ns"),
+};
+
+/* NULL terminated, filled in from simplefs_stat_attrs at module load */
+static struct attribute *simplefs_default_attrs[SIMPLEFS_STAT_NR + 1];
+
+static const char * const simplefs_op_names[SIMPLEFS_OP_NR] = {
+	[SIMPLEFS_OP_READ] = "read",
+	[SIMPLEFS_OP_WRITE] = "write",
+	[SIMPLEFS_OP_CREATE] = "create",
+	[SIMPLEFS_OP_UNLINK] = "unlink",
+	[SIMPLEFS_OP_LOOKUP] = "lookup",
+	[SIMPLEFS_OP_ITERATE] = "iterate",
+};
+
+static struct proc_dir_entry *simplefs_proc_root;
+static struct kset *simplefs_kset;
+static struct dentry *simplefs_debugfs_root;
+
+static u64 simplefs_stat_read(struct simplefs_sb_info *sbi,
+			      enum simplefs_stat stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[stat];
+	return sum;
+}
+
+static int simplefs_stats_show(struct seq_file *seq, void *v)
+{
+	struct simplefs_sb_info *sbi = seq->private;
+	int i;
+
+	for (i = 0; i < SIMPLEFS_STAT_NR; i++)
+		seq_printf(seq, "%s %llu\n", simplefs_stat_attrs[i].name,
+			   simplefs_stat_read(sbi, i));
+	return 0;
+}
+
+static int simplefs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, simplefs_stats_show, PDE_DATA(inode));
+}
+
+static const struct file_operations simplefs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = simplefs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* One block per operation: the total, then every non-empty bucket as
+ * "<from> <to> <count>" in nanoseconds, <to> exclusive, or "-" for the
+ * last bucket which has no upper end */
+static int simplefs_latency_show(struct seq_file *seq, void *v)
+{
+	struct simplefs_sb_info *sbi = seq->private;
+	u64 hist[SIMPLEFS_LAT_BUCKETS];
+	u64 total;
+	int op, b, cpu;
+
+	for (op = 0; op < SIMPLEFS_OP_NR; op++) {
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu) {
+			for (b = 0; b < SIMPLEFS_LAT_BUCKETS; b++)
+				hist[b] += per_cpu_ptr(sbi->stats, cpu)->latency[op][b];
+		}
+
+		total = 0;
+		for (b = 0; b < SIMPLEFS_LAT_BUCKETS; b++)
+			total += hist[b];
+		seq_printf(seq, "%s %llu\n", simplefs_op_names[op], total);
+
+		for (b = 0; b < SIMPLEFS_LAT_BUCKETS; b++) {
+			if (!hist[b])
+				continue;
+			if (b == SIMPLEFS_LAT_BUCKETS - 1)
+				seq_printf(seq, "  %llu - %llu\n", 1ULL << (b - 1),
+					   hist[b]);
+			else
+				seq_printf(seq, "  %llu %llu %llu\n",
+					   b ? 1ULL << (b - 1) : 0, 1ULL << b,
+					   hist[b]);
+		}
+	}
+	return 0;
+}
+
+static int simplefs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, simplefs_latency_show, inode->i_private);
+}
+
+static const struct file_operations simplefs_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = simplefs_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static ssize_t simplefs_attr_show(struct kobject *kobj, struct attribute *attr,
+				  char *buf)
+{
+	struct simplefs_sb_info *sbi = container_of(kobj,
+						    struct simplefs_sb_info, kobj);
+
+	return snprintf(buf, PAGE_SIZE, "%llu\n",
+			simplefs_stat_read(sbi, attr - simplefs_stat_attrs));
+}
+
+static void simplefs_kobj_release(struct kobject *kobj)
+{
+	struct simplefs_sb_info *sbi = container_of(kobj,
+						    struct simplefs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static const struct sysfs_ops simplefs_attr_ops = {
+	.show = simplefs_attr_show,
+};
+
+static struct kobj_type simplefs_ktype = {
+	.default_attrs = simplefs_default_attrs,
+	.sysfs_ops = &simplefs_attr_ops,
+	.release = simplefs_kobj_release,
+};
+
+/* Called before anything that bumps a counter, as early as possible in
+ * fill_super */
+int simplefs_stats_init(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+	sbi->stats = alloc_percpu(struct simplefs_stats);
+	if (!sbi->stats)
+		return -ENOMEM;
+	return 0;
+}
+
+void simplefs_stats_destroy(struct simplefs_sb_info *sbi)
+{
+	free_percpu(sbi->stats);
+	sbi->stats = NULL;
+}
+
+/* Publish the counters of a mount under its device name */
+int simplefs_stats_register(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+	int ret;
+
+	init_completion(&sbi->kobj_unregister);
+	sbi->kobj.kset = simplefs_kset;
+	ret = kobject_init_and_add(&sbi->kobj, &simplefs_ktype, NULL, "%s",
+				   sb->s_id);
+	if (ret) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		return ret;
+	}
+
+	/* /proc is optional, the counters are still in sysfs without it */
+	if (simplefs_proc_root)
+		sbi->proc = proc_mkdir(sb->s_id, simplefs_proc_root);
+	if (sbi->proc)
+		proc_create_data("stats", 0444, sbi->proc,
+				 &simplefs_stats_fops, sbi);
+
+	/* Likewise debugfs, which returns an error pointer when disabled */
+	if (!IS_ERR_OR_NULL(simplefs_debugfs_root)) {
+		sbi->debugfs = debugfs_create_dir(sb->s_id, simplefs_debugfs_root);
+		if (!IS_ERR_OR_NULL(sbi->debugfs))
+			debugfs_create_file("latency", 0444, sbi->debugfs, sbi,
+					    &simplefs_latency_fops);
+	}
+
+	return 0;
+}
+
+void simplefs_stats_unregister(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+	if (sbi->proc) {
+		remove_proc_entry("stats", sbi->proc);
+		remove_proc_entry(sb->s_id, simplefs_proc_root);
+		sbi->proc = NULL;
+	}
+	debugfs_remove_recursive(sbi->debugfs);
+	sbi->debugfs = NULL;
+
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+int simplefs_stats_module_init(void)
+{
+	int i;
+
+	for (i = 0; i < SIMPLEFS_STAT_NR; i++)
+		simplefs_default_attrs[i] = &simplefs_stat_attrs[i];
+
+	simplefs_kset = kset_create_and_add("simplefs", NULL, fs_kobj);
+	if (!simplefs_kset)
+		return -ENOMEM;
+
+	simplefs_proc_root = proc_mkdir("fs/simplefs", NULL);
+	simplefs_debugfs_root = debugfs_create_dir("simplefs", NULL);
+	return 0;
+}
+
+void simplefs_stats_module_exit(void)
+{
+	debugfs_remove_recursive(simplefs_debugfs_root);
+	if (simplefs_proc_root)
+		remove_proc_entry("fs/simplefs", NULL);
+	kset_unregister(simplefs_kset);
+}
@@ -1,5 +1,126 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/crc32c.h>
+#include <linux/hashtable.h>
+
 #include "simple.h"
 
+/* Mount options, kept in simplefs_sb_info.mount_opt */
+#define SIMPLEFS_MOUNT_DISCARD		0x0001
+#define SIMPLEFS_MOUNT_COMPRESS		0x0002	/* compress=lz4 */
+#define SIMPLEFS_MOUNT_DAX		0x0004
+
+#define clear_opt(sbi, opt)	((sbi)->mount_opt &= ~SIMPLEFS_MOUNT_##opt)
+#define set_opt(sbi, opt)	((sbi)->mount_opt |= SIMPLEFS_MOUNT_##opt)
+#define test_opt(sbi, opt)	((sbi)->mount_opt & SIMPLEFS_MOUNT_##opt)
+
+/* Per-mount event counters, exported by stats.c */
+enum simplefs_stat {
+	SIMPLEFS_STAT_BREAD,		/* sb_bread calls */
+	SIMPLEFS_STAT_PREFETCH,		/* sb_breadahead calls */
+	SIMPLEFS_STAT_BWRITE,		/* buffers marked dirty */
+	SIMPLEFS_STAT_SYNC_WRITE,	/* sync_dirty_buffer calls */
+	SIMPLEFS_STAT_BLOCK_ALLOC,
+	SIMPLEFS_STAT_BLOCK_FREE,
+	SIMPLEFS_STAT_BLOCK_CLONE,	/* blocks shared by a clone */
+	SIMPLEFS_STAT_BLOCK_COW,	/* shared blocks copied on write */
+	SIMPLEFS_STAT_BLOCK_DEFRAG,	/* blocks moved by SIMPLEFS_IOC_DEFRAG */
+	SIMPLEFS_STAT_COMPRESS,		/* compressed blocks written */
+	SIMPLEFS_STAT_DECOMPRESS,	/* files decompressed into the page cache */
+	SIMPLEFS_STAT_INODE_ALLOC,
+	SIMPLEFS_STAT_INODE_FREE,
+	SIMPLEFS_STAT_LOOKUP_HIT,
+	SIMPLEFS_STAT_LOOKUP_MISS,
+	SIMPLEFS_STAT_DIR_CACHE_BUILD,
+	SIMPLEFS_STAT_XATTR_INLINE,	/* xattrs read from the inode */
+	SIMPLEFS_STAT_XATTR_BLOCK,	/* xattr lookups that read the block */
+	/* For each mutex, the number of times it was found held and the
+	 * nanoseconds spent waiting for it, in that order */
+	SIMPLEFS_STAT_SB_LOCK_WAITS,
+	SIMPLEFS_STAT_SB_LOCK_WAIT_NS,
+	SIMPLEFS_STAT_INODES_LOCK_WAITS,
+	SIMPLEFS_STAT_INODES_LOCK_WAIT_NS,
+	SIMPLEFS_STAT_DIR_LOCK_WAITS,
+	SIMPLEFS_STAT_DIR_LOCK_WAIT_NS,
+	SIMPLEFS_STAT_GROUP_LOCK_WAITS,	/* all groups together */
+	SIMPLEFS_STAT_GROUP_LOCK_WAIT_NS,
+	SIMPLEFS_STAT_NR
+};
+
+/* Operations with a latency histogram */
+enum simplefs_op {
+	SIMPLEFS_OP_READ,
+	SIMPLEFS_OP_WRITE,
+	SIMPLEFS_OP_CREATE,
+	SIMPLEFS_OP_UNLINK,
+	SIMPLEFS_OP_LOOKUP,
+	SIMPLEFS_OP_ITERATE,
+	SIMPLEFS_OP_NR
+};
+
+/* Bucket 0 counts 0ns, bucket n latencies in [2^(n-1), 2^n) ns; the last
+ * one also takes everything longer (2^30ns is about a second) */
+#define SIMPLEFS_LAT_BUCKETS	32
+
+struct simplefs_stats {
+	u64 count[SIMPLEFS_STAT_NR];
+	u64 latency[SIMPLEFS_OP_NR][SIMPLEFS_LAT_BUCKETS];
+};
+
+/* In memory state of an allocation group */
+struct simplefs_group_info {
+	/* Serialises changes to the bitmaps and the descriptor of the group */
+	struct mutex lock;
+};
+
+struct simplefs_sb_info {
+	struct simplefs_super_block *sb;
+	struct buffer_head *bh;
+	/* The group descriptor blocks, held for the whole mount. A descriptor
+	 * is protected by the lock of its group. */
+	struct buffer_head **gdt_bh;
+	struct simplefs_group_info *groups;
+	struct super_block *vfs_sb;
+	unsigned long mount_opt;
+	/* SIMPLEFS_SB_DIRTY was already set at mount: the bitmap checksums
+	 * cannot be trusted until fsck-simplefs has run */
+	bool bitmaps_unverified;
+
+	/* Data blocks released by unlink/truncate that have not yet been
+	 * merged back into free_blocks. Protected by free_lock. */
+	spinlock_t free_lock;
+	struct list_head free_extents;
+	unsigned int free_pending;
+	struct delayed_work free_work;
+
+	/* Xattr blocks by checksum, so that inodes whose attributes come out
+	 * the same share one. Protected by simplefs_xattr_sem. */
+	DECLARE_HASHTABLE(xattr_blocks, 6);
+	unsigned int xattr_cached;
+
+	/* The free counts of the super block while mounted. They are written
+	 * back to it by simplefs_sb_sync. */
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+
+	/* Bumped on the local CPU only and summed when read */
+	struct simplefs_stats __percpu *stats;
+	struct kobject kobj;
+	struct completion kobj_unregister;
+	struct proc_dir_entry *proc;
+	struct dentry *debugfs;
+};
+
 static inline struct simplefs_sb_info *SIMPLEFS_SB(struct super_block *sb)
 {
 	return sb->s_fs_info;
@@ -9,3 +130,112 @@ static inline struct simplefs_inode *SIMPLEFS_INODE(struct inode *inode)
 {
 	return inode->i_private;
 }
+
+/* Made by mkfs-simplefs --from-dir: always mounted read-only, and as
+ * nothing in it ever changes, readers take no locks and there is no
+ * allocator state */
+static inline bool simplefs_read_only_image(struct super_block *sb)
+{
+	return SIMPLEFS_SB(sb)->sb->flags & SIMPLEFS_SB_READ_ONLY;
+}
+
+static inline void simplefs_stat_add(struct super_block *sb,
+				     enum simplefs_stat stat, u64 n)
+{
+	this_cpu_add(SIMPLEFS_SB(sb)->stats->count[stat], n);
+}
+
+static inline void simplefs_stat_inc(struct super_block *sb,
+				     enum simplefs_stat stat)
+{
+	this_cpu_inc(SIMPLEFS_SB(sb)->stats->count[stat]);
+}
+
+/* Account an operation that started at start (from ktime_get_ns) */
+static inline void simplefs_latency_add(struct super_block *sb,
+					enum simplefs_op op, u64 start)
+{
+	unsigned int bucket = fls64(ktime_get_ns() - start);
+
+	if (bucket >= SIMPLEFS_LAT_BUCKETS)
+		bucket = SIMPLEFS_LAT_BUCKETS - 1;
+	this_cpu_inc(SIMPLEFS_SB(sb)->stats->latency[op][bucket]);
+}
+
+/* Counted wrappers around the buffer cache calls */
+static inline struct buffer_head *simplefs_bread(struct super_block *sb,
+						 sector_t block)
+{
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_BREAD);
+	return sb_bread(sb, block);
+}
+
+static inline void simplefs_breadahead(struct super_block *sb, sector_t block)
+{
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_PREFETCH);
+	sb_breadahead(sb, block);
+}
+
+static inline void simplefs_mark_dirty(struct super_block *sb,
+				       struct buffer_head *bh)
+{
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_BWRITE);
+	mark_buffer_dirty(bh);
+}
+
+static inline int simplefs_sync_buffer(struct super_block *sb,
+				       struct buffer_head *bh)
+{
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_SYNC_WRITE);
+	return sync_dirty_buffer(bh);
+}
+
+/* Set once the checksum of a metadata buffer has been verified, so that
+ * blocks staying in the buffer cache are only checked when first read */
+enum {
+	BH_SimplefsVerified = BH_PrivateStart,
+};
+BUFFER_FNS(SimplefsVerified, simplefs_verified)
+
+/* crc32c() goes through the crypto API, which picks the SSE4.2 or arm64
+ * CRC instructions where the CPU has them */
+static inline uint32_t simplefs_csum(const void *p, size_t len)
+{
+	return crc32c(SIMPLEFS_CSUM_SEED, p, len);
+}
+
+static inline uint32_t simplefs_inode_csum(const struct simplefs_inode *inode)
+{
+	return simplefs_csum(inode, offsetof(struct simplefs_inode, checksum));
+}
+
+static inline uint32_t
+simplefs_desc_csum(const struct simplefs_group_desc *desc)
+{
+	return simplefs_csum(desc, offsetof(struct simplefs_group_desc, checksum));
+}
+
+static inline uint32_t
+simplefs_sb_csum(const struct simplefs_super_block *sb)
+{
+	return simplefs_csum(sb, offsetof(struct simplefs_super_block, checksum));
+}
+
+static inline uint32_t *simplefs_dir_csum(struct buffer_head *bh)
+{
+	return (uint32_t *)(bh->b_data + SIMPLEFS_DIR_CSUM_OFFSET(bh->b_size));
+}
+
+/* stats.c */
+int simplefs_stats_init(struct super_block *sb);
+void simplefs_stats_destroy(struct simplefs_sb_info *sbi);
+int simplefs_stats_register(struct super_block *sb);
+void simplefs_stats_unregister(struct super_block *sb);
+int simplefs_stats_module_init(void);
+void simplefs_stats_module_exit(void);
+
+/* Objects are capped by the number of inode table slots */
+static inline uint64_t simplefs_max_objects(struct super_block *sb)
+{
+	return SIMPLEFS_SB(sb)->sb->inodes_max;
+}
@@ -0,0 +1,123 @@
+/*
+ * Tracepoints for simplefs. They compile to a static branch that is not
+ * taken until the event is enabled, e.g. with
+ *
+ *   echo 1 > /sys/kernel/debug/tracing/events/simplefs/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefs
+
+#if !defined(_SIMPLEFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIMPLEFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* inode_no is 0 when the name is not in the directory */
+TRACE_EVENT(simplefs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, uint64_t inode_no),
+	TP_ARGS(dir, dentry, inode_no),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(uint64_t, inode_no)
+		__string(name, dentry->d_name.name)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->inode_no = inode_no;
+		__assign_str(name, dentry->d_name.name);
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->inode_no)
+);
+
+/* Both create and mkdir */
+TRACE_EVENT(simplefs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret),
+	TP_ARGS(dir, dentry, mode, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(umode_t, mode)
+		__field(int, ret)
+		__string(name, dentry->d_name.name)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ret ? 0 : d_inode(dentry)->i_ino;
+		__entry->mode = mode;
+		__entry->ret = ret;
+		__assign_str(name, dentry->d_name.name);
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s mode 0%o ino %lu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->mode, __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_iterate,
+	TP_PROTO(struct inode *dir, loff_t pos, unsigned int emitted),
+	TP_ARGS(dir, pos, emitted),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(loff_t, pos)
+		__field(unsigned int, emitted)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->pos = pos;
+		__entry->emitted = emitted;
+	),
+
+	TP_printk("dev %d,%d dir %lu pos %lld emitted %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->pos, __entry->emitted)
+);
+
+/* near is true when the inode went into its parent's inode table block */
+TRACE_EVENT(simplefs_alloc_inode,
+	TP_PROTO(struct inode *dir, umode_t mode, uint64_t inode_no, bool near),
+	TP_ARGS(dir, mode, inode_no, near),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(umode_t, mode)
+		__field(uint64_t, inode_no)
+		__field(bool, near)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->mode = mode;
+		__entry->inode_no = inode_no;
+		__entry->near = near;
+	),
+
+	TP_printk("dev %d,%d dir %lu mode 0%o ino %llu near %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->mode, __entry->inode_no, __entry->near)
+);
+
+#endif /* _SIMPLEFS_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>